@@ -0,0 +1,127 @@
+#include "AllocationTracking.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+    // Plain atomics with constant initialization, so counting works before any constructor of the module has run
+    atomic<uint64_t> s_Allocations = 0;
+    atomic<uint64_t> s_Bytes = 0;
+}
+
+namespace PartialDisplay::Allocation
+{
+    Counts GetCounts()
+    {
+        return { s_Allocations.load(memory_order_relaxed), s_Bytes.load(memory_order_relaxed) };
+    }
+}
+
+#if PD_ALLOCATION_TRACKING
+
+namespace
+{
+    void* Allocate(size_t Size)
+    {
+        s_Allocations.fetch_add(1, memory_order_relaxed);
+        s_Bytes.fetch_add(Size, memory_order_relaxed);
+        return malloc(Size != 0 ? Size : 1);
+    }
+
+    void* AllocateAligned(size_t Size, align_val_t Alignment)
+    {
+        s_Allocations.fetch_add(1, memory_order_relaxed);
+        s_Bytes.fetch_add(Size, memory_order_relaxed);
+        Size = Size != 0 ? Size : 1;
+#ifdef _WIN32
+        return _aligned_malloc(Size, size_t(Alignment));
+#else
+        void* Block = nullptr;
+        return posix_memalign(&Block, size_t(Alignment), Size) == 0 ? Block : nullptr;
+#endif
+    }
+
+    void FreeAligned(void* Block)
+    {
+#ifdef _WIN32
+        _aligned_free(Block);
+#else
+        free(Block);
+#endif
+    }
+}
+
+// The array, nothrow and sized forms are replaced as well rather than left to forward, which not every runtime does
+
+void* operator new(size_t Size)
+{
+    void* Block = Allocate(Size);
+    if (Block == nullptr)
+    {
+        throw bad_alloc();
+    }
+    return Block;
+}
+
+void* operator new[](size_t Size)
+{
+    return operator new(Size);
+}
+
+void* operator new(size_t Size, const nothrow_t&) noexcept
+{
+    return Allocate(Size);
+}
+
+void* operator new[](size_t Size, const nothrow_t&) noexcept
+{
+    return Allocate(Size);
+}
+
+void* operator new(size_t Size, align_val_t Alignment)
+{
+    void* Block = AllocateAligned(Size, Alignment);
+    if (Block == nullptr)
+    {
+        throw bad_alloc();
+    }
+    return Block;
+}
+
+void* operator new[](size_t Size, align_val_t Alignment)
+{
+    return operator new(Size, Alignment);
+}
+
+void* operator new(size_t Size, align_val_t Alignment, const nothrow_t&) noexcept
+{
+    return AllocateAligned(Size, Alignment);
+}
+
+void* operator new[](size_t Size, align_val_t Alignment, const nothrow_t&) noexcept
+{
+    return AllocateAligned(Size, Alignment);
+}
+
+void operator delete(void* Block) noexcept { free(Block); }
+void operator delete[](void* Block) noexcept { free(Block); }
+void operator delete(void* Block, size_t) noexcept { free(Block); }
+void operator delete[](void* Block, size_t) noexcept { free(Block); }
+void operator delete(void* Block, const nothrow_t&) noexcept { free(Block); }
+void operator delete[](void* Block, const nothrow_t&) noexcept { free(Block); }
+void operator delete(void* Block, align_val_t) noexcept { FreeAligned(Block); }
+void operator delete[](void* Block, align_val_t) noexcept { FreeAligned(Block); }
+void operator delete(void* Block, size_t, align_val_t) noexcept { FreeAligned(Block); }
+void operator delete[](void* Block, size_t, align_val_t) noexcept { FreeAligned(Block); }
+void operator delete(void* Block, align_val_t, const nothrow_t&) noexcept { FreeAligned(Block); }
+void operator delete[](void* Block, align_val_t, const nothrow_t&) noexcept { FreeAligned(Block); }
+
+#endif
\ No newline at end of file
@@ -0,0 +1,36 @@
+#pragma once
+
+// Heap allocation counting. The frame path is meant to allocate nothing once it has seen a frame of each size it
+// handles: buffers are recycled, scratch space is kept from one frame to the next and tasks are queued without
+// boxing them. Counting what goes through the global operator new is what keeps that true, the allocation benchmark
+// fails on any allocation after warm-up and the driver reports its count with the pipeline statistics. The module
+// linking AllocationTracking.cpp gets the counting operators; PD_ALLOCATION_TRACKING set to 0 leaves the standard
+// ones in place and every count at 0. Counting puts two atomic increments on every allocation, so it is on by default
+// in debug builds only; the benchmarks turn it on in every configuration.
+
+#include <cstdint>
+
+#ifndef PD_ALLOCATION_TRACKING
+#if defined(_DEBUG) || (defined(DBG) && DBG)
+#define PD_ALLOCATION_TRACKING 1
+#else
+#define PD_ALLOCATION_TRACKING 0
+#endif
+#endif
+
+namespace PartialDisplay::Allocation
+{
+    struct Counts
+    {
+        uint64_t Allocations;
+        uint64_t Bytes;
+    };
+
+    /// <summary>
+    /// Allocations made through operator new by every thread of the module since it loaded. Frees aren't counted,
+    /// this is about how often the allocator is called rather than how much memory is held.
+    /// </summary>
+    Counts GetCounts();
+
+    constexpr bool IsTracking() { return PD_ALLOCATION_TRACKING != 0; }
+}
\ No newline at end of file
@@ -0,0 +1,466 @@
+#include "CopyTuner.h"
+#include "PixelKernels.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <system_error>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+    using namespace PartialDisplay;
+    using namespace PartialDisplay::Tuning;
+
+    constexpr uint32_t CalibrationRounds = 3;
+    constexpr uint32_t ConfirmationRounds = 3;
+    constexpr double SimplerMargin = 0.03;     // How much faster a more involved strategy has to be to be picked
+    constexpr uint32_t ChunkCandidates[] = { 0, 16, 64 };
+    constexpr size_t CalibrationPitchAlignment = 256;  // As the pitch of staging surfaces
+    constexpr uint32_t MaxTunedSize = 16384;
+
+    const char* const MethodNames[] = { "cached", "streaming" };
+
+    struct CopyWork
+    {
+        CopyMethod Method;
+        const uint8_t* Src;
+        size_t SrcPitch;
+        uint8_t* Dst;
+        size_t DstPitch;
+        size_t RowBytes;
+        uint32_t Height;
+        uint32_t Chunk;
+        atomic<uint32_t> Next{ 0 };
+
+        void CopyChunks()
+        {
+            // Threads take chunks in turn rather than a share each, so one that starts late only holds up a chunk
+            for (;;)
+            {
+                uint32_t Top = Next.fetch_add(Chunk, memory_order_relaxed);
+                if (Top >= Height)
+                {
+                    return;
+                }
+                uint32_t Rows = min(Chunk, Height - Top);
+                auto Copy = Method == CopyMethod::Streaming ? Kernels::StreamRows : Kernels::CopyRows;
+                Copy(Src + size_t(Top) * SrcPitch, SrcPitch, Dst + size_t(Top) * DstPitch, DstPitch, RowBytes, Rows);
+            }
+        }
+    };
+
+    /// <summary>
+    /// A signature of what the strategies depend on that can change under a stored result.
+    /// </summary>
+    string GetMachine()
+    {
+        return string(Kernels::GetIsaName(Kernels::GetIsa())) + " " + to_string(thread::hardware_concurrency());
+    }
+}
+
+namespace PartialDisplay::Tuning
+{
+    const char* GetMethodName(CopyMethod Method)
+    {
+        return uint32_t(Method) < size(MethodNames) ? MethodNames[uint32_t(Method)] : "unknown";
+    }
+
+    CopyTuner::CopyTuner(Scheduling::TaskScheduler* Tasks, uint32_t Bands) : m_Tasks(Tasks), m_Bands(max(Bands, 1u)),
+        m_MaxThreads(Tasks != nullptr ? min(Tasks->GetWorkerCount() + 1, MaxCopyThreads) : 1)
+    {
+    }
+
+    CopyTuner::~CopyTuner()
+    {
+        // The calibration underway is finished, the ones queued after it are dropped
+        unique_lock<mutex> Lock(m_Mutex);
+        m_Queued.resize(min<size_t>(m_Queued.size(), 1));
+        Lock.unlock();
+        if (m_Calibrator.joinable())
+        {
+            m_Calibrator.join();
+        }
+    }
+
+    TunedCopy CopyTuner::Get(uint32_t Width, uint32_t Height, uint32_t BytesPerPixel)
+    {
+        TunedCopy Tuned;
+        if (Find(Width, Height, BytesPerPixel, Tuned))
+        {
+            return Tuned;
+        }
+
+        // Whoever calibrated the size while this waited has stored it
+        lock_guard<mutex> Calibrating(m_CalibrationMutex);
+        if (Find(Width, Height, BytesPerPixel, Tuned))
+        {
+            return Tuned;
+        }
+        return Store(Measure(Width, Height, BytesPerPixel));
+    }
+
+    bool CopyTuner::Find(uint32_t Width, uint32_t Height, uint32_t BytesPerPixel, TunedCopy& Tuned) const
+    {
+        lock_guard<mutex> Lock(m_Mutex);
+        size_t Index = IndexOf(Width, Height, BytesPerPixel);
+        if (Index == m_Tuned.size())
+        {
+            return false;
+        }
+        Tuned = m_Tuned[Index];
+        return true;
+    }
+
+    TunedCopy CopyTuner::GetWithoutWaiting(uint32_t Width, uint32_t Height, uint32_t BytesPerPixel)
+    {
+        // Every frame asks, and but for the first frames of a mode finds its size in the published copy
+        if (auto Published = atomic_load(&m_Published))
+        {
+            for (const TunedCopy& Tuned : *Published)
+            {
+                if (Tuned.Width == Width && Tuned.Height == Height && Tuned.BytesPerPixel == BytesPerPixel)
+                {
+                    return Tuned;
+                }
+            }
+        }
+
+        lock_guard<mutex> Lock(m_Mutex);
+        size_t Index = IndexOf(Width, Height, BytesPerPixel);
+        if (Index < m_Tuned.size())
+        {
+            return m_Tuned[Index];
+        }
+
+        TunedCopy Default;
+        Default.Width = Width;
+        Default.Height = Height;
+        Default.BytesPerPixel = BytesPerPixel;
+        bool Queued = any_of(m_Queued.begin(), m_Queued.end(), [&](const TunedCopy& Size)
+            {
+                return Size.Width == Width && Size.Height == Height && Size.BytesPerPixel == BytesPerPixel;
+            });
+        if (!Queued)
+        {
+            m_Queued.push_back(Default);
+        }
+        if (!m_Calibrating)
+        {
+            // The thread that worked through the queue before has cleared m_Calibrating last, so it is ending
+            if (m_Calibrator.joinable())
+            {
+                m_Calibrator.join();
+            }
+            try
+            {
+                m_Calibrator = thread(&CopyTuner::CalibrateQueued, this);
+                m_Calibrating = true;
+            }
+            catch (const system_error&)
+            {
+                // Copies stay plain; the next call tries again
+            }
+        }
+        return Default;
+    }
+
+    void CopyTuner::SetOnCalibrated(function<void()> Callback)
+    {
+        lock_guard<mutex> Lock(m_Mutex);
+        m_OnCalibrated = move(Callback);
+    }
+
+    TunedCopy CopyTuner::Calibrate(uint32_t Width, uint32_t Height, uint32_t BytesPerPixel)
+    {
+        lock_guard<mutex> Calibrating(m_CalibrationMutex);
+        return Store(Measure(Width, Height, BytesPerPixel));
+    }
+
+    void CopyTuner::Copy(const CopyStrategy& Strategy, const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch,
+        size_t RowBytes, uint32_t Height) const
+    {
+        CopyOn(m_Tasks, Strategy, Src, SrcPitch, Dst, DstPitch, RowBytes, Height);
+    }
+
+    void CopyTuner::CopyOn(Scheduling::TaskScheduler* Tasks, const CopyStrategy& Strategy, const void* Src,
+        size_t SrcPitch, void* Dst, size_t DstPitch, size_t RowBytes, uint32_t Height) const
+    {
+        uint32_t Threads = min({ Strategy.Threads, m_MaxThreads, Height });
+        if (Threads <= 1)
+        {
+            auto Copy = Strategy.Method == CopyMethod::Streaming ? Kernels::StreamRows : Kernels::CopyRows;
+            Copy(Src, SrcPitch, Dst, DstPitch, RowBytes, Height);
+            return;
+        }
+
+        // One range per thread, each copying chunks until there are none left. The body holds a single pointer, so
+        // it fits in the function without an allocation.
+        uint32_t Chunk = Strategy.ChunkRows != 0 ? Strategy.ChunkRows : (Height + Threads - 1) / Threads;
+        CopyWork Work{ Strategy.Method, static_cast<const uint8_t*>(Src), SrcPitch, static_cast<uint8_t*>(Dst),
+            DstPitch, RowBytes, Height, Chunk };
+        CopyWork* Context = &Work;
+        Tasks->ParallelFor(Threads, 1, [Context](size_t, size_t) { Context->CopyChunks(); });
+    }
+
+    vector<CopyStrategy> CopyTuner::GetCandidates() const
+    {
+        vector<uint32_t> ThreadCounts;
+        for (uint32_t Threads = 1; Threads < m_MaxThreads; Threads *= 2)
+        {
+            ThreadCounts.push_back(Threads);
+        }
+        ThreadCounts.push_back(m_MaxThreads);
+
+        // Without vectors, streaming stores are plain ones
+        vector<CopyStrategy> Candidates;
+        for (CopyMethod Method : { CopyMethod::Cached, CopyMethod::Streaming })
+        {
+            if (Method == CopyMethod::Streaming && Kernels::GetIsa() == Kernels::Isa::Scalar)
+            {
+                continue;
+            }
+            for (uint32_t Threads : ThreadCounts)
+            {
+                for (uint32_t Chunk : ChunkCandidates)
+                {
+                    if (Threads > 1 || Chunk == 0)
+                    {
+                        Candidates.push_back({ Method, Threads, Chunk });
+                    }
+                }
+            }
+        }
+        return Candidates;
+    }
+
+    string CopyTuner::Save() const
+    {
+        lock_guard<mutex> Lock(m_Mutex);
+        ostringstream Text;
+        Text << "# PartialDisplay copy strategies: width height bytes method threads chunk ns\n";
+        Text << "machine " << GetMachine() << "\n";
+        for (const TunedCopy& Tuned : m_Tuned)
+        {
+            Text << Tuned.Width << " " << Tuned.Height << " " << Tuned.BytesPerPixel << " "
+                << GetMethodName(Tuned.Strategy.Method) << " " << Tuned.Strategy.Threads << " "
+                << Tuned.Strategy.ChunkRows << " " << Tuned.FrameNs << "\n";
+        }
+        return Text.str();
+    }
+
+    size_t CopyTuner::Load(const string& Text)
+    {
+        istringstream Lines(Text);
+        string Line;
+        bool SameMachine = false;
+        vector<TunedCopy> Loaded;
+        while (getline(Lines, Line))
+        {
+            istringstream Fields(Line);
+            string First;
+            if (!(Fields >> First) || First[0] == '#')
+            {
+                continue;
+            }
+            if (First == "machine")
+            {
+                string Isa, Processors;
+                SameMachine = Fields >> Isa >> Processors && Isa + " " + Processors == GetMachine();
+                continue;
+            }
+
+            TunedCopy Tuned;
+            string Method;
+            Fields.str(Line);
+            Fields.clear();
+            if (!(Fields >> Tuned.Width >> Tuned.Height >> Tuned.BytesPerPixel >> Method >> Tuned.Strategy.Threads
+                >> Tuned.Strategy.ChunkRows >> Tuned.FrameNs))
+            {
+                continue;
+            }
+            auto Found = find(begin(MethodNames), end(MethodNames), Method);
+            Tuned.Strategy.Method = CopyMethod(Found - begin(MethodNames));
+            bool Runnable = Found != end(MethodNames) && Tuned.Strategy.Threads >= 1
+                && Tuned.Strategy.Threads <= m_MaxThreads && Tuned.Strategy.ChunkRows <= MaxTunedSize
+                && (Tuned.Strategy.Method != CopyMethod::Streaming || Kernels::GetIsa() != Kernels::Isa::Scalar);
+            if (Runnable && Tuned.Width != 0 && Tuned.Width <= MaxTunedSize && Tuned.Height != 0
+                && Tuned.Height <= MaxTunedSize && Tuned.BytesPerPixel != 0 && Tuned.BytesPerPixel <= 16)
+            {
+                Loaded.push_back(Tuned);
+            }
+        }
+        if (!SameMachine)
+        {
+            return 0;
+        }
+
+        lock_guard<mutex> Lock(m_Mutex);
+        size_t Count = 0;
+        for (const TunedCopy& Tuned : Loaded)
+        {
+            size_t Index = IndexOf(Tuned.Width, Tuned.Height, Tuned.BytesPerPixel);
+            if (Index == m_Tuned.size())
+            {
+                m_Tuned.push_back(Tuned);
+                Count++;
+            }
+        }
+        PublishLocked();
+        return Count;
+    }
+
+    vector<TunedCopy> CopyTuner::GetTuned() const
+    {
+        lock_guard<mutex> Lock(m_Mutex);
+        return m_Tuned;
+    }
+
+    uint64_t CopyTuner::GetCalibrations() const
+    {
+        lock_guard<mutex> Lock(m_Mutex);
+        return m_Calibrations;
+    }
+
+    void CopyTuner::CalibrateQueued()
+    {
+        // Measured without m_Mutex, so callers go on copying the plain way meanwhile
+        unique_lock<mutex> Lock(m_Mutex);
+        while (!m_Queued.empty())
+        {
+            TunedCopy Size = m_Queued.front();
+            function<void()> OnCalibrated = m_OnCalibrated;
+            Lock.unlock();
+            bool Calibrated = false;
+            {
+                lock_guard<mutex> Calibrating(m_CalibrationMutex);
+                TunedCopy Known;
+                if (!Find(Size.Width, Size.Height, Size.BytesPerPixel, Known))
+                {
+                    Store(Measure(Size.Width, Size.Height, Size.BytesPerPixel));
+                    Calibrated = true;
+                }
+            }
+            if (Calibrated && OnCalibrated)
+            {
+                OnCalibrated();
+            }
+            Lock.lock();
+            m_Queued.erase(m_Queued.begin());
+        }
+        m_Calibrating = false;
+    }
+
+    TunedCopy CopyTuner::Measure(uint32_t Width, uint32_t Height, uint32_t BytesPerPixel) const
+    {
+        // Both buffers are written before timing, so no candidate pays for faulting pages in
+        const size_t RowBytes = size_t(Width) * BytesPerPixel;
+        const size_t Pitch = (RowBytes + CalibrationPitchAlignment - 1) / CalibrationPitchAlignment
+            * CalibrationPitchAlignment;
+        vector<uint8_t> Src(Pitch * Height, uint8_t(0x5A)), Dst(Pitch * Height, uint8_t(0));
+
+        // As many workers as the copies have, but not theirs: measured on those, every candidate would queue behind
+        // the frames being copied meanwhile
+        unique_ptr<Scheduling::TaskScheduler> Workers;
+        if (m_MaxThreads > 1)
+        {
+            Workers = make_unique<Scheduling::TaskScheduler>(m_MaxThreads - 1);
+        }
+
+        auto Measure = [&](const CopyStrategy& Strategy)
+            {
+                auto Start = steady_clock::now();
+                for (uint32_t Band = 0; Band < m_Bands; Band++)
+                {
+                    uint32_t Top, Rows;
+                    Protocol::GetSliceRows(Height, m_Bands, Band, Top, Rows);
+                    CopyOn(Workers.get(), Strategy, Src.data() + Top * Pitch, Pitch, Dst.data() + Top * Pitch, Pitch,
+                        RowBytes, Rows);
+                }
+                return uint64_t(duration_cast<nanoseconds>(steady_clock::now() - Start).count());
+            };
+
+        const vector<CopyStrategy> Candidates = GetCandidates();
+        vector<uint64_t> Best(Candidates.size(), UINT64_MAX);
+        for (uint32_t Round = 0; Round < CalibrationRounds; Round++)
+        {
+            for (size_t i = 0; i < Candidates.size(); i++)
+            {
+                Best[i] = min(Best[i], Measure(Candidates[i]));
+            }
+        }
+
+        size_t Picked = 0;
+        for (size_t i = 1; i < Candidates.size(); i++)
+        {
+            if (Best[i] < Best[Picked] * (1 - SimplerMargin))
+            {
+                Picked = i;
+            }
+        }
+
+        // The fastest of many is partly the luckiest, so it has to beat the plain copy once more to be picked
+        if (Picked != 0)
+        {
+            uint64_t PickedNs = UINT64_MAX, PlainNs = UINT64_MAX;
+            for (uint32_t Round = 0; Round < ConfirmationRounds; Round++)
+            {
+                PickedNs = min(PickedNs, Measure(Candidates[Picked]));
+                PlainNs = min(PlainNs, Measure(Candidates[0]));
+            }
+            Best[Picked] = PickedNs;
+            Best[0] = PlainNs;
+            if (PickedNs >= PlainNs * (1 - SimplerMargin))
+            {
+                Picked = 0;
+            }
+        }
+
+        TunedCopy Tuned;
+        Tuned.Width = Width;
+        Tuned.Height = Height;
+        Tuned.BytesPerPixel = BytesPerPixel;
+        Tuned.Strategy = Candidates[Picked];
+        Tuned.FrameNs = Best[Picked];
+        Tuned.Calibrated = true;
+        return Tuned;
+    }
+
+    TunedCopy CopyTuner::Store(const TunedCopy& Tuned)
+    {
+        lock_guard<mutex> Lock(m_Mutex);
+        size_t Index = IndexOf(Tuned.Width, Tuned.Height, Tuned.BytesPerPixel);
+        if (Index == m_Tuned.size())
+        {
+            m_Tuned.push_back(Tuned);
+        }
+        else
+        {
+            m_Tuned[Index] = Tuned;
+        }
+        m_Calibrations++;
+        PublishLocked();
+        return Tuned;
+    }
+
+    void CopyTuner::PublishLocked()
+    {
+        atomic_store(&m_Published, make_shared<const vector<TunedCopy>>(m_Tuned));
+    }
+
+    size_t CopyTuner::IndexOf(uint32_t Width, uint32_t Height, uint32_t BytesPerPixel) const
+    {
+        for (size_t i = 0; i < m_Tuned.size(); i++)
+        {
+            const TunedCopy& Tuned = m_Tuned[i];
+            if (Tuned.Width == Width && Tuned.Height == Height && Tuned.BytesPerPixel == BytesPerPixel)
+            {
+                return i;
+            }
+        }
+        return m_Tuned.size();
+    }
+}
\ No newline at end of file
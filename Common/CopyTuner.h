@@ -0,0 +1,147 @@
+#pragma once
+
+// Picking how frames are copied by measuring it on the machine at hand. Whether streaming stores beat the cache,
+// and how many threads a copy is worth splitting over and in what chunks, depends on the processor, its caches and
+// memory, and the size of the frame, more than on anything known up front. The tuner calibrates the first time a
+// frame size comes up: it copies a frame of that size with every candidate strategy a few times over, interleaved so
+// they all see the same conditions, and keeps the fastest, preferring the simpler of two within a few percent. What
+// it picked is stored as text between runs, so the next run only calibrates sizes it has not seen. A caller that
+// can't wait the calibration out copies the plain way meanwhile, while the tuner calibrates on a thread of its own.
+// Calibrations run on workers of their own rather than those of the copies, which would queue behind live copies,
+// and copy between heap buffers, which stand in for the mapped surfaces the copies read.
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "TaskScheduler.h"
+
+namespace PartialDisplay::Tuning
+{
+    constexpr uint32_t MaxCopyThreads = 8;  // Past a handful of cores a copy is bound by memory anyway
+
+    enum class CopyMethod : uint32_t
+    {
+        Cached = 0,     // Plain stores, which leave the copy in cache for whoever reads it next
+        Streaming = 1,  // Non-temporal stores around the cache, which leave it to the rest of the frame path
+    };
+
+    const char* GetMethodName(CopyMethod Method);
+
+    struct CopyStrategy
+    {
+        CopyMethod Method = CopyMethod::Cached;
+        uint32_t Threads = 1;    // The calling thread included
+        uint32_t ChunkRows = 0;  // Rows a thread takes at a time, 0 for an even share each
+    };
+
+    /// <summary>
+    /// The strategy picked for one frame size.
+    /// </summary>
+    struct TunedCopy
+    {
+        uint32_t Width = 0;
+        uint32_t Height = 0;
+        uint32_t BytesPerPixel = 0;
+        CopyStrategy Strategy;
+        uint64_t FrameNs = 0;     // Best time of the strategy for a whole frame while calibrating
+        bool Calibrated = false;  // Measured by this tuner rather than loaded
+    };
+
+    class CopyTuner
+    {
+    public:
+        /// <summary>
+        /// Copies spread over Tasks, whose workers and the calling thread bound the thread counts tried; without it
+        /// every copy runs on the calling thread. Frames are copied in Bands horizontal bands one after the other,
+        /// as the caller copies them, which calibration does as well.
+        /// </summary>
+        explicit CopyTuner(Scheduling::TaskScheduler* Tasks, uint32_t Bands = 1);
+        ~CopyTuner();
+        CopyTuner(const CopyTuner&) = delete;
+        CopyTuner& operator=(const CopyTuner&) = delete;
+
+        /// <summary>
+        /// The strategy for frames of Width x Height pixels of BytesPerPixel, calibrated the first time the size
+        /// comes up, which takes a few dozen frame copies. Callers wait for a calibration underway.
+        /// </summary>
+        TunedCopy Get(uint32_t Width, uint32_t Height, uint32_t BytesPerPixel);
+
+        /// <summary>
+        /// The strategy known for a size, without calibrating. Returns false if there is none yet.
+        /// </summary>
+        bool Find(uint32_t Width, uint32_t Height, uint32_t BytesPerPixel, TunedCopy& Tuned) const;
+
+        /// <summary>
+        /// The strategy known for a size or, while there is none, the default one of plain copies on the calling
+        /// thread, with the size queued for calibrating in the background. Calls get the calibrated strategy from the
+        /// moment it is stored.
+        /// </summary>
+        TunedCopy GetWithoutWaiting(uint32_t Width, uint32_t Height, uint32_t BytesPerPixel);
+
+        /// <summary>
+        /// Called on the background calibration thread once a size it calibrated is stored, with no lock of the
+        /// tuner held; the place to save the strategies without holding up the callers copying.
+        /// </summary>
+        void SetOnCalibrated(std::function<void()> Callback);
+
+        /// <summary>
+        /// Measures every candidate on a frame of the size and keeps the fastest, replacing what was known of it.
+        /// </summary>
+        TunedCopy Calibrate(uint32_t Width, uint32_t Height, uint32_t BytesPerPixel);
+
+        /// <summary>
+        /// Copies Height rows of RowBytes as Strategy says, with no more threads than the tuner has.
+        /// </summary>
+        void Copy(const CopyStrategy& Strategy, const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch,
+            size_t RowBytes, uint32_t Height) const;
+
+        /// <summary>
+        /// What Calibrate tries, the simplest first: cached then streaming stores, each on one thread and then on
+        /// more, in even shares and in chunks.
+        /// </summary>
+        std::vector<CopyStrategy> GetCandidates() const;
+
+        /// <summary>
+        /// Every size known, as text to store until the next run. The text names the machine it was tuned on.
+        /// </summary>
+        std::string Save() const;
+
+        /// <summary>
+        /// Takes back what Save stored, skipping all of it if it was tuned on another machine, one with a different
+        /// kernel tier or number of processors, and any line that doesn't parse or that this tuner couldn't run.
+        /// Returns the number of sizes loaded.
+        /// </summary>
+        size_t Load(const std::string& Text);
+
+        std::vector<TunedCopy> GetTuned() const;
+        uint64_t GetCalibrations() const;
+
+    private:
+        Scheduling::TaskScheduler* m_Tasks;
+        uint32_t m_Bands;
+        uint32_t m_MaxThreads;
+        mutable std::mutex m_Mutex;
+        std::vector<TunedCopy> m_Tuned;  // One per mode the display went through, a handful
+        std::shared_ptr<const std::vector<TunedCopy>> m_Published;  // Copy of m_Tuned read without m_Mutex
+        uint64_t m_Calibrations = 0;
+        std::mutex m_CalibrationMutex;   // Held through a calibration, so no two measure at once
+        std::vector<TunedCopy> m_Queued; // Sizes for the background calibration, the one underway first
+        std::thread m_Calibrator;
+        bool m_Calibrating = false;      // m_Calibrator works through m_Queued
+        std::function<void()> m_OnCalibrated;
+
+        TunedCopy Measure(uint32_t Width, uint32_t Height, uint32_t BytesPerPixel) const;
+        TunedCopy Store(const TunedCopy& Tuned);
+        void PublishLocked();
+        void CopyOn(Scheduling::TaskScheduler* Tasks, const CopyStrategy& Strategy, const void* Src, size_t SrcPitch,
+            void* Dst, size_t DstPitch, size_t RowBytes, uint32_t Height) const;
+        void CalibrateQueued();
+        size_t IndexOf(uint32_t Width, uint32_t Height, uint32_t BytesPerPixel) const;  // m_Tuned.size() if unknown
+    };
+}
\ No newline at end of file
@@ -0,0 +1,38 @@
+#include "Demand.h"
+
+using namespace std;
+
+namespace PartialDisplay::Demand
+{
+    bool DemandTracker::OnRequest(uint64_t NowMs)
+    {
+        // The state is the time of the last request alone, so a request racing with the pause starting can't be lost:
+        // whichever request finds the window expired is the one that wakes capture up
+        uint64_t Previous = m_LastRequest.exchange(NowMs, memory_order_relaxed);
+        bool Woke = Previous == 0 || NowMs - Previous > m_WindowMs;
+        if (Woke)
+        {
+            m_Wakeups.fetch_add(1, memory_order_relaxed);
+        }
+        return Woke;
+    }
+
+    bool DemandTracker::IsActive(uint64_t NowMs) const
+    {
+        uint64_t Last = m_LastRequest.load(memory_order_relaxed);
+        return Last != 0 && (NowMs < Last || NowMs - Last <= m_WindowMs);
+    }
+
+    void VisibilityGate::OnPresent(bool Hidden, uint64_t NowNs)
+    {
+        if (Hidden && !m_Hidden)
+        {
+            m_Pauses++;
+        }
+        m_Hidden = Hidden;
+        if (Hidden)
+        {
+            m_NextTest = NowNs + m_TestIntervalNs;
+        }
+    }
+}
\ No newline at end of file
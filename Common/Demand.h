@@ -0,0 +1,71 @@
+#pragma once
+
+// Capturing only what someone is going to look at. On the producer side, frames are copied off the swap-chain and
+// read back only while consumers keep asking for them; once they stop, the last frame is merely held on to, and the
+// first request after the pause has it captured right away instead of waiting for the desktop to change. On the
+// consumer side, frames stop being fetched while none of their windows can be seen, minimized or occluded, and
+// presenting is tested now and then until one can be again, which ends the producer's demand as well.
+
+#include <atomic>
+#include <cstdint>
+
+namespace PartialDisplay::Demand
+{
+    /// <summary>
+    /// Whether consumers asked for frames recently. Requests and captures may come from different threads.
+    /// </summary>
+    class DemandTracker
+    {
+    public:
+        explicit DemandTracker(uint64_t WindowMs) : m_WindowMs(WindowMs) {}
+
+        /// <summary>
+        /// Records a request at NowMs. Returns true if it ends a pause, in which case the frame held back last should
+        /// be captured now rather than with the next one.
+        /// </summary>
+        bool OnRequest(uint64_t NowMs);
+
+        /// <summary>
+        /// Whether a frame presented at NowMs should be captured, which it should up to WindowMs after a request.
+        /// </summary>
+        bool IsActive(uint64_t NowMs) const;
+
+        uint64_t GetWakeups() const { return m_Wakeups.load(std::memory_order_relaxed); }
+
+    private:
+        uint64_t m_WindowMs;
+        std::atomic<uint64_t> m_LastRequest = 0;  // 0 before the first, which is a wakeup too
+        std::atomic<uint64_t> m_Wakeups = 0;
+    };
+
+    /// <summary>
+    /// Whether a consumer should fetch frames, paused while whatever it presents to can't be seen. Rendering thread
+    /// only.
+    /// </summary>
+    class VisibilityGate
+    {
+    public:
+        explicit VisibilityGate(uint64_t TestIntervalNs) : m_TestIntervalNs(TestIntervalNs) {}
+
+        /// <summary>
+        /// Feeds the outcome of presenting a frame, or of testing whether one would be seen, at NowNs.
+        /// </summary>
+        void OnPresent(bool Hidden, uint64_t NowNs);
+
+        bool ShouldFetch() const { return !m_Hidden; }
+
+        /// <summary>
+        /// Whether, paused, presenting should be tested again at NowNs; the result goes to OnPresent.
+        /// </summary>
+        bool ShouldTest(uint64_t NowNs) const { return m_Hidden && NowNs >= m_NextTest; }
+
+        uint64_t GetNextTest() const { return m_NextTest; }
+        uint64_t GetPauses() const { return m_Pauses; }
+
+    private:
+        uint64_t m_TestIntervalNs;
+        uint64_t m_NextTest = 0;
+        uint64_t m_Pauses = 0;
+        bool m_Hidden = false;
+    };
+}
\ No newline at end of file
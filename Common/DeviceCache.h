@@ -0,0 +1,131 @@
+#pragma once
+
+// Render devices kept across swap-chains. The OS hands out a new swap-chain on every mode change, resume from sleep
+// and display reconfiguration, and creating a device for it means enumerating adapters and standing up a driver
+// context, which is most of what such a switch costs. Devices are cached by the LUID of their adapter instead and
+// handed to every swap-chain rendered on it, until the device is lost, say with the GPU removed or its driver
+// updated, at which point the next request creates a new one. What a device is and how it is created and checked
+// is up to the owner, so the cache runs off-target with mock devices.
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace PartialDisplay::Devices
+{
+    /// <summary>
+    /// Packs an adapter LUID, its high and low parts, into a cache key.
+    /// </summary>
+    constexpr uint64_t MakeAdapterKey(int32_t HighPart, uint32_t LowPart)
+    {
+        return (uint64_t(uint32_t(HighPart)) << 32) | LowPart;
+    }
+
+    template <typename T>
+    class DeviceCache
+    {
+    public:
+        /// <summary>
+        /// Creates the device of an adapter, or returns null if it can't.
+        /// </summary>
+        typedef std::function<std::shared_ptr<T>(uint64_t Adapter)> CreateFunction;
+
+        /// <summary>
+        /// Whether a device is still usable, false once it is lost.
+        /// </summary>
+        typedef std::function<bool(const T& Device)> ValidFunction;
+
+        DeviceCache(CreateFunction Create, ValidFunction IsValid) : m_Create(std::move(Create)),
+            m_IsValid(std::move(IsValid)) {}
+        DeviceCache(const DeviceCache&) = delete;
+        DeviceCache& operator=(const DeviceCache&) = delete;
+
+        /// <summary>
+        /// Returns the device of Adapter, creating it unless a valid one is cached. Returns null if creating it
+        /// fails, which is not cached, the next call tries again. Callers asking for an adapter whose device is being
+        /// created wait for it rather than creating another.
+        /// </summary>
+        std::shared_ptr<T> Get(uint64_t Adapter)
+        {
+            std::lock_guard<std::mutex> Lock(m_Mutex);
+
+            // Lost devices are let go whichever adapter they belong to; whoever holds one keeps it until done with it
+            for (size_t i = 0; i < m_Entries.size();)
+            {
+                if (!m_IsValid(*m_Entries[i].Device))
+                {
+                    m_Entries.erase(m_Entries.begin() + i);
+                    m_Losses++;
+                    continue;
+                }
+                if (m_Entries[i].Adapter == Adapter)
+                {
+                    m_Hits++;
+                    return m_Entries[i].Device;
+                }
+                i++;
+            }
+
+            std::shared_ptr<T> Created = m_Create(Adapter);
+            m_Creations++;
+            if (Created)
+            {
+                m_Entries.push_back({ Adapter, Created });
+            }
+            return Created;
+        }
+
+        /// <summary>
+        /// Drops Device if it is still what the cache holds for Adapter, for a device that turned out unusable without
+        /// reporting itself lost. A device already replaced is left alone, so is its replacement.
+        /// </summary>
+        void Discard(uint64_t Adapter, const T* Device)
+        {
+            std::lock_guard<std::mutex> Lock(m_Mutex);
+            for (size_t i = 0; i < m_Entries.size(); i++)
+            {
+                if (m_Entries[i].Adapter == Adapter && m_Entries[i].Device.get() == Device)
+                {
+                    m_Entries.erase(m_Entries.begin() + i);
+                    m_Discards++;
+                    return;
+                }
+            }
+        }
+
+        void Clear()
+        {
+            std::lock_guard<std::mutex> Lock(m_Mutex);
+            m_Entries.clear();
+        }
+
+        size_t GetSize()
+        {
+            std::lock_guard<std::mutex> Lock(m_Mutex);
+            return m_Entries.size();
+        }
+
+        uint64_t GetHits() const { return m_Hits; }
+        uint64_t GetCreations() const { return m_Creations; }  // Failed ones included
+        uint64_t GetLosses() const { return m_Losses; }
+        uint64_t GetDiscards() const { return m_Discards; }
+
+    private:
+        struct Entry
+        {
+            uint64_t Adapter;
+            std::shared_ptr<T> Device;
+        };
+
+        CreateFunction m_Create;
+        ValidFunction m_IsValid;
+        std::mutex m_Mutex;
+        std::vector<Entry> m_Entries;  // A handful at most, one per render adapter
+        uint64_t m_Hits = 0;
+        uint64_t m_Creations = 0;
+        uint64_t m_Losses = 0;
+        uint64_t m_Discards = 0;
+    };
+}
\ No newline at end of file
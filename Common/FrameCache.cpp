@@ -0,0 +1,75 @@
+#include "FrameCache.h"
+
+#include <atomic>
+
+using namespace std;
+
+namespace PartialDisplay::Readback
+{
+    shared_ptr<const Frame> FrameCache::Get(uint64_t Sequence, const ReadFunction& Read)
+    {
+        // Held across the read back, so concurrent requests for a new frame read it once between them. A caller that
+        // looked up its sequence before someone else read a later frame gets that one, the surface has moved on too.
+        unique_lock<mutex> Lock(m_Mutex);
+        if (m_Current && m_Current->Sequence >= Sequence)
+        {
+            m_Hits++;
+            return m_Current;
+        }
+
+        // Only this cache can hand out new references and it does so under the lock, so a count of one means no
+        // reader is left; the fence orders their reads of the pixels before our writes
+        shared_ptr<Frame> Target;
+        if (m_Current && m_Current.use_count() == 1)
+        {
+            Target = move(m_Current);
+        }
+        for (size_t i = 0; !Target && i < SpareCount; i++)
+        {
+            if (m_Spares[i] && m_Spares[i].use_count() == 1)
+            {
+                Target = move(m_Spares[i]);
+            }
+        }
+        if (!Target)
+        {
+            Target = make_shared<Frame>();
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (m_Current)
+        {
+            Retire(move(m_Current));
+        }
+
+        m_Readbacks++;
+        if (!Read(*Target))
+        {
+            Retire(move(Target));
+            return nullptr;
+        }
+        Target->Sequence = Sequence;
+        m_Current = Target;
+        return Target;
+    }
+
+    void FrameCache::Invalidate()
+    {
+        unique_lock<mutex> Lock(m_Mutex);
+        m_Current.reset();
+        for (auto& Spare : m_Spares)
+        {
+            Spare.reset();
+        }
+    }
+
+    void FrameCache::Retire(shared_ptr<Frame> Retired)
+    {
+        // Into an empty slot, else in place of a spare still held, whose readers then free it as they finish
+        size_t Slot = 0;
+        while (Slot + 1 < SpareCount && m_Spares[Slot])
+        {
+            Slot++;
+        }
+        m_Spares[Slot] = move(Retired);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,64 @@
+#pragma once
+
+// Map-once CPU copies of captured frames. Reading a staging surface means mapping GPU-visible memory, which waits for
+// the copy into it and is slow to read, so each new frame is read back once into an ordinary buffer and every request
+// for that frame is served from there, however many readers there are and however fast they poll. Frames are
+// refcounted: a reader keeps the frame it was given alive while it converts it, and a buffer is recycled for a later
+// frame once no reader holds it.
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace PartialDisplay::Readback
+{
+    struct Frame
+    {
+        uint64_t Sequence = 0;
+        uint32_t Width = 0;
+        uint32_t Height = 0;
+        uint32_t Pitch = 0;
+        uint32_t Format = 0;  // Whatever the owner reads back, a DXGI_FORMAT in the driver
+        std::vector<uint8_t> Pixels;
+    };
+
+    class FrameCache
+    {
+    public:
+        /// <summary>
+        /// Reads the surface into a frame, which may be a recycled one still holding an older frame. Returns false if
+        /// the surface can't be read.
+        /// </summary>
+        typedef std::function<bool(Frame&)> ReadFunction;
+
+        /// <summary>
+        /// Returns the frame for Sequence, or a later one, reading it back with Read unless it is cached. Callers
+        /// arriving while a frame is read back wait for it rather than reading it again. Returns null if Read fails.
+        /// </summary>
+        std::shared_ptr<const Frame> Get(uint64_t Sequence, const ReadFunction& Read);
+
+        /// <summary>
+        /// Forgets the cached frame, for when the surface it was read from goes away.
+        /// </summary>
+        void Invalidate();
+
+        uint64_t GetReadbacks() const { return m_Readbacks; }
+        uint64_t GetHits() const { return m_Hits; }
+
+    private:
+        std::mutex m_Mutex;
+
+        // Frames before the current one, each recycled once its last reader lets go. Frames passing the stages and
+        // the one they are compared with hold on to theirs, there are enough spares that one is free regardless.
+        static constexpr size_t SpareCount = 4;
+
+        std::shared_ptr<Frame> m_Current;
+        std::shared_ptr<Frame> m_Spares[SpareCount];
+        uint64_t m_Readbacks = 0;
+        uint64_t m_Hits = 0;
+
+        void Retire(std::shared_ptr<Frame> Retired);
+    };
+}
\ No newline at end of file
@@ -0,0 +1,231 @@
+#include "FramePool.h"
+#include "ThreadPolicy.h"
+
+#include <algorithm>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <fstream>
+#include <limits>
+#include <string>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+
+namespace PartialDisplay::Memory
+{
+#ifdef _WIN32
+    static size_t GetLargePageSize()
+    {
+        static const size_t s_LargePageSize = GetLargePageMinimum();
+        return s_LargePageSize;
+    }
+
+    static char* AllocatePages(size_t Size, bool LargePages)
+    {
+        DWORD Type = MEM_RESERVE | MEM_COMMIT | (LargePages ? MEM_LARGE_PAGES : 0);
+        return static_cast<char*>(VirtualAlloc(nullptr, Size, Type, PAGE_READWRITE));
+    }
+
+    static void FreePages(char* Data, size_t)
+    {
+        VirtualFree(Data, 0, MEM_RELEASE);
+    }
+
+    bool FramePool::EnableLargePages()
+    {
+        // Large pages need SeLockMemoryPrivilege; it must be granted by policy, here we only switch it on.
+        HANDLE Token;
+        if (GetLargePageSize() == 0
+            || !OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &Token))
+        {
+            return false;
+        }
+
+        TOKEN_PRIVILEGES tp = {};
+        tp.PrivilegeCount = 1;
+        tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+        bool Enabled = LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid)
+            && AdjustTokenPrivileges(Token, FALSE, &tp, 0, nullptr, nullptr) && GetLastError() == ERROR_SUCCESS;
+        CloseHandle(Token);
+        if (!Enabled)
+        {
+            return false;
+        }
+
+        unique_lock<mutex> lock(m_Mutex);
+        m_LargePages = true;
+        return true;
+    }
+
+    uint64_t GetPageFaultCount()
+    {
+        PROCESS_MEMORY_COUNTERS Counters = {};
+        Counters.cb = sizeof(Counters);
+        return GetProcessMemoryInfo(GetCurrentProcess(), &Counters, sizeof(Counters)) ? Counters.PageFaultCount : 0;
+    }
+#else
+    static size_t GetLargePageSize()
+    {
+        // The default huge page size, "Hugepagesize:    2048 kB"; none if the kernel doesn't say
+        static const size_t s_LargePageSize = []
+            {
+                ifstream MemInfo("/proc/meminfo");
+                string Name;
+                size_t Size;
+                while (MemInfo >> Name)
+                {
+                    if (Name == "Hugepagesize:" && MemInfo >> Size)
+                    {
+                        return Size * 1024;
+                    }
+                    MemInfo.ignore(numeric_limits<streamsize>::max(), '\n');
+                }
+                return size_t(0);
+            }();
+        return s_LargePageSize;
+    }
+
+    static char* AllocatePages(size_t Size, bool LargePages)
+    {
+        int Flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_HUGETLB
+        Flags |= LargePages ? MAP_HUGETLB : 0;
+#else
+        if (LargePages)
+        {
+            return nullptr;
+        }
+#endif
+        void* Data = mmap(nullptr, Size, PROT_READ | PROT_WRITE, Flags, -1, 0);
+        return Data != MAP_FAILED ? static_cast<char*>(Data) : nullptr;
+    }
+
+    static void FreePages(char* Data, size_t Size)
+    {
+        munmap(Data, Size);
+    }
+
+    bool FramePool::EnableLargePages()
+    {
+        // Huge pages come from the pool reserved in /proc/sys/vm/nr_hugepages; when it runs dry buffers fall back to
+        // normal pages one by one
+        if (GetLargePageSize() == 0)
+        {
+            return false;
+        }
+        unique_lock<mutex> lock(m_Mutex);
+        m_LargePages = true;
+        return true;
+    }
+
+    uint64_t GetPageFaultCount()
+    {
+        rusage Usage = {};
+        return getrusage(RUSAGE_SELF, &Usage) == 0 ? uint64_t(Usage.ru_minflt) + uint64_t(Usage.ru_majflt) : 0;
+    }
+#endif
+
+    FrameBuffer::FrameBuffer(size_t Capacity, bool LargePages) : m_Data(), m_Capacity(), m_LargePages(), m_Locked()
+    {
+        if (LargePages && GetLargePageSize() != 0)
+        {
+            size_t Rounded = (Capacity + GetLargePageSize() - 1) / GetLargePageSize() * GetLargePageSize();
+            m_Data = AllocatePages(Rounded, true);
+            if (m_Data != nullptr)
+            {
+                m_Capacity = Rounded;
+                m_LargePages = true;
+                return;
+            }
+        }
+
+        // Fresh pages come zeroed from the OS, so there is no explicit clear to pay for here
+        m_Data = AllocatePages(Capacity, false);
+        m_Capacity = m_Data != nullptr ? Capacity : 0;
+    }
+
+    FrameBuffer::~FrameBuffer()
+    {
+        if (m_Data != nullptr)
+        {
+            if (m_Locked)
+            {
+                Scheduling::UnlockMemory(m_Data, m_Capacity);
+            }
+            FreePages(m_Data, m_Capacity);
+        }
+    }
+
+    bool FrameBuffer::Lock()
+    {
+        // Large pages are never paged out, there is nothing to lock
+        if (!m_Locked && !m_LargePages)
+        {
+            m_Locked = Scheduling::LockMemory(m_Data, m_Capacity);
+        }
+        return m_Locked || m_LargePages;
+    }
+
+    void FramePool::EnableMemoryLocking()
+    {
+        unique_lock<mutex> lock(m_Mutex);
+        m_LockMemory = true;
+    }
+
+    void FramePool::SetCapacity(size_t Capacity)
+    {
+        unique_lock<mutex> lock(m_Mutex);
+        m_Capacity = Capacity;
+        m_Free.erase(remove_if(m_Free.begin(), m_Free.end(),
+            [Capacity](const unique_ptr<FrameBuffer>& Buffer) { return Buffer->GetCapacity() < Capacity; }),
+            m_Free.end());
+    }
+
+    unique_ptr<FrameBuffer> FramePool::Acquire(size_t MinCapacity)
+    {
+        unique_lock<mutex> lock(m_Mutex);
+        for (auto it = m_Free.begin(); it != m_Free.end(); ++it)
+        {
+            if ((*it)->GetCapacity() >= MinCapacity)
+            {
+                auto Buffer = move(*it);
+                m_Free.erase(it);
+                return Buffer;
+            }
+        }
+
+        // Allocate at least the advertised capacity so a later mode change can reuse this buffer
+        auto Buffer = make_unique<FrameBuffer>(max(MinCapacity, m_Capacity), m_LargePages);
+        if (!Buffer->IsValid())
+        {
+            return nullptr;
+        }
+        if (m_LockMemory)
+        {
+            // Best effort, like the rest of the thread policy; the buffer is as usable unlocked
+            Buffer->Lock();
+        }
+        m_Allocations++;
+        return Buffer;
+    }
+
+    void FramePool::Release(unique_ptr<FrameBuffer> Buffer)
+    {
+        if (Buffer == nullptr)
+        {
+            return;
+        }
+
+        unique_lock<mutex> lock(m_Mutex);
+        if (Buffer->GetCapacity() >= m_Capacity)
+        {
+            m_Free.push_back(move(Buffer));
+        }
+    }
+}
\ No newline at end of file
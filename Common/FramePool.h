@@ -0,0 +1,73 @@
+#pragma once
+
+// Frame memory for the receiving end of the protocol. Frames are megabytes each and arrive many times a second, so
+// their buffers come straight from the OS, page-aligned and never zero-filled by us, and are recycled through a pool
+// sized from the capability query rather than grown frame by frame. The Windows backend uses VirtualAlloc, the POSIX
+// one mmap; both can back a buffer with large pages.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace PartialDisplay::Memory
+{
+    /// <summary>
+    /// Page-aligned frame memory taken directly from the OS. It is never zero-filled by us, and it is backed by large
+    /// pages when requested and the system has them to give: on Windows the process must hold SeLockMemoryPrivilege,
+    /// on Linux huge pages must have been reserved.
+    /// </summary>
+    class FrameBuffer
+    {
+    public:
+        FrameBuffer(size_t Capacity, bool LargePages);
+        ~FrameBuffer();
+        FrameBuffer(const FrameBuffer&) = delete;
+        FrameBuffer& operator=(const FrameBuffer&) = delete;
+
+        bool IsValid() const { return m_Data != nullptr; }
+        char* GetData() const { return m_Data; }
+        size_t GetCapacity() const { return m_Capacity; }
+        bool IsLargePage() const { return m_LargePages; }
+        bool Lock();
+
+    private:
+        char* m_Data;
+        size_t m_Capacity;
+        bool m_LargePages;
+        bool m_Locked;
+    };
+
+    /// <summary>
+    /// Recycles frame buffers so steady-state frames and resolution changes within the advertised capacity never
+    /// allocate.
+    /// </summary>
+    class FramePool
+    {
+    public:
+        /// <summary>
+        /// Backs buffers allocated from now on with large pages where possible. On Windows this enables
+        /// SeLockMemoryPrivilege, which policy must have granted; returns false if large pages can't be had.
+        /// </summary>
+        bool EnableLargePages();
+        void EnableMemoryLocking();
+        void SetCapacity(size_t Capacity);
+        std::unique_ptr<FrameBuffer> Acquire(size_t MinCapacity);
+        void Release(std::unique_ptr<FrameBuffer> Buffer);
+        size_t GetAllocationCount() const { return m_Allocations; }
+
+    private:
+        std::mutex m_Mutex;
+        std::vector<std::unique_ptr<FrameBuffer>> m_Free;
+        size_t m_Capacity = 0;
+        size_t m_Allocations = 0;
+        bool m_LargePages = false;
+        bool m_LockMemory = false;
+    };
+
+    /// <summary>
+    /// Page faults the process has taken so far, soft and hard, or 0 where the system doesn't count them.
+    /// </summary>
+    uint64_t GetPageFaultCount();
+}
\ No newline at end of file
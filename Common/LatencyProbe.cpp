@@ -0,0 +1,201 @@
+#include "LatencyProbe.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+namespace
+{
+    using namespace PartialDisplay;
+
+    // Black and white in every format, opaque. White in scRGB is 320 nits, bright enough to stay above half scale
+    // once PQ encoded or tone mapped down to 8 bits.
+    constexpr uint16_t HalfOne = 0x3C00;
+    constexpr uint16_t HalfWhite = 0x4400;
+    constexpr uint16_t HalfBlack16[4] = { 0, 0, 0, HalfOne };
+    constexpr uint16_t HalfWhite16[4] = { HalfWhite, HalfWhite, HalfWhite, HalfOne };
+    constexpr uint32_t Black32 = 0xFF000000;
+    constexpr uint32_t White32 = 0xFFFFFFFF;
+    constexpr uint32_t Black1010102 = 0xC0000000;
+    constexpr uint16_t Black565 = 0;
+    constexpr uint16_t White565 = 0xFFFF;
+
+    uint8_t Crc8(uint64_t Value)
+    {
+        uint8_t Crc = 0;
+        for (int i = 7; i >= 0; i--)
+        {
+            Crc ^= uint8_t(Value >> (i * 8));
+            for (int Bit = 0; Bit < 8; Bit++)
+            {
+                Crc = uint8_t((Crc & 0x80) ? (Crc << 1) ^ 0x07 : Crc << 1);
+            }
+        }
+        return Crc;
+    }
+
+    bool GetCell(uint64_t Value, uint32_t Cell)
+    {
+        if (Cell < 2)
+        {
+            return Cell == 0;
+        }
+        if (Cell < 66)
+        {
+            return (Value >> (65 - Cell)) & 1;
+        }
+        return (Crc8(Value) >> (73 - Cell)) & 1;
+    }
+
+    void FillCell(uint8_t* Row, uint32_t BytesPerPixel, const void* Pixel)
+    {
+        for (uint32_t x = 0; x < Probe::MarkerCellSize; x++)
+        {
+            memcpy(Row + x * BytesPerPixel, Pixel, BytesPerPixel);
+        }
+    }
+
+    /// <summary>
+    /// Whether the green of a pixel is at least half scale, which tells the cells apart however lossy the way there.
+    /// </summary>
+    bool IsBright(const uint8_t* Pixel, Protocol::PixelFormat Format)
+    {
+        switch (Format)
+        {
+        case Protocol::PixelFormat::R10G10B10A2:
+        {
+            uint32_t Packed;
+            memcpy(&Packed, Pixel, 4);
+            return ((Packed >> 10) & 0x3FF) >= 512;
+        }
+        case Protocol::PixelFormat::RGBA16F:
+        {
+            uint16_t Half;
+            memcpy(&Half, Pixel + 2, 2);
+            return Half >= 0x3800 && Half < 0x8000;  // At least 0.5, sign clear
+        }
+        case Protocol::PixelFormat::B5G6R5:
+        {
+            uint16_t Packed;
+            memcpy(&Packed, Pixel, 2);
+            return ((Packed >> 5) & 0x3F) >= 32;
+        }
+        default:
+            return Pixel[1] >= 128;
+        }
+    }
+}
+
+namespace PartialDisplay::Probe
+{
+    bool StampMarker(void* Pixels, size_t Pitch, uint32_t Width, uint32_t Height, Protocol::PixelFormat Format,
+        uint64_t Value)
+    {
+        if (!FitsMarker(Width, Height))
+        {
+            return false;
+        }
+
+        const void* Black = &Black32;
+        const void* White = &White32;
+        if (Format == Protocol::PixelFormat::R10G10B10A2)
+        {
+            Black = &Black1010102;
+        }
+        else if (Format == Protocol::PixelFormat::RGBA16F)
+        {
+            Black = HalfBlack16;
+            White = HalfWhite16;
+        }
+        else if (Format == Protocol::PixelFormat::B5G6R5)
+        {
+            Black = &Black565;
+            White = &White565;
+        }
+
+        uint32_t BytesPerPixel = Protocol::BytesPerPixel(Format);
+        uint8_t* Row = static_cast<uint8_t*>(Pixels);
+        for (uint32_t Cell = 0; Cell < MarkerCells; Cell++)
+        {
+            FillCell(Row + size_t(Cell) * MarkerCellSize * BytesPerPixel, BytesPerPixel,
+                GetCell(Value, Cell) ? White : Black);
+        }
+        for (uint32_t y = 1; y < MarkerHeight; y++)
+        {
+            memcpy(Row + y * Pitch, Row, size_t(MarkerWidth) * BytesPerPixel);
+        }
+        return true;
+    }
+
+    bool ReadMarker(const void* Pixels, size_t Pitch, uint32_t Width, uint32_t Height, Protocol::PixelFormat Format,
+        uint32_t Shift, uint64_t& Value)
+    {
+        // The centre of each cell, which even at the largest downscale only averages pixels of that cell
+        if ((Width << Shift) < MarkerWidth || (Height << Shift) < MarkerHeight)
+        {
+            return false;
+        }
+        uint32_t BytesPerPixel = Protocol::BytesPerPixel(Format);
+        const uint8_t* Row = static_cast<const uint8_t*>(Pixels) + ((MarkerCellSize / 2) >> Shift) * Pitch;
+        auto Read = [&](uint32_t Cell)
+            {
+                uint32_t x = (Cell * MarkerCellSize + MarkerCellSize / 2) >> Shift;
+                return IsBright(Row + size_t(x) * BytesPerPixel, Format);
+            };
+
+        if (!Read(0) || Read(1))
+        {
+            return false;
+        }
+        uint64_t Read64 = 0;
+        for (uint32_t Cell = 2; Cell < 66; Cell++)
+        {
+            Read64 = (Read64 << 1) | uint64_t(Read(Cell));
+        }
+        uint8_t Crc = 0;
+        for (uint32_t Cell = 66; Cell < MarkerCells; Cell++)
+        {
+            Crc = uint8_t((Crc << 1) | uint8_t(Read(Cell)));
+        }
+        if (Crc != Crc8(Read64))
+        {
+            return false;
+        }
+        Value = Read64;
+        return true;
+    }
+
+    void LatencyHistogram::Add(uint64_t LatencyNs)
+    {
+        m_Buckets[min<uint64_t>(LatencyNs / BucketNs, BucketCount - 1)]++;
+        m_Count++;
+        m_Total += LatencyNs;
+        m_Min = min(m_Min, LatencyNs);
+        m_Max = max(m_Max, LatencyNs);
+    }
+
+    void LatencyHistogram::Clear()
+    {
+        *this = LatencyHistogram();
+    }
+
+    uint64_t LatencyHistogram::GetPercentile(double Fraction) const
+    {
+        if (m_Count == 0)
+        {
+            return 0;
+        }
+        uint64_t Rank = max<uint64_t>(1, uint64_t(Fraction * m_Count + 0.5));
+        uint64_t Seen = 0;
+        for (uint32_t i = 0; i < BucketCount; i++)
+        {
+            Seen += m_Buckets[i];
+            if (Seen >= Rank)
+            {
+                return min((i + 1) * BucketNs, m_Max);
+            }
+        }
+        return m_Max;
+    }
+}
\ No newline at end of file
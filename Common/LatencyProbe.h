@@ -0,0 +1,80 @@
+#pragma once
+
+// Glass-to-glass latency probing. The producer stamps a 64-bit value, the time the OS presented the frame, into a
+// marker at the top left corner of the frame's pixels, and the consumer reads it back from the frame it is about to
+// present. Because the marker travels in the pixels rather than beside them, it goes through every conversion, diff,
+// tile codec and cache on the way, so a stage that shows stale or mangled pixels shows up too.
+//
+// The marker is a row of MarkerCells cells of MarkerCellSize pixels square, black or white: a white and a black cell
+// to find it by, the value from its most significant bit and a CRC-8 of it. Cells line up with the 8x8 blocks of
+// lossy tiles and stay two pixels wide when the frame is downscaled as far as it goes, so they survive both.
+
+#include <cstdint>
+#include <cstddef>
+
+#include "Protocol.h"
+
+namespace PartialDisplay::Probe
+{
+    constexpr uint32_t MarkerCellSize = 8;
+    constexpr uint32_t MarkerCells = 2 + 64 + 8;
+    constexpr uint32_t MarkerWidth = MarkerCellSize * MarkerCells;
+    constexpr uint32_t MarkerHeight = MarkerCellSize;
+
+    /// <summary>
+    /// What the marker covers in a full size frame, which is what the producer must add to the damage of every frame
+    /// it stamps.
+    /// </summary>
+    constexpr Protocol::DamageRect MarkerRect = { 0, 0, int32_t(MarkerWidth), int32_t(MarkerHeight) };
+
+    /// <summary>
+    /// Whether a full size frame is large enough to carry the marker.
+    /// </summary>
+    constexpr bool FitsMarker(uint32_t Width, uint32_t Height) { return Width >= MarkerWidth && Height >= MarkerHeight; }
+
+    /// <summary>
+    /// Writes Value into the marker of a full size frame in any of the protocol formats. Returns false, leaving the
+    /// frame alone, if it is too small.
+    /// </summary>
+    bool StampMarker(void* Pixels, size_t Pitch, uint32_t Width, uint32_t Height, Protocol::PixelFormat Format,
+        uint64_t Value);
+
+    /// <summary>
+    /// Reads the marker back from a frame of Width x Height pixels downscaled by 2^Shift, telling cells apart by
+    /// their green channel. Returns false if the frame carries no marker or a damaged one.
+    /// </summary>
+    bool ReadMarker(const void* Pixels, size_t Pitch, uint32_t Width, uint32_t Height, Protocol::PixelFormat Format,
+        uint32_t Shift, uint64_t& Value);
+
+    /// <summary>
+    /// Distribution of latencies in fixed buckets, so recording one costs no allocation and no sorting. Latencies are
+    /// kept to BucketNs and anything past the last bucket counts as the last bucket.
+    /// </summary>
+    class LatencyHistogram
+    {
+    public:
+        static constexpr uint64_t BucketNs = 50'000;
+        static constexpr uint32_t BucketCount = 4000;  // Up to 200 ms
+
+        void Add(uint64_t LatencyNs);
+        void Clear();
+
+        uint64_t GetCount() const { return m_Count; }
+        uint64_t GetMin() const { return m_Count != 0 ? m_Min : 0; }
+        uint64_t GetMax() const { return m_Max; }
+        uint64_t GetMean() const { return m_Count != 0 ? m_Total / m_Count : 0; }
+
+        /// <summary>
+        /// The latency Fraction of the samples are at or below, to the upper edge of its bucket and never past the
+        /// largest sample. 0 while empty.
+        /// </summary>
+        uint64_t GetPercentile(double Fraction) const;
+
+    private:
+        uint32_t m_Buckets[BucketCount] = {};
+        uint64_t m_Count = 0;
+        uint64_t m_Total = 0;
+        uint64_t m_Min = UINT64_MAX;
+        uint64_t m_Max = 0;
+    };
+}
\ No newline at end of file
@@ -0,0 +1,1458 @@
+#include "PixelKernels.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <immintrin.h>
+#define PD_KERNELS_SSE2 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// One binary carries every tier and picks at run time, so the wider tiers are compiled function by function. MSVC
+// takes any intrinsic anywhere, GCC and Clang have to be told which functions may use them.
+#if defined(__GNUC__)
+#define PD_TARGET(Features) __attribute__((target(Features)))
+#else
+#define PD_TARGET(Features)
+#endif
+
+using namespace std;
+using PartialDisplay::Kernels::Isa;
+
+namespace
+{
+    // HDR content is mapped so that SDR white keeps its brightness and highlights roll off smoothly towards 1.0.
+    constexpr float SdrWhiteScRgb = 2.5f;  // 200 nits, the default SDR content brightness of Windows HDR mode
+    constexpr float ToneMapKnee = 0.8f;    // Below this fraction of SDR white the mapping is linear
+    constexpr float NitsPerScRgb = 80.0f;
+    constexpr float PqMaxNits = 10000.0f;
+
+    // Ordered 4x4 Bayer matrix in 1/16ths of an 8-bit step, matching the 8.4 fixed point used by the tables
+    alignas(16) const uint16_t s_Bayer[4][4] =
+    {
+        {  0,  8,  2, 10 },
+        { 12,  4, 14,  6 },
+        {  3, 11,  1,  9 },
+        { 15,  7, 13,  5 },
+    };
+
+    constexpr uint16_t OpaqueAlpha = 255 << 4;
+
+    float HalfToFloat(uint16_t Half)
+    {
+        uint32_t Exponent = (Half >> 10) & 0x1F;
+        uint32_t Mantissa = Half & 0x3FF;
+        if (Exponent == 0)
+        {
+            return ldexp(float(Mantissa), -24);
+        }
+        if (Exponent == 31)
+        {
+            return HUGE_VALF;
+        }
+        return ldexp(float(Mantissa | 0x400), int(Exponent) - 25);
+    }
+
+    float ToneMap(float Linear)
+    {
+        // Linear is relative to SDR white; the exponential shoulder has slope 1 at the knee and approaches 1.0
+        if (Linear <= ToneMapKnee)
+        {
+            return max(Linear, 0.0f);
+        }
+        return ToneMapKnee + (1 - ToneMapKnee) * (1 - exp(-(Linear - ToneMapKnee) / (1 - ToneMapKnee)));
+    }
+
+    float SrgbEncode(float Linear)
+    {
+        return Linear <= 0.0031308f ? Linear * 12.92f : 1.055f * pow(Linear, 1 / 2.4f) - 0.055f;
+    }
+
+    // SMPTE ST 2084 constants
+    constexpr float PqM1 = 2610.0f / 16384;
+    constexpr float PqM2 = 2523.0f / 4096 * 128;
+    constexpr float PqC1 = 3424.0f / 4096;
+    constexpr float PqC2 = 2413.0f / 4096 * 32;
+    constexpr float PqC3 = 2392.0f / 4096 * 32;
+
+    float PqEncode(float Nits)
+    {
+        float L = pow(min(max(Nits / PqMaxNits, 0.0f), 1.0f), PqM1);
+        return pow((PqC1 + PqC2 * L) / (1 + PqC3 * L), PqM2);
+    }
+
+    float PqDecode(float Code)
+    {
+        float E = pow(Code, 1 / PqM2);
+        return PqMaxNits * pow(max(E - PqC1, 0.0f) / (PqC2 - PqC3 * E), 1 / PqM1);
+    }
+
+    uint16_t ToSdrFixed(float Linear)
+    {
+        return uint16_t(lround(SrgbEncode(ToneMap(Linear)) * OpaqueAlpha));
+    }
+
+    /// <summary>
+    /// Per-channel lookup tables. Every transfer function used here is a pure function of one channel, and both
+    /// input formats have few enough codes (32K non-negative halfs, 1K PQ codes) to tabulate them exactly.
+    /// Note that BT.2020 primaries are not converted to BT.709, so tone mapped HDR10 looks slightly desaturated.
+    /// </summary>
+    struct Tables
+    {
+        uint16_t HalfToSdr[0x8000];  // Non-negative half -> tone mapped sRGB, 8.4 fixed point
+        uint16_t HalfToPq[0x8000];   // Non-negative half -> 10-bit PQ code
+        uint16_t PqToSdr[1024];      // 10-bit PQ code -> tone mapped sRGB, 8.4 fixed point
+        uint16_t GatherSlack = 0;    // Gathers read 32 bits for every 16-bit entry, the last one of a table included:
+                                     // each table is the slack of the one before it, this of PqToSdr
+
+        Tables()
+        {
+            for (uint32_t Half = 0; Half < 0x8000; Half++)
+            {
+                float ScRgb = min(HalfToFloat(uint16_t(Half)), PqMaxNits / NitsPerScRgb);
+                HalfToSdr[Half] = ToSdrFixed(ScRgb / SdrWhiteScRgb);
+                HalfToPq[Half] = uint16_t(lround(PqEncode(ScRgb * NitsPerScRgb) * 1023));
+            }
+            for (uint32_t Code = 0; Code < 1024; Code++)
+            {
+                PqToSdr[Code] = ToSdrFixed(PqDecode(Code / 1023.0f) / NitsPerScRgb / SdrWhiteScRgb);
+            }
+        }
+    };
+
+    const Tables& GetTables()
+    {
+        static const Tables s_Tables;
+        return s_Tables;
+    }
+
+    inline uint16_t LookupHalf(const uint16_t* Table, uint16_t Half)
+    {
+        // Negative values are outside the gamut we can show
+        return (Half & 0x8000) ? 0 : Table[Half];
+    }
+
+    inline uint32_t PackDithered(uint32_t B, uint32_t G, uint32_t R, uint32_t Dither)
+    {
+        // 8.4 values top out at 255 << 4, adding less than one step never overflows a byte
+        return ((B + Dither) >> 4) | (((G + Dither) >> 4) << 8) | (((R + Dither) >> 4) << 16) | 0xFF000000;
+    }
+
+    inline uint16_t Pack565Pixel(uint32_t P, uint32_t X, uint32_t Y)
+    {
+        // Half a step of each channel's precision at most, saturating as the vector variants do
+        uint32_t Threshold = s_Bayer[Y & 3][X & 3];
+        uint32_t B = min((P & 0xFF) + (Threshold >> 1), 255u);
+        uint32_t G = min(((P >> 8) & 0xFF) + (Threshold >> 2), 255u);
+        uint32_t R = min(((P >> 16) & 0xFF) + (Threshold >> 1), 255u);
+        return uint16_t((B >> 3) | ((G >> 2) << 5) | ((R >> 3) << 11));
+    }
+
+#ifdef PD_KERNELS_SSE2
+    /// <summary>
+    /// Bayer thresholds of four BGRA pixels for truncating to 5-6-5 bits: half a step of the channel's precision.
+    /// </summary>
+    inline __m128i GetDither565Row(uint32_t Y)
+    {
+        alignas(16) uint8_t Bytes[16] = {};
+        for (uint32_t i = 0; i < 4; i++)
+        {
+            uint16_t Threshold = s_Bayer[Y & 3][i];
+            Bytes[i * 4 + 0] = uint8_t(Threshold >> 1);
+            Bytes[i * 4 + 1] = uint8_t(Threshold >> 2);
+            Bytes[i * 4 + 2] = uint8_t(Threshold >> 1);
+        }
+        return _mm_load_si128(reinterpret_cast<const __m128i*>(Bytes));
+    }
+
+    void ReadCpuid(uint32_t Leaf, uint32_t (&Registers)[4])
+    {
+#if defined(_MSC_VER)
+        int Values[4];
+        __cpuidex(Values, int(Leaf), 0);
+        memcpy(Registers, Values, sizeof(Values));
+#else
+        __cpuid_count(Leaf, 0, Registers[0], Registers[1], Registers[2], Registers[3]);
+#endif
+    }
+
+    uint64_t ReadXcr0()
+    {
+#if defined(_MSC_VER)
+        return _xgetbv(0);
+#else
+        uint32_t Low, High;
+        __asm__ volatile("xgetbv" : "=a"(Low), "=d"(High) : "c"(0));
+        return (uint64_t(High) << 32) | Low;
+#endif
+    }
+
+    /// <summary>
+    /// Copies Bytes with aligned non-temporal stores, the unaligned head and the tail with plain ones.
+    /// </summary>
+    void StreamRow(const uint8_t* Src, uint8_t* Dst, size_t Bytes)
+    {
+        size_t Head = min(Bytes, size_t(-reinterpret_cast<uintptr_t>(Dst) & 15));
+        memcpy(Dst, Src, Head);
+        size_t i = Head;
+        for (; i + 64 <= Bytes; i += 64)
+        {
+            __m128i A = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Src + i));
+            __m128i B = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Src + i + 16));
+            __m128i C = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Src + i + 32));
+            __m128i D = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Src + i + 48));
+            _mm_stream_si128(reinterpret_cast<__m128i*>(Dst + i), A);
+            _mm_stream_si128(reinterpret_cast<__m128i*>(Dst + i + 16), B);
+            _mm_stream_si128(reinterpret_cast<__m128i*>(Dst + i + 32), C);
+            _mm_stream_si128(reinterpret_cast<__m128i*>(Dst + i + 48), D);
+        }
+        for (; i + 16 <= Bytes; i += 16)
+        {
+            _mm_stream_si128(reinterpret_cast<__m128i*>(Dst + i),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(Src + i)));
+        }
+        memcpy(Dst + i, Src + i, Bytes - i);
+    }
+
+    // Row kernels by tier. Each converts as many leading pixels of a row as fill its vectors and returns how many;
+    // the scalar loop of the kernel does the rest. Tables index them by tier, Scalar has none and a tier without a
+    // variant of its own takes the one below.
+
+    typedef uint32_t (*Pack565Row)(const uint32_t* In, uint16_t* Out, uint32_t Width, uint32_t Y);
+
+    uint32_t Pack565Sse2(const uint32_t* In, uint16_t* Out, uint32_t Width, uint32_t Y)
+    {
+        // Saturating add of the threshold, then each pixel is packed in its 32-bit lane and the lanes are narrowed
+        // with a signed pack biased by 0x8000, as SSE2 has no unsigned 32-bit pack.
+        const __m128i Dither = GetDither565Row(Y);
+        const __m128i MaskB = _mm_set1_epi32(0x001F), MaskG = _mm_set1_epi32(0x07E0), MaskR = _mm_set1_epi32(0xF800);
+        const __m128i Bias32 = _mm_set1_epi32(0x8000), Bias16 = _mm_set1_epi16(-0x8000);
+        uint32_t x = 0;
+        for (; x + 8 <= Width; x += 8)
+        {
+            __m128i Packed[2];
+            for (uint32_t i = 0; i < 2; i++)
+            {
+                __m128i P = _mm_adds_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(In + x + i * 4)), Dither);
+                __m128i V = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(P, 3), MaskB), _mm_or_si128(
+                    _mm_and_si128(_mm_srli_epi32(P, 5), MaskG), _mm_and_si128(_mm_srli_epi32(P, 8), MaskR)));
+                Packed[i] = _mm_sub_epi32(V, Bias32);
+            }
+            __m128i Result = _mm_add_epi16(_mm_packs_epi32(Packed[0], Packed[1]), Bias16);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(Out + x), Result);
+        }
+        return x;
+    }
+
+    PD_TARGET("sse4.1")
+    uint32_t Pack565Sse41(const uint32_t* In, uint16_t* Out, uint32_t Width, uint32_t Y)
+    {
+        // As SSE2, with the unsigned pack that saves the bias
+        const __m128i Dither = GetDither565Row(Y);
+        const __m128i MaskB = _mm_set1_epi32(0x001F), MaskG = _mm_set1_epi32(0x07E0), MaskR = _mm_set1_epi32(0xF800);
+        uint32_t x = 0;
+        for (; x + 8 <= Width; x += 8)
+        {
+            __m128i Packed[2];
+            for (uint32_t i = 0; i < 2; i++)
+            {
+                __m128i P = _mm_adds_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(In + x + i * 4)), Dither);
+                Packed[i] = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(P, 3), MaskB), _mm_or_si128(
+                    _mm_and_si128(_mm_srli_epi32(P, 5), MaskG), _mm_and_si128(_mm_srli_epi32(P, 8), MaskR)));
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(Out + x), _mm_packus_epi32(Packed[0], Packed[1]));
+        }
+        return x;
+    }
+
+    PD_TARGET("avx2")
+    uint32_t Pack565Avx2(const uint32_t* In, uint16_t* Out, uint32_t Width, uint32_t Y)
+    {
+        // The dither repeats every four pixels, so both halves take the same thresholds
+        const __m256i Dither = _mm256_broadcastsi128_si256(GetDither565Row(Y));
+        const __m256i MaskB = _mm256_set1_epi32(0x001F), MaskG = _mm256_set1_epi32(0x07E0);
+        const __m256i MaskR = _mm256_set1_epi32(0xF800);
+        uint32_t x = 0;
+        for (; x + 16 <= Width; x += 16)
+        {
+            __m256i Packed[2];
+            for (uint32_t i = 0; i < 2; i++)
+            {
+                __m256i P = _mm256_adds_epu8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(In + x + i * 8)),
+                    Dither);
+                __m256i B = _mm256_and_si256(_mm256_srli_epi32(P, 3), MaskB);
+                __m256i G = _mm256_and_si256(_mm256_srli_epi32(P, 5), MaskG);
+                Packed[i] = _mm256_or_si256(B, _mm256_or_si256(G, _mm256_and_si256(_mm256_srli_epi32(P, 8), MaskR)));
+            }
+            // The pack works within 128-bit halves, the permute puts the pixels back in order
+            __m256i Result = _mm256_permute4x64_epi64(_mm256_packus_epi32(Packed[0], Packed[1]),
+                _MM_SHUFFLE(3, 1, 2, 0));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(Out + x), Result);
+        }
+        return x;
+    }
+
+    PD_TARGET("avx512f,avx512bw")
+    uint32_t Pack565Avx512(const uint32_t* In, uint16_t* Out, uint32_t Width, uint32_t Y)
+    {
+        const __m512i Dither = _mm512_broadcast_i32x4(GetDither565Row(Y));
+        const __m512i MaskB = _mm512_set1_epi32(0x001F), MaskG = _mm512_set1_epi32(0x07E0);
+        const __m512i MaskR = _mm512_set1_epi32(0xF800);
+        uint32_t x = 0;
+        for (; x + 16 <= Width; x += 16)
+        {
+            __m512i P = _mm512_adds_epu8(_mm512_loadu_si512(In + x), Dither);
+            __m512i V = _mm512_or_si512(_mm512_and_si512(_mm512_srli_epi32(P, 3), MaskB), _mm512_or_si512(
+                _mm512_and_si512(_mm512_srli_epi32(P, 5), MaskG), _mm512_and_si512(_mm512_srli_epi32(P, 8), MaskR)));
+            // Every lane holds a 16-bit result, narrowing keeps them in order
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(Out + x), _mm512_cvtepi32_epi16(V));
+        }
+        return x;
+    }
+
+    const Pack565Row s_Pack565[] = { nullptr, Pack565Sse2, Pack565Sse41, Pack565Avx2, Pack565Avx512 };
+    constexpr uint32_t Pack565Chunk = 256;  // Pixels, a multiple of every variant's vector
+
+    // The HDR conversions look every channel up in a table of 16-bit entries, which takes a gather. SSE2 and SSE4.1
+    // have none: storing the indices, looking them up one by one and reloading the results as a vector stalls on
+    // every reload and ran at 40% of the scalar loop, so those tiers take the scalar loop instead.
+    typedef uint32_t (*ToneMapRow)(const void* In, uint32_t* Out, uint32_t Width, uint32_t Y, const uint16_t* Table);
+
+    /// <summary>
+    /// Dithers eight pixels given as 8.4 fixed point channels in 32-bit lanes and packs them as opaque BGRA8.
+    /// </summary>
+    PD_TARGET("avx2")
+    inline __m256i PackDithered8(__m256i B, __m256i G, __m256i R, __m256i Dither)
+    {
+        B = _mm256_srli_epi32(_mm256_add_epi32(B, Dither), 4);
+        G = _mm256_slli_epi32(_mm256_srli_epi32(_mm256_add_epi32(G, Dither), 4), 8);
+        R = _mm256_slli_epi32(_mm256_srli_epi32(_mm256_add_epi32(R, Dither), 4), 16);
+        return _mm256_or_si256(_mm256_or_si256(B, G), _mm256_or_si256(R, _mm256_set1_epi32(int(0xFF000000))));
+    }
+
+    PD_TARGET("avx512f")
+    inline __m512i PackDithered16(__m512i B, __m512i G, __m512i R, __m512i Dither)
+    {
+        B = _mm512_srli_epi32(_mm512_add_epi32(B, Dither), 4);
+        G = _mm512_slli_epi32(_mm512_srli_epi32(_mm512_add_epi32(G, Dither), 4), 8);
+        R = _mm512_slli_epi32(_mm512_srli_epi32(_mm512_add_epi32(R, Dither), 4), 16);
+        return _mm512_or_si512(_mm512_or_si512(B, G), _mm512_or_si512(R, _mm512_set1_epi32(int(0xFF000000))));
+    }
+
+    /// <summary>
+    /// Looks up eight halfs, given in the low 16 bits of each lane, as LookupHalf does.
+    /// </summary>
+    PD_TARGET("avx2")
+    inline __m256i LookupHalf8(const uint16_t* Table, __m256i Halfs)
+    {
+        const __m256i Sign = _mm256_set1_epi32(0x8000);
+        __m256i Positive = _mm256_cmpeq_epi32(_mm256_and_si256(Halfs, Sign), _mm256_setzero_si256());
+        __m256i Entries = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), reinterpret_cast<const int*>(Table),
+            _mm256_and_si256(Halfs, _mm256_set1_epi32(0x7FFF)), Positive, 2);
+        return _mm256_and_si256(Entries, _mm256_set1_epi32(0xFFFF));
+    }
+
+    PD_TARGET("avx512f")
+    inline __m512i LookupHalf16(const uint16_t* Table, __m512i Halfs)
+    {
+        __mmask16 Positive = _mm512_testn_epi32_mask(Halfs, _mm512_set1_epi32(0x8000));
+        __m512i Entries = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), Positive,
+            _mm512_and_si512(Halfs, _mm512_set1_epi32(0x7FFF)), Table, 2);
+        return _mm512_and_si512(Entries, _mm512_set1_epi32(0xFFFF));
+    }
+
+    PD_TARGET("avx2")
+    uint32_t ScRgbToBgra8Avx2(const void* In, uint32_t* Out, uint32_t Width, uint32_t Y, const uint16_t* Table)
+    {
+        // Each pixel is two 32-bit lanes, RG and BA; gathering the even lanes and the odd ones separates them
+        const uint16_t* Bayer = s_Bayer[Y & 3];
+        const __m256i Dither = _mm256_setr_epi32(Bayer[0], Bayer[1], Bayer[2], Bayer[3], Bayer[0], Bayer[1],
+            Bayer[2], Bayer[3]);
+        const __m256i Split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+        const __m256i Low = _mm256_set1_epi32(0xFFFF);
+        auto* Pixels = static_cast<const uint8_t*>(In);
+        uint32_t x = 0;
+        for (; x + 8 <= Width; x += 8)
+        {
+            auto* P = reinterpret_cast<const __m256i*>(Pixels + size_t(x) * 8);
+            __m256i First = _mm256_permutevar8x32_epi32(_mm256_loadu_si256(P), Split);
+            __m256i Second = _mm256_permutevar8x32_epi32(_mm256_loadu_si256(P + 1), Split);
+            __m256i RG = _mm256_permute2x128_si256(First, Second, 0x20);
+            __m256i BA = _mm256_permute2x128_si256(First, Second, 0x31);
+            __m256i R = LookupHalf8(Table, _mm256_and_si256(RG, Low));
+            __m256i G = LookupHalf8(Table, _mm256_srli_epi32(RG, 16));
+            __m256i B = LookupHalf8(Table, _mm256_and_si256(BA, Low));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(Out + x), PackDithered8(B, G, R, Dither));
+        }
+        return x;
+    }
+
+    PD_TARGET("avx512f")
+    uint32_t ScRgbToBgra8Avx512(const void* In, uint32_t* Out, uint32_t Width, uint32_t Y, const uint16_t* Table)
+    {
+        const uint16_t* Bayer = s_Bayer[Y & 3];
+        const __m512i Dither = _mm512_setr_epi32(Bayer[0], Bayer[1], Bayer[2], Bayer[3], Bayer[0], Bayer[1],
+            Bayer[2], Bayer[3], Bayer[0], Bayer[1], Bayer[2], Bayer[3], Bayer[0], Bayer[1], Bayer[2], Bayer[3]);
+        const __m512i Even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+        const __m512i Odd = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31);
+        const __m512i Low = _mm512_set1_epi32(0xFFFF);
+        auto* Pixels = static_cast<const uint8_t*>(In);
+        uint32_t x = 0;
+        for (; x + 16 <= Width; x += 16)
+        {
+            const uint8_t* P = Pixels + size_t(x) * 8;
+            __m512i First = _mm512_loadu_si512(P), Second = _mm512_loadu_si512(P + 64);
+            __m512i RG = _mm512_permutex2var_epi32(First, Even, Second);
+            __m512i BA = _mm512_permutex2var_epi32(First, Odd, Second);
+            __m512i R = LookupHalf16(Table, _mm512_and_si512(RG, Low));
+            __m512i G = LookupHalf16(Table, _mm512_srli_epi32(RG, 16));
+            __m512i B = LookupHalf16(Table, _mm512_and_si512(BA, Low));
+            _mm512_storeu_si512(Out + x, PackDithered16(B, G, R, Dither));
+        }
+        return x;
+    }
+
+    PD_TARGET("avx2")
+    uint32_t Hdr10ToBgra8Avx2(const void* In, uint32_t* Out, uint32_t Width, uint32_t Y, const uint16_t* Table)
+    {
+        const uint16_t* Bayer = s_Bayer[Y & 3];
+        const __m256i Dither = _mm256_setr_epi32(Bayer[0], Bayer[1], Bayer[2], Bayer[3], Bayer[0], Bayer[1],
+            Bayer[2], Bayer[3]);
+        const __m256i Mask = _mm256_set1_epi32(0x3FF), Low = _mm256_set1_epi32(0xFFFF);
+        auto* Base = reinterpret_cast<const int*>(Table);
+        auto* Pixels = static_cast<const uint32_t*>(In);
+        uint32_t x = 0;
+        for (; x + 8 <= Width; x += 8)
+        {
+            __m256i P = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Pixels + x));
+            __m256i R = _mm256_and_si256(_mm256_i32gather_epi32(Base, _mm256_and_si256(P, Mask), 2), Low);
+            __m256i G = _mm256_and_si256(
+                _mm256_i32gather_epi32(Base, _mm256_and_si256(_mm256_srli_epi32(P, 10), Mask), 2), Low);
+            __m256i B = _mm256_and_si256(
+                _mm256_i32gather_epi32(Base, _mm256_and_si256(_mm256_srli_epi32(P, 20), Mask), 2), Low);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(Out + x), PackDithered8(B, G, R, Dither));
+        }
+        return x;
+    }
+
+    PD_TARGET("avx512f")
+    uint32_t Hdr10ToBgra8Avx512(const void* In, uint32_t* Out, uint32_t Width, uint32_t Y, const uint16_t* Table)
+    {
+        const uint16_t* Bayer = s_Bayer[Y & 3];
+        const __m512i Dither = _mm512_setr_epi32(Bayer[0], Bayer[1], Bayer[2], Bayer[3], Bayer[0], Bayer[1],
+            Bayer[2], Bayer[3], Bayer[0], Bayer[1], Bayer[2], Bayer[3], Bayer[0], Bayer[1], Bayer[2], Bayer[3]);
+        const __m512i Mask = _mm512_set1_epi32(0x3FF), Low = _mm512_set1_epi32(0xFFFF);
+        auto* Pixels = static_cast<const uint32_t*>(In);
+        uint32_t x = 0;
+        for (; x + 16 <= Width; x += 16)
+        {
+            __m512i P = _mm512_loadu_si512(Pixels + x);
+            __m512i R = _mm512_and_si512(_mm512_i32gather_epi32(_mm512_and_si512(P, Mask), Table, 2), Low);
+            __m512i G = _mm512_and_si512(
+                _mm512_i32gather_epi32(_mm512_and_si512(_mm512_srli_epi32(P, 10), Mask), Table, 2), Low);
+            __m512i B = _mm512_and_si512(
+                _mm512_i32gather_epi32(_mm512_and_si512(_mm512_srli_epi32(P, 20), Mask), Table, 2), Low);
+            _mm512_storeu_si512(Out + x, PackDithered16(B, G, R, Dither));
+        }
+        return x;
+    }
+
+    PD_TARGET("avx2")
+    uint32_t ScRgbToHdr10Avx2(const void* In, uint32_t* Out, uint32_t Width, uint32_t, const uint16_t* Table)
+    {
+        // Split into RG and BA lanes as ScRgbToBgra8Avx2 does, then packed as 10:10:10:2 with opaque alpha
+        const __m256i Split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+        const __m256i Low = _mm256_set1_epi32(0xFFFF), Alpha = _mm256_set1_epi32(int(3u << 30));
+        auto* Pixels = static_cast<const uint8_t*>(In);
+        uint32_t x = 0;
+        for (; x + 8 <= Width; x += 8)
+        {
+            auto* P = reinterpret_cast<const __m256i*>(Pixels + size_t(x) * 8);
+            __m256i First = _mm256_permutevar8x32_epi32(_mm256_loadu_si256(P), Split);
+            __m256i Second = _mm256_permutevar8x32_epi32(_mm256_loadu_si256(P + 1), Split);
+            __m256i RG = _mm256_permute2x128_si256(First, Second, 0x20);
+            __m256i BA = _mm256_permute2x128_si256(First, Second, 0x31);
+            __m256i R = LookupHalf8(Table, _mm256_and_si256(RG, Low));
+            __m256i G = _mm256_slli_epi32(LookupHalf8(Table, _mm256_srli_epi32(RG, 16)), 10);
+            __m256i B = _mm256_slli_epi32(LookupHalf8(Table, _mm256_and_si256(BA, Low)), 20);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(Out + x),
+                _mm256_or_si256(_mm256_or_si256(R, G), _mm256_or_si256(B, Alpha)));
+        }
+        return x;
+    }
+
+    PD_TARGET("avx512f")
+    uint32_t ScRgbToHdr10Avx512(const void* In, uint32_t* Out, uint32_t Width, uint32_t, const uint16_t* Table)
+    {
+        const __m512i Even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+        const __m512i Odd = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31);
+        const __m512i Low = _mm512_set1_epi32(0xFFFF), Alpha = _mm512_set1_epi32(int(3u << 30));
+        auto* Pixels = static_cast<const uint8_t*>(In);
+        uint32_t x = 0;
+        for (; x + 16 <= Width; x += 16)
+        {
+            const uint8_t* P = Pixels + size_t(x) * 8;
+            __m512i First = _mm512_loadu_si512(P), Second = _mm512_loadu_si512(P + 64);
+            __m512i RG = _mm512_permutex2var_epi32(First, Even, Second);
+            __m512i BA = _mm512_permutex2var_epi32(First, Odd, Second);
+            __m512i R = LookupHalf16(Table, _mm512_and_si512(RG, Low));
+            __m512i G = _mm512_slli_epi32(LookupHalf16(Table, _mm512_srli_epi32(RG, 16)), 10);
+            __m512i B = _mm512_slli_epi32(LookupHalf16(Table, _mm512_and_si512(BA, Low)), 20);
+            _mm512_storeu_si512(Out + x, _mm512_ternarylogic_epi32(R, G, _mm512_or_si512(B, Alpha), 0xFE));
+        }
+        return x;
+    }
+
+    const ToneMapRow s_ScRgbToBgra8[] = { nullptr, nullptr, nullptr, ScRgbToBgra8Avx2, ScRgbToBgra8Avx512 };
+    const ToneMapRow s_ScRgbToHdr10[] = { nullptr, nullptr, nullptr, ScRgbToHdr10Avx2, ScRgbToHdr10Avx512 };
+    const ToneMapRow s_Hdr10ToBgra8[] = { nullptr, nullptr, nullptr, Hdr10ToBgra8Avx2, Hdr10ToBgra8Avx512 };
+
+    // A gamma ramp looks every byte up in a table of 256 entries, too many for a byte shuffle to index, so it takes
+    // a gather as well; the tables hold 32-bit entries already shifted into place, which the gathers read as they
+    // are. SSE2 and SSE4.1 keep the scalar loop for the same reason as tone mapping.
+    typedef uint32_t (*ChannelLutRow)(const uint32_t* In, uint32_t* Out, uint32_t Width,
+        const PartialDisplay::Kernels::ChannelLut& Lut);
+
+    PD_TARGET("avx2")
+    uint32_t ApplyChannelLutAvx2(const uint32_t* In, uint32_t* Out, uint32_t Width,
+        const PartialDisplay::Kernels::ChannelLut& Lut)
+    {
+        const __m256i Byte = _mm256_set1_epi32(0xFF), Alpha = _mm256_set1_epi32(int(0xFF000000));
+        auto* Blue = reinterpret_cast<const int*>(Lut.Blue);
+        auto* Green = reinterpret_cast<const int*>(Lut.Green);
+        auto* Red = reinterpret_cast<const int*>(Lut.Red);
+        uint32_t x = 0;
+        for (; x + 8 <= Width; x += 8)
+        {
+            __m256i P = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(In + x));
+            __m256i B = _mm256_i32gather_epi32(Blue, _mm256_and_si256(P, Byte), 4);
+            __m256i G = _mm256_i32gather_epi32(Green, _mm256_and_si256(_mm256_srli_epi32(P, 8), Byte), 4);
+            __m256i R = _mm256_i32gather_epi32(Red, _mm256_and_si256(_mm256_srli_epi32(P, 16), Byte), 4);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(Out + x),
+                _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(P, Alpha), B), _mm256_or_si256(G, R)));
+        }
+        return x;
+    }
+
+    /// <summary>
+    /// Maps sixteen BGRA8 pixels through the tables: alpha from the pixels, the channels from the tables, which are
+    /// zero outside their own byte.
+    /// </summary>
+    PD_TARGET("avx512f")
+    inline __m512i MapChannels16(__m512i P, const PartialDisplay::Kernels::ChannelLut& Lut)
+    {
+        const __m512i Byte = _mm512_set1_epi32(0xFF);
+        __m512i B = _mm512_i32gather_epi32(_mm512_and_si512(P, Byte), Lut.Blue, 4);
+        __m512i G = _mm512_i32gather_epi32(_mm512_and_si512(_mm512_srli_epi32(P, 8), Byte), Lut.Green, 4);
+        __m512i R = _mm512_i32gather_epi32(_mm512_and_si512(_mm512_srli_epi32(P, 16), Byte), Lut.Red, 4);
+        return _mm512_ternarylogic_epi32(_mm512_and_si512(P, _mm512_set1_epi32(int(0xFF000000))), B,
+            _mm512_or_si512(G, R), 0xFE);
+    }
+
+    PD_TARGET("avx512f")
+    uint32_t ApplyChannelLutAvx512(const uint32_t* In, uint32_t* Out, uint32_t Width,
+        const PartialDisplay::Kernels::ChannelLut& Lut)
+    {
+        // Two vectors at a time, so the gathers of one overlap those of the other
+        uint32_t x = 0;
+        for (; x + 32 <= Width; x += 32)
+        {
+            __m512i First = _mm512_loadu_si512(In + x), Second = _mm512_loadu_si512(In + x + 16);
+            _mm512_storeu_si512(Out + x, MapChannels16(First, Lut));
+            _mm512_storeu_si512(Out + x + 16, MapChannels16(Second, Lut));
+        }
+        for (; x + 16 <= Width; x += 16)
+        {
+            _mm512_storeu_si512(Out + x, MapChannels16(_mm512_loadu_si512(In + x), Lut));
+        }
+        return x;
+    }
+
+    const ChannelLutRow s_ApplyChannelLut[] = { nullptr, nullptr, nullptr, ApplyChannelLutAvx2,
+        ApplyChannelLutAvx512 };
+
+    typedef uint32_t (*MirrorRow)(const uint32_t* In, uint32_t* Out, uint32_t Width);
+
+    uint32_t MirrorRowSse2(const uint32_t* In, uint32_t* Out, uint32_t Width)
+    {
+        uint32_t x = 0;
+        for (; x + 4 <= Width; x += 4)
+        {
+            __m128i Pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(In + Width - 4 - x));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(Out + x), _mm_shuffle_epi32(Pixels, _MM_SHUFFLE(0, 1, 2, 3)));
+        }
+        return x;
+    }
+
+    PD_TARGET("avx2")
+    uint32_t MirrorRowAvx2(const uint32_t* In, uint32_t* Out, uint32_t Width)
+    {
+        const __m256i Reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+        uint32_t x = 0;
+        for (; x + 8 <= Width; x += 8)
+        {
+            __m256i Pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(In + Width - 8 - x));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(Out + x), _mm256_permutevar8x32_epi32(Pixels, Reverse));
+        }
+        return x;
+    }
+
+    PD_TARGET("avx512f")
+    uint32_t MirrorRowAvx512(const uint32_t* In, uint32_t* Out, uint32_t Width)
+    {
+        const __m512i Reverse = _mm512_setr_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+        uint32_t x = 0;
+        for (; x + 16 <= Width; x += 16)
+        {
+            __m512i Pixels = _mm512_loadu_si512(In + Width - 16 - x);
+            _mm512_storeu_si512(Out + x, _mm512_permutexvar_epi32(Reverse, Pixels));
+        }
+        return x;
+    }
+
+    const MirrorRow s_MirrorRow[] = { nullptr, MirrorRowSse2, MirrorRowSse2, MirrorRowAvx2, MirrorRowAvx512 };
+
+    typedef uint32_t (*HalveRow)(const uint8_t* Top, const uint8_t* Bottom, uint32_t* Out, uint32_t Width);
+
+    uint32_t HalveRowSse2(const uint8_t* Top, const uint8_t* Bottom, uint32_t* Out, uint32_t Width)
+    {
+        // Eight pixels of two rows become four: the rows are summed in 16-bit lanes, then each pixel is added to its
+        // right neighbour by pairing the 64-bit halves.
+        const __m128i Zero = _mm_setzero_si128();
+        const __m128i Round = _mm_set1_epi16(2);
+        uint32_t x = 0;
+        for (; x + 4 <= Width; x += 4)
+        {
+            auto* T = reinterpret_cast<const __m128i*>(Top + size_t(x) * 8);
+            auto* B = reinterpret_cast<const __m128i*>(Bottom + size_t(x) * 8);
+            __m128i T0 = _mm_loadu_si128(T), T1 = _mm_loadu_si128(T + 1);
+            __m128i B0 = _mm_loadu_si128(B), B1 = _mm_loadu_si128(B + 1);
+
+            __m128i S0 = _mm_add_epi16(_mm_unpacklo_epi8(T0, Zero), _mm_unpacklo_epi8(B0, Zero));
+            __m128i S1 = _mm_add_epi16(_mm_unpackhi_epi8(T0, Zero), _mm_unpackhi_epi8(B0, Zero));
+            __m128i S2 = _mm_add_epi16(_mm_unpacklo_epi8(T1, Zero), _mm_unpacklo_epi8(B1, Zero));
+            __m128i S3 = _mm_add_epi16(_mm_unpackhi_epi8(T1, Zero), _mm_unpackhi_epi8(B1, Zero));
+
+            __m128i D01 = _mm_add_epi16(_mm_unpacklo_epi64(S0, S1), _mm_unpackhi_epi64(S0, S1));
+            __m128i D23 = _mm_add_epi16(_mm_unpacklo_epi64(S2, S3), _mm_unpackhi_epi64(S2, S3));
+            D01 = _mm_srli_epi16(_mm_add_epi16(D01, Round), 2);
+            D23 = _mm_srli_epi16(_mm_add_epi16(D23, Round), 2);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(Out + x), _mm_packus_epi16(D01, D23));
+        }
+        return x;
+    }
+
+    PD_TARGET("avx2")
+    uint32_t HalveRowAvx2(const uint8_t* Top, const uint8_t* Bottom, uint32_t* Out, uint32_t Width)
+    {
+        // As SSE2 within each 128-bit half, then a permute puts the halves' results back in order
+        const __m256i Zero = _mm256_setzero_si256();
+        const __m256i Round = _mm256_set1_epi16(2);
+        uint32_t x = 0;
+        for (; x + 8 <= Width; x += 8)
+        {
+            auto* T = reinterpret_cast<const __m256i*>(Top + size_t(x) * 8);
+            auto* B = reinterpret_cast<const __m256i*>(Bottom + size_t(x) * 8);
+            __m256i T0 = _mm256_loadu_si256(T), T1 = _mm256_loadu_si256(T + 1);
+            __m256i B0 = _mm256_loadu_si256(B), B1 = _mm256_loadu_si256(B + 1);
+
+            __m256i S0 = _mm256_add_epi16(_mm256_unpacklo_epi8(T0, Zero), _mm256_unpacklo_epi8(B0, Zero));
+            __m256i S1 = _mm256_add_epi16(_mm256_unpackhi_epi8(T0, Zero), _mm256_unpackhi_epi8(B0, Zero));
+            __m256i S2 = _mm256_add_epi16(_mm256_unpacklo_epi8(T1, Zero), _mm256_unpacklo_epi8(B1, Zero));
+            __m256i S3 = _mm256_add_epi16(_mm256_unpackhi_epi8(T1, Zero), _mm256_unpackhi_epi8(B1, Zero));
+
+            __m256i D01 = _mm256_add_epi16(_mm256_unpacklo_epi64(S0, S1), _mm256_unpackhi_epi64(S0, S1));
+            __m256i D23 = _mm256_add_epi16(_mm256_unpacklo_epi64(S2, S3), _mm256_unpackhi_epi64(S2, S3));
+            D01 = _mm256_srli_epi16(_mm256_add_epi16(D01, Round), 2);
+            D23 = _mm256_srli_epi16(_mm256_add_epi16(D23, Round), 2);
+            __m256i Result = _mm256_permute4x64_epi64(_mm256_packus_epi16(D01, D23), _MM_SHUFFLE(3, 1, 2, 0));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(Out + x), Result);
+        }
+        return x;
+    }
+
+    PD_TARGET("avx512f,avx512bw")
+    uint32_t HalveRowAvx512(const uint8_t* Top, const uint8_t* Bottom, uint32_t* Out, uint32_t Width)
+    {
+        const __m512i Zero = _mm512_setzero_si512();
+        const __m512i Round = _mm512_set1_epi16(2);
+        const __m512i Order = _mm512_setr_epi64(0, 2, 4, 6, 1, 3, 5, 7);
+        uint32_t x = 0;
+        for (; x + 16 <= Width; x += 16)
+        {
+            const uint8_t* T = Top + size_t(x) * 8;
+            const uint8_t* B = Bottom + size_t(x) * 8;
+            __m512i T0 = _mm512_loadu_si512(T), T1 = _mm512_loadu_si512(T + 64);
+            __m512i B0 = _mm512_loadu_si512(B), B1 = _mm512_loadu_si512(B + 64);
+
+            __m512i S0 = _mm512_add_epi16(_mm512_unpacklo_epi8(T0, Zero), _mm512_unpacklo_epi8(B0, Zero));
+            __m512i S1 = _mm512_add_epi16(_mm512_unpackhi_epi8(T0, Zero), _mm512_unpackhi_epi8(B0, Zero));
+            __m512i S2 = _mm512_add_epi16(_mm512_unpacklo_epi8(T1, Zero), _mm512_unpacklo_epi8(B1, Zero));
+            __m512i S3 = _mm512_add_epi16(_mm512_unpackhi_epi8(T1, Zero), _mm512_unpackhi_epi8(B1, Zero));
+
+            __m512i D01 = _mm512_add_epi16(_mm512_unpacklo_epi64(S0, S1), _mm512_unpackhi_epi64(S0, S1));
+            __m512i D23 = _mm512_add_epi16(_mm512_unpacklo_epi64(S2, S3), _mm512_unpackhi_epi64(S2, S3));
+            D01 = _mm512_srli_epi16(_mm512_add_epi16(D01, Round), 2);
+            D23 = _mm512_srli_epi16(_mm512_add_epi16(D23, Round), 2);
+            _mm512_storeu_si512(Out + x, _mm512_permutexvar_epi64(Order, _mm512_packus_epi16(D01, D23)));
+        }
+        return x;
+    }
+
+    const HalveRow s_HalveRow[] = { nullptr, HalveRowSse2, HalveRowSse2, HalveRowAvx2, HalveRowAvx512 };
+
+    // A column of blocks for the transposing orientations: source rows In, In + Step and so on, as many as the block is
+    // wide, become destination columns Out, Out + 4 and so on, for destination rows Top to Bottom, a multiple of the
+    // block's height apart. Mirrored source columns come out in reverse destination row order. The wider tiers write
+    // whole 64-byte destination lines, and with Stream, when those are aligned, write them around the cache: a
+    // transposed frame is read by another process and its lines are far apart, so fetching each one in to overwrite it
+    // costs more than the transpose itself.
+    typedef void (*TransposeColumn)(const uint8_t* In, ptrdiff_t Step, uint8_t* Out, size_t DstPitch, uint32_t Top,
+        uint32_t Bottom, uint32_t Width, bool Stream);
+
+    template <bool FlipX>
+    void TransposeColumnSse2(const uint8_t* In, ptrdiff_t Step, uint8_t* Out, size_t DstPitch, uint32_t Top,
+        uint32_t Bottom, uint32_t Width, bool)
+    {
+        for (uint32_t y = Top; y < Bottom; y += 4)
+        {
+            const uint8_t* Block = In + (FlipX ? Width - 4 - y : y) * sizeof(uint32_t);
+            __m128i R0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Block));
+            __m128i R1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Block + Step));
+            __m128i R2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Block + 2 * Step));
+            __m128i R3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Block + 3 * Step));
+
+            __m128i T0 = _mm_unpacklo_epi32(R0, R1);  // 00 10 01 11
+            __m128i T1 = _mm_unpacklo_epi32(R2, R3);  // 20 30 21 31
+            __m128i T2 = _mm_unpackhi_epi32(R0, R1);  // 02 12 03 13
+            __m128i T3 = _mm_unpackhi_epi32(R2, R3);  // 22 32 23 33
+
+            uint8_t* Rows = Out + y * DstPitch;
+            size_t Row0 = FlipX ? 3 : 0, Row1 = FlipX ? 2 : 1, Row2 = FlipX ? 1 : 2, Row3 = FlipX ? 0 : 3;
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(Rows + Row0 * DstPitch), _mm_unpacklo_epi64(T0, T1));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(Rows + Row1 * DstPitch), _mm_unpackhi_epi64(T0, T1));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(Rows + Row2 * DstPitch), _mm_unpacklo_epi64(T2, T3));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(Rows + Row3 * DstPitch), _mm_unpackhi_epi64(T2, T3));
+        }
+    }
+
+    /// <summary>
+    /// Transposes eight rows of eight pixels in place: the SSE2 4x4 steps within each 128-bit half, then the halves of
+    /// rows 0-3 and 4-7 are paired up.
+    /// </summary>
+    PD_TARGET("avx2")
+    inline void Transpose8x8Avx2(__m256i (&R)[8])
+    {
+        __m256i T[8];
+        for (uint32_t i = 0; i < 8; i += 2)
+        {
+            T[i] = _mm256_unpacklo_epi32(R[i], R[i + 1]);
+            T[i + 1] = _mm256_unpackhi_epi32(R[i], R[i + 1]);
+        }
+        for (uint32_t i = 0; i < 8; i += 4)
+        {
+            // Rows i to i + 3 of columns c and c + 4, for c = 0 to 3
+            R[i] = _mm256_unpacklo_epi64(T[i], T[i + 2]);
+            R[i + 1] = _mm256_unpackhi_epi64(T[i], T[i + 2]);
+            R[i + 2] = _mm256_unpacklo_epi64(T[i + 1], T[i + 3]);
+            R[i + 3] = _mm256_unpackhi_epi64(T[i + 1], T[i + 3]);
+        }
+        for (uint32_t c = 0; c < 4; c++)
+        {
+            T[c] = _mm256_permute2x128_si256(R[c], R[c + 4], 0x20);
+            T[c + 4] = _mm256_permute2x128_si256(R[c], R[c + 4], 0x31);
+        }
+        for (uint32_t i = 0; i < 8; i++)
+        {
+            R[i] = T[i];
+        }
+    }
+
+    template <bool FlipX>
+    PD_TARGET("avx2")
+    void TransposeColumnAvx2(const uint8_t* In, ptrdiff_t Step, uint8_t* Out, size_t DstPitch, uint32_t Top,
+        uint32_t Bottom, uint32_t Width, bool Stream)
+    {
+        // Two 8x8 transposes side by side, source rows 0-7 and 8-15, so each destination row gets a whole line
+        for (uint32_t y = Top; y < Bottom; y += 8)
+        {
+            const uint8_t* Block = In + (FlipX ? Width - 8 - y : y) * sizeof(uint32_t);
+            __m256i Left[8], Right[8];
+            for (uint32_t i = 0; i < 8; i++)
+            {
+                Left[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Block + ptrdiff_t(i) * Step));
+                Right[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Block + ptrdiff_t(i + 8) * Step));
+            }
+            Transpose8x8Avx2(Left);
+            Transpose8x8Avx2(Right);
+
+            uint8_t* Rows = Out + y * DstPitch;
+            for (uint32_t i = 0; i < 8; i++)
+            {
+                auto* Row = reinterpret_cast<__m256i*>(Rows + (FlipX ? 7 - i : i) * DstPitch);
+                if (Stream)
+                {
+                    _mm256_stream_si256(Row, Left[i]);
+                    _mm256_stream_si256(Row + 1, Right[i]);
+                }
+                else
+                {
+                    _mm256_storeu_si256(Row, Left[i]);
+                    _mm256_storeu_si256(Row + 1, Right[i]);
+                }
+            }
+        }
+    }
+
+    template <bool FlipX>
+    PD_TARGET("avx512f")
+    void TransposeColumnAvx512(const uint8_t* In, ptrdiff_t Step, uint8_t* Out, size_t DstPitch, uint32_t Top,
+        uint32_t Bottom, uint32_t Width, bool Stream)
+    {
+        // 16x16, so every load and every store is a whole cache line's worth: the SSE2 4x4 steps within each 128-bit
+        // lane, then two lane shuffles gather lane l of the four row groups into destination rows l * 4 + c
+        for (uint32_t y = Top; y < Bottom; y += 16)
+        {
+            const uint8_t* Block = In + (FlipX ? Width - 16 - y : y) * sizeof(uint32_t);
+            __m512i R[16], T[16];
+            for (uint32_t i = 0; i < 16; i++)
+            {
+                R[i] = _mm512_loadu_si512(Block + ptrdiff_t(i) * Step);
+            }
+            for (uint32_t i = 0; i < 16; i += 2)
+            {
+                T[i] = _mm512_unpacklo_epi32(R[i], R[i + 1]);
+                T[i + 1] = _mm512_unpackhi_epi32(R[i], R[i + 1]);
+            }
+            for (uint32_t i = 0; i < 16; i += 4)
+            {
+                // Lane l: rows i to i + 3 of column l * 4 + c, for c = 0 to 3
+                R[i] = _mm512_unpacklo_epi64(T[i], T[i + 2]);
+                R[i + 1] = _mm512_unpackhi_epi64(T[i], T[i + 2]);
+                R[i + 2] = _mm512_unpacklo_epi64(T[i + 1], T[i + 3]);
+                R[i + 3] = _mm512_unpackhi_epi64(T[i + 1], T[i + 3]);
+            }
+
+            uint8_t* Rows = Out + y * DstPitch;
+            for (uint32_t c = 0; c < 4; c++)
+            {
+                __m512i Even01 = _mm512_shuffle_i32x4(R[c], R[c + 4], _MM_SHUFFLE(2, 0, 2, 0));
+                __m512i Odd01 = _mm512_shuffle_i32x4(R[c], R[c + 4], _MM_SHUFFLE(3, 1, 3, 1));
+                __m512i Even23 = _mm512_shuffle_i32x4(R[c + 8], R[c + 12], _MM_SHUFFLE(2, 0, 2, 0));
+                __m512i Odd23 = _mm512_shuffle_i32x4(R[c + 8], R[c + 12], _MM_SHUFFLE(3, 1, 3, 1));
+                const __m512i Columns[4] =
+                {
+                    _mm512_shuffle_i32x4(Even01, Even23, _MM_SHUFFLE(2, 0, 2, 0)),
+                    _mm512_shuffle_i32x4(Odd01, Odd23, _MM_SHUFFLE(2, 0, 2, 0)),
+                    _mm512_shuffle_i32x4(Even01, Even23, _MM_SHUFFLE(3, 1, 3, 1)),
+                    _mm512_shuffle_i32x4(Odd01, Odd23, _MM_SHUFFLE(3, 1, 3, 1)),
+                };
+                for (uint32_t l = 0; l < 4; l++)
+                {
+                    uint8_t* Row = Rows + (FlipX ? 15 - (l * 4 + c) : l * 4 + c) * DstPitch;
+                    if (Stream)
+                    {
+                        _mm512_stream_si512(reinterpret_cast<__m512i*>(Row), Columns[l]);
+                    }
+                    else
+                    {
+                        _mm512_storeu_si512(Row, Columns[l]);
+                    }
+                }
+            }
+        }
+    }
+
+    template <bool FlipX>
+    const TransposeColumn s_TransposeColumn[] =
+    {
+        nullptr, TransposeColumnSse2<FlipX>, TransposeColumnSse2<FlipX>, TransposeColumnAvx2<FlipX>,
+        TransposeColumnAvx512<FlipX>
+    };
+    constexpr uint32_t s_TransposeBlockRows[] = { 1, 4, 4, 8, 16 };
+    constexpr uint32_t s_TransposeBlockColumns[] = { 1, 4, 4, 16, 16 };
+#endif
+
+    // Transposing orientations work on tiles of TransposeTileRows source columns by TransposeTileColumns source
+    // rows. Walking 64 bytes along each source row keeps the reads sequential, and only 16 rows are live at a time, so
+    // they don't evict each other even when the pitch aliases to few cache sets.
+    constexpr uint32_t TransposeTileRows = 256;
+    constexpr uint32_t TransposeTileColumns = 16;
+
+    inline const uint32_t* PixelAt(const void* Base, size_t Pitch, uint32_t X, uint32_t Y)
+    {
+        return reinterpret_cast<const uint32_t*>(static_cast<const uint8_t*>(Base) + Y * Pitch) + X;
+    }
+
+    /// <summary>
+    /// Copies rows in order or reversed, for the orientations that keep the axes.
+    /// </summary>
+    void MirrorRows(const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width, uint32_t Height,
+        bool FlipX, bool FlipY, Isa Level)
+    {
+        for (uint32_t y = 0; y < Height; y++)
+        {
+            const uint32_t* In = PixelAt(Src, SrcPitch, 0, FlipY ? Height - 1 - y : y);
+            auto* Out = reinterpret_cast<uint32_t*>(static_cast<uint8_t*>(Dst) + y * DstPitch);
+            if (!FlipX)
+            {
+                memcpy(Out, In, Width * sizeof(uint32_t));
+                continue;
+            }
+
+            uint32_t x = 0;
+#ifdef PD_KERNELS_SSE2
+            if (Level != Isa::Scalar)
+            {
+                x = s_MirrorRow[size_t(Level)](In, Out, Width);
+            }
+#endif
+            for (; x < Width; x++)
+            {
+                Out[x] = In[Width - 1 - x];
+            }
+        }
+    }
+
+    /// <summary>
+    /// Transposes with optional mirroring: destination (x, y) comes from source (FlipX ? Width - 1 - y : y,
+    /// FlipY ? Height - 1 - x : x). The destination is Height pixels wide and Width pixels high.
+    /// </summary>
+    template <bool FlipX, bool FlipY>
+    void TransposeTiled(const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width, uint32_t Height,
+        Isa Level)
+    {
+        auto CopyScalar = [=](uint32_t Top, uint32_t Bottom, uint32_t Left, uint32_t Right)
+        {
+            for (uint32_t y = Top; y < Bottom; y++)
+            {
+                auto* Out = reinterpret_cast<uint32_t*>(static_cast<uint8_t*>(Dst) + y * DstPitch);
+                uint32_t Column = FlipX ? Width - 1 - y : y;
+                for (uint32_t x = Left; x < Right; x++)
+                {
+                    Out[x] = *PixelAt(Src, SrcPitch, Column, FlipY ? Height - 1 - x : x);
+                }
+            }
+        };
+
+        // Tiles start 16 columns apart, so the wider tiers' lines are aligned wherever the destination rows are
+        const bool Stream = Level >= Isa::Avx2 && reinterpret_cast<uintptr_t>(Dst) % 64 == 0 && DstPitch % 64 == 0;
+        for (uint32_t TileY = 0; TileY < Width; TileY += TransposeTileRows)
+        {
+            uint32_t TileBottom = min(TileY + TransposeTileRows, Width);
+            for (uint32_t TileX = 0; TileX < Height; TileX += TransposeTileColumns)
+            {
+                uint32_t TileRight = min(TileX + TransposeTileColumns, Height);
+                uint32_t BlockBottom = TileY;
+                uint32_t BlockRight = TileX;
+
+#ifdef PD_KERNELS_SSE2
+                // Scalar leaves no blocks, the edges below then cover the whole tile
+                if (Level != Isa::Scalar)
+                {
+                    const uint32_t Rows = s_TransposeBlockRows[size_t(Level)];
+                    const uint32_t Columns = s_TransposeBlockColumns[size_t(Level)];
+                    BlockBottom = TileY + (TileBottom - TileY) / Rows * Rows;
+                    BlockRight = TileX + (TileRight - TileX) / Columns * Columns;
+                    ptrdiff_t Step = FlipY ? -ptrdiff_t(SrcPitch) : ptrdiff_t(SrcPitch);
+                    for (uint32_t x = TileX; x < BlockRight; x += Columns)
+                    {
+                        // As many consecutive destination columns as consecutive source rows
+                        auto* In = reinterpret_cast<const uint8_t*>(
+                            PixelAt(Src, SrcPitch, 0, FlipY ? Height - 1 - x : x));
+                        s_TransposeColumn<FlipX>[size_t(Level)](In, Step,
+                            static_cast<uint8_t*>(Dst) + x * sizeof(uint32_t), DstPitch, TileY, BlockBottom, Width,
+                            Stream);
+                    }
+                }
+#endif
+
+                // Edges that don't fill a block
+                CopyScalar(TileY, BlockBottom, BlockRight, TileRight);
+                CopyScalar(BlockBottom, TileBottom, TileX, TileRight);
+            }
+        }
+
+#ifdef PD_KERNELS_SSE2
+        // Streaming stores are weakly ordered, whoever is told the frame is there next must see it
+        if (Stream)
+        {
+            _mm_sfence();
+        }
+#endif
+    }
+}
+
+namespace PartialDisplay::Kernels
+{
+    Isa DetectIsa()
+    {
+#ifdef PD_KERNELS_SSE2
+        uint32_t Leaf0[4], Leaf1[4], Leaf7[4] = {};
+        ReadCpuid(0, Leaf0);
+        ReadCpuid(1, Leaf1);
+        if (Leaf0[0] >= 7)
+        {
+            ReadCpuid(7, Leaf7);
+        }
+
+        // The AVX tiers also need the OS to save their registers on a context switch: the upper halves of YMM, and
+        // for AVX-512 the opmasks and ZMM as well
+        const uint64_t Xcr0 = (Leaf1[2] & (1u << 27)) ? ReadXcr0() : 0;
+        const bool Sse2 = (Leaf1[3] & (1u << 26)) != 0;
+        const bool Sse41 = Sse2 && (Leaf1[2] & (1u << 19)) != 0;
+        const bool Avx2 = Sse41 && (Leaf1[2] & (1u << 28)) && (Leaf7[1] & (1u << 5)) && (Xcr0 & 0x06) == 0x06;
+        const bool Avx512 = Avx2 && (Leaf7[1] & (1u << 16)) && (Leaf7[1] & (1u << 30)) && (Xcr0 & 0xE6) == 0xE6;
+        return Avx512 ? Isa::Avx512 : Avx2 ? Isa::Avx2 : Sse41 ? Isa::Sse41 : Sse2 ? Isa::Sse2 : Isa::Scalar;
+#else
+        return Isa::Scalar;
+#endif
+    }
+
+    static atomic<Isa>& GetSelectedIsa()
+    {
+        static atomic<Isa> s_Selected(DetectIsa());
+        return s_Selected;
+    }
+
+    Isa SelectIsa(Isa Limit)
+    {
+        Isa Level = min(Limit, DetectIsa());
+        GetSelectedIsa().store(Level, memory_order_relaxed);
+        return Level;
+    }
+
+    Isa GetIsa()
+    {
+        return GetSelectedIsa().load(memory_order_relaxed);
+    }
+
+    const char* GetIsaName(Isa Level)
+    {
+        const char* Names[IsaCount] = { "scalar", "sse2", "sse4.1", "avx2", "avx512" };
+        return uint32_t(Level) < IsaCount ? Names[uint32_t(Level)] : "unknown";
+    }
+
+    void CopyRows(const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, size_t RowBytes, uint32_t Height)
+    {
+        // Slices past the bottom of a short frame are empty
+        if (Height == 0)
+        {
+            return;
+        }
+        if (SrcPitch == DstPitch)
+        {
+            memcpy(Dst, Src, SrcPitch * (Height - 1) + RowBytes);
+            return;
+        }
+
+        auto* SrcRow = static_cast<const uint8_t*>(Src);
+        auto* DstRow = static_cast<uint8_t*>(Dst);
+        for (uint32_t y = 0; y < Height; y++, SrcRow += SrcPitch, DstRow += DstPitch)
+        {
+            memcpy(DstRow, SrcRow, RowBytes);
+        }
+    }
+
+    void StreamRows(const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, size_t RowBytes, uint32_t Height)
+    {
+#ifdef PD_KERNELS_SSE2
+        if (Height != 0 && GetIsa() != Isa::Scalar)
+        {
+            auto* SrcRow = static_cast<const uint8_t*>(Src);
+            auto* DstRow = static_cast<uint8_t*>(Dst);
+            if (SrcPitch == DstPitch)
+            {
+                StreamRow(SrcRow, DstRow, SrcPitch * (Height - 1) + RowBytes);
+            }
+            else
+            {
+                for (uint32_t y = 0; y < Height; y++, SrcRow += SrcPitch, DstRow += DstPitch)
+                {
+                    StreamRow(SrcRow, DstRow, RowBytes);
+                }
+            }
+
+            // Streaming stores are weakly ordered, whoever is told the rows are there next must see them
+            _mm_sfence();
+            return;
+        }
+#endif
+        CopyRows(Src, SrcPitch, Dst, DstPitch, RowBytes, Height);
+    }
+
+    void ScRgbToBgra8(const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width, uint32_t Height)
+    {
+        const uint16_t* Table = GetTables().HalfToSdr;
+        const Isa Level = GetIsa();
+
+        for (uint32_t y = 0; y < Height; y++)
+        {
+            auto* In = reinterpret_cast<const uint16_t*>(static_cast<const uint8_t*>(Src) + y * SrcPitch);
+            auto* Out = reinterpret_cast<uint32_t*>(static_cast<uint8_t*>(Dst) + y * DstPitch);
+            uint32_t x = 0;
+
+#ifdef PD_KERNELS_SSE2
+            if (s_ScRgbToBgra8[size_t(Level)] != nullptr)
+            {
+                x = s_ScRgbToBgra8[size_t(Level)](In, Out, Width, y, Table);
+            }
+#endif
+
+            for (; x < Width; x++)
+            {
+                const uint16_t* Pixel = In + x * 4;
+                Out[x] = PackDithered(LookupHalf(Table, Pixel[2]), LookupHalf(Table, Pixel[1]),
+                    LookupHalf(Table, Pixel[0]), s_Bayer[y & 3][x & 3]);
+            }
+        }
+    }
+
+    void ScRgbToHdr10(const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width, uint32_t Height)
+    {
+        const uint16_t* Table = GetTables().HalfToPq;
+        const Isa Level = GetIsa();
+
+        for (uint32_t y = 0; y < Height; y++)
+        {
+            auto* In = reinterpret_cast<const uint16_t*>(static_cast<const uint8_t*>(Src) + y * SrcPitch);
+            auto* Out = reinterpret_cast<uint32_t*>(static_cast<uint8_t*>(Dst) + y * DstPitch);
+            uint32_t x = 0;
+
+#ifdef PD_KERNELS_SSE2
+            if (s_ScRgbToHdr10[size_t(Level)] != nullptr)
+            {
+                x = s_ScRgbToHdr10[size_t(Level)](In, Out, Width, y, Table);
+            }
+#endif
+
+            for (; x < Width; x++)
+            {
+                const uint16_t* Pixel = In + x * 4;
+                Out[x] = uint32_t(LookupHalf(Table, Pixel[0]))
+                    | (uint32_t(LookupHalf(Table, Pixel[1])) << 10)
+                    | (uint32_t(LookupHalf(Table, Pixel[2])) << 20)
+                    | (3u << 30);
+            }
+        }
+    }
+
+    void Hdr10ToBgra8(const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width, uint32_t Height)
+    {
+        const uint16_t* Table = GetTables().PqToSdr;
+        const Isa Level = GetIsa();
+
+        for (uint32_t y = 0; y < Height; y++)
+        {
+            auto* In = reinterpret_cast<const uint32_t*>(static_cast<const uint8_t*>(Src) + y * SrcPitch);
+            auto* Out = reinterpret_cast<uint32_t*>(static_cast<uint8_t*>(Dst) + y * DstPitch);
+            uint32_t x = 0;
+
+#ifdef PD_KERNELS_SSE2
+            if (s_Hdr10ToBgra8[size_t(Level)] != nullptr)
+            {
+                x = s_Hdr10ToBgra8[size_t(Level)](In, Out, Width, y, Table);
+            }
+#endif
+
+            for (; x < Width; x++)
+            {
+                uint32_t Pixel = In[x];
+                Out[x] = PackDithered(Table[(Pixel >> 20) & 0x3FF], Table[(Pixel >> 10) & 0x3FF], Table[Pixel & 0x3FF],
+                    s_Bayer[y & 3][x & 3]);
+            }
+        }
+    }
+
+    bool BuildChannelLut(const uint16_t (&Ramp)[3][256], ChannelLut& Lut)
+    {
+        bool Identity = true;
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t Red = (uint32_t(Ramp[0][i]) * 255 + 32767) / 65535;
+            uint32_t Green = (uint32_t(Ramp[1][i]) * 255 + 32767) / 65535;
+            uint32_t Blue = (uint32_t(Ramp[2][i]) * 255 + 32767) / 65535;
+            Identity &= Red == i && Green == i && Blue == i;
+
+            Lut.Blue[i] = Blue;
+            Lut.Green[i] = Green << 8;
+            Lut.Red[i] = Red << 16;
+        }
+        return !Identity;
+    }
+
+    void ApplyChannelLut(const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width, uint32_t Height,
+        const ChannelLut& Lut)
+    {
+        const Isa Level = GetIsa();
+        for (uint32_t y = 0; y < Height; y++)
+        {
+            auto* In = reinterpret_cast<const uint32_t*>(static_cast<const uint8_t*>(Src) + y * SrcPitch);
+            auto* Out = reinterpret_cast<uint32_t*>(static_cast<uint8_t*>(Dst) + y * DstPitch);
+            uint32_t x = 0;
+
+#ifdef PD_KERNELS_SSE2
+            if (s_ApplyChannelLut[size_t(Level)] != nullptr)
+            {
+                x = s_ApplyChannelLut[size_t(Level)](In, Out, Width, Lut);
+            }
+#endif
+
+            // Whole pixels at a time: three loads from the pre-shifted tables and two ORs each, unrolled by four
+            for (; x + 4 <= Width; x += 4)
+            {
+                uint32_t P0 = In[x], P1 = In[x + 1], P2 = In[x + 2], P3 = In[x + 3];
+                Out[x] = (P0 & 0xFF000000) | Lut.Blue[P0 & 0xFF] | Lut.Green[(P0 >> 8) & 0xFF] | Lut.Red[(P0 >> 16) & 0xFF];
+                Out[x + 1] = (P1 & 0xFF000000) | Lut.Blue[P1 & 0xFF] | Lut.Green[(P1 >> 8) & 0xFF] | Lut.Red[(P1 >> 16) & 0xFF];
+                Out[x + 2] = (P2 & 0xFF000000) | Lut.Blue[P2 & 0xFF] | Lut.Green[(P2 >> 8) & 0xFF] | Lut.Red[(P2 >> 16) & 0xFF];
+                Out[x + 3] = (P3 & 0xFF000000) | Lut.Blue[P3 & 0xFF] | Lut.Green[(P3 >> 8) & 0xFF] | Lut.Red[(P3 >> 16) & 0xFF];
+            }
+            for (; x < Width; x++)
+            {
+                uint32_t P = In[x];
+                Out[x] = (P & 0xFF000000) | Lut.Blue[P & 0xFF] | Lut.Green[(P >> 8) & 0xFF] | Lut.Red[(P >> 16) & 0xFF];
+            }
+        }
+    }
+
+    void TransformPixels32(const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width, uint32_t Height,
+        Orientation Transform)
+    {
+        bool FlipX = (uint32_t(Transform) & OrientationFlipX) != 0;
+        bool FlipY = (uint32_t(Transform) & OrientationFlipY) != 0;
+        Isa Level = GetIsa();
+        if (SwapsAxes(Transform))
+        {
+            // Instantiated per mirroring so the inner loop carries no branches
+            auto Transpose = FlipX
+                ? (FlipY ? TransposeTiled<true, true> : TransposeTiled<true, false>)
+                : (FlipY ? TransposeTiled<false, true> : TransposeTiled<false, false>);
+            Transpose(Src, SrcPitch, Dst, DstPitch, Width, Height, Level);
+        }
+        else
+        {
+            MirrorRows(Src, SrcPitch, Dst, DstPitch, Width, Height, FlipX, FlipY, Level);
+        }
+    }
+
+    Protocol::DamageRect TransformRect(const Protocol::DamageRect& Rect, uint32_t Width, uint32_t Height,
+        Orientation Transform)
+    {
+        Protocol::DamageRect Result = Rect;
+        if (uint32_t(Transform) & OrientationFlipX)
+        {
+            Result.Left = int32_t(Width) - Rect.Right;
+            Result.Right = int32_t(Width) - Rect.Left;
+        }
+        if (uint32_t(Transform) & OrientationFlipY)
+        {
+            Result.Top = int32_t(Height) - Rect.Bottom;
+            Result.Bottom = int32_t(Height) - Rect.Top;
+        }
+        if (SwapsAxes(Transform))
+        {
+            Result = { Result.Top, Result.Left, Result.Bottom, Result.Right };
+        }
+        return Result;
+    }
+
+    void DownscaleBgra8(const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width, uint32_t Height,
+        uint32_t Shift)
+    {
+        const uint32_t Factor = 1u << Shift;
+        const uint32_t Bits = Shift * 2;
+        const uint32_t Rounding = (1u << Bits) >> 1;
+        const Isa Level = GetIsa();
+
+        for (uint32_t y = 0; y < Height; y++)
+        {
+            auto* Row = static_cast<const uint8_t*>(Src) + size_t(y) * Factor * SrcPitch;
+            auto* Out = reinterpret_cast<uint32_t*>(static_cast<uint8_t*>(Dst) + y * DstPitch);
+            uint32_t x = 0;
+
+#ifdef PD_KERNELS_SSE2
+            if (Shift == 1 && Level != Isa::Scalar)
+            {
+                x = s_HalveRow[size_t(Level)](Row, Row + SrcPitch, Out, Width);
+            }
+#endif
+
+            for (; x < Width; x++)
+            {
+                uint32_t B = 0, G = 0, R = 0, A = 0;
+                for (uint32_t j = 0; j < Factor; j++)
+                {
+                    auto* In = reinterpret_cast<const uint32_t*>(Row + j * SrcPitch) + size_t(x) * Factor;
+                    for (uint32_t i = 0; i < Factor; i++)
+                    {
+                        uint32_t P = In[i];
+                        B += P & 0xFF;
+                        G += (P >> 8) & 0xFF;
+                        R += (P >> 16) & 0xFF;
+                        A += P >> 24;
+                    }
+                }
+                Out[x] = ((B + Rounding) >> Bits) | (((G + Rounding) >> Bits) << 8) | (((R + Rounding) >> Bits) << 16)
+                    | (((A + Rounding) >> Bits) << 24);
+            }
+        }
+    }
+
+    Protocol::DamageRect DownscaleRect(const Protocol::DamageRect& Rect, uint32_t Shift)
+    {
+        const int32_t Round = (1 << Shift) - 1;
+        return { Rect.Left >> Shift, Rect.Top >> Shift, (Rect.Right + Round) >> Shift, (Rect.Bottom + Round) >> Shift };
+    }
+
+    uint32_t DiffDamage(const void* Previous, const void* Current, size_t Pitch, uint32_t Width, uint32_t Height,
+        uint32_t BytesPerPixel, const Protocol::DamageRect* Damage, uint32_t DamageCount, Protocol::DamageRect* Rects,
+        uint32_t MaxRects)
+    {
+        auto RowDiffers = [&](int32_t y, int32_t Left, int32_t Right)
+            {
+                const size_t Offset = y * Pitch + size_t(Left) * BytesPerPixel;
+                return memcmp(static_cast<const uint8_t*>(Previous) + Offset,
+                    static_cast<const uint8_t*>(Current) + Offset, size_t(Right - Left) * BytesPerPixel) != 0;
+            };
+
+        if (Damage != nullptr)
+        {
+            uint32_t Count = 0;
+            for (uint32_t i = 0; i < DamageCount && Count < MaxRects; i++)
+            {
+                Protocol::DamageRect Rect = { max(Damage[i].Left, 0), max(Damage[i].Top, 0),
+                    min(Damage[i].Right, int32_t(Width)), min(Damage[i].Bottom, int32_t(Height)) };
+                if (Rect.Left >= Rect.Right)
+                {
+                    continue;
+                }
+                while (Rect.Top < Rect.Bottom && !RowDiffers(Rect.Top, Rect.Left, Rect.Right))
+                {
+                    Rect.Top++;
+                }
+                while (Rect.Bottom > Rect.Top && !RowDiffers(Rect.Bottom - 1, Rect.Left, Rect.Right))
+                {
+                    Rect.Bottom--;
+                }
+                if (Rect.Top < Rect.Bottom)
+                {
+                    Rects[Count++] = Rect;
+                }
+            }
+            return Count;
+        }
+
+        // A run of changed tiles extends the rect that ended on the row above with the same columns, if any. Rects
+        // are built in place until there are too many, from then on only the bounds are kept.
+        const int32_t Tile = int32_t(Protocol::TileSize);
+        const uint32_t TilesX = (Width + Tile - 1) / Tile, TilesY = (Height + Tile - 1) / Tile;
+        uint32_t Count = 0;
+        bool Overflow = false;
+        Protocol::DamageRect Bounds = { int32_t(Width), int32_t(Height), 0, 0 };
+        for (uint32_t ty = 0; ty < TilesY; ty++)
+        {
+            const int32_t Top = int32_t(ty) * Tile, Bottom = min(Top + Tile, int32_t(Height));
+            int32_t RunStart = -1;
+            for (uint32_t tx = 0; tx <= TilesX; tx++)
+            {
+                bool Changed = false;
+                if (tx < TilesX)
+                {
+                    const int32_t Left = int32_t(tx) * Tile, Right = min(Left + Tile, int32_t(Width));
+                    for (int32_t y = Top; y < Bottom && !Changed; y++)
+                    {
+                        Changed = RowDiffers(y, Left, Right);
+                    }
+                }
+                if (Changed && RunStart < 0)
+                {
+                    RunStart = int32_t(tx) * Tile;
+                }
+                if (Changed || RunStart < 0)
+                {
+                    continue;
+                }
+
+                const int32_t RunEnd = min(int32_t(tx) * Tile, int32_t(Width));
+                auto Above = Overflow ? Rects + Count : find_if(Rects, Rects + Count,
+                    [&](const Protocol::DamageRect& Rect)
+                    {
+                        return Rect.Bottom == Top && Rect.Left == RunStart && Rect.Right == RunEnd;
+                    });
+                if (Above != Rects + Count)
+                {
+                    Above->Bottom = Bottom;
+                }
+                else if (!Overflow && Count < MaxRects)
+                {
+                    Rects[Count++] = { RunStart, Top, RunEnd, Bottom };
+                }
+                else
+                {
+                    Overflow = true;
+                }
+                Bounds = { min(Bounds.Left, RunStart), min(Bounds.Top, Top), max(Bounds.Right, RunEnd),
+                    max(Bounds.Bottom, Bottom) };
+                RunStart = -1;
+            }
+        }
+
+        if (Overflow)
+        {
+            Rects[0] = Bounds;
+            return 1;
+        }
+        return Count;
+    }
+
+    void Bgra8ToB5G6R5(const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width, uint32_t Height,
+        const ChannelLut* Lut)
+    {
+        const Isa Level = GetIsa();
+        for (uint32_t y = 0; y < Height; y++)
+        {
+            auto* In = reinterpret_cast<const uint32_t*>(static_cast<const uint8_t*>(Src) + y * SrcPitch);
+            auto* Out = reinterpret_cast<uint16_t*>(static_cast<uint8_t*>(Dst) + y * DstPitch);
+            uint32_t x = 0;
+
+#ifdef PD_KERNELS_SSE2
+            if (Lut == nullptr && Level != Isa::Scalar)
+            {
+                x = s_Pack565[size_t(Level)](In, Out, Width, y);
+            }
+            else if (Level != Isa::Scalar)
+            {
+                // The ramp is looked up a chunk at a time into a buffer the vector packing then reads, which keeps
+                // the packing off the scalar loop; chunks are whole vectors so the dither stays in step
+                alignas(64) uint32_t Mapped[Pack565Chunk];
+                for (; x < Width; x += Pack565Chunk)
+                {
+                    uint32_t Count = min(Width - x, Pack565Chunk);
+                    ApplyChannelLut(In + x, 0, Mapped, 0, Count, 1, *Lut);
+                    for (uint32_t i = s_Pack565[size_t(Level)](Mapped, Out + x, Count, y); i < Count; i++)
+                    {
+                        Out[x + i] = Pack565Pixel(Mapped[i], x + i, y);
+                    }
+                }
+            }
+#endif
+
+            for (; x < Width; x++)
+            {
+                uint32_t P = In[x];
+                if (Lut != nullptr)
+                {
+                    P = Lut->Blue[P & 0xFF] | Lut->Green[(P >> 8) & 0xFF] | Lut->Red[(P >> 16) & 0xFF];
+                }
+                Out[x] = Pack565Pixel(P, x, y);
+            }
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,156 @@
+#pragma once
+
+// Pixel conversion kernels shared by the driver and the app. Every kernel converts Height rows of Width pixels from
+// a pitched source into a pitched destination; the buffers must not overlap.
+
+#include <cstdint>
+#include <cstddef>
+
+#include "Protocol.h"
+
+namespace PartialDisplay::Kernels
+{
+    /// <summary>
+    /// Per-channel 8-bit lookup tables for BGRA pixels, each entry already shifted into the byte its channel occupies.
+    /// </summary>
+    struct ChannelLut
+    {
+        uint32_t Blue[256];
+        uint32_t Green[256];
+        uint32_t Red[256];
+    };
+
+    /// <summary>
+    /// The eight rotations and mirrorings of a frame. Bit 0 mirrors source X, bit 1 mirrors source Y and bit 2 swaps
+    /// the axes before mirroring, so composing with a mirror is a single XOR.
+    /// </summary>
+    enum class Orientation : uint32_t
+    {
+        Identity = 0,
+        FlipHorizontal = 1,
+        FlipVertical = 2,
+        Rotate180 = 3,
+        Transpose = 4,
+        Rotate270 = 5,   // Counter-clockwise
+        Rotate90 = 6,    // Clockwise
+        Transverse = 7,
+    };
+
+    constexpr uint32_t OrientationFlipX = 1;
+    constexpr uint32_t OrientationFlipY = 2;
+    constexpr uint32_t OrientationSwapAxes = 4;
+
+    constexpr bool SwapsAxes(Orientation Transform) { return (uint32_t(Transform) & OrientationSwapAxes) != 0; }
+
+    /// <summary>
+    /// Instruction set tiers the kernels come in, each a superset of the one before. Every tier produces exactly the
+    /// same pixels as Scalar, the plain C++ reference.
+    /// </summary>
+    enum class Isa : uint32_t
+    {
+        Scalar = 0,
+        Sse2 = 1,
+        Sse41 = 2,
+        Avx2 = 3,
+        Avx512 = 4,  // AVX-512 F and BW
+    };
+
+    constexpr uint32_t IsaCount = 5;
+
+    /// <summary>
+    /// The highest tier both this processor and the OS support.
+    /// </summary>
+    Isa DetectIsa();
+
+    /// <summary>
+    /// Makes every kernel run the lower of Limit and the highest tier detected, and returns the tier picked. Meant
+    /// for startup, before any kernel runs; until it is called the kernels run the highest tier detected.
+    /// </summary>
+    Isa SelectIsa(Isa Limit);
+
+    Isa GetIsa();
+
+    const char* GetIsaName(Isa Level);
+
+    /// <summary>
+    /// Copies RowBytes bytes of every row, collapsing to a single memcpy when both pitches match.
+    /// </summary>
+    void CopyRows(const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, size_t RowBytes, uint32_t Height);
+
+    /// <summary>
+    /// As CopyRows, with non-temporal stores that go around the cache, for copies too large to stay in it or read
+    /// back by another core. The stores are fenced before returning. The Scalar tier copies as CopyRows does.
+    /// </summary>
+    void StreamRows(const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, size_t RowBytes, uint32_t Height);
+
+    /// <summary>
+    /// Tone maps half-float scRGB (R16G16B16A16_FLOAT) into dithered 8-bit sRGB BGRA.
+    /// </summary>
+    void ScRgbToBgra8(const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width, uint32_t Height);
+
+    /// <summary>
+    /// Encodes half-float scRGB into packed R10G10B10A2 with the PQ transfer, halving the size without clipping HDR.
+    /// </summary>
+    void ScRgbToHdr10(const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width, uint32_t Height);
+
+    /// <summary>
+    /// Tone maps packed PQ R10G10B10A2 into 8-bit sRGB BGRA, dithering the 10-bit precision down to 8 bits.
+    /// </summary>
+    void Hdr10ToBgra8(const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width, uint32_t Height);
+
+    /// <summary>
+    /// Builds lookup tables from a 16-bit ramp ordered red, green, blue. Returns false if the ramp is the identity,
+    /// in which case the stage should be skipped altogether.
+    /// </summary>
+    bool BuildChannelLut(const uint16_t (&Ramp)[3][256], ChannelLut& Lut);
+
+    /// <summary>
+    /// Maps every BGRA8 pixel through the lookup tables, leaving alpha untouched. Src may equal Dst.
+    /// </summary>
+    void ApplyChannelLut(const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width, uint32_t Height,
+        const ChannelLut& Lut);
+
+    /// <summary>
+    /// Rotates or mirrors Width x Height 32-bit pixels. The destination is Height x Width when the orientation swaps
+    /// axes. Transposing orientations walk the frame in cache-sized tiles of register transposes, 4x4 to
+    /// 16x16 pixels as wide as the instruction set goes.
+    /// </summary>
+    void TransformPixels32(const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width, uint32_t Height,
+        Orientation Transform);
+
+    /// <summary>
+    /// Maps a rect of a Width x Height frame to where TransformPixels32 moves it. Transforming the pixels of the rect
+    /// on their own yields exactly the pixels of the mapped rect, which is what lets damage be transformed alone.
+    /// </summary>
+    Protocol::DamageRect TransformRect(const Protocol::DamageRect& Rect, uint32_t Width, uint32_t Height,
+        Orientation Transform);
+
+    /// <summary>
+    /// Shrinks BGRA8 pixels by 2^Shift in both dimensions, averaging each block. Width and Height are the destination
+    /// size; the source must hold Width << Shift by Height << Shift pixels.
+    /// </summary>
+    void DownscaleBgra8(const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width, uint32_t Height,
+        uint32_t Shift);
+
+    /// <summary>
+    /// Maps a rect to the pixels of a frame downscaled by 2^Shift that it touches.
+    /// </summary>
+    Protocol::DamageRect DownscaleRect(const Protocol::DamageRect& Rect, uint32_t Shift);
+
+    /// <summary>
+    /// Compares two frames of the same layout and narrows Damage down to what differs: each rect is shrunk to its
+    /// rows that differ and dropped if none do. Without Damage the frames are compared tile by tile, and runs of
+    /// changed tiles are joined along rows and then down columns; if that takes more than MaxRects, which must be at
+    /// least 1, their bounds are written instead. Rects may be Damage. Returns the number of rects written to Rects,
+    /// 0 when nothing changed.
+    /// </summary>
+    uint32_t DiffDamage(const void* Previous, const void* Current, size_t Pitch, uint32_t Width, uint32_t Height,
+        uint32_t BytesPerPixel, const Protocol::DamageRect* Damage, uint32_t DamageCount, Protocol::DamageRect* Rects,
+        uint32_t MaxRects);
+
+    /// <summary>
+    /// Packs BGRA8 into dithered B5G6R5, halving the size. Lut, if not null, is applied on the way.
+    /// </summary>
+    void Bgra8ToB5G6R5(const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width, uint32_t Height,
+        const ChannelLut* Lut);
+}
\ No newline at end of file
@@ -0,0 +1,485 @@
+#pragma once
+
+// Definitions shared by the driver and its user-mode clients. Everything that crosses the IOCTL boundary is declared
+// here with fixed-width types so both sides agree on the layout.
+//
+// A client first sends IOCTL_Custom_Negotiate with a ClientHello describing what it can consume and gets back a
+// ServerHello with the intersection of both sides plus the buffer size it needs. Each IOCTL_Custom_GetMonitorData
+// then carries a FrameRequest picking from the negotiated options, and is answered with a FrameDescriptor, its
+// damage rects and the frame data:
+//
+//   FrameDescriptor | DamageRect[DamageCount] | padding up to HeaderSize | DataSize bytes of frame data
+//
+// With CompressionTiles the frame data is a tile stream that only carries the tiles touched by the damage:
+//
+//   TileStreamHeader | { TileHeader | TileHeader::Size bytes of payload }[TileCount]
+//
+// With CompressionTileCache as well, both sides remember the last TileCacheSize tiles sent under a 64-bit hash of
+// their pixels, and a tile seen before is sent as that hash alone. The producer only mirrors what the consumer holds,
+// so both caches must see the same streams in the same order; whenever the producer can't be sure of that (a request
+// with LastSequence 0, a new swap-chain) it starts over and flags the stream with TileStreamCacheReset.
+//
+// With FeatureLatencyProbe, frames captured while any client asks for it carry a marker in their top left corner
+// holding FrameDescriptor::Timestamp of the frame the pixels are from, for measuring latency up to the screen.
+//
+// IOCTL_Custom_GetStatistics takes no input and answers with the counters of each stage frames pass through in the
+// driver, for finding which one holds the others up, and with how the driver copies frames of the current mode.
+//
+// With FeatureSlices, IOCTL_Custom_GetSlice delivers a frame in SliceCount horizontal slices, one request each, every
+// slice as soon as the driver has read it back, so the client can upload a slice while the next is still being read.
+// Each SliceRequest is answered with a SliceDescriptor and the slice's rows:
+//
+//   SliceDescriptor | padding up to SliceHeaderSize | Rows * Pitch bytes of rows
+//
+// Slice 0 starts on the newest frame after LastSequence; the others name the frame they belong to in Sequence and are
+// answered with SliceSuperseded once the driver has moved on from it, upon which the client starts over. Slices are
+// whole frames at full size, without damage, tiles or downscaling.
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#define IOCTL_Custom_GetMonitorData CTL_CODE(FILE_DEVICE_SCREEN, 0x842, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_Custom_Negotiate CTL_CODE(FILE_DEVICE_SCREEN, 0x843, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_Custom_Trace CTL_CODE(FILE_DEVICE_SCREEN, 0x844, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_Custom_GetStatistics CTL_CODE(FILE_DEVICE_SCREEN, 0x845, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_Custom_GetSlice CTL_CODE(FILE_DEVICE_SCREEN, 0x846, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+namespace PartialDisplay::Protocol
+{
+#ifdef GUID_DEFINED
+    // Device interface the driver exposes the IOCTLs on; clients open it, and wait for it to arrive after creating
+    // the device. {B37B60D5-FF55-470B-A98D-952A365C82D2}
+    const GUID DeviceInterface = { 0xb37b60d5, 0xff55, 0x470b, { 0xa9, 0x8d, 0x95, 0x2a, 0x36, 0x5c, 0x82, 0xd2 } };
+#endif
+
+    // Raised whenever a struct below changes layout, each side refusing any other; 2 added the copy strategy to
+    // PipelineStatistics
+    constexpr uint16_t Version = 2;
+    constexpr uint32_t FrameDescriptorMagic = 0x46444450;  // "PDDF"
+    constexpr uint32_t SliceDescriptorMagic = 0x53444450;  // "PDDS"
+    constexpr size_t HeaderAlignment = 64;
+    constexpr uint32_t MaxDamageRects = 64;
+    constexpr uint32_t MaxDownscale = 2;
+    constexpr uint32_t TileSize = 16;
+    constexpr uint32_t DefaultTileQuality = 75;
+    constexpr uint32_t TileCacheSize = 4096;
+    constexpr uint32_t MaxStages = 8;
+    constexpr uint32_t MaxSlices = 16;
+    constexpr uint32_t SliceAlignment = 16;  // Slices start on a tile row, which keeps the dither of B5G6R5 in step
+
+    enum class PixelFormat : uint32_t
+    {
+        BGRA8 = 0,        // 8-bit sRGB, HDR content is tone mapped
+        R10G10B10A2 = 1,  // Packed 10-bit, the HDR10 transport for HDR surfaces
+        RGBA16F = 2,      // Half-float scRGB, only produced from FP16 surfaces
+        B5G6R5 = 3,       // Dithered 16-bit sRGB for constrained links, only produced from 8-bit surfaces
+    };
+
+    enum class ColorSpace : uint32_t
+    {
+        Srgb = 0,   // sRGB transfer, BT.709 primaries
+        ScRgb = 1,  // Linear, BT.709 primaries, 1.0 = 80 nits
+        Hdr10 = 2,  // SMPTE ST 2084 (PQ) transfer, BT.2020 primaries
+    };
+
+    constexpr uint32_t FormatBit(PixelFormat Format) { return 1u << uint32_t(Format); }
+
+    constexpr uint32_t BytesPerPixel(PixelFormat Format)
+    {
+        return Format == PixelFormat::RGBA16F ? 8 : Format == PixelFormat::B5G6R5 ? 2 : 4;
+    }
+
+    enum CompressionFlags : uint32_t
+    {
+        CompressionNone = 0,
+        CompressionTiles = 1u << 0,      // BGRA8 as raw and lossy tiles, only produced from 8-bit surfaces at full size
+        CompressionTileCache = 1u << 1,  // Repeated tiles as references to a cache on both sides, with CompressionTiles
+    };
+
+    enum class TileMode : uint16_t
+    {
+        Raw = 0,    // TileSize x TileSize BGRA8 pixels, clipped at the right and bottom edges, tightly packed
+        Lossy = 1,  // YCoCg 4:2:0, quantized 8x8 DCT blocks, see TileCodec.h
+        Cached = 2, // The 64-bit hash of a tile in the cache
+    };
+
+    enum TileFlags : uint16_t
+    {
+        TileCacheable = 1u << 0,  // The payload starts with the 64-bit hash to cache the tile under
+    };
+
+    enum TileStreamFlags : uint16_t
+    {
+        TileStreamCacheReset = 1u << 0,  // Empty the tile cache before decoding this stream
+    };
+
+    enum FeatureFlags : uint32_t
+    {
+        FeatureDamageRects = 1u << 0,    // Report the damage accumulated since FrameRequest::LastSequence
+        FeatureSkipUnchanged = 1u << 1,  // Answer with a bare descriptor when nothing changed since LastSequence
+        FeatureDownscale = 1u << 2,      // Shrink 8-bit frames as asked by FrameRequest::Downscale
+        FeatureLatencyProbe = 1u << 3,   // Stamp the QPC present time into the pixels of frames, see LatencyProbe.h
+        FeatureSlices = 1u << 4,         // IOCTL_Custom_GetSlice
+    };
+
+    enum FrameFlags : uint32_t
+    {
+        FrameFullDamage = 1u << 0,  // Damage is unknown or too fragmented, treat the whole frame as damaged
+        FrameUnchanged = 1u << 1,   // No new frame since LastSequence, no data follows
+        FrameDownscaleMask = 3u << 2,  // Log2 of the factor the frame was shrunk by, damage is in shrunk pixels
+    };
+
+    constexpr uint32_t FrameDownscaleShift = 2;
+
+    enum SliceFlags : uint32_t
+    {
+        SliceUnchanged = 1u << 0,   // No frame after LastSequence, no rows follow
+        SliceSuperseded = 1u << 1,  // The frame is gone, start over from slice 0; no rows follow
+    };
+
+    /// <summary>
+    /// Input of IOCTL_Custom_Negotiate.
+    /// </summary>
+    struct ClientHello
+    {
+        uint32_t Size;
+        uint16_t Version;
+        uint16_t Reserved;
+        uint32_t Formats;      // FormatBit() set
+        uint32_t Compression;  // CompressionFlags set
+        uint32_t Features;     // FeatureFlags set
+    };
+
+    /// <summary>
+    /// Output of IOCTL_Custom_Negotiate: what both sides support, and how large frame buffers need to be.
+    /// </summary>
+    struct ServerHello
+    {
+        uint32_t Size;
+        uint16_t Version;
+        uint16_t Reserved;
+        uint32_t Formats;
+        uint32_t Compression;
+        uint32_t Features;
+        uint32_t MaxWidth;
+        uint32_t MaxHeight;
+        uint32_t CurrentWidth;     // 0 while no swap-chain is assigned
+        uint32_t CurrentHeight;
+        uint32_t CurrentPitch;     // 0 until the current staging surface has been mapped once
+        uint64_t MaxResponseSize;  // Largest IOCTL_Custom_GetMonitorData response for any supported mode
+    };
+
+    /// <summary>
+    /// Input of IOCTL_Custom_GetMonitorData.
+    /// </summary>
+    struct FrameRequest
+    {
+        uint32_t Size;
+        uint16_t Version;
+        uint16_t Quality;       // Lossy tile quality from 1 to 100 for CompressionTiles, 0 for DefaultTileQuality
+        uint32_t Format;
+        uint32_t Compression;
+        uint32_t Features;
+        uint32_t Downscale;     // Log2 of the factor to shrink both dimensions by, up to MaxDownscale
+        uint64_t LastSequence;  // Sequence of the last frame the client holds, 0 if none
+    };
+
+    struct DamageRect
+    {
+        int32_t Left;
+        int32_t Top;
+        int32_t Right;
+        int32_t Bottom;
+    };
+
+    /// <summary>
+    /// Header of an IOCTL_Custom_GetMonitorData response.
+    /// </summary>
+    struct FrameDescriptor
+    {
+        uint32_t Magic;
+        uint16_t Version;
+        uint16_t HeaderSize;    // Offset of the frame data from the start of the descriptor
+        uint32_t Format;
+        uint32_t Compression;
+        uint32_t Width;
+        uint32_t Height;
+        uint32_t Pitch;
+        uint32_t DamageCount;
+        uint64_t Sequence;      // Increases by one for every frame the driver captured
+        uint64_t Timestamp;     // QPC time the OS presented the frame
+        uint64_t DataSize;      // Bytes of frame data following the header; the response is truncated to the
+                                // descriptor alone when the output buffer can't hold HeaderSize + DataSize
+        uint32_t Flags;         // FrameFlags set
+        uint32_t ColorSpace;    // ColorSpace of the frame data
+    };
+
+    /// <summary>
+    /// Start of CompressionTiles frame data.
+    /// </summary>
+    struct TileStreamHeader
+    {
+        uint32_t TileCount;
+        uint16_t Quality;  // What lossy tiles were quantized with
+        uint16_t Flags;    // TileStreamFlags set
+    };
+
+    struct TileHeader
+    {
+        uint16_t X;     // Column of the tile, in tiles
+        uint16_t Y;     // Row of the tile, in tiles
+        uint16_t Mode;  // TileMode
+        uint16_t Flags; // TileFlags set
+        uint32_t Size;  // Payload bytes following the header
+    };
+
+    /// <summary>
+    /// Input of IOCTL_Custom_GetSlice.
+    /// </summary>
+    struct SliceRequest
+    {
+        uint32_t Size;
+        uint16_t Version;
+        uint16_t Slice;       // Index of the slice, below SliceCount
+        uint32_t SliceCount;  // Slices the client cuts frames into, up to MaxSlices
+        uint32_t Format;
+        uint32_t Features;    // FeatureLatencyProbe or none
+        uint32_t TimeoutMs;   // How long to wait for the slice to be read back
+        uint64_t Sequence;    // For slice 0 the last frame the client holds, 0 if none; for the others their frame's
+    };
+
+    /// <summary>
+    /// Header of an IOCTL_Custom_GetSlice response.
+    /// </summary>
+    struct SliceDescriptor
+    {
+        uint32_t Magic;
+        uint16_t Version;
+        uint16_t Slice;
+        uint32_t Flags;       // SliceFlags set
+        uint32_t Format;
+        uint32_t ColorSpace;
+        uint32_t Width;       // Of the whole frame
+        uint32_t Height;
+        uint32_t Top;         // First row of the slice
+        uint32_t Rows;
+        uint32_t Pitch;
+        uint64_t Sequence;
+        uint64_t Timestamp;   // QPC time the OS presented the frame
+        uint64_t DataSize;    // Rows * Pitch; the response is truncated to the descriptor if the buffer can't hold them
+    };
+
+    enum class TraceCommand : uint32_t
+    {
+        Start = 0,  // Start recording trace spans in the driver
+        Stop = 1,   // Stop recording, what was recorded stays readable
+        Read = 2,   // Export the recorded events
+    };
+
+    /// <summary>
+    /// Input of IOCTL_Custom_Trace.
+    /// </summary>
+    struct TraceRequest
+    {
+        uint32_t Size;
+        uint16_t Version;
+        uint16_t Reserved;
+        uint32_t Command;  // TraceCommand
+        uint32_t Reserved2;
+    };
+
+    /// <summary>
+    /// Output of IOCTL_Custom_Trace, followed for TraceCommand::Read by DataSize bytes of comma separated Chrome trace
+    /// events in UTF-8. Like frames, the response is truncated to this header when the buffer can't hold the events.
+    /// </summary>
+    struct TraceResponse
+    {
+        uint32_t Size;
+        uint16_t Version;
+        uint16_t Reserved;
+        uint32_t Enabled;  // Whether the driver is recording after the command
+        uint32_t Reserved2;
+        uint64_t DataSize;
+    };
+
+    /// <summary>
+    /// Counters of one stage of the driver's frame pipeline, since its swap-chain was assigned.
+    /// </summary>
+    struct StageStatistics
+    {
+        char Name[16];       // NUL terminated
+        uint64_t Processed;  // Frames the stage ran on
+        uint64_t Dropped;    // Frames discarded by or in front of the stage
+        uint64_t BusyNs;     // Time spent running the stage
+        uint32_t Depth;      // Frames queued in front of the stage
+        uint32_t MaxDepth;   // Most frames ever queued in front of it
+    };
+
+    /// <summary>
+    /// How the driver reads back frames of the current mode, as calibrated on the machine it runs on.
+    /// </summary>
+    struct CopyStatistics
+    {
+        uint32_t Width;       // Mode the strategy is for, 0 until one is picked
+        uint32_t Height;
+        uint32_t Method;      // 0 plain stores, 1 streaming stores
+        uint32_t Threads;     // Threads a frame is copied on
+        uint32_t ChunkRows;   // Rows a thread takes at a time, 0 for an even share each
+        uint32_t Calibrated;  // 1 if measured since the driver loaded, 0 if stored by an earlier run
+        uint64_t FrameNs;     // Time the strategy took to copy a frame while calibrating
+    };
+
+    /// <summary>
+    /// Output of IOCTL_Custom_GetStatistics for the first monitor, stages in the order frames pass them.
+    /// </summary>
+    struct PipelineStatistics
+    {
+        uint32_t Size;
+        uint16_t Version;
+        uint16_t StageCount;
+        uint64_t Sequence;     // Latest frame published to requests
+        uint64_t Allocations;  // Heap allocations the driver made since it loaded, 0 if it doesn't count them
+        StageStatistics Stages[MaxStages];
+        CopyStatistics Copy;
+    };
+
+    static_assert(sizeof(ClientHello) == 20, "ClientHello layout changed");
+    static_assert(sizeof(ServerHello) == 48, "ServerHello layout changed");
+    static_assert(sizeof(FrameRequest) == 32, "FrameRequest layout changed");
+    static_assert(sizeof(DamageRect) == 16, "DamageRect layout changed");
+    static_assert(sizeof(FrameDescriptor) == 64, "FrameDescriptor layout changed");
+    static_assert(sizeof(TileStreamHeader) == 8, "TileStreamHeader layout changed");
+    static_assert(sizeof(TileHeader) == 12, "TileHeader layout changed");
+    static_assert(sizeof(SliceRequest) == 32, "SliceRequest layout changed");
+    static_assert(sizeof(SliceDescriptor) == 64, "SliceDescriptor layout changed");
+    static_assert(sizeof(TraceRequest) == 16, "TraceRequest layout changed");
+    static_assert(sizeof(TraceResponse) == 24, "TraceResponse layout changed");
+    static_assert(sizeof(StageStatistics) == 48, "StageStatistics layout changed");
+    static_assert(sizeof(CopyStatistics) == 32, "CopyStatistics layout changed");
+    static_assert(sizeof(PipelineStatistics) == 24 + 48 * MaxStages + 32, "PipelineStatistics layout changed");
+    static_assert(offsetof(FrameDescriptor, Sequence) == 32, "FrameDescriptor layout changed");
+
+    constexpr size_t AlignHeader(size_t Size)
+    {
+        return (Size + HeaderAlignment - 1) / HeaderAlignment * HeaderAlignment;
+    }
+
+    constexpr size_t GetHeaderSize(uint32_t DamageCount)
+    {
+        return AlignHeader(sizeof(FrameDescriptor) + size_t(DamageCount) * sizeof(DamageRect));
+    }
+
+    constexpr size_t MaxHeaderSize = GetHeaderSize(MaxDamageRects);
+    constexpr size_t SliceHeaderSize = AlignHeader(sizeof(SliceDescriptor));
+
+    /// <summary>
+    /// Rows of every slice but the last when Height rows are cut into Count slices, a multiple of SliceAlignment.
+    /// </summary>
+    constexpr uint32_t GetSliceHeight(uint32_t Height, uint32_t Count)
+    {
+        uint32_t Rows = (Height + Count - 1) / Count;
+        return (Rows + SliceAlignment - 1) / SliceAlignment * SliceAlignment;
+    }
+
+    /// <summary>
+    /// Locates slice Index of Count. Slices past the bottom of a short frame are empty.
+    /// </summary>
+    constexpr void GetSliceRows(uint32_t Height, uint32_t Count, uint32_t Index, uint32_t& Top, uint32_t& Rows)
+    {
+        uint32_t SliceHeight = GetSliceHeight(Height, Count);
+        Top = SliceHeight * Index < Height ? SliceHeight * Index : Height;
+        Rows = Height - Top < SliceHeight ? Height - Top : SliceHeight;
+    }
+
+    /// <summary>
+    /// A parsed IOCTL_Custom_GetMonitorData response. Points into the response buffer.
+    /// </summary>
+    struct FrameView
+    {
+        const FrameDescriptor* Descriptor;
+        const DamageRect* Damage;
+        const uint8_t* Data;  // nullptr when the response carries no data
+    };
+
+    /// <summary>
+    /// Completes the header of a response whose descriptor is already filled in at the start of Buffer: writes its
+    /// DamageCount rects after it and zeroes the padding up to HeaderSize. ParseFrame is the other side.
+    /// </summary>
+    inline void PackHeader(void* Buffer, const DamageRect* Damage)
+    {
+        auto* Descriptor = static_cast<FrameDescriptor*>(Buffer);
+        auto* Rects = reinterpret_cast<uint8_t*>(Descriptor + 1);
+        size_t RectBytes = size_t(Descriptor->DamageCount) * sizeof(DamageRect);
+        if (RectBytes != 0)
+        {
+            memcpy(Rects, Damage, RectBytes);
+        }
+        memset(Rects + RectBytes, 0, Descriptor->HeaderSize - sizeof(FrameDescriptor) - RectBytes);
+    }
+
+    /// <summary>
+    /// Validates a response and locates its parts. Returns false on a malformed or foreign response, including one
+    /// whose size overflows or whose uncompressed data is too small for the rows it claims; a truncated or unchanged
+    /// frame parses successfully with Data left null.
+    /// </summary>
+    inline bool ParseFrame(const void* Buffer, size_t Length, FrameView& View)
+    {
+        View = {};
+        if (Length < sizeof(FrameDescriptor))
+        {
+            return false;
+        }
+
+        auto* Descriptor = static_cast<const FrameDescriptor*>(Buffer);
+        if (Descriptor->Magic != FrameDescriptorMagic || Descriptor->Version != Version
+            || Descriptor->DamageCount > MaxDamageRects
+            || Descriptor->HeaderSize < GetHeaderSize(Descriptor->DamageCount))
+        {
+            return false;
+        }
+
+        // DataSize comes off the wire; HeaderSize + DataSize, what GetResponseSize reports, must not wrap around
+        if (Descriptor->DataSize > UINT64_MAX - Descriptor->HeaderSize)
+        {
+            return false;
+        }
+
+        // Readers walk Height rows of Pitch bytes, Width pixels each, so the data must hold them; both products fit
+        // in 64 bits
+        if (Descriptor->DataSize != 0 && Descriptor->Compression == CompressionNone
+            && (uint64_t(Descriptor->Pitch) * Descriptor->Height > Descriptor->DataSize
+                || Descriptor->Pitch < uint64_t(Descriptor->Width) * BytesPerPixel(PixelFormat(Descriptor->Format))))
+        {
+            return false;
+        }
+
+        View.Descriptor = Descriptor;
+        if (Length >= Descriptor->HeaderSize)
+        {
+            View.Damage = reinterpret_cast<const DamageRect*>(Descriptor + 1);
+            if (Descriptor->DataSize != 0 && Descriptor->DataSize <= Length - Descriptor->HeaderSize)
+            {
+                View.Data = static_cast<const uint8_t*>(Buffer) + Descriptor->HeaderSize;
+            }
+        }
+        return true;
+    }
+
+    /// <summary>
+    /// Log2 of the factor a frame was shrunk by. Width and Height are the shrunk size, the frame covers the display
+    /// at Width and Height shifted back up.
+    /// </summary>
+    constexpr uint32_t GetDownscale(const FrameDescriptor& Descriptor)
+    {
+        return (Descriptor.Flags & FrameDownscaleMask) >> FrameDownscaleShift;
+    }
+
+    /// <summary>
+    /// Size of the whole response described by a descriptor, what a client must provide to receive the frame.
+    /// </summary>
+    inline uint64_t GetResponseSize(const FrameDescriptor& Descriptor)
+    {
+        return uint64_t(Descriptor.HeaderSize) + Descriptor.DataSize;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,124 @@
+#include "SliceBoard.h"
+
+#include <chrono>
+
+using namespace std;
+
+namespace PartialDisplay::Slices
+{
+    void SliceLease::Release()
+    {
+        if (m_Board != nullptr)
+        {
+            m_Board->Release();
+            m_Board = nullptr;
+        }
+    }
+
+    void SliceBoard::Close()
+    {
+        unique_lock<mutex> Lock(m_Mutex);
+        m_Open = false;
+        m_Changed.notify_all();
+        if (m_Readers != 0)
+        {
+            m_WriterWaits++;
+            m_Changed.wait(Lock, [&] { return m_Readers == 0; });
+        }
+    }
+
+    void SliceBoard::Shutdown()
+    {
+        {
+            lock_guard<mutex> Lock(m_Mutex);
+            m_Shutdown = true;
+        }
+        Close();
+    }
+
+    void SliceBoard::Begin(const SliceFrame& Frame)
+    {
+        Close();
+        lock_guard<mutex> Lock(m_Mutex);
+        m_Frame = Frame;
+        m_Open = true;
+    }
+
+    void SliceBoard::Publish(uint32_t Band)
+    {
+        lock_guard<mutex> Lock(m_Mutex);
+        m_Ready[Band] = m_Frame.Sequence;
+        m_Changed.notify_all();
+    }
+
+    WaitResult SliceBoard::Acquire(uint64_t Sequence, uint32_t Slice, uint32_t Count, uint32_t TimeoutMs,
+        SliceLease& Lease)
+    {
+        Lease.Release();
+        auto Deadline = chrono::steady_clock::now() + chrono::milliseconds(TimeoutMs);
+        unique_lock<mutex> Lock(m_Mutex);
+        for (;;)
+        {
+            if (m_Shutdown)
+            {
+                return WaitResult::Shutdown;
+            }
+            if (Slice == 0 ? m_Frame.Sequence <= Sequence : m_Frame.Sequence != Sequence)
+            {
+                return Slice == 0 ? WaitResult::Unchanged : WaitResult::Superseded;
+            }
+            if (m_Open && IsReady(Slice, Count))
+            {
+                m_Readers++;
+                Lease.m_Board = this;
+                Lease.m_Frame = m_Frame;
+                return WaitResult::Ready;
+            }
+
+            // A closed frame is about to be replaced, which only the first slice can wait for
+            if (!m_Open && Slice != 0)
+            {
+                return WaitResult::Superseded;
+            }
+            if (chrono::steady_clock::now() >= Deadline)
+            {
+                return WaitResult::TimedOut;
+            }
+            m_Changed.wait_until(Lock, Deadline);
+        }
+    }
+
+    uint64_t SliceBoard::GetSequence()
+    {
+        lock_guard<mutex> Lock(m_Mutex);
+        return m_Frame.Sequence;
+    }
+
+    uint64_t SliceBoard::GetWriterWaits()
+    {
+        lock_guard<mutex> Lock(m_Mutex);
+        return m_WriterWaits;
+    }
+
+    bool SliceBoard::IsReady(uint32_t Slice, uint32_t Count) const
+    {
+        // Bands are written in order, so the one holding the last row of the slice being done means they all are
+        uint32_t Top, Rows;
+        Protocol::GetSliceRows(m_Frame.Height, Count, Slice, Top, Rows);
+        if (Rows == 0)
+        {
+            return true;
+        }
+        uint32_t Band = (Top + Rows - 1) / Protocol::GetSliceHeight(m_Frame.Height, BandCount);
+        return m_Ready[Band] == m_Frame.Sequence;
+    }
+
+    void SliceBoard::Release()
+    {
+        lock_guard<mutex> Lock(m_Mutex);
+        if (--m_Readers == 0)
+        {
+            m_Changed.notify_all();
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,119 @@
+#pragma once
+
+// Frames handed over a slice at a time while they are read back. The writer copies a frame into memory of its own band
+// by band and publishes each band as it lands: every band has a readiness marker holding the sequence of the frame it
+// was last written for. A reader waits for the band holding the last row of its slice, then copies the slice out
+// while the writer goes on with the next band. Before the writer reuses memory a frame might be in it stops handing
+// that frame out and waits for the readers still copying from it, which they do for one slice at most, so the memory
+// needs no reference counting of its own.
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+#include "Protocol.h"
+
+namespace PartialDisplay::Slices
+{
+    /// <summary>
+    /// A frame on the board, being read back or read back last. The pixels belong to the writer.
+    /// </summary>
+    struct SliceFrame
+    {
+        uint64_t Sequence = 0;
+        uint64_t Timestamp = 0;
+        uint32_t Width = 0;
+        uint32_t Height = 0;
+        uint32_t Pitch = 0;
+        uint32_t Format = 0;  // Whatever the owner reads back, a DXGI_FORMAT in the driver
+        const uint8_t* Pixels = nullptr;
+    };
+
+    enum class WaitResult
+    {
+        Ready,       // The slice is read back, and leased
+        Unchanged,   // No frame after the one the reader holds
+        Superseded,  // The reader's frame is gone
+        TimedOut,    // The slice wasn't read back in time
+        Shutdown,    // The writer is going away, there will be no more frames
+    };
+
+    class SliceBoard;
+
+    /// <summary>
+    /// Keeps the frame of a slice from being overwritten while the slice is copied out. The writer waits for it
+    /// before reading the next frame, so it is released as soon as the copy is done.
+    /// </summary>
+    class SliceLease
+    {
+    public:
+        SliceLease() = default;
+        ~SliceLease() { Release(); }
+        SliceLease(const SliceLease&) = delete;
+        SliceLease& operator=(const SliceLease&) = delete;
+
+        const SliceFrame& GetFrame() const { return m_Frame; }
+        void Release();
+
+    private:
+        friend class SliceBoard;
+        SliceBoard* m_Board = nullptr;
+        SliceFrame m_Frame;
+    };
+
+    class SliceBoard
+    {
+    public:
+        /// <summary>
+        /// What the writer publishes frames in, the slices of GetSliceRows with MaxSlices. Readers may cut frames into
+        /// fewer slices.
+        /// </summary>
+        static constexpr uint32_t BandCount = Protocol::MaxSlices;
+
+        /// <summary>
+        /// Stops handing out the frame on the board and waits for the readers still copying from it, for a writer
+        /// about to touch memory the frame might be in.
+        /// </summary>
+        void Close();
+
+        /// <summary>
+        /// Closes the board for good as its writer goes away: readers waiting for a slice return at once and later
+        /// ones don't wait. Waits for the readers still copying, as Close does.
+        /// </summary>
+        void Shutdown();
+
+        /// <summary>
+        /// Puts a frame on the board whose rows are about to be written, closing the one before. Sequence is not 0.
+        /// </summary>
+        void Begin(const SliceFrame& Frame);
+
+        /// <summary>
+        /// Marks band Band of the frame on the board as written. Bands are written in order.
+        /// </summary>
+        void Publish(uint32_t Band);
+
+        /// <summary>
+        /// Waits up to TimeoutMs for slice Slice of frames cut into Count and leases it. Slice 0 is of the newest
+        /// frame after Sequence and only waited for if there is one; the others are of frame Sequence.
+        /// </summary>
+        WaitResult Acquire(uint64_t Sequence, uint32_t Slice, uint32_t Count, uint32_t TimeoutMs, SliceLease& Lease);
+
+        uint64_t GetSequence();     // Of the frame on the board, 0 if none
+        uint64_t GetWriterWaits();  // Times the writer waited for readers to finish
+
+    private:
+        friend class SliceLease;
+
+        std::mutex m_Mutex;
+        std::condition_variable m_Changed;  // Both ways, for readers waiting on bands and the writer on readers
+        SliceFrame m_Frame;
+        bool m_Open = false;
+        bool m_Shutdown = false;
+        uint32_t m_Readers = 0;
+        uint64_t m_Ready[BandCount] = {};  // The readiness markers, the frame each band was last written for
+        uint64_t m_WriterWaits = 0;
+
+        bool IsReady(uint32_t Slice, uint32_t Count) const;
+        void Release();
+    };
+}
\ No newline at end of file
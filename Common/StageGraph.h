@@ -0,0 +1,357 @@
+#pragma once
+
+// Stage graph for the frame pipeline. Each stage runs on a thread of its own and hands items to the next one through
+// a bounded single-producer single-consumer queue, so the next frame can be captured while the last one is still
+// being read back and compared, and a slow stage shows up as a full queue in front of it instead of as a stall of
+// whatever runs before it. What happens when a queue is full is up to the stage behind it: Block holds the producer
+// until there is room, which suits stages every frame has to pass, while Drop discards the item and counts it. Like
+// the tile codec it only uses the standard library, so it runs and is benchmarked off-target.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ThreadPolicy.h"
+
+namespace PartialDisplay::Pipeline
+{
+    /// <summary>
+    /// Bounded lock-free queue between exactly one producer thread and one consumer thread. The capacity is rounded
+    /// up to a power of two.
+    /// </summary>
+    template <typename T>
+    class SpscQueue
+    {
+    public:
+        explicit SpscQueue(size_t Capacity) : m_Items(RoundUp(Capacity)), m_Mask(m_Items.size() - 1) {}
+        SpscQueue(const SpscQueue&) = delete;
+        SpscQueue& operator=(const SpscQueue&) = delete;
+
+        /// <summary>
+        /// Moves Item in unless the queue is full, in which case Item is left alone. Producer only.
+        /// </summary>
+        bool TryPush(T&& Item)
+        {
+            size_t Tail = m_Tail.load(std::memory_order_relaxed);
+            if (Tail - m_HeadSeen == m_Items.size())
+            {
+                m_HeadSeen = m_Head.load(std::memory_order_acquire);
+                if (Tail - m_HeadSeen == m_Items.size())
+                {
+                    return false;
+                }
+            }
+            m_Items[Tail & m_Mask] = std::move(Item);
+            m_Tail.store(Tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        /// <summary>
+        /// Moves the oldest item out, if there is one. Consumer only.
+        /// </summary>
+        bool TryPop(T& Item)
+        {
+            size_t Head = m_Head.load(std::memory_order_relaxed);
+            if (Head == m_TailSeen)
+            {
+                m_TailSeen = m_Tail.load(std::memory_order_acquire);
+                if (Head == m_TailSeen)
+                {
+                    return false;
+                }
+            }
+            // The slot is cleared right away so whatever the item owns is released with it, not on reuse
+            Item = std::move(m_Items[Head & m_Mask]);
+            m_Items[Head & m_Mask] = T();
+            m_Head.store(Head + 1, std::memory_order_release);
+            return true;
+        }
+
+        /// <summary>
+        /// Items queued, exact only on the producer or the consumer thread.
+        /// </summary>
+        size_t GetSize() const
+        {
+            // Head first: the tail read after it can only be further along
+            size_t Head = m_Head.load(std::memory_order_acquire);
+            return m_Tail.load(std::memory_order_acquire) - Head;
+        }
+
+        size_t GetCapacity() const { return m_Items.size(); }
+
+    private:
+        std::vector<T> m_Items;
+        size_t m_Mask;
+
+        // Each side keeps its own index and the last value it saw of the other's on a cache line of their own
+        alignas(64) std::atomic<size_t> m_Head = 0;
+        size_t m_TailSeen = 0;
+        alignas(64) std::atomic<size_t> m_Tail = 0;
+        size_t m_HeadSeen = 0;
+
+        static size_t RoundUp(size_t Capacity)
+        {
+            size_t Result = 1;
+            while (Result < Capacity)
+            {
+                Result *= 2;
+            }
+            return Result;
+        }
+    };
+
+    /// <summary>
+    /// Lets a thread wait for a condition that another thread makes true and then rings for. The waiter spins
+    /// briefly before sleeping, and ringing costs one atomic operation when nobody sleeps.
+    /// </summary>
+    class Doorbell
+    {
+    public:
+        template <typename Predicate>
+        void Wait(Predicate Ready)
+        {
+            auto SpinUntil = std::chrono::steady_clock::now() + std::chrono::microseconds(20);
+            while (!Ready())
+            {
+                if (std::chrono::steady_clock::now() < SpinUntil)
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                // Announced before checking again. Ring reads the count with a read-modify-write after making the
+                // condition true, so either it sees the sleeper or the sleeper sees the condition.
+                std::unique_lock<std::mutex> Lock(m_Mutex);
+                m_Sleepers.fetch_add(1, std::memory_order_acq_rel);
+                m_Signal.wait(Lock, Ready);
+                m_Sleepers.fetch_sub(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+
+        void Ring()
+        {
+            if (m_Sleepers.fetch_add(0, std::memory_order_acq_rel) != 0)
+            {
+                std::lock_guard<std::mutex> Lock(m_Mutex);
+                m_Signal.notify_all();
+            }
+        }
+
+    private:
+        std::mutex m_Mutex;
+        std::condition_variable m_Signal;
+        std::atomic<uint32_t> m_Sleepers = 0;
+    };
+
+    enum class Backpressure
+    {
+        Block,  // The producer waits for room
+        Drop,   // The item is discarded
+    };
+
+    struct StageStats
+    {
+        const char* Name;
+        uint64_t Processed;  // Items the stage ran on
+        uint64_t Dropped;    // Items the stage discarded, or that were discarded because its queue was full
+        uint64_t BusyNs;     // Time spent running the stage
+        uint32_t Depth;      // Items queued in front of the stage
+        uint32_t MaxDepth;   // Most items ever queued in front of it
+    };
+
+    /// <summary>
+    /// A chain of stages each item passes through in order. Items enter with Submit, from one thread at a time, and
+    /// leave after the last stage or when a stage returns false.
+    /// </summary>
+    template <typename T>
+    class StageGraph
+    {
+    public:
+        typedef std::function<bool(T&)> StageFunction;
+
+        StageGraph() = default;
+        ~StageGraph() { Stop(); }
+        StageGraph(const StageGraph&) = delete;
+        StageGraph& operator=(const StageGraph&) = delete;
+
+        /// <summary>
+        /// Appends a stage fed by a queue of QueueDepth items, before Start. Policy applies when that queue is full.
+        /// </summary>
+        void AddStage(const char* Name, StageFunction Body, size_t QueueDepth, Backpressure Policy = Backpressure::Block)
+        {
+            m_Stages.push_back(std::make_unique<Stage>(Name, std::move(Body), QueueDepth, Policy));
+        }
+
+        /// <summary>
+        /// Starts a thread per stage under Policy.
+        /// </summary>
+        void Start(const Scheduling::ThreadPolicy& Policy = {})
+        {
+            m_Stop = false;
+            for (size_t i = 0; i < m_Stages.size(); i++)
+            {
+                m_Stages[i]->Thread = std::thread([this, i, Policy] { RunStage(i, Policy); });
+            }
+        }
+
+        /// <summary>
+        /// Stops every stage once it is done with its current item. Queued items stay queued until the graph is
+        /// started again or destroyed.
+        /// </summary>
+        void Stop()
+        {
+            m_Stop = true;
+            for (auto& Current : m_Stages)
+            {
+                Current->Ready.Ring();
+                Current->Room.Ring();
+            }
+            for (auto& Current : m_Stages)
+            {
+                if (Current->Thread.joinable())
+                {
+                    Current->Thread.join();
+                }
+            }
+        }
+
+        /// <summary>
+        /// Hands Item to the first stage. Returns false if it was dropped, or the graph stopped while blocked.
+        /// </summary>
+        bool Submit(T Item)
+        {
+            m_InFlight.fetch_add(1, std::memory_order_relaxed);
+            return Push(0, std::move(Item));
+        }
+
+        /// <summary>
+        /// Returns once every submitted item has left the graph.
+        /// </summary>
+        void WaitIdle() const
+        {
+            while (m_InFlight.load(std::memory_order_acquire) != 0 && !m_Stop.load(std::memory_order_relaxed))
+            {
+                std::this_thread::yield();
+            }
+        }
+
+        size_t GetStageCount() const { return m_Stages.size(); }
+
+        std::vector<StageStats> GetStats() const
+        {
+            std::vector<StageStats> Stats;
+            for (auto& Current : m_Stages)
+            {
+                Stats.push_back({ Current->Name, Current->Processed.load(std::memory_order_relaxed),
+                    Current->Dropped.load(std::memory_order_relaxed), Current->BusyNs.load(std::memory_order_relaxed),
+                    uint32_t(Current->Input.GetSize()), Current->MaxDepth.load(std::memory_order_relaxed) });
+            }
+            return Stats;
+        }
+
+    private:
+        struct Stage
+        {
+            Stage(const char* Name, StageFunction Body, size_t QueueDepth, Backpressure Policy)
+                : Name(Name), Body(std::move(Body)), Policy(Policy), Input(QueueDepth) {}
+
+            const char* Name;
+            StageFunction Body;
+            Backpressure Policy;
+            SpscQueue<T> Input;
+            Doorbell Ready;  // Rung when an item is queued
+            Doorbell Room;   // Rung when an item is taken
+            std::thread Thread;
+            std::atomic<uint64_t> Processed = 0;
+            std::atomic<uint64_t> Dropped = 0;
+            std::atomic<uint64_t> BusyNs = 0;
+            std::atomic<uint32_t> MaxDepth = 0;
+        };
+
+        std::vector<std::unique_ptr<Stage>> m_Stages;
+        std::atomic<bool> m_Stop = false;
+        std::atomic<size_t> m_InFlight = 0;
+
+        // Called only by whoever feeds stage Index, so the queue keeps a single producer
+        bool Push(size_t Index, T&& Item)
+        {
+            Stage& Target = *m_Stages[Index];
+            while (!Target.Input.TryPush(std::move(Item)))
+            {
+                if (Target.Policy == Backpressure::Drop || m_Stop.load(std::memory_order_relaxed))
+                {
+                    Target.Dropped.fetch_add(1, std::memory_order_relaxed);
+                    Leave();
+                    return false;
+                }
+                Target.Room.Wait([&]
+                    {
+                        return Target.Input.GetSize() < Target.Input.GetCapacity() || m_Stop.load();
+                    });
+            }
+
+            uint32_t Depth = uint32_t(Target.Input.GetSize());
+            if (Depth > Target.MaxDepth.load(std::memory_order_relaxed))
+            {
+                Target.MaxDepth.store(Depth, std::memory_order_relaxed);
+            }
+            Target.Ready.Ring();
+            return true;
+        }
+
+        void Leave()
+        {
+            m_InFlight.fetch_sub(1, std::memory_order_release);
+        }
+
+        void RunStage(size_t Index, const Scheduling::ThreadPolicy& Policy)
+        {
+            Scheduling::ScopedThreadPolicy Applied(Policy);
+            Stage& Current = *m_Stages[Index];
+            const bool Last = Index + 1 == m_Stages.size();
+            T Item;
+            for (;;)
+            {
+                Current.Ready.Wait([&] { return Current.Input.GetSize() != 0 || m_Stop.load(); });
+                if (m_Stop.load(std::memory_order_relaxed))
+                {
+                    break;
+                }
+                if (!Current.Input.TryPop(Item))
+                {
+                    continue;
+                }
+                Current.Room.Ring();
+
+                auto Start = std::chrono::steady_clock::now();
+                bool Keep = Current.Body(Item);
+                Current.BusyNs.fetch_add(uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - Start).count()), std::memory_order_relaxed);
+                Current.Processed.fetch_add(1, std::memory_order_relaxed);
+
+                if (!Keep)
+                {
+                    Current.Dropped.fetch_add(1, std::memory_order_relaxed);
+                    Leave();
+                }
+                else if (Last)
+                {
+                    Leave();
+                }
+                else
+                {
+                    Push(Index + 1, std::move(Item));
+                }
+                Item = T();
+            }
+        }
+    };
+}
\ No newline at end of file
@@ -0,0 +1,232 @@
+#include "TaskScheduler.h"
+
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+
+namespace
+{
+    constexpr auto SpinBeforeSleep = chrono::microseconds(50);
+
+    // The scheduler and queue of the worker running on this thread, if it is one
+    struct WorkerIdentity
+    {
+        const PartialDisplay::Scheduling::TaskScheduler* Owner = nullptr;
+        size_t Index = 0;
+    };
+    thread_local WorkerIdentity t_Worker;
+}
+
+namespace PartialDisplay::Scheduling
+{
+    void TaskGroup::Run(function<void()> Task)
+    {
+        m_Pending.fetch_add(1, memory_order_relaxed);
+        m_Scheduler.Push({ move(Task), nullptr, nullptr, 0, 0, this });
+    }
+
+    void TaskGroup::RunRange(void (*Range)(const void*, size_t, size_t), const void* Context, size_t Begin, size_t End)
+    {
+        m_Pending.fetch_add(1, memory_order_relaxed);
+        m_Scheduler.Push({ nullptr, Range, Context, Begin, End, this });
+    }
+
+    void TaskGroup::Wait()
+    {
+        while (m_Pending.load(memory_order_acquire) != 0)
+        {
+            if (!m_Scheduler.TryRunOne())
+            {
+                // What is left is running elsewhere and is short, a frame's worth of tiles at most
+                this_thread::yield();
+            }
+        }
+    }
+
+    TaskScheduler::TaskScheduler(uint32_t Workers, const ThreadPolicy& Policy)
+    {
+        for (uint32_t i = 0; i <= Workers; i++)
+        {
+            m_Queues.push_back(make_unique<Queue>());
+        }
+        for (uint32_t i = 0; i < Workers; i++)
+        {
+            m_Threads.emplace_back([this, i, Policy] { RunWorker(i, Policy); });
+        }
+    }
+
+    TaskScheduler::~TaskScheduler()
+    {
+        {
+            lock_guard<mutex> Lock(m_SleepMutex);
+            m_Stop = true;
+        }
+        m_Wake.notify_all();
+        for (auto& Thread : m_Threads)
+        {
+            Thread.join();
+        }
+    }
+
+    uint32_t TaskScheduler::GetDefaultWorkerCount()
+    {
+        return max(thread::hardware_concurrency(), 1u) - 1;
+    }
+
+    void TaskScheduler::ParallelFor(size_t Count, size_t Grain, const function<void(size_t, size_t)>& Body)
+    {
+        Grain = max<size_t>(Grain, 1);
+        if (Count <= Grain || m_Threads.empty())
+        {
+            if (Count != 0)
+            {
+                Body(0, Count);
+            }
+            return;
+        }
+
+        // Each split forks its upper half and carries on with the lower one, so a thief takes the largest piece left
+        struct Split
+        {
+            TaskGroup* Group;
+            size_t Grain;
+            const function<void(size_t, size_t)>* Body;
+
+            static void Run(const void* Context, size_t Begin, size_t End)
+            {
+                const Split& State = *static_cast<const Split*>(Context);
+                while (End - Begin > State.Grain)
+                {
+                    size_t Middle = Begin + (End - Begin) / 2;
+                    State.Group->RunRange(Run, Context, Middle, End);
+                    End = Middle;
+                }
+                (*State.Body)(Begin, End);
+            }
+        };
+
+        TaskGroup Group(*this);
+        const Split State = { &Group, Grain, &Body };
+        Split::Run(&State, 0, Count);
+        Group.Wait();
+    }
+
+    void TaskScheduler::Push(Task&& Item)
+    {
+        // Counted before it is queued so the count never drops below what the queues hold. Pairs with a sleeper
+        // announcing itself before checking the count, one of the two sees the other.
+        m_Queued.fetch_add(1, memory_order_seq_cst);
+        size_t Index = t_Worker.Owner == this ? t_Worker.Index : m_Threads.size();
+        {
+            Queue& Target = *m_Queues[Index];
+            lock_guard<mutex> Lock(Target.Mutex);
+            if (Target.Count == Target.Tasks.size())
+            {
+                // Full, unrolled into a ring twice the size. Only ever happens while the queues warm up.
+                vector<Task> Grown(max<size_t>(Target.Tasks.size() * 2, 64));
+                for (size_t i = 0; i < Target.Count; i++)
+                {
+                    Grown[i] = move(Target.Tasks[(Target.Head + i) % Target.Tasks.size()]);
+                }
+                Target.Tasks = move(Grown);
+                Target.Head = 0;
+            }
+            Target.Tasks[(Target.Head + Target.Count) % Target.Tasks.size()] = move(Item);
+            Target.Count++;
+        }
+        if (m_Sleepers.load(memory_order_seq_cst) != 0)
+        {
+            lock_guard<mutex> Lock(m_SleepMutex);
+            m_Wake.notify_one();
+        }
+    }
+
+    bool TaskScheduler::TryTake(size_t Index, bool Back, Task& Item)
+    {
+        Queue& Source = *m_Queues[Index];
+        lock_guard<mutex> Lock(Source.Mutex);
+        if (Source.Count == 0)
+        {
+            return false;
+        }
+        size_t Slot = Back ? (Source.Head + Source.Count - 1) % Source.Tasks.size() : Source.Head;
+        Item = move(Source.Tasks[Slot]);
+        Source.Tasks[Slot] = Task();
+        if (!Back)
+        {
+            Source.Head = (Source.Head + 1) % Source.Tasks.size();
+        }
+        Source.Count--;
+        return true;
+    }
+
+    bool TaskScheduler::TryRunOne()
+    {
+        if (m_Queued.load(memory_order_acquire) == 0)
+        {
+            return false;
+        }
+
+        // Our own newest task first, then whatever outside threads submitted, then the oldest task of another worker
+        const size_t Count = m_Queues.size();
+        const size_t Self = t_Worker.Owner == this ? t_Worker.Index : Count - 1;
+        Task Item;
+        bool Found = TryTake(Self, true, Item) || (Self != Count - 1 && TryTake(Count - 1, false, Item));
+        for (size_t i = 1; !Found && i < Count; i++)
+        {
+            size_t Victim = (Self + i) % Count;
+            if (Victim != Count - 1 && TryTake(Victim, false, Item))
+            {
+                Found = true;
+                m_Steals.fetch_add(1, memory_order_relaxed);
+            }
+        }
+        if (!Found)
+        {
+            return false;
+        }
+
+        m_Queued.fetch_sub(1, memory_order_relaxed);
+        if (Item.Range != nullptr)
+        {
+            Item.Range(Item.Context, Item.Begin, Item.End);
+        }
+        else
+        {
+            Item.Body();
+        }
+        Item.Group->m_Pending.fetch_sub(1, memory_order_release);
+        return true;
+    }
+
+    void TaskScheduler::RunWorker(size_t Index, const ThreadPolicy& Policy)
+    {
+        ScopedThreadPolicy Applied(Policy);
+        t_Worker = { this, Index };
+        while (!m_Stop.load(memory_order_relaxed))
+        {
+            if (TryRunOne())
+            {
+                continue;
+            }
+
+            // Work for the next frame usually shows up soon after, spinning a little saves waking up through the OS
+            auto SpinUntil = chrono::steady_clock::now() + SpinBeforeSleep;
+            while (m_Queued.load(memory_order_relaxed) == 0 && chrono::steady_clock::now() < SpinUntil)
+            {
+                this_thread::yield();
+            }
+            if (m_Queued.load(memory_order_relaxed) != 0)
+            {
+                continue;
+            }
+
+            unique_lock<mutex> Lock(m_SleepMutex);
+            m_Sleepers.fetch_add(1, memory_order_seq_cst);
+            m_Wake.wait(Lock, [this] { return m_Queued.load(memory_order_seq_cst) != 0 || m_Stop.load(); });
+            m_Sleepers.fetch_sub(1, memory_order_relaxed);
+        }
+        t_Worker = {};
+    }
+}
\ No newline at end of file
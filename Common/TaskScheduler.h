@@ -0,0 +1,119 @@
+#pragma once
+
+// Work-stealing task scheduler for the per-tile work of a frame. Each worker keeps its own deque, pushing and popping
+// at the back so what it just forked stays hot in its cache, while idle workers steal the oldest, and so largest,
+// piece of work from the front of someone else's. Threads outside the scheduler submit through a shared queue and
+// help run tasks while they wait for their group, so forking from the pipeline thread costs no hand-off. Idle
+// workers spin briefly before going to sleep, which keeps the wake-up for the next frame cheap without burning a
+// core between frames. The queues are rings that grow but never shrink and ParallelFor queues plain ranges, so a
+// frame's worth of tiles costs no allocation once the queues have grown to it.
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ThreadPolicy.h"
+
+namespace PartialDisplay::Scheduling
+{
+    class TaskScheduler;
+
+    /// <summary>
+    /// Tasks forked together and joined with Wait. Tasks may fork more tasks into the same group or into groups of
+    /// their own.
+    /// </summary>
+    class TaskGroup
+    {
+    public:
+        explicit TaskGroup(TaskScheduler& Scheduler) : m_Scheduler(Scheduler) {}
+        ~TaskGroup() { Wait(); }
+        TaskGroup(const TaskGroup&) = delete;
+        TaskGroup& operator=(const TaskGroup&) = delete;
+
+        void Run(std::function<void()> Task);
+
+        /// <summary>
+        /// Returns once every task run in the group has finished, running queued tasks in the meantime.
+        /// </summary>
+        void Wait();
+
+    private:
+        friend class TaskScheduler;
+
+        TaskScheduler& m_Scheduler;
+        std::atomic<size_t> m_Pending = 0;
+
+        // Runs Range(Context, Begin, End), which unlike Run takes nothing to box the call in
+        void RunRange(void (*Range)(const void*, size_t, size_t), const void* Context, size_t Begin, size_t End);
+    };
+
+    class TaskScheduler
+    {
+    public:
+        /// <summary>
+        /// Starts Workers threads under Policy. The thread waiting on a group works too, so 0 workers runs every task
+        /// on it.
+        /// </summary>
+        explicit TaskScheduler(uint32_t Workers = GetDefaultWorkerCount(), const ThreadPolicy& Policy = {});
+        ~TaskScheduler();
+        TaskScheduler(const TaskScheduler&) = delete;
+        TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+        /// <summary>
+        /// One worker per logical processor but the one the waiting thread runs on.
+        /// </summary>
+        static uint32_t GetDefaultWorkerCount();
+
+        uint32_t GetWorkerCount() const { return uint32_t(m_Threads.size()); }
+        uint64_t GetSteals() const { return m_Steals.load(std::memory_order_relaxed); }
+
+        /// <summary>
+        /// Calls Body on ranges of at most Grain indices covering [0, Count), splitting the range in halves so idle
+        /// workers steal large pieces first. Returns once every range is done.
+        /// </summary>
+        void ParallelFor(size_t Count, size_t Grain, const std::function<void(size_t Begin, size_t End)>& Body);
+
+    private:
+        friend class TaskGroup;
+
+        // Either a boxed Body, or a Range with its Context and bounds
+        struct Task
+        {
+            std::function<void()> Body;
+            void (*Range)(const void* Context, size_t Begin, size_t End) = nullptr;
+            const void* Context = nullptr;
+            size_t Begin = 0;
+            size_t End = 0;
+            TaskGroup* Group = nullptr;
+        };
+
+        // A deque kept as a ring in Tasks, Count of them starting at Head
+        struct Queue
+        {
+            std::mutex Mutex;
+            std::vector<Task> Tasks;
+            size_t Head = 0;
+            size_t Count = 0;
+        };
+
+        std::vector<std::unique_ptr<Queue>> m_Queues;  // One per worker, then the one other threads submit to
+        std::vector<std::thread> m_Threads;
+        std::atomic<size_t> m_Queued = 0;
+        std::atomic<uint32_t> m_Sleepers = 0;
+        std::atomic<bool> m_Stop = false;
+        std::atomic<uint64_t> m_Steals = 0;
+        std::mutex m_SleepMutex;
+        std::condition_variable m_Wake;
+
+        void Push(Task&& Item);
+        bool TryRunOne();
+        bool TryTake(size_t Index, bool Back, Task& Item);
+        void RunWorker(size_t Index, const ThreadPolicy& Policy);
+    };
+}
\ No newline at end of file
@@ -0,0 +1,194 @@
+#include "ThreadPolicy.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <avrt.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+namespace PartialDisplay::Scheduling
+{
+#ifdef _WIN32
+    ScopedThreadPolicy::ScopedThreadPolicy(const ThreadPolicy& Policy)
+    {
+        HANDLE Thread = GetCurrentThread();
+
+        // MMCSS boosts the thread into the real-time range while it is active and keeps it from starving the
+        // system, which is why it is preferred to raising the priority ourselves
+        if (Policy.MmcssTask != nullptr)
+        {
+            DWORD TaskIndex = 0;
+            m_MmcssHandle = AvSetMmThreadCharacteristicsW(Policy.MmcssTask, &TaskIndex);
+            if (m_MmcssHandle == nullptr)
+            {
+                m_Failures |= FailedMmcss;
+            }
+        }
+
+        if (Policy.Priority != ThreadPriority::Normal)
+        {
+            const int Priorities[] =
+            {
+                THREAD_PRIORITY_NORMAL,
+                THREAD_PRIORITY_ABOVE_NORMAL,
+                THREAD_PRIORITY_HIGHEST,
+                THREAD_PRIORITY_TIME_CRITICAL,
+            };
+
+            m_PreviousPriority = GetThreadPriority(Thread);
+            m_PriorityChanged = SetThreadPriority(Thread, Priorities[uint32_t(Policy.Priority) & 3]) != FALSE;
+            if (!m_PriorityChanged)
+            {
+                m_Failures |= FailedPriority;
+            }
+        }
+
+        if (Policy.Affinity != 0)
+        {
+            m_PreviousAffinity = SetThreadAffinityMask(Thread, DWORD_PTR(Policy.Affinity));
+            if (m_PreviousAffinity == 0)
+            {
+                m_Failures |= FailedAffinity;
+            }
+        }
+    }
+
+    ScopedThreadPolicy::~ScopedThreadPolicy()
+    {
+        HANDLE Thread = GetCurrentThread();
+        if (m_PreviousAffinity != 0)
+        {
+            SetThreadAffinityMask(Thread, DWORD_PTR(m_PreviousAffinity));
+        }
+        if (m_PriorityChanged)
+        {
+            SetThreadPriority(Thread, m_PreviousPriority);
+        }
+        if (m_MmcssHandle != nullptr)
+        {
+            AvRevertMmThreadCharacteristics(m_MmcssHandle);
+        }
+    }
+
+    bool LockMemory(const void* Address, size_t Size)
+    {
+        if (VirtualLock(const_cast<void*>(Address), Size))
+        {
+            return true;
+        }
+        if (GetLastError() != ERROR_WORKING_SET_QUOTA)
+        {
+            return false;
+        }
+
+        // The lock counts against the minimum working set, grow both bounds by the region and try again
+        SIZE_T Minimum, Maximum;
+        HANDLE Process = GetCurrentProcess();
+        if (!GetProcessWorkingSetSize(Process, &Minimum, &Maximum)
+            || !SetProcessWorkingSetSize(Process, Minimum + Size, Maximum + Size))
+        {
+            return false;
+        }
+        return VirtualLock(const_cast<void*>(Address), Size) != FALSE;
+    }
+
+    void UnlockMemory(const void* Address, size_t Size)
+    {
+        VirtualUnlock(const_cast<void*>(Address), Size);
+    }
+#else
+    ScopedThreadPolicy::ScopedThreadPolicy(const ThreadPolicy& Policy)
+    {
+        pthread_t Thread = pthread_self();
+
+        if (Policy.Priority != ThreadPriority::Normal)
+        {
+            sched_param Previous = {};
+            pthread_getschedparam(Thread, &m_PreviousPolicy, &Previous);
+            m_PreviousPriority = Previous.sched_priority;
+
+            int Minimum = sched_get_priority_min(SCHED_FIFO);
+            int Maximum = sched_get_priority_max(SCHED_FIFO);
+            sched_param Param = {};
+            switch (Policy.Priority)
+            {
+            case ThreadPriority::AboveNormal: Param.sched_priority = Minimum; break;
+            case ThreadPriority::High: Param.sched_priority = (Minimum + Maximum) / 2; break;
+            default: Param.sched_priority = Maximum - 1; break;
+            }
+
+            // Needs CAP_SYS_NICE or an RLIMIT_RTPRIO allowance
+            m_PriorityChanged = pthread_setschedparam(Thread, SCHED_FIFO, &Param) == 0;
+            if (!m_PriorityChanged)
+            {
+                m_Failures |= FailedPriority;
+            }
+        }
+
+        if (Policy.Affinity != 0)
+        {
+            cpu_set_t Previous;
+            CPU_ZERO(&Previous);
+            if (pthread_getaffinity_np(Thread, sizeof(Previous), &Previous) == 0)
+            {
+                for (int Cpu = 0; Cpu < 64; Cpu++)
+                {
+                    m_PreviousAffinity |= CPU_ISSET(Cpu, &Previous) ? uint64_t(1) << Cpu : 0;
+                }
+            }
+
+            cpu_set_t Set;
+            CPU_ZERO(&Set);
+            for (int Cpu = 0; Cpu < 64; Cpu++)
+            {
+                if (Policy.Affinity & (uint64_t(1) << Cpu))
+                {
+                    CPU_SET(Cpu, &Set);
+                }
+            }
+            if (pthread_setaffinity_np(Thread, sizeof(Set), &Set) != 0)
+            {
+                m_PreviousAffinity = 0;
+                m_Failures |= FailedAffinity;
+            }
+        }
+    }
+
+    ScopedThreadPolicy::~ScopedThreadPolicy()
+    {
+        pthread_t Thread = pthread_self();
+        if (m_PreviousAffinity != 0)
+        {
+            cpu_set_t Set;
+            CPU_ZERO(&Set);
+            for (int Cpu = 0; Cpu < 64; Cpu++)
+            {
+                if (m_PreviousAffinity & (uint64_t(1) << Cpu))
+                {
+                    CPU_SET(Cpu, &Set);
+                }
+            }
+            pthread_setaffinity_np(Thread, sizeof(Set), &Set);
+        }
+        if (m_PriorityChanged)
+        {
+            sched_param Param = {};
+            Param.sched_priority = m_PreviousPriority;
+            pthread_setschedparam(Thread, m_PreviousPolicy, &Param);
+        }
+    }
+
+    bool LockMemory(const void* Address, size_t Size)
+    {
+        return mlock(Address, Size) == 0;
+    }
+
+    void UnlockMemory(const void* Address, size_t Size)
+    {
+        munlock(Address, Size);
+    }
+#endif
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+// Scheduling policy for pipeline threads. A policy names the priority, the processors and, on Windows, the MMCSS
+// task a thread should run under; applying it is best effort so an unprivileged process still runs, just without
+// the guarantees. The Windows backend uses MMCSS and thread priorities, the POSIX one SCHED_FIFO and
+// pthread affinity.
+
+#include <cstdint>
+#include <cstddef>
+
+namespace PartialDisplay::Scheduling
+{
+    enum class ThreadPriority : uint32_t
+    {
+        Normal = 0,       // Leave the scheduler defaults alone
+        AboveNormal = 1,  // Windows: above normal; POSIX: lowest SCHED_FIFO priority
+        High = 2,         // Windows: highest; POSIX: middle of the SCHED_FIFO range
+        Realtime = 3,     // Windows: time critical; POSIX: top of the SCHED_FIFO range less one, left for watchdogs
+    };
+
+    enum PolicyFailure : uint32_t
+    {
+        FailedMmcss = 1u << 0,
+        FailedPriority = 1u << 1,
+        FailedAffinity = 1u << 2,
+    };
+
+    struct ThreadPolicy
+    {
+        const wchar_t* MmcssTask = nullptr;  // Task under HKLM\...\Multimedia\SystemProfile\Tasks, ignored by POSIX
+        ThreadPriority Priority = ThreadPriority::Normal;
+        uint64_t Affinity = 0;               // Mask of logical processors 0-63, 0 leaves the thread unpinned
+        bool LockMemory = false;             // Buffers owned by the thread should be pinned with LockMemory()
+    };
+
+    /// <summary>
+    /// Applies a policy to the calling thread and restores the previous settings when destroyed, so it must be
+    /// destroyed on the same thread.
+    /// </summary>
+    class ScopedThreadPolicy
+    {
+    public:
+        explicit ScopedThreadPolicy(const ThreadPolicy& Policy);
+        ~ScopedThreadPolicy();
+        ScopedThreadPolicy(const ScopedThreadPolicy&) = delete;
+        ScopedThreadPolicy& operator=(const ScopedThreadPolicy&) = delete;
+
+        /// <summary>
+        /// PolicyFailure set of the parts that could not be applied, typically for lack of privilege.
+        /// </summary>
+        uint32_t GetFailures() const { return m_Failures; }
+
+    private:
+        void* m_MmcssHandle = nullptr;
+        bool m_PriorityChanged = false;
+        int m_PreviousPolicy = 0;
+        int m_PreviousPriority = 0;
+        uint64_t m_PreviousAffinity = 0;
+        uint32_t m_Failures = 0;
+    };
+
+    /// <summary>
+    /// Pins memory so a real-time thread never takes a page fault on it. On Windows the working set is grown to make
+    /// room first. Returns false if the memory could not be locked; the memory stays usable either way.
+    /// </summary>
+    bool LockMemory(const void* Address, size_t Size);
+    void UnlockMemory(const void* Address, size_t Size);
+}
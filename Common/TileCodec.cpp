@@ -0,0 +1,1070 @@
+#include "TileCodec.h"
+#include "TaskScheduler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define PD_CODEC_SSE2 1
+#endif
+
+using namespace std;
+using namespace PartialDisplay;
+
+namespace
+{
+    constexpr uint32_t TileSize = Protocol::TileSize;
+    constexpr uint32_t BlocksPerTile = 6;                        // Four luma blocks, one Co and one Cg
+    constexpr size_t MaxLossySize = BlocksPerTile * (1 + 64 * 3);  // A count and 64 three-byte varints per block
+
+    // A tile with at most this many colours is UI whatever its gradients look like
+    constexpr uint32_t UiMaxColors = 32;
+    // Otherwise it is still UI if this many neighbour pairs are identical, as on flat backgrounds behind text...
+    constexpr float UiMinFlatFraction = 0.4f;
+    // ...or jump by more than EdgeStep, as across the strokes of text on anything but a flat background
+    constexpr float UiMinEdgeFraction = 0.15f;
+    constexpr int EdgeStep = 48;
+
+    typedef uint32_t TilePixels[TileSize][TileSize];
+    typedef float Block[8][8];
+
+    // Natural index of each zigzag position
+    const uint8_t s_ZigZag[64] =
+    {
+         0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+        12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+        35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+        58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+    };
+
+    // Quantization tables of JPEG (ITU T.81 annex K) in natural order, luma first
+    const uint8_t s_QuantTables[2][64] =
+    {
+        {
+            16, 11, 10, 16,  24,  40,  51,  61,
+            12, 12, 14, 19,  26,  58,  60,  55,
+            14, 13, 16, 24,  40,  57,  69,  56,
+            14, 17, 22, 29,  51,  87,  80,  62,
+            18, 22, 37, 56,  68, 109, 103,  77,
+            24, 35, 55, 64,  81, 104, 113,  92,
+            49, 64, 78, 87, 103, 121, 120, 101,
+            72, 92, 95, 98, 112, 100, 103,  99,
+        },
+        {
+            17, 18, 24, 47, 99, 99, 99, 99,
+            18, 21, 26, 66, 99, 99, 99, 99,
+            24, 26, 56, 99, 99, 99, 99, 99,
+            47, 66, 99, 99, 99, 99, 99, 99,
+            99, 99, 99, 99, 99, 99, 99, 99,
+            99, 99, 99, 99, 99, 99, 99, 99,
+            99, 99, 99, 99, 99, 99, 99, 99,
+            99, 99, 99, 99, 99, 99, 99, 99,
+        },
+    };
+
+    /// <summary>
+    /// Orthonormal DCT-II basis and its transpose, so both passes of either direction are plain matrix products.
+    /// </summary>
+    struct DctBasis
+    {
+        Block Forward;
+        Block Transposed;
+
+        DctBasis()
+        {
+            const double Pi = 3.14159265358979323846;
+            for (uint32_t u = 0; u < 8; u++)
+            {
+                double Scale = u == 0 ? sqrt(1.0 / 8) : sqrt(2.0 / 8);
+                for (uint32_t x = 0; x < 8; x++)
+                {
+                    Forward[u][x] = float(Scale * cos((2 * x + 1) * u * Pi / 16));
+                    Transposed[x][u] = Forward[u][x];
+                }
+            }
+        }
+    };
+
+    const DctBasis& GetBasis()
+    {
+        static const DctBasis s_Basis;
+        return s_Basis;
+    }
+
+    /// <summary>
+    /// The JPEG tables scaled by quality the way libjpeg does, in natural order.
+    /// </summary>
+    struct Quantizer
+    {
+        float Step[2][64];
+        float Inverse[2][64];
+
+        explicit Quantizer(uint32_t Quality)
+        {
+            uint32_t Scale = Quality < 50 ? 5000 / Quality : 200 - Quality * 2;
+            for (uint32_t t = 0; t < 2; t++)
+            {
+                for (uint32_t i = 0; i < 64; i++)
+                {
+                    uint32_t Value = clamp((s_QuantTables[t][i] * Scale + 50) / 100, 1u, 255u);
+                    Step[t][i] = float(Value);
+                    Inverse[t][i] = 1.0f / float(Value);
+                }
+            }
+        }
+    };
+
+    // Out = A * B, each output row built from the rows of B scaled by one element of A
+    void Multiply(const Block& A, const Block& B, Block& Out)
+    {
+#ifdef PD_CODEC_SSE2
+        __m128 Low[8], High[8];
+        for (uint32_t k = 0; k < 8; k++)
+        {
+            Low[k] = _mm_loadu_ps(&B[k][0]);
+            High[k] = _mm_loadu_ps(&B[k][4]);
+        }
+        for (uint32_t i = 0; i < 8; i++)
+        {
+            __m128 Scale = _mm_set1_ps(A[i][0]);
+            __m128 RowLow = _mm_mul_ps(Scale, Low[0]);
+            __m128 RowHigh = _mm_mul_ps(Scale, High[0]);
+            for (uint32_t k = 1; k < 8; k++)
+            {
+                Scale = _mm_set1_ps(A[i][k]);
+                RowLow = _mm_add_ps(RowLow, _mm_mul_ps(Scale, Low[k]));
+                RowHigh = _mm_add_ps(RowHigh, _mm_mul_ps(Scale, High[k]));
+            }
+            _mm_storeu_ps(&Out[i][0], RowLow);
+            _mm_storeu_ps(&Out[i][4], RowHigh);
+        }
+#else
+        for (uint32_t i = 0; i < 8; i++)
+        {
+            float Row[8] = {};
+            for (uint32_t k = 0; k < 8; k++)
+            {
+                for (uint32_t j = 0; j < 8; j++)
+                {
+                    Row[j] += A[i][k] * B[k][j];
+                }
+            }
+            memcpy(Out[i], Row, sizeof(Row));
+        }
+#endif
+    }
+
+    uint8_t* PutVarint(uint8_t* Out, uint32_t Value)
+    {
+        while (Value >= 0x80)
+        {
+            *Out++ = uint8_t(Value | 0x80);
+            Value >>= 7;
+        }
+        *Out++ = uint8_t(Value);
+        return Out;
+    }
+
+    bool GetVarint(const uint8_t*& In, const uint8_t* End, uint32_t& Value)
+    {
+        Value = 0;
+        for (uint32_t Shift = 0; Shift < 35 && In < End; Shift += 7)
+        {
+            uint8_t Byte = *In++;
+            Value |= uint32_t(Byte & 0x7F) << Shift;
+            if (!(Byte & 0x80))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    inline uint32_t ClampByte(float Value)
+    {
+        return uint32_t(clamp(Value + 0.5f, 0.0f, 255.0f));
+    }
+
+    /// <summary>
+    /// Copies a tile into a full TileSize square, repeating the last column and row past the frame edge so the
+    /// transform sees no artificial edge.
+    /// </summary>
+    void GatherTile(const uint8_t* Src, size_t Pitch, uint32_t Width, uint32_t Height, const Kernels::ChannelLut* Lut,
+        TilePixels& Pixels)
+    {
+        if (Lut == nullptr && Width == TileSize && Height == TileSize)
+        {
+            Kernels::CopyRows(Src, Pitch, Pixels, sizeof(Pixels[0]), sizeof(Pixels[0]), TileSize);
+            return;
+        }
+
+        for (uint32_t y = 0; y < TileSize; y++)
+        {
+            auto* Row = reinterpret_cast<const uint32_t*>(Src + min(y, Height - 1) * Pitch);
+            for (uint32_t x = 0; x < TileSize; x++)
+            {
+                uint32_t P = Row[min(x, Width - 1)];
+                if (Lut != nullptr)
+                {
+                    P = (P & 0xFF000000) | Lut->Blue[P & 0xFF] | Lut->Green[(P >> 8) & 0xFF] | Lut->Red[(P >> 16) & 0xFF];
+                }
+                Pixels[y][x] = P;
+            }
+        }
+    }
+
+    inline uint32_t GreenOf(const uint8_t* Row, uint32_t x)
+    {
+        return Row[x * 4 + 1];
+    }
+
+    /// <summary>
+    /// Counts the neighbour pairs whose green is identical (Flat) and whose green jumps by more than EdgeStep
+    /// (Edges), horizontally and vertically.
+    /// </summary>
+    void GradientCounts(const uint8_t* Src, size_t Pitch, uint32_t Width, uint32_t Height, uint32_t& Flat,
+        uint32_t& Edges)
+    {
+#ifdef PD_CODEC_SSE2
+        if (Width == TileSize && Height == TileSize)
+        {
+            // One row of green is one register; byte counters can't overflow over 2 * 16 rows
+            const __m128i Zero = _mm_setzero_si128();
+            const __m128i GreenMask = _mm_set1_epi32(0xFF);
+            const __m128i Step = _mm_set1_epi8(char(EdgeStep));
+            const __m128i HorizontalLanes = _mm_srli_si128(_mm_set1_epi8(-1), 1);
+            __m128i FlatCount = Zero, SmallCount = Zero, Previous = Zero;
+            for (uint32_t y = 0; y < TileSize; y++)
+            {
+                auto* Row = reinterpret_cast<const __m128i*>(Src + y * Pitch);
+                __m128i G0 = _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128(Row + 0), 8), GreenMask);
+                __m128i G1 = _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128(Row + 1), 8), GreenMask);
+                __m128i G2 = _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128(Row + 2), 8), GreenMask);
+                __m128i G3 = _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128(Row + 3), 8), GreenMask);
+                __m128i Green = _mm_packus_epi16(_mm_packs_epi32(G0, G1), _mm_packs_epi32(G2, G3));
+
+                __m128i Right = _mm_srli_si128(Green, 1);
+                __m128i Diff = _mm_or_si128(_mm_subs_epu8(Green, Right), _mm_subs_epu8(Right, Green));
+                FlatCount = _mm_sub_epi8(FlatCount, _mm_and_si128(_mm_cmpeq_epi8(Diff, Zero), HorizontalLanes));
+                SmallCount = _mm_sub_epi8(SmallCount,
+                    _mm_and_si128(_mm_cmpeq_epi8(_mm_subs_epu8(Diff, Step), Zero), HorizontalLanes));
+
+                if (y != 0)
+                {
+                    Diff = _mm_or_si128(_mm_subs_epu8(Green, Previous), _mm_subs_epu8(Previous, Green));
+                    FlatCount = _mm_sub_epi8(FlatCount, _mm_cmpeq_epi8(Diff, Zero));
+                    SmallCount = _mm_sub_epi8(SmallCount, _mm_cmpeq_epi8(_mm_subs_epu8(Diff, Step), Zero));
+                }
+                Previous = Green;
+            }
+
+            // Horizontal sums of the byte counters
+            FlatCount = _mm_sad_epu8(FlatCount, Zero);
+            SmallCount = _mm_sad_epu8(SmallCount, Zero);
+            Flat = uint32_t(_mm_cvtsi128_si32(FlatCount) + _mm_cvtsi128_si32(_mm_srli_si128(FlatCount, 8)));
+            uint32_t Small = uint32_t(_mm_cvtsi128_si32(SmallCount) + _mm_cvtsi128_si32(_mm_srli_si128(SmallCount, 8)));
+            Edges = 2 * TileSize * (TileSize - 1) - Small;
+            return;
+        }
+#endif
+        Flat = 0;
+        Edges = 0;
+        for (uint32_t y = 0; y < Height; y++)
+        {
+            const uint8_t* Row = Src + y * Pitch;
+            for (uint32_t x = 0; x < Width; x++)
+            {
+                int G = int(GreenOf(Row, x));
+                if (x + 1 < Width)
+                {
+                    int Step = abs(int(GreenOf(Row, x + 1)) - G);
+                    Flat += Step == 0;
+                    Edges += Step > EdgeStep;
+                }
+                if (y + 1 < Height)
+                {
+                    int Step = abs(int(GreenOf(Row + Pitch, x)) - G);
+                    Flat += Step == 0;
+                    Edges += Step > EdgeStep;
+                }
+            }
+        }
+    }
+
+    constexpr uint32_t HashLanes = sizeof(TilePixels) / 16;  // 16-byte lanes per tile
+
+    /// <summary>
+    /// Keys mixed into every 16 bytes of a tile so the hash depends on where pixels are, not just on what they are.
+    /// </summary>
+    struct HashKeys
+    {
+        uint64_t Keys[HashLanes][2];
+
+        HashKeys()
+        {
+            // SplitMix64 from a fixed seed, both sides of the cache must derive the same keys
+            uint64_t State = 0x5044444654494C45ull;
+            for (auto& Lane : Keys)
+            {
+                for (uint64_t& Key : Lane)
+                {
+                    uint64_t Z = (State += 0x9E3779B97F4A7C15ull);
+                    Z = (Z ^ (Z >> 30)) * 0xBF58476D1CE4E5B9ull;
+                    Z = (Z ^ (Z >> 27)) * 0x94D049BB133111EBull;
+                    Key = Z ^ (Z >> 31);
+                }
+            }
+        }
+    };
+
+    const HashKeys& GetHashKeys()
+    {
+        static const HashKeys s_Keys;
+        return s_Keys;
+    }
+
+    inline uint64_t Avalanche(uint64_t Value)
+    {
+        Value ^= Value >> 37;
+        Value *= 0x165667919E3779F9ull;
+        return Value ^ (Value >> 32);
+    }
+
+    /// <summary>
+    /// 64-bit hash of a tile. Each 16 bytes are XORed with their keys, the halves of each 64-bit word multiplied
+    /// together and accumulated with the data of the other word, the way XXH3 accumulates; the vector and scalar
+    /// paths compute exactly the same value.
+    /// </summary>
+    uint64_t HashTile(const TilePixels& Pixels, uint64_t Seed)
+    {
+        const HashKeys& Keys = GetHashKeys();
+        auto* Bytes = reinterpret_cast<const uint8_t*>(Pixels);
+        uint64_t Accumulator[2] = { 0x9E3779B185EBCA87ull, 0x85EBCA77C2B2AE63ull };
+#ifdef PD_CODEC_SSE2
+        __m128i Sum = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Accumulator));
+        for (uint32_t i = 0; i < HashLanes; i++)
+        {
+            __m128i Data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Bytes + i * 16));
+            __m128i Keyed = _mm_xor_si128(Data, _mm_loadu_si128(reinterpret_cast<const __m128i*>(Keys.Keys[i])));
+            __m128i Product = _mm_mul_epu32(Keyed, _mm_srli_epi64(Keyed, 32));
+            Sum = _mm_add_epi64(Sum, _mm_add_epi64(Product, _mm_shuffle_epi32(Data, _MM_SHUFFLE(1, 0, 3, 2))));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(Accumulator), Sum);
+#else
+        for (uint32_t i = 0; i < HashLanes; i++)
+        {
+            uint64_t Data[2];
+            memcpy(Data, Bytes + i * 16, sizeof(Data));
+            for (uint32_t j = 0; j < 2; j++)
+            {
+                uint64_t Keyed = Data[j] ^ Keys.Keys[i][j];
+                Accumulator[j] += (Keyed & 0xFFFFFFFF) * (Keyed >> 32) + Data[j ^ 1];
+            }
+        }
+#endif
+        return Avalanche(Accumulator[0] ^ ((Accumulator[1] << 29) | (Accumulator[1] >> 35)) ^ Avalanche(Seed + 1));
+    }
+
+    uint8_t* EncodeBlock(Block& Samples, const float* Inverse, uint8_t* Out)
+    {
+        const DctBasis& Basis = GetBasis();
+        Block Temp, Coefficients;
+        Multiply(Basis.Forward, Samples, Temp);
+        Multiply(Temp, Basis.Transposed, Coefficients);
+
+        int32_t Quantized[64];
+        uint32_t Count = 0;
+        for (uint32_t i = 0; i < 64; i++)
+        {
+            uint32_t n = s_ZigZag[i];
+            float Value = Coefficients[n / 8][n % 8] * Inverse[n];
+            Quantized[i] = int32_t(Value + (Value >= 0 ? 0.5f : -0.5f));
+            if (Quantized[i] != 0)
+            {
+                Count = i + 1;
+            }
+        }
+
+        Out = PutVarint(Out, Count);
+        for (uint32_t i = 0; i < Count; i++)
+        {
+            Out = PutVarint(Out, (uint32_t(Quantized[i]) << 1) ^ uint32_t(Quantized[i] >> 31));
+        }
+        return Out;
+    }
+
+    bool DecodeBlock(const uint8_t*& In, const uint8_t* End, const float* Step, Block& Samples)
+    {
+        uint32_t Count;
+        if (!GetVarint(In, End, Count) || Count > 64)
+        {
+            return false;
+        }
+
+        Block Coefficients = {};
+        for (uint32_t i = 0; i < Count; i++)
+        {
+            uint32_t Coded;
+            if (!GetVarint(In, End, Coded))
+            {
+                return false;
+            }
+            uint32_t n = s_ZigZag[i];
+            int32_t Value = int32_t(Coded >> 1) ^ -int32_t(Coded & 1);
+            Coefficients[n / 8][n % 8] = float(Value) * Step[n];
+        }
+
+        const DctBasis& Basis = GetBasis();
+        Block Temp;
+        Multiply(Basis.Transposed, Coefficients, Temp);
+        Multiply(Temp, Basis.Forward, Samples);
+        return true;
+    }
+
+    size_t EncodeLossy(const TilePixels& Pixels, const Quantizer& Quant, uint8_t* Out)
+    {
+        // Luma is centred on zero like JPEG's level shift; Co and Cg already are
+        Block Luma[4], Co = {}, Cg = {};
+#ifdef PD_CODEC_SSE2
+        // Two rows at a time, each half of a row is one luma block row and four chroma samples
+        const __m128i ByteMask = _mm_set1_epi32(0xFF);
+        const __m128 Quarter = _mm_set1_ps(0.25f), Half = _mm_set1_ps(0.5f), Bias = _mm_set1_ps(128.0f);
+        for (uint32_t y = 0; y < TileSize; y += 2)
+        {
+            for (uint32_t h = 0; h < 2; h++)
+            {
+                __m128 OrangeSum[2] = { _mm_setzero_ps(), _mm_setzero_ps() };
+                __m128 GreenSum[2] = { _mm_setzero_ps(), _mm_setzero_ps() };
+                for (uint32_t Row = y; Row < y + 2; Row++)
+                {
+                    for (uint32_t q = 0; q < 2; q++)
+                    {
+                        __m128i P = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&Pixels[Row][h * 8 + q * 4]));
+                        __m128 B = _mm_cvtepi32_ps(_mm_and_si128(P, ByteMask));
+                        __m128 G = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(P, 8), ByteMask));
+                        __m128 R = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(P, 16), ByteMask));
+                        __m128 RB = _mm_add_ps(R, B);
+                        __m128 Y = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(Quarter, RB), _mm_mul_ps(Half, G)), Bias);
+                        _mm_storeu_ps(&Luma[(Row / 8) * 2 + h][Row % 8][q * 4], Y);
+                        OrangeSum[q] = _mm_add_ps(OrangeSum[q], _mm_sub_ps(R, B));
+                        GreenSum[q] = _mm_add_ps(GreenSum[q], _mm_sub_ps(_mm_add_ps(G, G), RB));
+                    }
+                }
+
+                // Adjacent columns add up to the four 2x2 sums
+                __m128 Orange = _mm_add_ps(_mm_shuffle_ps(OrangeSum[0], OrangeSum[1], _MM_SHUFFLE(2, 0, 2, 0)),
+                    _mm_shuffle_ps(OrangeSum[0], OrangeSum[1], _MM_SHUFFLE(3, 1, 3, 1)));
+                __m128 Green = _mm_add_ps(_mm_shuffle_ps(GreenSum[0], GreenSum[1], _MM_SHUFFLE(2, 0, 2, 0)),
+                    _mm_shuffle_ps(GreenSum[0], GreenSum[1], _MM_SHUFFLE(3, 1, 3, 1)));
+                _mm_storeu_ps(&Co[y / 2][h * 4], _mm_mul_ps(Orange, _mm_set1_ps(0.125f)));
+                _mm_storeu_ps(&Cg[y / 2][h * 4], _mm_mul_ps(Green, _mm_set1_ps(0.0625f)));
+            }
+        }
+#else
+        for (uint32_t y = 0; y < TileSize; y++)
+        {
+            for (uint32_t x = 0; x < TileSize; x++)
+            {
+                uint32_t P = Pixels[y][x];
+                float B = float(P & 0xFF), G = float((P >> 8) & 0xFF), R = float((P >> 16) & 0xFF);
+                Luma[(y / 8) * 2 + x / 8][y % 8][x % 8] = 0.25f * R + 0.5f * G + 0.25f * B - 128.0f;
+                Co[y / 2][x / 2] += 0.125f * (R - B);
+                Cg[y / 2][x / 2] += 0.0625f * (2 * G - R - B);
+            }
+        }
+#endif
+
+        uint8_t* Cursor = Out;
+        for (Block& Samples : Luma)
+        {
+            Cursor = EncodeBlock(Samples, Quant.Inverse[0], Cursor);
+        }
+        Cursor = EncodeBlock(Co, Quant.Inverse[1], Cursor);
+        Cursor = EncodeBlock(Cg, Quant.Inverse[1], Cursor);
+        return size_t(Cursor - Out);
+    }
+
+    bool DecodeLossy(const uint8_t* In, const uint8_t* End, const Quantizer& Quant, TilePixels& Pixels)
+    {
+        Block Luma[4], Co, Cg;
+        for (Block& Samples : Luma)
+        {
+            if (!DecodeBlock(In, End, Quant.Step[0], Samples)) return false;
+        }
+        if (!DecodeBlock(In, End, Quant.Step[1], Co)) return false;
+        if (!DecodeBlock(In, End, Quant.Step[1], Cg)) return false;
+        if (In != End) return false;
+
+#ifdef PD_CODEC_SSE2
+        const __m128 Bias = _mm_set1_ps(128.0f), Low = _mm_setzero_ps(), High = _mm_set1_ps(255.0f);
+        const __m128i Alpha = _mm_set1_epi32(int(0xFF000000));
+        for (uint32_t y = 0; y < TileSize; y++)
+        {
+            for (uint32_t x = 0; x < TileSize; x += 4)
+            {
+                __m128 Y = _mm_add_ps(_mm_loadu_ps(&Luma[(y / 8) * 2 + x / 8][y % 8][x % 8]), Bias);
+                // Two chroma samples, each repeated for two pixels
+                __m128 ChromaO = _mm_castpd_ps(_mm_load_sd(reinterpret_cast<const double*>(&Co[y / 2][x / 2])));
+                __m128 ChromaG = _mm_castpd_ps(_mm_load_sd(reinterpret_cast<const double*>(&Cg[y / 2][x / 2])));
+                ChromaO = _mm_unpacklo_ps(ChromaO, ChromaO);
+                ChromaG = _mm_unpacklo_ps(ChromaG, ChromaG);
+
+                __m128 Base = _mm_sub_ps(Y, ChromaG);
+                __m128i B = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_sub_ps(Base, ChromaO), Low), High));
+                __m128i G = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_add_ps(Y, ChromaG), Low), High));
+                __m128i R = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_add_ps(Base, ChromaO), Low), High));
+                __m128i P = _mm_or_si128(_mm_or_si128(B, _mm_slli_epi32(G, 8)), _mm_or_si128(_mm_slli_epi32(R, 16), Alpha));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(&Pixels[y][x]), P);
+            }
+        }
+#else
+        for (uint32_t y = 0; y < TileSize; y++)
+        {
+            for (uint32_t x = 0; x < TileSize; x++)
+            {
+                float Y = Luma[(y / 8) * 2 + x / 8][y % 8][x % 8] + 128.0f;
+                float ChromaO = Co[y / 2][x / 2], ChromaG = Cg[y / 2][x / 2];
+                float Base = Y - ChromaG;
+                Pixels[y][x] = ClampByte(Base - ChromaO) | (ClampByte(Y + ChromaG) << 8) | (ClampByte(Base + ChromaO) << 16)
+                    | 0xFF000000;
+            }
+        }
+#endif
+        return true;
+    }
+
+    constexpr size_t TileBatch = 1024;   // Tiles taken through each step together, bounds the scratch memory
+    constexpr size_t TileGrain = 8;      // Tiles per task, a few microseconds of work
+    constexpr size_t MaxTilePayload = TileSize * TileSize * 4;
+
+    struct BatchTile
+    {
+        Protocol::TileHeader Header;
+        uint32_t Width;
+        uint32_t Height;
+        uint64_t Hash;
+        const uint8_t* Payload;  // Decoding only, past the hash
+        const uint8_t* End;
+    };
+
+    /// <summary>
+    /// Makes Scratch hold at least Size elements, dropping what it held if it has to grow. Never shrinks it.
+    /// </summary>
+    template <typename T>
+    void GrowScratch(vector<T>& Scratch, size_t Size)
+    {
+        if (Scratch.size() < Size)
+        {
+            Scratch = vector<T>(Size);
+        }
+    }
+
+    /// <summary>
+    /// Calls Body for every tile of a batch, spread over Tasks or all on this thread without it. Only a reference to
+    /// Body is captured, small enough for std::function to hold without allocating.
+    /// </summary>
+    template <typename Function>
+    void ForEachTile(Scheduling::TaskScheduler* Tasks, size_t Count, const Function& Body)
+    {
+        auto Range = [&](size_t Begin, size_t End)
+            {
+                for (size_t i = Begin; i < End; i++)
+                {
+                    Body(i);
+                }
+            };
+        if (Tasks != nullptr)
+        {
+            Tasks->ParallelFor(Count, TileGrain, Range);
+        }
+        else
+        {
+            Range(0, Count);
+        }
+    }
+
+    /// <summary>
+    /// Writes the payload of an uncached tile, lossy if it is photographic and comes out smaller than raw. Returns
+    /// its size, at most MaxTilePayload.
+    /// </summary>
+    uint32_t EncodeTile(const TilePixels& Pixels, uint32_t Width, uint32_t Height, const Quantizer& Quant,
+        uint8_t* Out, uint16_t& Mode)
+    {
+        uint32_t Size = Width * Height * 4;
+        if (Codec::ClassifyTile(Pixels, sizeof(Pixels[0]), Width, Height) == Codec::TileClass::Photo)
+        {
+            uint8_t Lossy[MaxLossySize];
+            size_t LossySize = EncodeLossy(Pixels, Quant, Lossy);
+            if (LossySize != 0 && LossySize < Size)
+            {
+                Mode = uint16_t(Protocol::TileMode::Lossy);
+                memcpy(Out, Lossy, LossySize);
+                return uint32_t(LossySize);
+            }
+        }
+
+        Mode = uint16_t(Protocol::TileMode::Raw);
+        for (uint32_t y = 0; y < Height; y++)
+        {
+            memcpy(Out + y * Width * 4, Pixels[y], Width * 4);
+        }
+        return Size;
+    }
+}
+
+namespace PartialDisplay::Codec
+{
+    struct TileScratch::Buffers
+    {
+        vector<uint8_t> Marked;    // Encoding: per tile of the frame, whether it is damaged
+        vector<uint32_t> Tiles;    // Encoding: the damaged tiles
+        vector<BatchTile> Batch;   // Encoding: the batch of them; decoding: every tile of the stream
+        vector<TilePixels> Pixels;
+        vector<uint8_t> Payloads;  // Encoding only
+        vector<uint8_t> Seen;      // Decoding: per tile of the frame, whether the stream had it yet
+    };
+
+    TileScratch::TileScratch() = default;
+    TileScratch::~TileScratch() = default;
+
+    TileScratch::Buffers& TileScratch::GetBuffers()
+    {
+        if (!m_Buffers)
+        {
+            m_Buffers = make_unique<Buffers>();
+        }
+        return *m_Buffers;
+    }
+
+    TileClass ClassifyTile(const void* Src, size_t Pitch, uint32_t Width, uint32_t Height)
+    {
+        // Distinct colours, in an open-addressed set twice the limit so probes stay short
+        constexpr uint32_t SetSize = UiMaxColors * 2;
+        constexpr uint32_t Empty = 0xFFFFFFFF;
+        uint32_t Set[SetSize];
+        fill(begin(Set), end(Set), Empty);
+
+        uint32_t Colors = 0;
+        for (uint32_t y = 0; y < Height && Colors <= UiMaxColors; y++)
+        {
+            auto* Row = reinterpret_cast<const uint32_t*>(static_cast<const uint8_t*>(Src) + y * Pitch);
+            for (uint32_t x = 0; x < Width && Colors <= UiMaxColors; x++)
+            {
+                uint32_t Color = Row[x] & 0xFFFFFF;
+                uint32_t Slot = (Color * 2654435761u) >> 26;
+                while (Set[Slot] != Empty && Set[Slot] != Color)
+                {
+                    Slot = (Slot + 1) % SetSize;
+                }
+                if (Set[Slot] == Empty)
+                {
+                    Set[Slot] = Color;
+                    Colors++;
+                }
+            }
+        }
+        if (Colors <= UiMaxColors)
+        {
+            return TileClass::Ui;
+        }
+
+        // Steps of green, a good enough luma proxy, to the right and downwards neighbour
+        uint32_t Pairs = (Width - 1) * Height + Width * (Height - 1), Flat = 0, Edges = 0;
+        GradientCounts(static_cast<const uint8_t*>(Src), Pitch, Width, Height, Flat, Edges);
+        if (Flat >= Pairs * UiMinFlatFraction || Edges >= Pairs * UiMinEdgeFraction)
+        {
+            return TileClass::Ui;
+        }
+        return TileClass::Photo;
+    }
+
+    uint64_t HashTile(const void* Src, size_t Pitch, uint32_t Width, uint32_t Height, uint32_t Quality)
+    {
+        TilePixels Pixels;
+        GatherTile(static_cast<const uint8_t*>(Src), Pitch, Width, Height, nullptr, Pixels);
+        return ::HashTile(Pixels, Quality);
+    }
+
+    TileCache::TileCache(uint32_t Capacity, bool StorePixels)
+        : m_Hashes(Capacity), m_Used(Capacity)
+    {
+        size_t IndexSize = 1;
+        while (IndexSize < size_t(Capacity) * 2)
+        {
+            IndexSize *= 2;
+        }
+        m_Index.assign(IndexSize, Empty);
+        if (StorePixels)
+        {
+            m_Pixels.resize(size_t(Capacity) * TilePixelCount);
+        }
+    }
+
+    void TileCache::Reset()
+    {
+        fill(m_Index.begin(), m_Index.end(), Empty);
+        fill(m_Used.begin(), m_Used.end(), uint8_t(0));
+        m_Count = 0;
+        m_Hand = 0;
+        m_Reset = true;
+    }
+
+    bool TileCache::TakeReset()
+    {
+        bool Reset = m_Reset;
+        m_Reset = false;
+        return Reset;
+    }
+
+    uint32_t TileCache::Find(uint64_t Hash)
+    {
+        m_Lookups++;
+        size_t Mask = m_Index.size() - 1;
+        for (size_t i = size_t(Hash) & Mask; m_Index[i] != Empty; i = (i + 1) & Mask)
+        {
+            if (m_Hashes[m_Index[i]] == Hash)
+            {
+                m_Hits++;
+                m_Used[m_Index[i]] = 1;
+                return m_Index[i];
+            }
+        }
+        return NotFound;
+    }
+
+    uint32_t TileCache::Insert(uint64_t Hash)
+    {
+        uint32_t Capacity = uint32_t(m_Hashes.size());
+        uint32_t Slot;
+        if (m_Count < Capacity)
+        {
+            Slot = m_Count++;
+        }
+        else
+        {
+            // Tiles used since the hand last passed get a second chance, the first one that wasn't is replaced
+            while (m_Used[m_Hand])
+            {
+                m_Used[m_Hand] = 0;
+                m_Hand = (m_Hand + 1) % Capacity;
+            }
+            Slot = m_Hand;
+            m_Hand = (m_Hand + 1) % Capacity;
+            Unlink(m_Hashes[Slot]);
+        }
+
+        m_Hashes[Slot] = Hash;
+        m_Used[Slot] = 0;
+        size_t Mask = m_Index.size() - 1;
+        size_t i = size_t(Hash) & Mask;
+        while (m_Index[i] != Empty)
+        {
+            i = (i + 1) & Mask;
+        }
+        m_Index[i] = Slot;
+        return Slot;
+    }
+
+    void TileCache::Unlink(uint64_t Hash)
+    {
+        size_t Mask = m_Index.size() - 1;
+        size_t i = size_t(Hash) & Mask;
+        while (m_Index[i] != Empty && m_Hashes[m_Index[i]] != Hash)
+        {
+            i = (i + 1) & Mask;
+        }
+        if (m_Index[i] == Empty)
+        {
+            return;
+        }
+
+        // Shift later entries of the probe run back into the hole unless that would move them before their home
+        for (size_t j = (i + 1) & Mask; m_Index[j] != Empty; j = (j + 1) & Mask)
+        {
+            size_t Home = size_t(m_Hashes[m_Index[j]]) & Mask;
+            if (((j - Home) & Mask) >= ((j - i) & Mask))
+            {
+                m_Index[i] = m_Index[j];
+                i = j;
+            }
+        }
+        m_Index[i] = Empty;
+    }
+
+    size_t GetMaxStreamSize(uint32_t Width, uint32_t Height)
+    {
+        size_t Tiles = size_t((Width + TileSize - 1) / TileSize) * ((Height + TileSize - 1) / TileSize);
+        return sizeof(Protocol::TileStreamHeader) + Tiles * (sizeof(Protocol::TileHeader) + sizeof(uint64_t))
+            + size_t(Width) * Height * 4;
+    }
+
+    size_t EncodeTiles(const void* Src, size_t Pitch, uint32_t Width, uint32_t Height,
+        const Protocol::DamageRect* Damage, uint32_t DamageCount, uint32_t Quality, const Kernels::ChannelLut* Lut,
+        TileCache* Cache, Scheduling::TaskScheduler* Tasks, void* Dst, size_t Capacity, TileScratch* Scratch)
+    {
+        if (Width == 0 || Height == 0 || Capacity < GetMaxStreamSize(Width, Height))
+        {
+            return 0;
+        }
+
+        // Only ever grown, assign and clear keep the capacity
+        TileScratch Local;
+        TileScratch::Buffers& Buffers = (Scratch != nullptr ? *Scratch : Local).GetBuffers();
+
+        uint32_t Columns = (Width + TileSize - 1) / TileSize;
+        uint32_t Rows = (Height + TileSize - 1) / TileSize;
+        vector<uint8_t>& Marked = Buffers.Marked;
+        Marked.assign(size_t(Columns) * Rows, Damage == nullptr);
+        for (uint32_t i = 0; Damage != nullptr && i < DamageCount; i++)
+        {
+            int32_t Left = max(Damage[i].Left, 0), Top = max(Damage[i].Top, 0);
+            int32_t Right = min(Damage[i].Right, int32_t(Width)), Bottom = min(Damage[i].Bottom, int32_t(Height));
+            for (int32_t ty = Top / int32_t(TileSize); Left < Right && ty * int32_t(TileSize) < Bottom; ty++)
+            {
+                for (int32_t tx = Left / int32_t(TileSize); tx * int32_t(TileSize) < Right; tx++)
+                {
+                    Marked[size_t(ty) * Columns + tx] = 1;
+                }
+            }
+        }
+        vector<uint32_t>& Tiles = Buffers.Tiles;
+        Tiles.clear();
+        for (uint32_t i = 0; i < Marked.size(); i++)
+        {
+            if (Marked[i])
+            {
+                Tiles.push_back(i);
+            }
+        }
+
+        Protocol::TileStreamHeader Stream = {};
+        Stream.Quality = uint16_t(Quality == 0 ? Protocol::DefaultTileQuality : min(Quality, 100u));
+        if (Cache != nullptr && Cache->TakeReset())
+        {
+            Stream.Flags |= Protocol::TileStreamCacheReset;
+        }
+        Quantizer Quant(Stream.Quality);
+
+        uint8_t* Cursor = static_cast<uint8_t*>(Dst) + sizeof(Stream);
+        size_t BatchSize = min(Tiles.size(), TileBatch);
+        vector<TilePixels>& Pixels = Buffers.Pixels;
+        vector<BatchTile>& Batch = Buffers.Batch;
+        vector<uint8_t>& Payloads = Buffers.Payloads;
+        GrowScratch(Pixels, BatchSize);
+        GrowScratch(Batch, BatchSize);
+        GrowScratch(Payloads, BatchSize * MaxTilePayload);
+        for (size_t First = 0; First < Tiles.size(); First += TileBatch)
+        {
+            size_t Count = min(TileBatch, Tiles.size() - First);
+
+            // Tiles are gathered and hashed in any order, the quality is part of the hash so a lossy tile is never
+            // reused at another quality
+            ForEachTile(Tasks, Count, [&](size_t i)
+                {
+                    uint32_t tx = Tiles[First + i] % Columns, ty = Tiles[First + i] / Columns;
+                    BatchTile& Tile = Batch[i];
+                    Tile = {};
+                    Tile.Header.X = uint16_t(tx);
+                    Tile.Header.Y = uint16_t(ty);
+                    Tile.Width = min(TileSize, Width - tx * TileSize);
+                    Tile.Height = min(TileSize, Height - ty * TileSize);
+                    GatherTile(static_cast<const uint8_t*>(Src) + ty * TileSize * Pitch + tx * TileSize * 4, Pitch,
+                        Tile.Width, Tile.Height, Lut, Pixels[i]);
+                    Tile.Hash = Cache != nullptr ? ::HashTile(Pixels[i], Stream.Quality) : 0;
+                });
+
+            // ...but the cache has to see them in stream order, as the consumer's will
+            for (size_t i = 0; Cache != nullptr && i < Count; i++)
+            {
+                BatchTile& Tile = Batch[i];
+                if (Cache->Find(Tile.Hash) != TileCache::NotFound)
+                {
+                    Tile.Header.Mode = uint16_t(Protocol::TileMode::Cached);
+                    continue;
+                }
+                Cache->Insert(Tile.Hash);
+                Tile.Header.Flags = Protocol::TileCacheable;
+            }
+
+            ForEachTile(Tasks, Count, [&](size_t i)
+                {
+                    BatchTile& Tile = Batch[i];
+                    if (Protocol::TileMode(Tile.Header.Mode) != Protocol::TileMode::Cached)
+                    {
+                        Tile.Header.Size = EncodeTile(Pixels[i], Tile.Width, Tile.Height, Quant,
+                            &Payloads[i * MaxTilePayload], Tile.Header.Mode);
+                    }
+                });
+
+            for (size_t i = 0; i < Count; i++)
+            {
+                Protocol::TileHeader Header = Batch[i].Header;
+                bool Hashed = Protocol::TileMode(Header.Mode) == Protocol::TileMode::Cached
+                    || (Header.Flags & Protocol::TileCacheable);
+                uint32_t Size = Header.Size;
+                Header.Size += Hashed ? sizeof(uint64_t) : 0;
+                memcpy(Cursor, &Header, sizeof(Header));
+                Cursor += sizeof(Header);
+                if (Hashed)
+                {
+                    memcpy(Cursor, &Batch[i].Hash, sizeof(uint64_t));
+                    Cursor += sizeof(uint64_t);
+                }
+                memcpy(Cursor, &Payloads[i * MaxTilePayload], Size);
+                Cursor += Size;
+                Stream.TileCount++;
+            }
+        }
+
+        memcpy(Dst, &Stream, sizeof(Stream));
+        return size_t(Cursor - static_cast<uint8_t*>(Dst));
+    }
+
+    bool DecodeTiles(const void* Stream, size_t Size, void* Dst, size_t Pitch, uint32_t Width, uint32_t Height,
+        TileCache* Cache, Scheduling::TaskScheduler* Tasks, TileScratch* Scratch)
+    {
+        Protocol::TileStreamHeader Header;
+        if (Size < sizeof(Header))
+        {
+            return false;
+        }
+        memcpy(&Header, Stream, sizeof(Header));
+        if (Header.Quality == 0 || Header.Quality > 100 || Header.TileCount > Size / sizeof(Protocol::TileHeader))
+        {
+            return false;
+        }
+        if (Cache != nullptr && (Header.Flags & Protocol::TileStreamCacheReset))
+        {
+            Cache->Reset();
+        }
+
+        // Everything but the payloads is checked up front. No tile may appear twice, so the tiles can be decoded
+        // into the frame in any order.
+        Quantizer Quant(Header.Quality);
+        uint32_t Columns = (Width + TileSize - 1) / TileSize;
+        uint32_t Rows = (Height + TileSize - 1) / TileSize;
+        const uint8_t* Cursor = static_cast<const uint8_t*>(Stream) + sizeof(Header);
+        const uint8_t* End = static_cast<const uint8_t*>(Stream) + Size;
+        TileScratch Local;
+        TileScratch::Buffers& Buffers = (Scratch != nullptr ? *Scratch : Local).GetBuffers();
+        vector<uint8_t>& Seen = Buffers.Seen;
+        vector<BatchTile>& Tiles = Buffers.Batch;
+        Seen.assign(size_t(Columns) * Rows, 0);
+        Tiles.resize(Header.TileCount);
+        for (BatchTile& Tile : Tiles)
+        {
+            if (size_t(End - Cursor) < sizeof(Tile.Header))
+            {
+                return false;
+            }
+            memcpy(&Tile.Header, Cursor, sizeof(Tile.Header));
+            Cursor += sizeof(Tile.Header);
+            if (Tile.Header.X >= Columns || Tile.Header.Y >= Rows || Tile.Header.Size > size_t(End - Cursor)
+                || Seen[size_t(Tile.Header.Y) * Columns + Tile.Header.X]++)
+            {
+                return false;
+            }
+
+            Tile.Payload = Cursor;
+            Tile.End = Cursor + Tile.Header.Size;
+            Cursor = Tile.End;
+            Tile.Width = min(TileSize, Width - Tile.Header.X * TileSize);
+            Tile.Height = min(TileSize, Height - Tile.Header.Y * TileSize);
+
+            auto Mode = Protocol::TileMode(Tile.Header.Mode);
+            if (Mode == Protocol::TileMode::Cached || (Tile.Header.Flags & Protocol::TileCacheable))
+            {
+                if (Cache == nullptr || Tile.Header.Size < sizeof(Tile.Hash))
+                {
+                    return false;
+                }
+                memcpy(&Tile.Hash, Tile.Payload, sizeof(Tile.Hash));
+                Tile.Payload += sizeof(Tile.Hash);
+            }
+            if ((Mode == Protocol::TileMode::Raw && size_t(Tile.End - Tile.Payload) != Tile.Width * Tile.Height * 4)
+                || (Mode == Protocol::TileMode::Cached && Tile.Payload != Tile.End)
+                || (Mode != Protocol::TileMode::Raw && Mode != Protocol::TileMode::Lossy
+                    && Mode != Protocol::TileMode::Cached))
+            {
+                return false;
+            }
+        }
+        if (Cursor != End)
+        {
+            return false;
+        }
+
+        vector<TilePixels>& Pixels = Buffers.Pixels;
+        GrowScratch(Pixels, min(Tiles.size(), TileBatch));
+        for (size_t First = 0; First < Tiles.size(); First += TileBatch)
+        {
+            size_t Count = min(TileBatch, Tiles.size() - First);
+
+            atomic<bool> Failed = false;
+            ForEachTile(Tasks, Count, [&](size_t i)
+                {
+                    const BatchTile& Tile = Tiles[First + i];
+                    uint8_t* Target = static_cast<uint8_t*>(Dst) + Tile.Header.Y * TileSize * Pitch
+                        + Tile.Header.X * TileSize * 4;
+                    switch (Protocol::TileMode(Tile.Header.Mode))
+                    {
+                    case Protocol::TileMode::Raw:
+                        Kernels::CopyRows(Tile.Payload, Tile.Width * 4, Target, Pitch, Tile.Width * 4, Tile.Height);
+                        if (Tile.Header.Flags & Protocol::TileCacheable)
+                        {
+                            // Cached like the encoder saw it, edges repeated
+                            GatherTile(Tile.Payload, Tile.Width * 4, Tile.Width, Tile.Height, nullptr, Pixels[i]);
+                        }
+                        break;
+                    case Protocol::TileMode::Lossy:
+                        if (!DecodeLossy(Tile.Payload, Tile.End, Quant, Pixels[i]))
+                        {
+                            Failed.store(true, memory_order_relaxed);
+                            break;
+                        }
+                        Kernels::CopyRows(Pixels[i], sizeof(Pixels[i][0]), Target, Pitch, Tile.Width * 4,
+                            Tile.Height);
+                        break;
+                    default:
+                        break;
+                    }
+                });
+            if (Failed.load(memory_order_relaxed))
+            {
+                return false;
+            }
+
+            // The cache is updated and read in stream order, a tile may well be the copy of one earlier in the batch
+            for (size_t i = 0; Cache != nullptr && i < Count; i++)
+            {
+                const BatchTile& Tile = Tiles[First + i];
+                if (Protocol::TileMode(Tile.Header.Mode) == Protocol::TileMode::Cached)
+                {
+                    uint32_t Slot = Cache->Find(Tile.Hash);
+                    uint32_t* Cached = Slot != TileCache::NotFound ? Cache->GetPixels(Slot) : nullptr;
+                    if (Cached == nullptr)
+                    {
+                        return false;
+                    }
+                    uint8_t* Target = static_cast<uint8_t*>(Dst) + Tile.Header.Y * TileSize * Pitch
+                        + Tile.Header.X * TileSize * 4;
+                    Kernels::CopyRows(Cached, sizeof(Pixels[i][0]), Target, Pitch, Tile.Width * 4, Tile.Height);
+                }
+                else if (Tile.Header.Flags & Protocol::TileCacheable)
+                {
+                    uint32_t* Cached = Cache->GetPixels(Cache->Insert(Tile.Hash));
+                    if (Cached == nullptr)
+                    {
+                        return false;
+                    }
+                    memcpy(Cached, Pixels[i], sizeof(Pixels[i]));
+                }
+            }
+        }
+        return true;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,155 @@
+#pragma once
+
+// Tile codec for CompressionTiles. A frame is cut into TileSize x TileSize tiles and every tile is classified: text
+// and UI (few colours, flat runs, hard edges) is sent raw so it stays sharp, photographic content goes through a
+// fast lossy transform codec. Lossy tiles are converted to YCoCg, their chroma is averaged down to 4:2:0, and the
+// four luma and two chroma 8x8 blocks are DCT transformed, quantized with the JPEG tables scaled by the quality and
+// written in zigzag order as a coefficient count followed by signed varints. A lossy tile that would not come out
+// smaller than raw is sent raw.
+//
+// Only the tiles touched by the damage are encoded; the decoder patches them into the frame it holds. With a
+// TileCache on both sides, a tile whose hash the cache holds is sent as the hash alone. The hash is a vectorized
+// multiply-accumulate over the tile, position dependent and finished with an avalanche, and the caches evict with
+// CLOCK so tiles hit since the hand last passed survive one more round.
+//
+// Given a TaskScheduler, tiles are gathered, hashed, classified and transformed in parallel, a batch at a time. Only
+// the cache lookups and the assembly of the stream run in order, so the stream is the same whatever the scheduler.
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "Protocol.h"
+#include "PixelKernels.h"
+
+namespace PartialDisplay::Scheduling
+{
+    class TaskScheduler;
+}
+
+namespace PartialDisplay::Codec
+{
+    enum class TileClass : uint32_t
+    {
+        Ui = 0,     // Text, UI and flat areas, kept lossless
+        Photo = 1,  // Photographic or video content, coded lossy
+    };
+
+    /// <summary>
+    /// A fixed number of tiles under their hashes, evicted with CLOCK. The consumer stores the pixels of each tile,
+    /// the producer only mirrors the hashes to know what the consumer holds. Both must apply the same streams in the
+    /// same order, which EncodeTiles and DecodeTiles take care of.
+    /// </summary>
+    class TileCache
+    {
+    public:
+        static constexpr uint32_t NotFound = 0xFFFFFFFF;
+
+        TileCache(uint32_t Capacity, bool StorePixels);
+
+        /// <summary>
+        /// Forgets every tile. The next stream EncodeTiles produces with this cache tells the consumer to do the same.
+        /// </summary>
+        void Reset();
+
+        /// <summary>
+        /// Returns the slot holding Hash and marks it recently used, or NotFound.
+        /// </summary>
+        uint32_t Find(uint64_t Hash);
+
+        /// <summary>
+        /// Adds Hash, evicting the first tile the CLOCK hand finds unused since its last pass. Returns the slot.
+        /// </summary>
+        uint32_t Insert(uint64_t Hash);
+
+        /// <summary>
+        /// TileSize x TileSize pixels of a slot, null unless the cache stores pixels.
+        /// </summary>
+        uint32_t* GetPixels(uint32_t Slot)
+        {
+            return m_Pixels.empty() ? nullptr : &m_Pixels[size_t(Slot) * TilePixelCount];
+        }
+
+        uint64_t GetLookups() const { return m_Lookups; }
+        uint64_t GetHits() const { return m_Hits; }
+
+        /// <summary>
+        /// Whether Reset was called since the last call, for EncodeTiles to flag the stream.
+        /// </summary>
+        bool TakeReset();
+
+    private:
+        static constexpr uint32_t Empty = 0xFFFFFFFF;
+        static constexpr size_t TilePixelCount = size_t(Protocol::TileSize) * Protocol::TileSize;
+
+        std::vector<uint64_t> m_Hashes;    // Per slot
+        std::vector<uint8_t> m_Used;       // Per slot, the CLOCK bit
+        std::vector<uint32_t> m_Index;     // Open-addressed from hash to slot, a power of two at least twice the slots
+        std::vector<uint32_t> m_Pixels;
+        uint32_t m_Count = 0;
+        uint32_t m_Hand = 0;
+        uint64_t m_Lookups = 0;
+        uint64_t m_Hits = 0;
+        bool m_Reset = true;
+
+        void Unlink(uint64_t Hash);
+    };
+
+    /// <summary>
+    /// Working memory of EncodeTiles and DecodeTiles. It grows to the largest frame it has been used for and is kept
+    /// from call to call, so passing the same one each time keeps steady streams from allocating. One call at a time.
+    /// </summary>
+    class TileScratch
+    {
+    public:
+        TileScratch();
+        ~TileScratch();
+        TileScratch(const TileScratch&) = delete;
+        TileScratch& operator=(const TileScratch&) = delete;
+
+        struct Buffers;  // Up to the codec
+
+        Buffers& GetBuffers();
+
+    private:
+        std::unique_ptr<Buffers> m_Buffers;
+    };
+
+    /// <summary>
+    /// Classifies Width x Height BGRA8 pixels, at most TileSize in each direction, from their colour count and
+    /// neighbour gradients.
+    /// </summary>
+    TileClass ClassifyTile(const void* Src, size_t Pitch, uint32_t Width, uint32_t Height);
+
+    /// <summary>
+    /// The hash the tile cache knows Width x Height BGRA8 pixels by, at most TileSize in each direction, when they
+    /// are encoded at Quality.
+    /// </summary>
+    uint64_t HashTile(const void* Src, size_t Pitch, uint32_t Width, uint32_t Height, uint32_t Quality);
+
+    /// <summary>
+    /// Largest stream EncodeTiles can produce for a frame, every tile raw and cacheable.
+    /// </summary>
+    size_t GetMaxStreamSize(uint32_t Width, uint32_t Height);
+
+    /// <summary>
+    /// Encodes the tiles of a BGRA8 frame touched by Damage, or every tile when Damage is null. Lut, if not null,
+    /// is applied to the pixels first. Cache, if not null, mirrors the consumer's cache and is updated with what the
+    /// stream tells the consumer to cache. Tasks, if not null, spreads the tiles over its workers. Scratch, if not
+    /// null, is used instead of allocating working memory. Returns the stream size, 0 if Capacity is below
+    /// GetMaxStreamSize.
+    /// </summary>
+    size_t EncodeTiles(const void* Src, size_t Pitch, uint32_t Width, uint32_t Height,
+        const Protocol::DamageRect* Damage, uint32_t DamageCount, uint32_t Quality, const Kernels::ChannelLut* Lut,
+        TileCache* Cache, Scheduling::TaskScheduler* Tasks, void* Dst, size_t Capacity, TileScratch* Scratch = nullptr);
+
+    /// <summary>
+    /// Decodes a stream into a BGRA8 frame, leaving the tiles it doesn't carry alone. Cache must store pixels and is
+    /// required for streams with cached tiles. Tasks and Scratch are as for EncodeTiles. Returns false on a malformed
+    /// stream, one carrying a tile twice included, or a tile missing from the cache, in which case the frame may be
+    /// partially patched and the cache is out of step with the producer.
+    /// </summary>
+    bool DecodeTiles(const void* Stream, size_t Size, void* Dst, size_t Pitch, uint32_t Width, uint32_t Height,
+        TileCache* Cache, Scheduling::TaskScheduler* Tasks, TileScratch* Scratch = nullptr);
+}
\ No newline at end of file
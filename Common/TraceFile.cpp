@@ -0,0 +1,253 @@
+#include "TraceFile.h"
+#include "Protocol.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace PartialDisplay::Trace
+{
+    static_assert(sizeof(DamageRect) == sizeof(Protocol::DamageRect), "Damage rect layouts differ");
+
+    void InitHeader(FileHeader& Header, uint64_t Frequency)
+    {
+        Header = {};
+        Header.Magic = FileMagic;
+        Header.Version = Version;
+        Header.Frequency = Frequency;
+        Header.DataEnd = AlignRecord(sizeof(FileHeader));
+    }
+
+    // Damage the record keeps for a response: none when the whole frame changed
+    static uint32_t GetRecordDamage(const Protocol::FrameView& View)
+    {
+        return (View.Descriptor->Flags & Protocol::FrameFullDamage) ? 0 : View.Descriptor->DamageCount;
+    }
+
+    uint64_t GetRecordSize(const void* Response, size_t Size)
+    {
+        Protocol::FrameView View;
+        if (!Protocol::ParseFrame(Response, Size, View))
+        {
+            return 0;
+        }
+        return AlignRecord(sizeof(FrameHeader) + GetRecordDamage(View) * sizeof(DamageRect) + Size);
+    }
+
+    uint64_t WriteRecord(void* Record, const void* Response, size_t Size, uint64_t Timestamp)
+    {
+        Protocol::FrameView View;
+        if (!Protocol::ParseFrame(Response, Size, View))
+        {
+            return 0;
+        }
+
+        const Protocol::FrameDescriptor& Descriptor = *View.Descriptor;
+        uint32_t DamageCount = GetRecordDamage(View);
+        size_t DamageSize = DamageCount * sizeof(DamageRect);
+        auto* Header = static_cast<FrameHeader*>(Record);
+        Header->Magic = FrameMagic;
+        Header->Flags = 0;
+        Header->Timestamp = Timestamp;
+        Header->Width = Descriptor.Width;
+        Header->Height = Descriptor.Height;
+        Header->Pitch = Descriptor.Pitch;
+        Header->DamageCount = DamageCount;
+        Header->PayloadSize = Size;
+        if (DamageSize != 0)
+        {
+            memcpy(Header + 1, View.Damage, DamageSize);
+        }
+        memcpy(reinterpret_cast<uint8_t*>(Header + 1) + DamageSize, Response, Size);
+        return AlignRecord(sizeof(FrameHeader) + DamageSize + Size);
+    }
+
+    bool Reader::Open(const void* Data, uint64_t Size)
+    {
+        m_Data = static_cast<const uint8_t*>(Data);
+        m_Size = Size;
+        m_Index.clear();
+        if (Size < sizeof(FileHeader))
+        {
+            return false;
+        }
+
+        auto* Header = reinterpret_cast<const FileHeader*>(m_Data);
+        if (Header->Magic != FileMagic || Header->Version != Version)
+        {
+            return false;
+        }
+        m_Frequency = Header->Frequency;
+
+        if (Header->IndexOffset != 0 && Header->IndexOffset <= Size
+            && Header->FrameCount <= (Size - Header->IndexOffset) / sizeof(IndexEntry))
+        {
+            auto* Entries = reinterpret_cast<const IndexEntry*>(m_Data + Header->IndexOffset);
+            m_Index.resize(size_t(Header->FrameCount));
+            for (size_t i = 0; i < m_Index.size(); i++)
+            {
+                m_Index[i] = Entries[i].Offset;
+            }
+            return true;
+        }
+
+        // The recorder was interrupted before writing the index, walk the records instead
+        uint64_t End = Header->DataEnd < Size ? Header->DataEnd : Size;
+        uint64_t RecordSize;
+        for (uint64_t Offset = AlignRecord(sizeof(FileHeader)); IsRecord(Offset, End, RecordSize);
+            Offset += AlignRecord(RecordSize))
+        {
+            m_Index.push_back(Offset);
+        }
+        return true;
+    }
+
+    bool Reader::IsRecord(uint64_t Offset, uint64_t End, uint64_t& Size) const
+    {
+        if (Offset > End || End - Offset < sizeof(FrameHeader))
+        {
+            return false;
+        }
+        auto* Header = reinterpret_cast<const FrameHeader*>(m_Data + Offset);
+        uint64_t Available = End - Offset - sizeof(FrameHeader);
+        if (Header->Magic != FrameMagic || Header->DamageCount > Protocol::MaxDamageRects
+            || Header->DamageCount * sizeof(DamageRect) > Available
+            || Header->PayloadSize > Available - Header->DamageCount * sizeof(DamageRect))
+        {
+            return false;
+        }
+        Size = sizeof(FrameHeader) + Header->DamageCount * sizeof(DamageRect) + Header->PayloadSize;
+        return true;
+    }
+
+    bool Reader::GetFrame(size_t Index, Frame& Frame) const
+    {
+        uint64_t Size;
+        if (Index >= m_Index.size() || !IsRecord(m_Index[Index], m_Size, Size))
+        {
+            return false;
+        }
+        auto* Header = reinterpret_cast<const FrameHeader*>(m_Data + m_Index[Index]);
+        Frame.Timestamp = Header->Timestamp;
+        Frame.Response = reinterpret_cast<const uint8_t*>(Header + 1) + Header->DamageCount * sizeof(DamageRect);
+        Frame.Size = size_t(Header->PayloadSize);
+        return true;
+    }
+
+    MappedFile::~MappedFile()
+    {
+        Close();
+    }
+
+#ifdef _WIN32
+
+    bool MappedFile::Open(const string& Path)
+    {
+        Close();
+        m_File = CreateFileA(Path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+        return Map();
+    }
+
+    bool MappedFile::Open(const wstring& Path)
+    {
+        Close();
+        m_File = CreateFileW(Path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+        return Map();
+    }
+
+    bool MappedFile::Map()
+    {
+        LARGE_INTEGER Size;
+        if (m_File == INVALID_HANDLE_VALUE)
+        {
+            m_File = nullptr;
+            return false;
+        }
+        if (!GetFileSizeEx(m_File, &Size) || Size.QuadPart == 0)
+        {
+            return false;
+        }
+
+        m_Mapping = CreateFileMapping(m_File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_Mapping == nullptr)
+        {
+            return false;
+        }
+        m_View = MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0);
+        m_Size = m_View != nullptr ? uint64_t(Size.QuadPart) : 0;
+        return m_View != nullptr;
+    }
+
+    void MappedFile::Close()
+    {
+        if (m_View != nullptr)
+        {
+            UnmapViewOfFile(m_View);
+        }
+        if (m_Mapping != nullptr)
+        {
+            CloseHandle(m_Mapping);
+        }
+        if (m_File != nullptr)
+        {
+            CloseHandle(m_File);
+        }
+        m_View = m_Mapping = m_File = nullptr;
+        m_Size = 0;
+    }
+
+#else
+
+    bool MappedFile::Open(const string& Path)
+    {
+        Close();
+        int File = open(Path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (File < 0)
+        {
+            return false;
+        }
+
+        // The mapping keeps the file referenced, the descriptor isn't needed past this
+        struct stat Status = {};
+        bool Valid = fstat(File, &Status) == 0;
+        if (Valid && Status.st_size == 0)
+        {
+            // Nothing to map, and mmap refuses an empty range
+            errno = EINVAL;
+            Valid = false;
+        }
+        void* View = Valid ? mmap(nullptr, size_t(Status.st_size), PROT_READ, MAP_SHARED, File, 0) : MAP_FAILED;
+        int Error = errno;
+        close(File);
+        errno = Error;
+        if (View == MAP_FAILED)
+        {
+            return false;
+        }
+        m_View = View;
+        m_Size = uint64_t(Status.st_size);
+        return true;
+    }
+
+    void MappedFile::Close()
+    {
+        if (m_View != nullptr)
+        {
+            munmap(const_cast<void*>(m_View), size_t(m_Size));
+        }
+        m_View = nullptr;
+        m_Size = 0;
+    }
+
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,160 @@
+#pragma once
+
+// Trace files hold the frame stream exactly as a client received it, so a session recorded by the viewer can be
+// replayed into the viewer again or into the benchmarks on any platform. Layout:
+//
+//   FileHeader (64 bytes)
+//   FrameHeader | DamageRect[DamageCount] | payload  -- repeated, each record aligned to RecordAlignment
+//   IndexEntry[FrameCount]                           -- written on close, located by IndexOffset
+//
+// The payload is the response as returned by the driver, so it parses with Protocol::ParseFrame. A file whose
+// recorder never got to write the index (IndexOffset == 0) is still readable by walking the records up to DataEnd,
+// which is updated after every appended frame.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace PartialDisplay::Trace
+{
+    constexpr uint32_t FileMagic = 0x52544450;   // "PDTR"
+    constexpr uint32_t FrameMagic = 0x52464450;  // "PDFR"
+    constexpr uint32_t Version = 3;  // Raised with Protocol::Version too, as payloads are in its layout
+    constexpr uint64_t RecordAlignment = 64;
+
+    struct FileHeader
+    {
+        uint32_t Magic;
+        uint32_t Version;
+        uint64_t Frequency;  // Timestamp ticks per second, the QPC frequency of the recording machine
+        uint64_t DataEnd;
+        uint64_t IndexOffset;
+        uint64_t FrameCount;
+        uint64_t Reserved[3];
+    };
+
+    struct FrameHeader
+    {
+        uint32_t Magic;
+        uint32_t Flags;
+        uint64_t Timestamp;    // Ticks since the recording started
+        uint32_t Width;
+        uint32_t Height;
+        uint32_t Pitch;
+        uint32_t DamageCount;  // 0 means the whole frame is damaged
+        uint64_t PayloadSize;
+    };
+
+    struct DamageRect
+    {
+        int32_t Left;
+        int32_t Top;
+        int32_t Right;
+        int32_t Bottom;
+    };
+
+    struct IndexEntry
+    {
+        uint64_t Offset;
+        uint64_t Timestamp;
+    };
+
+    static_assert(sizeof(FileHeader) == 64, "Trace file header layout changed");
+    static_assert(sizeof(FrameHeader) == 40, "Trace frame header layout changed");
+    static_assert(sizeof(IndexEntry) == 16, "Trace index layout changed");
+
+    constexpr uint64_t AlignRecord(uint64_t Size)
+    {
+        return (Size + RecordAlignment - 1) / RecordAlignment * RecordAlignment;
+    }
+
+    /// <summary>
+    /// Fills in the header of a trace without frames. The first record goes at AlignRecord(sizeof(FileHeader)).
+    /// </summary>
+    void InitHeader(FileHeader& Header, uint64_t Frequency);
+
+    /// <summary>
+    /// Size of the record of a response of Size bytes, padding included, or 0 if the response isn't a frame.
+    /// </summary>
+    uint64_t GetRecordSize(const void* Response, size_t Size);
+
+    /// <summary>
+    /// Writes the record of a response to Record, which has room for GetRecordSize bytes, padding left as it is.
+    /// Returns the size of the record, 0 if the response isn't a frame and nothing was written.
+    /// </summary>
+    uint64_t WriteRecord(void* Record, const void* Response, size_t Size, uint64_t Timestamp);
+
+    struct Frame
+    {
+        uint64_t Timestamp;
+        const void* Response;
+        size_t Size;
+    };
+
+    /// <summary>
+    /// Finds the frames of a trace held in memory, mapped or read whole. Every record is checked against the size of
+    /// the trace before it is handed out, so a damaged or cut off trace reads up to its last whole frame.
+    /// </summary>
+    class Reader
+    {
+    public:
+        /// <summary>
+        /// Indexes the Size bytes of trace at Data, which must stay valid while frames are read, from the index
+        /// written on close or else by walking the records. Returns false if Data isn't a trace of this version.
+        /// </summary>
+        bool Open(const void* Data, uint64_t Size);
+
+        size_t GetFrameCount() const { return m_Index.size(); }
+        uint64_t GetFrequency() const { return m_Frequency; }
+
+        /// <summary>
+        /// Locates frame Index. Returns false if its record is damaged.
+        /// </summary>
+        bool GetFrame(size_t Index, Frame& Frame) const;
+
+    private:
+        const uint8_t* m_Data = nullptr;
+        uint64_t m_Size = 0;
+        uint64_t m_Frequency = 0;
+        std::vector<uint64_t> m_Index;
+
+        bool IsRecord(uint64_t Offset, uint64_t End, uint64_t& Size) const;
+    };
+
+    /// <summary>
+    /// A file mapped read-only in one view, for traces too large to read in.
+    /// </summary>
+    class MappedFile
+    {
+    public:
+        MappedFile() = default;
+        ~MappedFile();
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        /// <summary>
+        /// Maps the file. Returns false, with errno or the last error set, if it can't be opened, is empty or can't
+        /// be mapped.
+        /// </summary>
+        bool Open(const std::string& Path);
+#ifdef _WIN32
+        bool Open(const std::wstring& Path);
+#endif
+
+        const void* GetData() const { return m_View; }
+        uint64_t GetSize() const { return m_Size; }
+
+    private:
+        const void* m_View = nullptr;
+        uint64_t m_Size = 0;
+#ifdef _WIN32
+        void* m_File = nullptr;  // The file and mapping handles, kept apart from windows.h
+        void* m_Mapping = nullptr;
+
+        bool Map();
+#endif
+
+        void Close();
+    };
+}
\ No newline at end of file
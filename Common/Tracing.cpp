@@ -0,0 +1,198 @@
+#include "Tracing.h"
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+    using PartialDisplay::Tracing::EventType;
+
+    // 32 bytes per event, 256 KB per thread that ever traced
+    constexpr uint64_t RingCapacity = 8192;
+
+    struct Event
+    {
+        uint64_t Time;  // steady_clock nanoseconds
+        const char* Name;
+        int64_t Value;
+        uint32_t ThreadId;
+        EventType Type;
+    };
+
+    /// <summary>
+    /// One thread's events. Only the owning thread writes; Head is published with release so an exporter sees
+    /// complete events below it. Rings of exited threads are handed to new threads and keep their old events.
+    /// </summary>
+    struct Ring
+    {
+        atomic<uint64_t> Head = 0;
+        atomic<bool> InUse = false;
+        Event Events[RingCapacity];
+    };
+
+    mutex s_RingsMutex;
+    vector<unique_ptr<Ring>> s_Rings;
+
+    uint32_t GetThreadId()
+    {
+#ifdef _WIN32
+        return GetCurrentThreadId();
+#else
+        return uint32_t(syscall(SYS_gettid));
+#endif
+    }
+
+    Ring* AcquireRing()
+    {
+        lock_guard<mutex> Lock(s_RingsMutex);
+        for (auto& Ring : s_Rings)
+        {
+            bool Free = false;
+            if (Ring->InUse.compare_exchange_strong(Free, true))
+            {
+                return Ring.get();
+            }
+        }
+
+        s_Rings.push_back(make_unique<Ring>());
+        s_Rings.back()->InUse = true;
+        return s_Rings.back().get();
+    }
+
+    /// <summary>
+    /// Binds a ring to the thread on first use and gives it back when the thread exits.
+    /// </summary>
+    struct ThreadRing
+    {
+        Ring* Owned = nullptr;
+        uint32_t ThreadId = 0;
+
+        ~ThreadRing()
+        {
+            if (Owned != nullptr)
+            {
+                Owned->InUse = false;
+            }
+        }
+
+        Ring* Get()
+        {
+            if (Owned == nullptr)
+            {
+                Owned = AcquireRing();
+                ThreadId = GetThreadId();
+            }
+            return Owned;
+        }
+    };
+
+    thread_local ThreadRing t_Ring;
+
+    void AppendEscaped(string& Out, const char* Text)
+    {
+        for (; *Text != 0; Text++)
+        {
+            if (*Text == '"' || *Text == '\\')
+            {
+                Out += '\\';
+            }
+            Out += *Text;
+        }
+    }
+}
+
+namespace PartialDisplay::Tracing
+{
+    atomic<bool> g_Enabled = false;
+
+    void Start()
+    {
+        g_Enabled.store(true, memory_order_relaxed);
+    }
+
+    void Stop()
+    {
+        g_Enabled.store(false, memory_order_relaxed);
+    }
+
+    void Record(EventType Type, const char* Name, int64_t Value)
+    {
+        Ring* Ring = t_Ring.Get();
+        uint64_t Head = Ring->Head.load(memory_order_relaxed);
+        Event& Slot = Ring->Events[Head % RingCapacity];
+        Slot.Time = uint64_t(chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count());
+        Slot.Name = Name;
+        Slot.Value = Value;
+        Slot.ThreadId = t_Ring.ThreadId;
+        Slot.Type = Type;
+        Ring->Head.store(Head + 1, memory_order_release);
+    }
+
+    string ExportChromeEvents(uint32_t ProcessId, const char* ProcessName)
+    {
+        string Out;
+        char Line[256];
+        snprintf(Line, sizeof(Line), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"", ProcessId);
+        Out += Line;
+        AppendEscaped(Out, ProcessName);
+        Out += "\"}}";
+
+        lock_guard<mutex> Lock(s_RingsMutex);
+        vector<Event> Events;
+        for (auto& Ring : s_Rings)
+        {
+            // Copy what is there, then drop whatever the owner may have overwritten while we were copying
+            uint64_t Head = Ring->Head.load(memory_order_acquire);
+            uint64_t First = Head > RingCapacity ? Head - RingCapacity : 0;
+            Events.clear();
+            for (uint64_t i = First; i < Head; i++)
+            {
+                Events.push_back(Ring->Events[i % RingCapacity]);
+            }
+            // The slot of the next event may be half written too, hence the + 1
+            uint64_t After = Ring->Head.load(memory_order_acquire) + 1;
+            size_t Overwritten = size_t(min<uint64_t>(After > RingCapacity ? After - RingCapacity - First : 0,
+                Events.size()));
+
+            for (size_t i = Overwritten; i < Events.size(); i++)
+            {
+                const Event& Event = Events[i];
+                static const char* const Phases[] = { "B", "E", "C" };
+                snprintf(Line, sizeof(Line), ",\n{\"ph\":\"%s\",\"pid\":%u,\"tid\":%u,\"ts\":%" PRIu64 ".%03u,\"name\":\"",
+                    Phases[uint32_t(Event.Type) % 3], ProcessId, Event.ThreadId, Event.Time / 1000,
+                    unsigned(Event.Time % 1000));
+                Out += Line;
+                AppendEscaped(Out, Event.Name);
+                if (Event.Type == EventType::Counter)
+                {
+                    snprintf(Line, sizeof(Line), "\",\"args\":{\"value\":%" PRId64 "}}", Event.Value);
+                    Out += Line;
+                }
+                else
+                {
+                    Out += "\"}";
+                }
+            }
+        }
+        return Out;
+    }
+
+    string WrapChromeTrace(const string& Events)
+    {
+        return "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" + Events + "\n]}\n";
+    }
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+// Low-overhead span and counter tracing. Every thread records into its own ring of fixed-size events, so recording
+// takes no lock and only touches memory the thread owns; when a ring is full the oldest events are overwritten.
+// Recording is switched on and off at runtime, and the PD_TRACE_* macros compile to nothing when PD_TRACING is 0.
+// Traces are exported as Chrome trace event JSON, which chrome://tracing and Perfetto load directly.
+//
+// Timestamps come from steady_clock, which is QPC on Windows, so events of the driver and the app line up when
+// their exports are merged into one file.
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#ifndef PD_TRACING
+#define PD_TRACING 1
+#endif
+
+namespace PartialDisplay::Tracing
+{
+    enum class EventType : uint32_t
+    {
+        Begin = 0,
+        End = 1,
+        Counter = 2,
+    };
+
+    extern std::atomic<bool> g_Enabled;
+
+    inline bool IsEnabled() { return g_Enabled.load(std::memory_order_relaxed); }
+    void Start();
+    void Stop();
+
+    /// <summary>
+    /// Appends an event to the calling thread's ring. Name must have static storage duration, only the pointer is
+    /// kept.
+    /// </summary>
+    void Record(EventType Type, const char* Name, int64_t Value = 0);
+
+    /// <summary>
+    /// Chrome trace events of every thread, comma separated without the enclosing array, so exports of several
+    /// processes can be concatenated. ProcessName labels the process in the viewer.
+    /// </summary>
+    std::string ExportChromeEvents(uint32_t ProcessId, const char* ProcessName);
+
+    /// <summary>
+    /// Wraps comma separated events into a complete trace file.
+    /// </summary>
+    std::string WrapChromeTrace(const std::string& Events);
+
+    /// <summary>
+    /// Records a begin event now and the matching end event when it goes out of scope.
+    /// </summary>
+    class Span
+    {
+    public:
+        explicit Span(const char* Name) : m_Name(IsEnabled() ? Name : nullptr)
+        {
+            if (m_Name != nullptr)
+            {
+                Record(EventType::Begin, m_Name);
+            }
+        }
+
+        ~Span()
+        {
+            // Ends even if tracing stopped meanwhile, so the exported spans stay balanced
+            if (m_Name != nullptr)
+            {
+                Record(EventType::End, m_Name);
+            }
+        }
+
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+
+    private:
+        const char* m_Name;
+    };
+
+    inline void Counter(const char* Name, int64_t Value)
+    {
+        if (IsEnabled())
+        {
+            Record(EventType::Counter, Name, Value);
+        }
+    }
+}
+
+#if PD_TRACING
+#define PD_TRACE_CONCAT_INNER(a, b) a##b
+#define PD_TRACE_CONCAT(a, b) PD_TRACE_CONCAT_INNER(a, b)
+#define PD_TRACE_SPAN(Name) ::PartialDisplay::Tracing::Span PD_TRACE_CONCAT(TraceSpan, __LINE__)(Name)
+#define PD_TRACE_COUNTER(Name, Value) ::PartialDisplay::Tracing::Counter(Name, int64_t(Value))
+#else
+#define PD_TRACE_SPAN(Name) ((void)0)
+#define PD_TRACE_COUNTER(Name, Value) ((void)0)
+#endif
@@ -0,0 +1,108 @@
+#include "Viewport.h"
+
+#include <algorithm>
+#include <cwchar>
+#include <cstdlib>
+
+using namespace std;
+
+namespace PartialDisplay::Layout
+{
+    bool ParseViewport(const wchar_t* Text, ViewportSpec& Spec)
+    {
+        Spec = {};
+        uint32_t* Fields[] = { &Spec.Source.Left, &Spec.Source.Top, &Spec.Source.Width, &Spec.Source.Height };
+        const wchar_t Separators[] = { L',', L',', L',', L'@' };
+        for (size_t i = 0; i < 4; i++)
+        {
+            wchar_t* End = nullptr;
+            *Fields[i] = uint32_t(wcstoul(Text, &End, 10));
+            if (End == Text || (*End != Separators[i] && !(i == 3 && *End == 0)))
+            {
+                return false;
+            }
+            Text = End + (*End != 0);
+        }
+
+        if (Text[-1] == L'@')
+        {
+            wchar_t* End = nullptr;
+            Spec.Monitor = uint32_t(wcstoul(Text, &End, 10));
+            if (End == Text || *End != 0)
+            {
+                return false;
+            }
+        }
+        return Spec.Source.Width != 0 && Spec.Source.Height != 0;
+    }
+
+    bool ResolveSource(const SourceRect& Requested, uint32_t FrameWidth, uint32_t FrameHeight, SourceRect& Resolved)
+    {
+        if (Requested.Width == 0 || Requested.Height == 0)
+        {
+            Resolved = { 0, 0, FrameWidth, FrameHeight };
+            return FrameWidth != 0 && FrameHeight != 0;
+        }
+
+        Resolved.Left = min(Requested.Left, FrameWidth);
+        Resolved.Top = min(Requested.Top, FrameHeight);
+        Resolved.Width = min(Requested.Width, FrameWidth - Resolved.Left);
+        Resolved.Height = min(Requested.Height, FrameHeight - Resolved.Top);
+        return Resolved.Width != 0 && Resolved.Height != 0;
+    }
+
+    ViewportConstants GetViewportConstants(const SourceRect& Source, uint32_t FrameWidth, uint32_t FrameHeight,
+        uint32_t WindowWidth, uint32_t WindowHeight)
+    {
+        ViewportConstants Constants;
+
+        // A minimized window reports zero, any ratio will do until it comes back
+        float SourceRatio = float(max(Source.Width, 1u)) / max(Source.Height, 1u);
+        float WindowRatio = float(max(WindowWidth, 1u)) / max(WindowHeight, 1u);
+        if (SourceRatio < WindowRatio)
+        {
+            Constants.XOffset = 1 - SourceRatio / WindowRatio;
+            Constants.YOffset = 0;
+            Constants.XScale = SourceRatio / WindowRatio;
+            Constants.YScale = 1;
+        }
+        else
+        {
+            Constants.XOffset = 0;
+            Constants.YOffset = 0;
+            Constants.XScale = 1;
+            Constants.YScale = WindowRatio / SourceRatio;
+        }
+
+        Constants.U = float(Source.Left) / max(FrameWidth, 1u);
+        Constants.V = float(Source.Top) / max(FrameHeight, 1u);
+        Constants.UScale = float(Source.Width) / max(FrameWidth, 1u);
+        Constants.VScale = float(Source.Height) / max(FrameHeight, 1u);
+        return Constants;
+    }
+
+    bool IsDamaged(const SourceRect& Source, const Protocol::FrameDescriptor& Descriptor,
+        const Protocol::DamageRect* Damage)
+    {
+        if ((Descriptor.Flags & Protocol::FrameFullDamage) || Damage == nullptr)
+        {
+            return true;
+        }
+
+        // Damage of a downscaled frame is in its shrunk pixels
+        uint32_t Shift = Protocol::GetDownscale(Descriptor);
+        int64_t Round = (int64_t(1) << Shift) - 1;
+        int64_t Left = int64_t(Source.Left) >> Shift;
+        int64_t Top = int64_t(Source.Top) >> Shift;
+        int64_t Right = (int64_t(Source.Left) + Source.Width + Round) >> Shift;
+        int64_t Bottom = (int64_t(Source.Top) + Source.Height + Round) >> Shift;
+        for (uint32_t i = 0; i < Descriptor.DamageCount; i++)
+        {
+            if (Damage[i].Left < Right && Damage[i].Right > Left && Damage[i].Top < Bottom && Damage[i].Bottom > Top)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+}
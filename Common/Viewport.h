@@ -0,0 +1,68 @@
+#pragma once
+
+// Viewport layout and damage routing. Several windows can each show a sub-rectangle of the same frame; this part
+// decides what each of them samples and whether a frame touches it. It avoids Windows headers, so the benchmarks
+// check it on every platform.
+
+#include <cstdint>
+
+#include "Protocol.h"
+
+namespace PartialDisplay::Layout
+{
+    /// <summary>
+    /// A rectangle of the frame in pixels. A zero width or height stands for the whole frame.
+    /// </summary>
+    struct SourceRect
+    {
+        uint32_t Left = 0;
+        uint32_t Top = 0;
+        uint32_t Width = 0;
+        uint32_t Height = 0;
+    };
+
+    struct ViewportSpec
+    {
+        SourceRect Source;
+        uint32_t Monitor = UINT32_MAX;  // Index in monitor enumeration order, UINT32_MAX for the default monitor
+    };
+
+    /// <summary>
+    /// Vertex shader constants of one viewport: where the quad lands in the window, and which part of the frame
+    /// texture it samples.
+    /// </summary>
+    struct ViewportConstants
+    {
+        float XOffset;
+        float YOffset;
+        float XScale;
+        float YScale;
+        float U;
+        float V;
+        float UScale;
+        float VScale;
+    };
+
+    /// <summary>
+    /// Parses "Left,Top,Width,Height[@Monitor]".
+    /// </summary>
+    bool ParseViewport(const wchar_t* Text, ViewportSpec& Spec);
+
+    /// <summary>
+    /// Clips a requested rect to the frame. Returns false if nothing of it is left.
+    /// </summary>
+    bool ResolveSource(const SourceRect& Requested, uint32_t FrameWidth, uint32_t FrameHeight, SourceRect& Resolved);
+
+    /// <summary>
+    /// Fits a resolved source rect into a window keeping its aspect ratio.
+    /// </summary>
+    ViewportConstants GetViewportConstants(const SourceRect& Source, uint32_t FrameWidth, uint32_t FrameHeight,
+        uint32_t WindowWidth, uint32_t WindowHeight);
+
+    /// <summary>
+    /// Whether a frame changed anything inside a resolved source rect, given in display pixels even when the frame
+    /// is downscaled. Damage may be null when the response carried none, which counts as full damage.
+    /// </summary>
+    bool IsDamaged(const SourceRect& Source, const Protocol::FrameDescriptor& Descriptor,
+        const Protocol::DamageRect* Damage);
+}
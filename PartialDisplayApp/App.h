@@ -7,11 +7,28 @@
 #include <wrl.h>
 #include <d3d11.h>
 
+#include <atomic>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <thread>
 #include <vector>
 #include <string>
 
+#include "../Common/Protocol.h"
+#include "../Common/PixelKernels.h"
+#include "../Common/ThreadPolicy.h"
+#include "../Common/Tracing.h"
+#include "../Common/TileCodec.h"
+#include "../Common/TaskScheduler.h"
+#include "../Common/LatencyProbe.h"
+#include "../Common/Demand.h"
+#include "../Common/CopyTuner.h"
+#include "../Common/FramePool.h"
+#include "../Common/TraceFile.h"
+#include "../Common/Viewport.h"
+
 using Microsoft::WRL::ComPtr;
 using Microsoft::WRL::Wrappers::HandleT;
 
@@ -33,6 +50,22 @@ namespace PartialDisplay::Helper
         }
     };
 
+    struct HCMNOTIFICATION_Traits
+    {
+        using Type = HCMNOTIFICATION;
+
+        inline static bool Close(_In_ Type h) noexcept
+        {
+            // Waits for a callback that is running to return
+            return ::CM_Unregister_Notification(h) == CR_SUCCESS;
+        }
+
+        inline static Type GetInvalidValue() noexcept
+        {
+            return nullptr;
+        }
+    };
+
     struct HMENU_Traits
     {
         using Type = HMENU;
@@ -55,65 +88,302 @@ namespace PartialDisplay
 
     struct MonitorData
     {
-        constexpr static size_t HeaderLength = sizeof(UINT[3]);
-        std::vector<char> Buffer;
-
-        MonitorData() : Buffer(HeaderLength, 0) {}
-        UINT GetWidth() { return reinterpret_cast<UINT*>(Buffer.data())[0]; }
-        UINT GetHeight() { return reinterpret_cast<UINT*>(Buffer.data())[1]; }
-        UINT GetPitch() { return reinterpret_cast<UINT*>(Buffer.data())[2]; }
-        const char* GetData() { return Buffer.data() + HeaderLength; }
+        std::unique_ptr<Memory::FrameBuffer> Buffer;
+        size_t Length = 0;
+        Protocol::FrameView View = {};
+
+        bool Parse() { return Protocol::ParseFrame(Buffer->GetData(), Length, View); }
+        bool HasData() const { return View.Data != nullptr; }
+        const Protocol::FrameDescriptor& GetDescriptor() const { return *View.Descriptor; }
+        UINT GetWidth() const { return View.Descriptor->Width; }
+        UINT GetHeight() const { return View.Descriptor->Height; }
+        UINT GetPitch() const { return View.Descriptor->Pitch; }
+        const char* GetData() const { return reinterpret_cast<const char*>(View.Data); }
     };
 
-    class Ioctl
+    class FrameSource
     {
     public:
         MonitorData m_Monitor;
+        Memory::FramePool m_Pool;
 
-        bool CreateDevice();
-        bool GetDeviceFileName();
-        bool TryOpenHandle();
-        bool RefreshMonitorData();
+        virtual ~FrameSource();
+        virtual bool RefreshMonitorData() = 0;
+
+        /// <summary>
+        /// Forwards a trace command to whatever produces the frames. Events receives the exported events on
+        /// TraceCommand::Read. Returns false if the source can't be traced.
+        /// </summary>
+        virtual bool ControlTrace(Protocol::TraceCommand, std::string*) { return false; }
+
+        /// <summary>
+        /// Asks for frames in a cheaper format or size from now on. Sources that can't produce them ignore it; the
+        /// descriptor of each frame tells what it actually is.
+        /// </summary>
+        virtual void RequestQuality(Protocol::PixelFormat, uint32_t) {}
+
+        /// <summary>
+        /// Asks for the next frame to be sent whole because the one held by the client can't be patched.
+        /// </summary>
+        virtual void RequestKeyFrame() {}
+
+        /// <summary>
+        /// Reads the counters of the stages frames pass on their way to the source. Returns false if it has none.
+        /// </summary>
+        virtual bool GetStatistics(Protocol::PipelineStatistics&) { return false; }
+
+        /// <summary>
+        /// Called with the monitor data and the rows Top to Top + Rows each time a slice of a frame is in place there,
+        /// before RefreshMonitorData returns the whole frame. Sources that deliver whole frames never call it.
+        /// </summary>
+        typedef std::function<void(const MonitorData& Monitor, UINT Top, UINT Rows)> SliceHook;
+        virtual void SetSliceHook(SliceHook) {}
+
+    protected:
+        bool ReserveFrame(size_t Capacity);
+    };
+
+    class Ioctl : public FrameSource
+    {
+    public:
+        /// <summary>
+        /// Opens the device, reattaching to one left by an earlier run or creating it, and waits for its interface
+        /// to arrive rather than for a fixed time.
+        /// </summary>
+        bool Attach();
+        bool Negotiate();
+        bool RefreshMonitorData() override;
+        bool ControlTrace(Protocol::TraceCommand Command, std::string* Events) override;
+        void RequestQuality(Protocol::PixelFormat Format, uint32_t Downscale) override;
+        void RequestKeyFrame() override { m_LastSequence = 0; }
+        bool GetStatistics(Protocol::PipelineStatistics& Statistics) override;
+        void SetSliceHook(SliceHook Hook) override { m_SliceHook = std::move(Hook); }
+
+        /// <summary>
+        /// Asks for frames in Count slices from 1 to MaxSlices, or whole with 0. Slices come at full size without
+        /// damage or tiles, the downscale asked for by RequestQuality is ignored. Takes effect on the next negotiation.
+        /// </summary>
+        void SetSlices(UINT Count) { m_SliceCount = Count; }
+
+        /// <summary>
+        /// Asks for CompressionTiles at Quality from 1 to 100, or for plain frames with 0. Takes effect on the next
+        /// negotiation.
+        /// </summary>
+        void SetTileQuality(UINT Quality) { m_TileQuality = Quality; }
+
+        /// <summary>
+        /// Asks the driver to stamp the latency marker into every frame. Takes effect on the next negotiation.
+        /// </summary>
+        void SetLatencyProbe(bool Enabled) { m_LatencyProbe = Enabled; }
 
     private:
         HandleT<Helper::HSWDEVICE_Traits> m_hSwDevice;
         std::wstring m_DeviceFileName;
         unique_handle m_hDevice;
+        unique_handle m_hArrival;
+        HandleT<Helper::HCMNOTIFICATION_Traits> m_hNotification;
         WCHAR m_DeviceInstanceId[MAX_DEVICE_ID_LEN + 1];
+        size_t m_FrameCapacity = 0;
+        std::optional<Protocol::ServerHello> m_Negotiated;
+        UINT64 m_LastSequence = 0;
+        Protocol::PixelFormat m_Format = Protocol::PixelFormat::BGRA8;
+        UINT m_Downscale = 0;
+        UINT m_TileQuality = 0;
+        bool m_LatencyProbe = false;
+        UINT m_SliceCount = 0;
+        std::unique_ptr<Memory::FrameBuffer> m_SliceBuffer;  // Each slice lands here before it is put in place
+        SliceHook m_SliceHook;
+
+        constexpr static UINT SliceTimeoutMs = 100;
+
+        bool CreateDevice();
+        bool FindDeviceInterface();
+        bool TryOpenHandle();
+        bool RefreshSlices();
 
         static void SwDeviceCreationCallback(HSWDEVICE hSwDevice, HRESULT CreateResult, PVOID pContext, PCWSTR pszDeviceInstanceId);
+        static DWORD CALLBACK DeviceInterfaceCallback(HCMNOTIFICATION hNotify, PVOID Context, CM_NOTIFY_ACTION Action,
+            PCM_NOTIFY_EVENT_DATA EventData, DWORD EventDataSize);
+    };
+
+    /// <summary>
+    /// Appends every frame received from the driver to a memory-mapped trace file. Frames are handed over to a writer
+    /// thread through a fixed set of slots; when all slots are busy the frame is dropped instead of blocking.
+    /// </summary>
+    class TraceRecorder
+    {
+    public:
+        ~TraceRecorder();
+        bool Open(const std::wstring& FileName);
+        void Close();
+        void Record(const MonitorData& Monitor);
+        UINT64 GetDroppedFrames() const { return m_Dropped; }
+
+    private:
+        struct Slot
+        {
+            std::vector<char> Data;
+            UINT64 Timestamp = 0;
+        };
+
+        constexpr static size_t SlotCount = 4;
+
+        Slot m_Slots[SlotCount];
+        std::atomic<size_t> m_Head = 0;
+        std::atomic<size_t> m_Tail = 0;
+        std::atomic<UINT64> m_Dropped = 0;
+        std::atomic<bool> m_Stopping = false;
+
+        unique_handle m_hFile;
+        unique_handle m_hWakeEvent;
+        HANDLE m_hMapping = nullptr;
+        char* m_View = nullptr;
+        UINT64 m_Capacity = 0;
+        UINT64 m_Used = 0;
+        LARGE_INTEGER m_Start = {};
+        std::vector<Trace::IndexEntry> m_Index;
+        std::thread m_Writer;
+
+        void WriterLoop();
+        bool Append(const Slot& Frame);
+        bool Reserve(UINT64 Required);
+        void Unmap();
+    };
+
+    /// <summary>
+    /// Feeds frames from a trace file back to the renderer, either paced by the recorded timestamps or as fast as the
+    /// consumer can take them.
+    /// </summary>
+    class TraceReplayer : public FrameSource
+    {
+    public:
+        bool Open(const std::wstring& FileName, bool MaxSpeed);
+        bool RefreshMonitorData() override;
+        size_t GetFrameCount() const { return m_Reader.GetFrameCount(); }
+
+    private:
+        Trace::MappedFile m_File;
+        Trace::Reader m_Reader;
+        size_t m_Next = 0;
+        bool m_MaxSpeed = false;
+        UINT64 m_FirstTimestamp = 0;
+        LARGE_INTEGER m_Start = {};
     };
 
+    /// <summary>
+    /// CPU stage rotating and mirroring frames for panels mounted in portrait. The transformed frame is kept between
+    /// calls, so when the driver reports damage only the damaged rects are transformed again.
+    /// </summary>
+    class FrameTransform
+    {
+    public:
+        explicit FrameTransform(Kernels::Orientation Transform) : m_Transform(Transform) {}
+        MonitorData& Apply(MonitorData& Monitor);
+
+    private:
+        Kernels::Orientation m_Transform;
+        MonitorData m_Output;
+        UINT64 m_Sequence = 0;
+        bool m_Valid = false;
+    };
+
+    /// <summary>
+    /// CPU stage turning CompressionTiles frames back into plain BGRA8. A stream only carries the damaged tiles, so
+    /// the decoded frame is kept between calls and patched. Apply returns null when a stream can't be applied to it,
+    /// after a lost frame, a malformed stream or a tile missing from the cache, and the source should then be asked
+    /// for a key frame.
+    /// </summary>
+    class FrameDecoder
+    {
+    public:
+        MonitorData* Apply(MonitorData& Monitor);
+        const Codec::TileCache* GetCache() const { return m_Cache.get(); }
+
+    private:
+        MonitorData m_Output;
+        std::unique_ptr<Codec::TileCache> m_Cache;  // Created with the first stream, it holds 16 MB of tiles
+        std::unique_ptr<Scheduling::TaskScheduler> m_Tasks;  // Likewise, so plain frames start no workers
+        Codec::TileScratch m_Scratch;
+        UINT64 m_Sequence = 0;
+        bool m_Valid = false;
+    };
+
+    /// <summary>
+    /// One D3D device and one frame texture shared by every viewport. Each frame is uploaded once, then only the
+    /// viewports whose source rect it damaged are drawn and presented. Viewports are added before rendering starts;
+    /// after that the window thread only posts sizes, all D3D work stays on the rendering thread.
+    /// </summary>
     class Rendering
     {
     public:
         ~Rendering();
-        HRESULT InitD3D(HWND hWnd, UINT WindowWidth, UINT WindowHeight);
-        HRESULT OnSize(UINT WindowWidth, UINT WindowHeight) { return UpdateConfig(0, 0, WindowWidth, WindowHeight); }
-        HRESULT UpdateFrame(UINT ScreenWidth, UINT ScreenHeight, UINT pitch, const void* data);
+        HRESULT InitD3D();
+        HRESULT AddViewport(HWND hWnd, UINT WindowWidth, UINT WindowHeight, const Layout::SourceRect& Source);
+        HRESULT OnSize(HWND hWnd, UINT WindowWidth, UINT WindowHeight);
+        /// <summary>
+        /// Uploads a frame and presents the viewports it damaged. Returns DXGI_STATUS_OCCLUDED when no viewport can be
+        /// seen, minimized or occluded, and the frame was wasted.
+        /// </summary>
+        HRESULT UpdateFrame(const MonitorData& Monitor);
+
+        /// <summary>
+        /// Uploads Rows rows from Top of a frame whose other slices are still on their way, so that by the time the
+        /// last one is in, UpdateFrame only has to present it. Nothing is presented here.
+        /// </summary>
+        HRESULT UploadSlice(const MonitorData& Monitor, UINT Top, UINT Rows);
+
+        /// <summary>
+        /// Checks whether a viewport could be seen again without presenting anything. Returns DXGI_STATUS_OCCLUDED
+        /// while none can, S_OK once one can; that viewport is drawn again with the next frame.
+        /// </summary>
+        HRESULT TestPresent();
+
+        /// <summary>
+        /// Calls Hook on the rendering thread once a frame with data is uploaded, right before it is presented.
+        /// </summary>
+        void SetPresentHook(std::function<void()> Hook) { m_PresentHook = std::move(Hook); }
 
     private:
-        struct PreviousConfig
+        struct Viewport
         {
-            UINT m_ScreenWidth = 0;
-            UINT m_ScreenHeight = 0;
-            UINT m_WindowWidth = 0;
-            UINT m_WindowHeight = 0;
-            bool LoadOrUpdate(UINT& ScreenWidth, UINT& ScreenHeight, UINT& WindowWidth, UINT& WindowHeight);
+            HWND hWnd = nullptr;
+            Layout::SourceRect Requested;
+            Layout::SourceRect Source;  // Requested, clipped to the current frame
+            UINT WindowWidth = 0;
+            UINT WindowHeight = 0;
+            std::atomic<UINT64> PendingSize = 0;  // Width << 32 | Height, posted by the window thread
+            bool Visible = false;
+            bool Occluded = false;  // As of its last present
+            bool ConfigChanged = true;
+            bool Dirty = true;
+            ComPtr<IDXGISwapChain> SwapChain;
+            ComPtr<ID3D11RenderTargetView> RenderTarget;
+            ComPtr<ID3D11Buffer> ConfigBuffer;
         };
 
         ComPtr<ID3D11Device> m_Device;
         ComPtr<ID3D11DeviceContext> m_DeviceContext;
-        ComPtr<IDXGISwapChain> m_SwapChain;
-        ComPtr<ID3D11RenderTargetView> m_RenderTarget;
-        ComPtr<ID3D11Buffer> m_ConfigBuffer;
+        ComPtr<IDXGIFactory> m_Factory;
+        ComPtr<IDXGIOutput> m_VBlankOutput;
         ComPtr<ID3D11Texture2D> m_TextureBuffer;
-
-        PreviousConfig m_PreviousConfig;
+        std::vector<std::unique_ptr<Viewport>> m_Viewports;
+        UINT m_TextureWidth = 0;
+        UINT m_TextureHeight = 0;
+        DXGI_FORMAT m_TextureFormat = DXGI_FORMAT_UNKNOWN;
+        D3D11_USAGE m_TextureUsage = D3D11_USAGE_DYNAMIC;  // Default once slices are uploaded, which can't map it
+        UINT64 m_SlicedSequence = 0;  // Frame slices were last uploaded for, and how many of its rows
+        UINT m_SlicedRows = 0;
+        UINT m_FrameWidth = 0;   // Display size the frame covers, the texture size unless downscaled
+        UINT m_FrameHeight = 0;
+        std::function<void()> m_PresentHook;
 
         HRESULT InitPipeline();
         HRESULT InitGraphics();
-        HRESULT UpdateConfig(UINT ScreenWidth, UINT ScreenHeight, UINT WindowWidth, UINT WindowHeight);
+        HRESULT PrepareTexture(UINT Width, UINT Height, Protocol::PixelFormat Format, D3D11_USAGE Usage);
+        HRESULT UpdateConfig(Viewport& View);
+        HRESULT UpdateViewports();
+        HRESULT Draw(Viewport& View, UINT SyncInterval);
+        bool IsHidden() const;
     };
 
     class Window
@@ -122,15 +392,24 @@ namespace PartialDisplay
         Window();
         ~Window();
 
-        static std::shared_ptr<Window> CreateMyWindow(HINSTANCE hInstance, HMONITOR hMonitor);
-        int MainLoop();
-        bool UpdateFrame(Ioctl& ioctl);
+        static std::shared_ptr<Window> CreateMyWindow(HINSTANCE hInstance, HMONITOR hMonitor,
+            std::shared_ptr<Rendering> Renderer, const Layout::SourceRect& Source, bool Tray);
+        static int MainLoop();
+
+        /// <summary>
+        /// Adds a tracing entry to the tray menu. Toggle is called on the window thread with true to start tracing
+        /// and false to stop and save it, and returns whether it succeeded.
+        /// </summary>
+        void SetTraceToggle(std::function<bool(bool)> Toggle) { m_TraceToggle = std::move(Toggle); }
 
     private:
         HWND m_hWnd;
-        std::optional<Rendering> m_Rendering;
+        bool m_Tray;
+        bool m_Tracing = false;
+        std::function<bool(bool)> m_TraceToggle;
+        std::shared_ptr<Rendering> m_Rendering;
 
-        bool InitMyWindow(HINSTANCE hInstance, HMONITOR hMonitor);
+        bool InitMyWindow(HINSTANCE hInstance, HMONITOR hMonitor, const Layout::SourceRect& Source);
         bool CreateMyTray(HWND hWnd, bool create);
         static LRESULT CALLBACK WindowProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam);
         bool HandleTrayMessage(WPARAM wParam, LPARAM lParam);
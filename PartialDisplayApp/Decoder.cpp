@@ -0,0 +1,77 @@
+#include "App.h"
+
+using namespace std;
+using namespace PartialDisplay;
+
+MonitorData* FrameDecoder::Apply(MonitorData& Monitor)
+{
+    if (!Monitor.HasData())
+    {
+        // Nothing changed, the renderer presents what it already has
+        return &Monitor;
+    }
+
+    const Protocol::FrameDescriptor& Source = Monitor.GetDescriptor();
+    if (!(Source.Compression & Protocol::CompressionTiles))
+    {
+        m_Valid = false;
+        return &Monitor;
+    }
+
+    UINT Pitch = (Source.Width * sizeof(UINT32) + 63) & ~63u;
+
+    // The header is always reserved at its largest so the pixels stay put whatever the damage count
+    size_t Required = Protocol::MaxHeaderSize + size_t(Pitch) * Source.Height;
+    if (!m_Output.Buffer || m_Output.Buffer->GetCapacity() < Required)
+    {
+        m_Valid = false;
+        m_Output.Buffer = make_unique<Memory::FrameBuffer>(Required, false);
+        if (!m_Output.Buffer->IsValid())
+        {
+            m_Output.Buffer.reset();
+            return nullptr;
+        }
+    }
+
+    // A stream of the whole frame decodes on its own, one of damaged tiles only on top of the previous frame
+    bool Whole = (Source.Flags & Protocol::FrameFullDamage) != 0;
+    if (!Whole && !(m_Valid && Source.Sequence > m_Sequence && m_Output.GetWidth() == Source.Width
+        && m_Output.GetHeight() == Source.Height))
+    {
+        m_Valid = false;
+        return nullptr;
+    }
+
+    if (!m_Cache)
+    {
+        m_Cache = make_unique<Codec::TileCache>(Protocol::TileCacheSize, true);
+        m_Tasks = make_unique<Scheduling::TaskScheduler>();
+    }
+
+    char* Base = m_Output.Buffer->GetData();
+    auto* Descriptor = reinterpret_cast<Protocol::FrameDescriptor*>(Base);
+    char* Data = Base + Protocol::MaxHeaderSize;
+    if (!Codec::DecodeTiles(Monitor.GetData(), size_t(Source.DataSize), Data, Pitch, Source.Width, Source.Height,
+        m_Cache.get(), m_Tasks.get(), &m_Scratch))
+    {
+        printf("Malformed tile stream.\n");
+        m_Valid = false;
+        return nullptr;
+    }
+
+    *Descriptor = Source;
+    if (Monitor.View.Damage != nullptr)
+    {
+        copy(Monitor.View.Damage, Monitor.View.Damage + Source.DamageCount,
+            reinterpret_cast<Protocol::DamageRect*>(Descriptor + 1));
+    }
+    Descriptor->HeaderSize = uint16_t(Protocol::MaxHeaderSize);
+    Descriptor->Compression = Protocol::CompressionNone;
+    Descriptor->Pitch = Pitch;
+    Descriptor->DataSize = size_t(Pitch) * Source.Height;
+
+    m_Output.Length = Protocol::MaxHeaderSize + Descriptor->DataSize;
+    m_Valid = m_Output.Parse();
+    m_Sequence = Source.Sequence;
+    return m_Valid ? &m_Output : nullptr;
+}
\ No newline at end of file
@@ -0,0 +1,29 @@
+#include "App.h"
+
+using namespace std;
+using namespace PartialDisplay;
+
+FrameSource::~FrameSource()
+{
+    m_Pool.Release(move(m_Monitor.Buffer));
+}
+
+bool FrameSource::ReserveFrame(size_t Capacity)
+{
+    if (m_Monitor.Buffer != nullptr && m_Monitor.Buffer->GetCapacity() >= Capacity)
+    {
+        return true;
+    }
+
+    auto Buffer = m_Pool.Acquire(Capacity);
+    if (Buffer == nullptr)
+    {
+        printf("Can't allocate %zu bytes of frame memory\n", Capacity);
+        return false;
+    }
+
+    m_Pool.Release(move(m_Monitor.Buffer));
+    m_Monitor.Buffer = move(Buffer);
+    m_Monitor.Length = 0;
+    return true;
+}
\ No newline at end of file
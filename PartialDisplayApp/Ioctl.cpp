@@ -1,15 +1,12 @@
 #include "App.h"
+#include "Readiness.h"
 #include <winioctl.h>
-
-#define INITGUID
-#include <devpkey.h>
+#include <chrono>
 
 using namespace std;
 using namespace PartialDisplay;
 using namespace PartialDisplay::Helper;
 
-#define IOCTL_Custom_GetMonitorData CTL_CODE(FILE_DEVICE_SCREEN, 0x842, METHOD_BUFFERED, FILE_READ_ACCESS)
-
 struct CreateCallbackArguments
 {
     bool Cancelled;
@@ -70,7 +67,14 @@ bool Ioctl::CreateDevice()
         return false;
     }
 
-    printf("Device created\n\n");
+    // Left in place when we exit, so the next run reattaches instead of waiting for the driver to start again
+    hr = SwDeviceSetLifetime(hSwDevice, SWDeviceLifetimeParentPresent);
+    if (FAILED(hr))
+    {
+        printf("Can't keep the device past this run: 0x%lx\n", hr);
+    }
+
+    printf("Device %ws created\n\n", m_DeviceInstanceId);
     m_hSwDevice.Attach(hSwDevice);
     return true;
 }
@@ -90,35 +94,25 @@ void Ioctl::SwDeviceCreationCallback(HSWDEVICE hSwDevice, HRESULT CreateResult,
     }
 }
 
-bool Ioctl::GetDeviceFileName()
+bool Ioctl::FindDeviceInterface()
 {
-    // Get device instance handle from instance id
-    DEVINST devInst;
-    CONFIGRET cmret = CM_Locate_DevNode(&devInst, m_DeviceInstanceId, CM_LOCATE_DEVNODE_NORMAL);
-    if (cmret != CR_SUCCESS)
-    {
-        printf("Can't locate device node: %#lx\n", cmret);
-        return false;
-    }
-
-    // Get device PDO name
-    DEVPROPTYPE PropertyType;
-    ULONG BufferSize = 0;
-    cmret = CM_Get_DevNode_Property(devInst, &DEVPKEY_Device_PDOName, &PropertyType, nullptr, &BufferSize, 0);
-    if (cmret != CR_BUFFER_SMALL)
+    // An empty list is the normal answer until the driver has started the device
+    GUID Interface = Protocol::DeviceInterface;
+    ULONG Length = 0;
+    CONFIGRET cmret = CM_Get_Device_Interface_List_Size(&Length, &Interface, nullptr,
+        CM_GET_DEVICE_INTERFACE_LIST_PRESENT);
+    if (cmret != CR_SUCCESS || Length <= 1)
     {
-        printf("Can't get PDO name size: %#lx\n", cmret);
         return false;
     }
-    auto Buffer = make_unique<BYTE[]>(BufferSize);
-    cmret = CM_Get_DevNode_Property(devInst, &DEVPKEY_Device_PDOName, &PropertyType, Buffer.get(), &BufferSize, 0);
-    if (cmret != CR_SUCCESS)
+    vector<WCHAR> List(Length);
+    cmret = CM_Get_Device_Interface_List(&Interface, nullptr, List.data(), Length, CM_GET_DEVICE_INTERFACE_LIST_PRESENT);
+    if (cmret != CR_SUCCESS || List[0] == L'\0')
     {
-        printf("Can't get PDO name: %#lx\n", cmret);
         return false;
     }
 
-    m_DeviceFileName = wstring(L"\\\\?\\GLOBALROOT") + reinterpret_cast<PWSTR>(Buffer.get());
+    m_DeviceFileName = List.data();
     printf("File name is %ws\n", m_DeviceFileName.c_str());
     return true;
 }
@@ -138,29 +132,379 @@ bool Ioctl::TryOpenHandle()
     return true;
 }
 
+DWORD CALLBACK Ioctl::DeviceInterfaceCallback(HCMNOTIFICATION, PVOID Context, CM_NOTIFY_ACTION Action,
+    PCM_NOTIFY_EVENT_DATA, DWORD)
+{
+    if (Action == CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL)
+    {
+        SetEvent(static_cast<Ioctl*>(Context)->m_hArrival.Get());
+    }
+    return ERROR_SUCCESS;
+}
+
+bool Ioctl::Attach()
+{
+    auto Now = [] { return uint64_t(chrono::steady_clock::now().time_since_epoch() / 1ns); };
+
+    // Registered before looking for the interface so one arriving in between isn't missed
+    m_hArrival.Attach(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+    CM_NOTIFY_FILTER Filter = {};
+    Filter.cbSize = sizeof(Filter);
+    Filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+    Filter.u.DeviceInterface.ClassGuid = Protocol::DeviceInterface;
+    HCMNOTIFICATION hNotification;
+    CONFIGRET cmret = CM_Register_Notification(&Filter, this, DeviceInterfaceCallback, &hNotification);
+    if (cmret == CR_SUCCESS)
+    {
+        m_hNotification.Attach(hNotification);
+    }
+    else
+    {
+        printf("Can't register for device arrival, polling instead: %#lx\n", cmret);
+    }
+
+    Readiness::Tracker Tracker({}, Now());
+    while (true)
+    {
+        Readiness::Step Step = Tracker.Next(Now());
+        switch (Step.What)
+        {
+        case Readiness::Action::Open:
+            Tracker.OnOpened(Now(), FindDeviceInterface() && TryOpenHandle());
+            break;
+        case Readiness::Action::Create:
+            Tracker.OnCreated(Now(), CreateDevice());
+            break;
+        case Readiness::Action::Wait:
+        {
+            uint64_t Current = Now();
+            DWORD Timeout = Step.Until > Current ? DWORD((Step.Until - Current + 999'999) / 1'000'000) : 0;
+            if (WaitForSingleObject(m_hArrival.Get(), Timeout) == WAIT_OBJECT_0)
+            {
+                Tracker.OnArrival();
+            }
+            break;
+        }
+        case Readiness::Action::Ready:
+            printf("%s device after %u attempts\n", Tracker.IsReattached() ? "Reattached to the" : "Opened the new",
+                Tracker.GetAttempts());
+            return true;
+        case Readiness::Action::Fail:
+            printf("The device did not come up\n");
+            return false;
+        }
+    }
+}
+
+bool Ioctl::Negotiate()
+{
+    Protocol::ClientHello Client = {};
+    Client.Size = sizeof(Client);
+    Client.Version = Protocol::Version;
+    Client.Formats = Protocol::FormatBit(Protocol::PixelFormat::BGRA8) | Protocol::FormatBit(Protocol::PixelFormat::B5G6R5);
+    Client.Compression = m_TileQuality != 0 ? Protocol::CompressionTiles | Protocol::CompressionTileCache
+        : Protocol::CompressionNone;
+    Client.Features = Protocol::FeatureDamageRects | Protocol::FeatureSkipUnchanged | Protocol::FeatureDownscale;
+    if (m_LatencyProbe)
+    {
+        Client.Features |= Protocol::FeatureLatencyProbe;
+    }
+    if (m_SliceCount != 0)
+    {
+        Client.Features |= Protocol::FeatureSlices;
+    }
+
+    Protocol::ServerHello Server = {};
+    DWORD Returned;
+    if (!DeviceIoControl(m_hDevice.Get(), IOCTL_Custom_Negotiate, &Client, sizeof(Client),
+        &Server, sizeof(Server), &Returned, nullptr) || Returned < sizeof(Server))
+    {
+        printf("Can't negotiate with the driver: %#lx\n", GetLastError());
+        return false;
+    }
+    if (Server.Version != Protocol::Version || !(Server.Formats & Protocol::FormatBit(Protocol::PixelFormat::BGRA8)))
+    {
+        printf("Driver speaks protocol version %u, expected %u\n", Server.Version, Protocol::Version);
+        return false;
+    }
+
+    if (m_SliceCount != 0 && !(Server.Features & Protocol::FeatureSlices))
+    {
+        printf("Driver can't deliver frames in slices, receiving them whole\n");
+    }
+
+    m_Negotiated = Server;
+    m_FrameCapacity = max(m_FrameCapacity, size_t(Server.MaxResponseSize));
+    m_Pool.SetCapacity(m_FrameCapacity);
+    return true;
+}
+
 bool Ioctl::RefreshMonitorData()
 {
+    PD_TRACE_SPAN("RefreshMonitorData");
+
+    if (!m_Negotiated && !Negotiate())
+    {
+        return false;
+    }
+    if (m_SliceCount != 0 && (m_Negotiated->Features & Protocol::FeatureSlices))
+    {
+        return RefreshSlices();
+    }
+
+    Protocol::FrameRequest Request = {};
+    Request.Size = sizeof(Request);
+    Request.Version = Protocol::Version;
+    Request.Format = UINT32((m_Negotiated->Formats & Protocol::FormatBit(m_Format)) ? m_Format : Protocol::PixelFormat::BGRA8);
+    Request.Compression = m_Negotiated->Compression & (Protocol::CompressionTiles | Protocol::CompressionTileCache);
+    Request.Quality = uint16_t(min(m_TileQuality, 100u));
+    Request.Features = m_Negotiated->Features;
+    Request.Downscale = (m_Negotiated->Features & Protocol::FeatureDownscale) ? m_Downscale : 0;
+
     for (int retry = 0; retry < 3; retry++)
     {
+        if (!ReserveFrame(m_FrameCapacity))
+        {
+            return false;
+        }
+
+        // Only skip the frame we still hold; a fresh buffer has to be filled completely
+        Request.LastSequence = m_Monitor.Length != 0 ? m_LastSequence : 0;
+
         DWORD Returned;
-        if (!DeviceIoControl(m_hDevice.Get(), IOCTL_Custom_GetMonitorData, nullptr, 0,
-            m_Monitor.Buffer.data(), m_Monitor.Buffer.size(), &Returned, nullptr))
+        if (!DeviceIoControl(m_hDevice.Get(), IOCTL_Custom_GetMonitorData, &Request, sizeof(Request),
+            m_Monitor.Buffer->GetData(), DWORD(m_Monitor.Buffer->GetCapacity()), &Returned, nullptr))
         {
             DWORD error = GetLastError();
             printf("IOCTL Error: %lx\n", error);
             return false;
         }
 
-        if (Returned > m_Monitor.HeaderLength)
+        m_Monitor.Length = Returned;
+        if (!m_Monitor.Parse())
         {
-            m_Monitor.Buffer.resize(Returned);
+            printf("Malformed frame response.\n");
+            m_Monitor.Length = 0;
+            return false;
+        }
+
+        const auto& Descriptor = m_Monitor.GetDescriptor();
+        if (m_Monitor.HasData() || (Descriptor.Flags & Protocol::FrameUnchanged))
+        {
+            m_LastSequence = Descriptor.Sequence;
             return true;
         }
 
-        size_t required = m_Monitor.HeaderLength + size_t(m_Monitor.GetPitch()) * m_Monitor.GetHeight();
-        m_Monitor.Buffer.resize(required);
+        // The surface outgrew the advertised capacity (e.g. a larger pitch than estimated), size from the descriptor
+        m_FrameCapacity = max(m_FrameCapacity, size_t(Protocol::GetResponseSize(Descriptor)));
+        m_Pool.SetCapacity(m_FrameCapacity);
+        m_Monitor.Length = 0;
     }
 
     printf("Continuous small buffer.\n");
     return false;
+}
+
+bool Ioctl::RefreshSlices()
+{
+    Protocol::SliceRequest Request = {};
+    Request.Size = sizeof(Request);
+    Request.Version = Protocol::Version;
+    Request.SliceCount = m_SliceCount;
+    Request.Format = UINT32((m_Negotiated->Formats & Protocol::FormatBit(m_Format)) ? m_Format
+        : Protocol::PixelFormat::BGRA8);
+    Request.Features = m_Negotiated->Features & Protocol::FeatureLatencyProbe;
+    Request.TimeoutMs = SliceTimeoutMs;
+
+    // Each slice is put in place in the monitor data behind a descriptor of the whole frame, which the rest of the
+    // app gets once every slice is there; the hook gets the slices as they come, while the driver reads the next
+    UINT64 Sequence = 0;
+    for (int retry = 0; retry < 3 && Request.Slice < m_SliceCount;)
+    {
+        if (!m_SliceBuffer || m_SliceBuffer->GetCapacity() < m_FrameCapacity)
+        {
+            m_Pool.Release(move(m_SliceBuffer));
+            m_SliceBuffer = m_Pool.Acquire(m_FrameCapacity);
+            if (!m_SliceBuffer)
+            {
+                printf("Can't allocate %zu bytes of slice memory\n", m_FrameCapacity);
+                return false;
+            }
+        }
+
+        // Only skip the frame we still hold, like whole frames; once a slice of another is put in place we hold none
+        Request.Sequence = Request.Slice != 0 ? Sequence : m_Monitor.Length != 0 && Sequence == 0 ? m_LastSequence : 0;
+
+        DWORD Returned;
+        if (!DeviceIoControl(m_hDevice.Get(), IOCTL_Custom_GetSlice, &Request, sizeof(Request),
+            m_SliceBuffer->GetData(), DWORD(m_SliceBuffer->GetCapacity()), &Returned, nullptr))
+        {
+            DWORD error = GetLastError();
+            printf("IOCTL Error: %lx\n", error);
+            m_Monitor.Length = Sequence != 0 ? 0 : m_Monitor.Length;
+            return false;
+        }
+
+        Protocol::SliceDescriptor Slice;
+        if (Returned >= sizeof(Slice))
+        {
+            memcpy(&Slice, m_SliceBuffer->GetData(), sizeof(Slice));
+        }
+        if (Returned < sizeof(Slice) || Slice.Magic != Protocol::SliceDescriptorMagic
+            || Slice.Version != Protocol::Version)
+        {
+            printf("Malformed slice response.\n");
+            return false;
+        }
+        if ((Slice.Flags & Protocol::SliceUnchanged) && m_Monitor.Length == 0)
+        {
+            return false;
+        }
+        if (Slice.Flags & Protocol::SliceUnchanged)
+        {
+            // The frame we hold stays, only its descriptor says nothing changed
+            auto* Descriptor = reinterpret_cast<Protocol::FrameDescriptor*>(m_Monitor.Buffer->GetData());
+            Descriptor->Flags |= Protocol::FrameUnchanged;
+            Descriptor->DataSize = 0;
+            m_Monitor.Parse();
+            return true;
+        }
+        if (Slice.Flags & Protocol::SliceSuperseded)
+        {
+            // The driver moved on while we were halfway through, start over on its newest frame
+            Request.Slice = 0;
+            retry++;
+            continue;
+        }
+        if (Returned < Protocol::SliceHeaderSize + Slice.DataSize)
+        {
+            // Like whole frames, the surface outgrew the advertised capacity
+            m_FrameCapacity = max(m_FrameCapacity, size_t(Protocol::SliceHeaderSize + Slice.DataSize));
+            m_Pool.SetCapacity(m_FrameCapacity);
+            Request.Slice = 0;
+            retry++;
+            continue;
+        }
+
+        if (Request.Slice == 0)
+        {
+            size_t HeaderSize = Protocol::GetHeaderSize(0);
+            size_t Required = HeaderSize + size_t(Slice.Pitch) * Slice.Height;
+            m_FrameCapacity = max(m_FrameCapacity, Required);
+            if (!ReserveFrame(m_FrameCapacity))
+            {
+                return false;
+            }
+
+            Protocol::FrameDescriptor Descriptor = {};
+            Descriptor.Magic = Protocol::FrameDescriptorMagic;
+            Descriptor.Version = Protocol::Version;
+            Descriptor.HeaderSize = UINT16(HeaderSize);
+            Descriptor.Format = Slice.Format;
+            Descriptor.Width = Slice.Width;
+            Descriptor.Height = Slice.Height;
+            Descriptor.Pitch = Slice.Pitch;
+            Descriptor.Sequence = Slice.Sequence;
+            Descriptor.Timestamp = Slice.Timestamp;
+            Descriptor.DataSize = UINT64(Slice.Pitch) * Slice.Height;
+            Descriptor.Flags = Protocol::FrameFullDamage;
+            Descriptor.ColorSpace = Slice.ColorSpace;
+            memcpy(m_Monitor.Buffer->GetData(), &Descriptor, sizeof(Descriptor));
+            Protocol::PackHeader(m_Monitor.Buffer->GetData(), nullptr);
+            m_Monitor.Length = Required;
+            m_Monitor.Parse();
+            Sequence = Slice.Sequence;
+        }
+
+        const Protocol::FrameDescriptor& Descriptor = m_Monitor.GetDescriptor();
+        if (Slice.Sequence != Sequence || Slice.Pitch != Descriptor.Pitch || Slice.Top + Slice.Rows > Descriptor.Height)
+        {
+            printf("Malformed slice response.\n");
+            m_Monitor.Length = 0;
+            return false;
+        }
+        if (Slice.Rows != 0)
+        {
+            memcpy(m_Monitor.Buffer->GetData() + Descriptor.HeaderSize + size_t(Slice.Top) * Slice.Pitch,
+                m_SliceBuffer->GetData() + Protocol::SliceHeaderSize, size_t(Slice.DataSize));
+            if (m_SliceHook)
+            {
+                m_SliceHook(m_Monitor, Slice.Top, Slice.Rows);
+            }
+        }
+        Request.Slice++;
+    }
+
+    if (Request.Slice < m_SliceCount)
+    {
+        printf("Frames keep moving on before their slices are in.\n");
+        m_Monitor.Length = 0;
+        return false;
+    }
+    m_LastSequence = Sequence;
+    return true;
+}
+
+void Ioctl::RequestQuality(Protocol::PixelFormat Format, uint32_t Downscale)
+{
+    if (Format != m_Format || Downscale != m_Downscale)
+    {
+        // The frame we hold no longer matches, so the next one must not be skipped or patched with damage
+        m_Format = Format;
+        m_Downscale = Downscale;
+        m_LastSequence = 0;
+    }
+}
+
+bool Ioctl::ControlTrace(Protocol::TraceCommand Command, string* Events)
+{
+    Protocol::TraceRequest Request = {};
+    Request.Size = sizeof(Request);
+    Request.Version = Protocol::Version;
+    Request.Command = UINT32(Command);
+
+    // The driver keeps recording while we read, so size the buffer from its last answer plus some slack
+    vector<char> Buffer(sizeof(Protocol::TraceResponse));
+    for (int retry = 0; retry < 3; retry++)
+    {
+        DWORD Returned;
+        if (!DeviceIoControl(m_hDevice.Get(), IOCTL_Custom_Trace, &Request, sizeof(Request),
+            Buffer.data(), DWORD(Buffer.size()), &Returned, nullptr) || Returned < sizeof(Protocol::TraceResponse))
+        {
+            printf("Trace command %u failed: %#lx\n", Request.Command, GetLastError());
+            return false;
+        }
+
+        Protocol::TraceResponse Response;
+        memcpy(&Response, Buffer.data(), sizeof(Response));
+        if (Command != Protocol::TraceCommand::Read)
+        {
+            return true;
+        }
+        if (Returned >= sizeof(Response) + Response.DataSize)
+        {
+            if (Events)
+            {
+                Events->assign(Buffer.data() + sizeof(Response), size_t(Response.DataSize));
+            }
+            return true;
+        }
+
+        Buffer.resize(sizeof(Response) + size_t(Response.DataSize) + Response.DataSize / 4);
+    }
+
+    printf("Trace keeps outgrowing the buffer.\n");
+    return false;
+}
+
+bool Ioctl::GetStatistics(Protocol::PipelineStatistics& Statistics)
+{
+    DWORD Returned;
+    if (!DeviceIoControl(m_hDevice.Get(), IOCTL_Custom_GetStatistics, nullptr, 0, &Statistics, sizeof(Statistics),
+        &Returned, nullptr) || Returned < sizeof(Statistics))
+    {
+        printf("Statistics request failed: %#lx\n", GetLastError());
+        return false;
+    }
+    return Statistics.Version == Protocol::Version;
 }
\ No newline at end of file
@@ -0,0 +1,114 @@
+#include "Quality.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+    constexpr double Smoothing = 1.0 / 8;  // Weight of a new sample, about the last eight frames count
+}
+
+namespace PartialDisplay::Quality
+{
+    Controller::Controller(const ControllerConfig& Config) : m_Config(Config), m_StepUpAfter(Config.StepUpAfter)
+    {
+        // Each level keeps the savings of the one before; dropping the rate comes last as it costs smoothness
+        const uint64_t HalfRate = Config.FrameBudget * 2;
+        m_Levels.push_back({ "full", Protocol::PixelFormat::BGRA8, 0, 0, 1.0 });
+        if (Config.AllowReducedFormat)
+        {
+            m_Levels.push_back({ "reduced format", Protocol::PixelFormat::B5G6R5, 0, 0, 0.5 });
+            m_Levels.push_back({ "downscaled", Protocol::PixelFormat::B5G6R5, 1, 0, 0.125 });
+            m_Levels.push_back({ "reduced rate", Protocol::PixelFormat::B5G6R5, 1, HalfRate, 0.125 });
+        }
+        else
+        {
+            m_Levels.push_back({ "downscaled", Protocol::PixelFormat::BGRA8, 1, 0, 0.25 });
+            m_Levels.push_back({ "reduced rate", Protocol::PixelFormat::BGRA8, 1, HalfRate, 0.25 });
+        }
+    }
+
+    bool Controller::OnFrame(uint64_t Now, uint64_t Busy, uint64_t Skipped)
+    {
+        const Level& Current = m_Levels[m_Current];
+        double Budget = GetBudget(Current);
+        double Load = double(Busy) / Budget;
+
+        // A level fetching every other refresh skips a frame each time by design
+        double Expected = Budget / double(m_Config.FrameBudget) - 1;
+        double Backlog = max(0.0, double(Skipped) - Expected);
+
+        if (!m_Primed)
+        {
+            m_Primed = true;
+            m_Load = Load;
+            m_Backlog = Backlog;
+            m_CalmSince = m_CrowdedSince = m_LastChange = Now;
+        }
+        else
+        {
+            m_Load += (Load - m_Load) * Smoothing;
+            m_Backlog += (Backlog - m_Backlog) * Smoothing;
+        }
+
+        // A step up that held for as long as it was made to wait earns back some patience
+        if (m_StepUpPending && Now - m_LastChange >= m_StepUpAfter)
+        {
+            m_StepUpPending = false;
+            m_StepUpAfter = max(m_Config.StepUpAfter, m_StepUpAfter / 2);
+        }
+
+        bool Pressure = m_Load > m_Config.StepDownLoad || m_Backlog > m_Config.BacklogLimit;
+        bool Headroom = !Pressure && m_Current > 0 && m_Backlog <= m_Config.BacklogLimit / 2
+            && PredictLoad(m_Current - 1) < m_Config.StepUpLoad;
+        if (!Pressure)
+        {
+            m_CalmSince = Now;
+        }
+        if (!Headroom)
+        {
+            m_CrowdedSince = Now;
+        }
+
+        if (Pressure && Now - m_CalmSince >= m_Config.StepDownAfter && m_Current + 1 < m_Levels.size())
+        {
+            if (m_StepUpPending)
+            {
+                m_StepUpPending = false;
+                m_StepUpAfter = min(m_StepUpAfter * 2, m_Config.MaxStepUpAfter);
+            }
+            ChangeLevel(m_Current + 1, Now);
+            return true;
+        }
+        if (Headroom && Now - m_CrowdedSince >= m_StepUpAfter)
+        {
+            ChangeLevel(m_Current - 1, Now);
+            m_StepUpPending = true;
+            return true;
+        }
+        return false;
+    }
+
+    double Controller::GetBudget(const Level& Target) const
+    {
+        return double(max(m_Config.FrameBudget, Target.FrameInterval));
+    }
+
+    double Controller::PredictLoad(size_t Target) const
+    {
+        // Fetching scales with the bytes moved, and the budget grows with the interval between fetches
+        const Level& Current = m_Levels[m_Current];
+        const Level& Next = m_Levels[Target];
+        return m_Load * (Next.Cost / Current.Cost) * (GetBudget(Current) / GetBudget(Next));
+    }
+
+    void Controller::ChangeLevel(size_t Target, uint64_t Now)
+    {
+        // Start the new level from what it is predicted to cost rather than what the old one did
+        m_Load = PredictLoad(Target);
+        m_Backlog = 0;
+        m_Current = Target;
+        m_LastChange = m_CalmSince = m_CrowdedSince = Now;
+    }
+}
\ No newline at end of file
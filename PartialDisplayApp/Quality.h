@@ -0,0 +1,75 @@
+#pragma once
+
+// Adaptive quality. When fetching frames eats most of the display interval, or the driver produces frames faster
+// than they are consumed, the controller steps down a ladder of cheaper levels, and steps back up once the level
+// above is predicted to fit comfortably. Times are passed in by the caller, so the controller runs the same under a
+// real clock and a simulated one, and it avoids Windows headers so it can be exercised off-target.
+
+#include <cstdint>
+#include <vector>
+
+#include "../Common/Protocol.h"
+
+namespace PartialDisplay::Quality
+{
+    struct Level
+    {
+        const char* Name;
+        Protocol::PixelFormat Format;
+        uint32_t Downscale;      // Log2 of the factor frames are shrunk by
+        uint64_t FrameInterval;  // Minimum ns between fetches, 0 to take every frame the display can show
+        double Cost;             // Bytes per frame relative to the full level
+    };
+
+    struct ControllerConfig
+    {
+        uint64_t FrameBudget = 16'666'667;        // ns one frame may take, the display refresh interval
+        double StepDownLoad = 0.85;               // Fraction of the budget above which the pipeline is under pressure
+        double StepUpLoad = 0.6;                  // Fraction the level above must be predicted to stay under
+        double BacklogLimit = 1.5;                // Frames skipped per frame consumed that count as pressure
+        uint64_t StepDownAfter = 250'000'000;     // ns pressure has to last before stepping down
+        uint64_t StepUpAfter = 2'000'000'000;     // ns headroom has to last before stepping up
+        uint64_t MaxStepUpAfter = 60'000'000'000; // Cap for StepUpAfter, which doubles every time a step up fails
+        bool AllowReducedFormat = true;           // Off when a later stage needs 32-bit pixels
+    };
+
+    /// <summary>
+    /// Picks the quality level from per-frame timing and backlog. Pressure and headroom both have to persist before
+    /// the level changes, the thresholds leave a dead band between them, and a step up that is soon undone makes
+    /// the next one wait twice as long, so a pipeline sitting on a boundary doesn't oscillate.
+    /// </summary>
+    class Controller
+    {
+    public:
+        explicit Controller(const ControllerConfig& Config = {});
+
+        /// <summary>
+        /// Reports a consumed frame. Now is a monotonic time in ns, Busy the ns spent fetching the frame and Skipped
+        /// how many frames the producer made since the previous one that were never consumed. Returns true when the
+        /// level changed.
+        /// </summary>
+        bool OnFrame(uint64_t Now, uint64_t Busy, uint64_t Skipped);
+
+        const Level& GetLevel() const { return m_Levels[m_Current]; }
+        size_t GetLevelIndex() const { return m_Current; }
+        size_t GetLevelCount() const { return m_Levels.size(); }
+        uint64_t GetStepUpAfter() const { return m_StepUpAfter; }
+
+    private:
+        ControllerConfig m_Config;
+        std::vector<Level> m_Levels;
+        size_t m_Current = 0;
+        bool m_Primed = false;
+        double m_Load = 0;      // Smoothed fraction of the current level's budget spent fetching
+        double m_Backlog = 0;   // Smoothed frames skipped beyond what the level's interval skips on purpose
+        uint64_t m_CalmSince = 0;       // Last time there was no pressure
+        uint64_t m_CrowdedSince = 0;    // Last time there was no headroom
+        uint64_t m_LastChange = 0;
+        uint64_t m_StepUpAfter;
+        bool m_StepUpPending = false;   // The last change was a step up that hasn't proven itself yet
+
+        double GetBudget(const Level& Target) const;
+        double PredictLoad(size_t Target) const;
+        void ChangeLevel(size_t Target, uint64_t Now);
+    };
+}
\ No newline at end of file
@@ -0,0 +1,95 @@
+#include "Readiness.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace PartialDisplay::Readiness
+{
+    uint64_t Backoff::Next()
+    {
+        uint64_t Delay = m_Delay;
+        m_Delay = min(m_Delay * 2, m_Config.Max);
+        return Delay;
+    }
+
+    Tracker::Tracker(const TrackerConfig& Config, uint64_t Now)
+        : m_Config(Config), m_Backoff(Config.Retry), m_Deadline(Now + Config.Timeout)
+    {
+    }
+
+    Step Tracker::Next(uint64_t Now)
+    {
+        if (m_State == Action::Ready || m_State == Action::Fail)
+        {
+            return { m_State, 0 };
+        }
+        if (Now >= m_Deadline)
+        {
+            m_State = Action::Fail;
+            return { m_State, 0 };
+        }
+        if (m_State == Action::Wait && Now >= m_Until)
+        {
+            m_State = Action::Open;
+        }
+        return { m_State, m_Until };
+    }
+
+    void Tracker::OnOpened(uint64_t Now, bool Succeeded)
+    {
+        m_Attempts++;
+        if (Succeeded)
+        {
+            m_State = Action::Ready;
+        }
+        else if (m_Attempts == 1 && !m_Created)
+        {
+            // Nothing left over from an earlier run to reattach to
+            m_State = Action::Create;
+        }
+        else
+        {
+            Retry(Now);
+        }
+    }
+
+    void Tracker::OnCreated(uint64_t Now, bool Succeeded)
+    {
+        if (!Succeeded)
+        {
+            m_State = Action::Fail;
+            return;
+        }
+
+        // The interface arrives once the driver has started the device, until then there is nothing to open
+        m_Created = true;
+        if (m_Arrived)
+        {
+            m_State = Action::Open;
+        }
+        else
+        {
+            Retry(Now);
+        }
+    }
+
+    void Tracker::OnArrival()
+    {
+        // The interface may well show up before creation returns, that arrival counts once it does
+        if (m_State == Action::Wait)
+        {
+            m_State = Action::Open;
+        }
+        else if (m_State == Action::Create)
+        {
+            m_Arrived = true;
+        }
+    }
+
+    void Tracker::Retry(uint64_t Now)
+    {
+        m_State = Action::Wait;
+        m_Until = min(Now + m_Backoff.Next(), m_Deadline);
+    }
+}
\ No newline at end of file
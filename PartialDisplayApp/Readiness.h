@@ -0,0 +1,93 @@
+#pragma once
+
+// Device readiness. Rather than sleeping for however long the driver usually takes to come up, the app reattaches to
+// a device that is already there, creates one only when there is none, and otherwise waits for the driver's device
+// interface to arrive. Polling with a growing delay stays as the fallback in case a notification is missed. Like the
+// quality controller, times are passed in by the caller and no Windows headers are used, so it runs off-target under
+// a simulated clock.
+
+#include <cstdint>
+
+namespace PartialDisplay::Readiness
+{
+    struct BackoffConfig
+    {
+        uint64_t Initial = 5'000'000;     // ns before the first retry
+        uint64_t Max = 1'000'000'000;     // ns the delay stops growing at
+    };
+
+    /// <summary>
+    /// Retry delays that double from Initial up to Max, and start over once an attempt succeeds.
+    /// </summary>
+    class Backoff
+    {
+    public:
+        explicit Backoff(const BackoffConfig& Config = {}) : m_Config(Config), m_Delay(Config.Initial) {}
+
+        /// <summary>
+        /// Returns the delay to wait before the next attempt and doubles the one after.
+        /// </summary>
+        uint64_t Next();
+
+        void Reset() { m_Delay = m_Config.Initial; }
+
+    private:
+        BackoffConfig m_Config;
+        uint64_t m_Delay;
+    };
+
+    enum class Action
+    {
+        Open,    // Try to open the device interface
+        Create,  // No device to open, create it
+        Wait,    // Wait for the interface to arrive, or until the step's deadline
+        Ready,   // The device is open
+        Fail,    // Gave up
+    };
+
+    struct Step
+    {
+        Action What;
+        uint64_t Until;  // For Wait, when to try again if nothing arrives
+    };
+
+    struct TrackerConfig
+    {
+        BackoffConfig Retry;
+        uint64_t Timeout = 20'000'000'000;  // ns from the start after which the device counts as not coming
+    };
+
+    /// <summary>
+    /// Decides what to do next while bringing up the device. The caller runs each step it is given and reports the
+    /// outcome, and reports device interface arrivals whenever they are notified.
+    /// </summary>
+    class Tracker
+    {
+    public:
+        Tracker(const TrackerConfig& Config, uint64_t Now);
+
+        Step Next(uint64_t Now);
+
+        void OnOpened(uint64_t Now, bool Succeeded);
+        void OnCreated(uint64_t Now, bool Succeeded);
+        void OnArrival();
+
+        /// <summary>
+        /// Whether the device was found already there rather than created.
+        /// </summary>
+        bool IsReattached() const { return m_State == Action::Ready && !m_Created; }
+        uint32_t GetAttempts() const { return m_Attempts; }
+
+    private:
+        TrackerConfig m_Config;
+        Backoff m_Backoff;
+        Action m_State = Action::Open;
+        uint64_t m_Deadline;
+        uint64_t m_Until = 0;
+        uint32_t m_Attempts = 0;
+        bool m_Created = false;
+        bool m_Arrived = false;
+
+        void Retry(uint64_t Now);
+    };
+}
\ No newline at end of file
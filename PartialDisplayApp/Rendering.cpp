@@ -7,16 +7,55 @@ using namespace PartialDisplay;
 
 Rendering::~Rendering()
 {
-    if (m_SwapChain != nullptr)
+    for (auto& View : m_Viewports)
     {
-        m_SwapChain->SetFullscreenState(false, nullptr);
+        View->SwapChain->SetFullscreenState(false, nullptr);
     }
 }
 
-HRESULT Rendering::InitD3D(HWND hWnd, UINT WindowWidth, UINT WindowHeight)
+HRESULT Rendering::InitD3D()
 {
     HRESULT hr;
 
+    // create a device and device context, swap chains are added per viewport
+    hr = D3D11CreateDevice(NULL,
+        D3D_DRIVER_TYPE_HARDWARE,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        D3D11_SDK_VERSION,
+        &m_Device,
+        NULL,
+        &m_DeviceContext);
+    if (FAILED(hr)) { return hr; }
+
+    // swap chains must come from the factory that created the device
+    ComPtr<IDXGIDevice> DxgiDevice;
+    ComPtr<IDXGIAdapter> Adapter;
+    hr = m_Device.As(&DxgiDevice);
+    if (FAILED(hr)) { return hr; }
+    hr = DxgiDevice->GetAdapter(&Adapter);
+    if (FAILED(hr)) { return hr; }
+    hr = Adapter->GetParent(__uuidof(IDXGIFactory), &m_Factory);
+    if (FAILED(hr)) { return hr; }
+
+    hr = InitPipeline();
+    if (FAILED(hr)) { return hr; }
+    return InitGraphics();
+}
+
+HRESULT Rendering::AddViewport(HWND hWnd, UINT WindowWidth, UINT WindowHeight, const Layout::SourceRect& Source)
+{
+    HRESULT hr;
+
+    auto View = make_unique<Viewport>();
+    View->hWnd = hWnd;
+    View->Requested = Source;
+    View->WindowWidth = WindowWidth;
+    View->WindowHeight = WindowHeight;
+    View->PendingSize = UINT64(WindowWidth) << 32 | WindowHeight;
+
     // create a struct to hold information about the swap chain
     DXGI_SWAP_CHAIN_DESC scd = {};
 
@@ -31,27 +70,30 @@ HRESULT Rendering::InitD3D(HWND hWnd, UINT WindowWidth, UINT WindowHeight)
     scd.Windowed = TRUE;                                   // windowed/full-screen mode
     scd.Flags = DXGI_SWAP_CHAIN_FLAG_ALLOW_MODE_SWITCH;    // allow full-screen switching
 
-    // create a device, device context and swap chain using the information in the scd struct
-    hr = D3D11CreateDeviceAndSwapChain(NULL,
-        D3D_DRIVER_TYPE_HARDWARE,
-        NULL,
-        NULL,
-        NULL,
-        NULL,
-        D3D11_SDK_VERSION,
-        &scd,
-        &m_SwapChain,
-        &m_Device,
-        NULL,
-        &m_DeviceContext);
+    hr = m_Factory->CreateSwapChain(m_Device.Get(), &scd, &View->SwapChain);
     if (FAILED(hr)) { return hr; }
 
-    hr = InitPipeline();
-    if (FAILED(hr)) { return hr; }
-    hr = InitGraphics();
+    D3D11_BUFFER_DESC bd = {};
+    bd.Usage = D3D11_USAGE_DEFAULT;
+    bd.ByteWidth = sizeof(Layout::ViewportConstants);
+    bd.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+    hr = m_Device->CreateBuffer(&bd, nullptr, &View->ConfigBuffer);
     if (FAILED(hr)) { return hr; }
-    hr = UpdateConfig(0, 0, WindowWidth, WindowHeight);
-    return hr;
+
+    m_Viewports.push_back(move(View));
+    return S_OK;
+}
+
+HRESULT Rendering::OnSize(HWND hWnd, UINT WindowWidth, UINT WindowHeight)
+{
+    for (auto& View : m_Viewports)
+    {
+        if (View->hWnd == hWnd)
+        {
+            View->PendingSize = UINT64(WindowWidth) << 32 | WindowHeight;
+        }
+    }
+    return S_OK;
 }
 
 HRESULT Rendering::InitPipeline()
@@ -133,145 +175,272 @@ HRESULT Rendering::InitGraphics()
     return S_OK;
 }
 
-HRESULT Rendering::UpdateConfig(UINT ScreenWidth, UINT ScreenHeight, UINT WindowWidth, UINT WindowHeight)
+HRESULT Rendering::UpdateConfig(Viewport& View)
 {
-    struct DisplayConfig
-    {
-        float XOffset;
-        float YOffset;
-        float XScale;
-        float YScale;
-    };
-
     HRESULT hr;
 
-    if (m_ConfigBuffer == nullptr)
-    {
-        D3D11_BUFFER_DESC bd = {};
-        bd.Usage = D3D11_USAGE_DEFAULT;
-        bd.ByteWidth = sizeof(DisplayConfig);
-        bd.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-        hr = m_Device->CreateBuffer(&bd, nullptr, &m_ConfigBuffer);
-        if (FAILED(hr)) { return hr; }
-        m_DeviceContext->VSSetConstantBuffers(0, 1, m_ConfigBuffer.GetAddressOf());
-    }
-
-    if (!m_PreviousConfig.LoadOrUpdate(ScreenWidth, ScreenHeight, WindowWidth, WindowHeight))
+    View.ConfigChanged = false;
+    View.Dirty = true;
+    View.Visible = Layout::ResolveSource(View.Requested, m_FrameWidth, m_FrameHeight, View.Source)
+        && View.WindowWidth != 0 && View.WindowHeight != 0;
+    if (!View.Visible)
     {
         return S_OK;
     }
 
-    DisplayConfig config;
-    float ScreenRatio = float(ScreenWidth) / ScreenHeight;
-    float WindowRatio = float(WindowWidth) / WindowHeight;
-    if (ScreenRatio < WindowRatio)
-    {
-        config.XOffset = 1 - ScreenRatio / WindowRatio;
-        config.YOffset = 0;
-        config.XScale = ScreenRatio / WindowRatio;
-        config.YScale = 1;
-    }
-    else
-    {
-        config.XOffset = 0;
-        config.YOffset = 0;
-        config.XScale = 1;
-        config.YScale = WindowRatio / ScreenRatio;
-    }
-    m_DeviceContext->UpdateSubresource(m_ConfigBuffer.Get(), 0, nullptr, &config, 0, 0);
+    Layout::ViewportConstants config = Layout::GetViewportConstants(
+        View.Source, m_FrameWidth, m_FrameHeight, View.WindowWidth, View.WindowHeight);
+    m_DeviceContext->UpdateSubresource(View.ConfigBuffer.Get(), 0, nullptr, &config, 0, 0);
 
-    m_RenderTarget.Reset();
-    hr = m_SwapChain->ResizeBuffers(
-        2, WindowWidth, WindowHeight, DXGI_FORMAT_UNKNOWN, DXGI_SWAP_CHAIN_FLAG_ALLOW_MODE_SWITCH);
+    View.RenderTarget.Reset();
+    hr = View.SwapChain->ResizeBuffers(
+        2, View.WindowWidth, View.WindowHeight, DXGI_FORMAT_UNKNOWN, DXGI_SWAP_CHAIN_FLAG_ALLOW_MODE_SWITCH);
     if (FAILED(hr)) { return hr; }
 
     // get the address of the back buffer
     ComPtr<ID3D11Texture2D> BackBuffer;
-    hr = m_SwapChain->GetBuffer(0, __uuidof(ID3D11Texture2D), &BackBuffer);
+    hr = View.SwapChain->GetBuffer(0, __uuidof(ID3D11Texture2D), &BackBuffer);
     if (FAILED(hr)) { return hr; }
     // use the back buffer address to create the render target
-    hr = m_Device->CreateRenderTargetView(BackBuffer.Get(), nullptr, &m_RenderTarget);
-    if (FAILED(hr)) { return hr; }
+    return m_Device->CreateRenderTargetView(BackBuffer.Get(), nullptr, &View.RenderTarget);
+}
+
+HRESULT Rendering::Draw(Viewport& View, UINT SyncInterval)
+{
     // set the render target as the back buffer
-    m_DeviceContext->OMSetRenderTargets(1, m_RenderTarget.GetAddressOf(), nullptr);
+    m_DeviceContext->OMSetRenderTargets(1, View.RenderTarget.GetAddressOf(), nullptr);
+    m_DeviceContext->VSSetConstantBuffers(0, 1, View.ConfigBuffer.GetAddressOf());
 
     D3D11_VIEWPORT viewport = {};
     viewport.TopLeftX = 0;
     viewport.TopLeftY = 0;
-    viewport.Width = (FLOAT)WindowWidth;
-    viewport.Height = (FLOAT)WindowHeight;
+    viewport.Width = (FLOAT)View.WindowWidth;
+    viewport.Height = (FLOAT)View.WindowHeight;
     m_DeviceContext->RSSetViewports(1, &viewport);
+
+    float color[] = { 0, 0, 0, 1 };
+    m_DeviceContext->ClearRenderTargetView(View.RenderTarget.Get(), color);
+    m_DeviceContext->Draw(4, 0);
+
+    PD_TRACE_SPAN("Present");
+    HRESULT hr = View.SwapChain->Present(SyncInterval, 0);
+
+    // nothing was shown, so it is drawn again once it can be seen
+    View.Occluded = hr == DXGI_STATUS_OCCLUDED;
+    View.Dirty = View.Occluded;
+    return hr;
+}
+
+HRESULT Rendering::UpdateViewports()
+{
+    // occluded viewports aren't drawn, only tested until they can be seen again
+    for (auto& View : m_Viewports)
+    {
+        UINT64 Size = View->PendingSize;
+        if (UINT(Size >> 32) != View->WindowWidth || UINT(Size) != View->WindowHeight)
+        {
+            View->WindowWidth = UINT(Size >> 32);
+            View->WindowHeight = UINT(Size);
+            View->ConfigChanged = true;
+        }
+        if (View->ConfigChanged)
+        {
+            HRESULT hr = UpdateConfig(*View);
+            if (FAILED(hr)) { return hr; }
+        }
+        if (View->Visible && View->Occluded)
+        {
+            View->Occluded = View->SwapChain->Present(0, DXGI_PRESENT_TEST) == DXGI_STATUS_OCCLUDED;
+        }
+    }
     return S_OK;
 }
 
-HRESULT Rendering::UpdateFrame(UINT ScreenWidth, UINT ScreenHeight, UINT pitch, const void* data)
+bool Rendering::IsHidden() const
+{
+    // minimized windows are sized to nothing, which leaves their viewports invisible
+    for (auto& View : m_Viewports)
+    {
+        if (View->Visible && !View->Occluded)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+HRESULT Rendering::TestPresent()
+{
+    HRESULT hr = UpdateViewports();
+    if (FAILED(hr)) { return hr; }
+    return IsHidden() ? DXGI_STATUS_OCCLUDED : S_OK;
+}
+
+HRESULT Rendering::PrepareTexture(UINT Width, UINT Height, Protocol::PixelFormat Format, D3D11_USAGE Usage)
 {
     HRESULT hr;
+    DXGI_FORMAT TextureFormat = Format == Protocol::PixelFormat::B5G6R5
+        ? DXGI_FORMAT_B5G6R5_UNORM : DXGI_FORMAT_B8G8R8A8_UNORM;
 
     // check if the buffer can be reused
-    if (ScreenWidth != m_PreviousConfig.m_ScreenWidth || ScreenHeight != m_PreviousConfig.m_ScreenHeight)
+    if (Width == m_TextureWidth && Height == m_TextureHeight && TextureFormat == m_TextureFormat
+        && Usage == m_TextureUsage && m_TextureBuffer)
     {
-        // create texture buffer
-        D3D11_TEXTURE2D_DESC td;
-        td.Width = ScreenWidth;
-        td.Height = ScreenHeight;
-        td.MipLevels = 1;
-        td.ArraySize = 1;
-        td.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
-        td.SampleDesc.Count = 1;
-        td.SampleDesc.Quality = 0;
-        td.Usage = D3D11_USAGE_DYNAMIC;
-        td.BindFlags = D3D11_BIND_SHADER_RESOURCE;
-        td.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
-        td.MiscFlags = 0;
-        hr = m_Device->CreateTexture2D(&td, nullptr, &m_TextureBuffer);
-        if (FAILED(hr)) { return hr; }
+        return S_OK;
+    }
 
-        // create and select texture view
-        ComPtr<ID3D11ShaderResourceView> TextureView;
-        D3D11_SHADER_RESOURCE_VIEW_DESC srv = {};
-        srv.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
-        srv.ViewDimension = D3D_SRV_DIMENSION_TEXTURE2D;
-        srv.Texture2D.MostDetailedMip = 0;
-        srv.Texture2D.MipLevels = 1;
-        hr = m_Device->CreateShaderResourceView(m_TextureBuffer.Get(), &srv, &TextureView);
-        if (FAILED(hr)) { return hr; }
-        m_DeviceContext->PSSetShaderResources(0, 1, TextureView.GetAddressOf());
+    // create texture buffer
+    D3D11_TEXTURE2D_DESC td;
+    td.Width = Width;
+    td.Height = Height;
+    td.MipLevels = 1;
+    td.ArraySize = 1;
+    td.Format = TextureFormat;
+    td.SampleDesc.Count = 1;
+    td.SampleDesc.Quality = 0;
+    td.Usage = Usage;
+    td.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+    td.CPUAccessFlags = Usage == D3D11_USAGE_DYNAMIC ? D3D11_CPU_ACCESS_WRITE : 0;
+    td.MiscFlags = 0;
+    hr = m_Device->CreateTexture2D(&td, nullptr, &m_TextureBuffer);
+    if (FAILED(hr)) { return hr; }
 
-        // update display config
-        UpdateConfig(ScreenWidth, ScreenHeight, 0, 0);
-    }
+    // create and select texture view
+    ComPtr<ID3D11ShaderResourceView> TextureView;
+    D3D11_SHADER_RESOURCE_VIEW_DESC srv = {};
+    srv.Format = TextureFormat;
+    srv.ViewDimension = D3D_SRV_DIMENSION_TEXTURE2D;
+    srv.Texture2D.MostDetailedMip = 0;
+    srv.Texture2D.MipLevels = 1;
+    hr = m_Device->CreateShaderResourceView(m_TextureBuffer.Get(), &srv, &TextureView);
+    if (FAILED(hr)) { return hr; }
+    m_DeviceContext->PSSetShaderResources(0, 1, TextureView.GetAddressOf());
+    m_TextureWidth = Width;
+    m_TextureHeight = Height;
+    m_TextureFormat = TextureFormat;
+    m_TextureUsage = Usage;
+    m_SlicedRows = 0;
+    return S_OK;
+}
 
-    D3D11_MAPPED_SUBRESOURCE ms;
-    hr = m_DeviceContext->Map(m_TextureBuffer.Get(), 0, D3D11_MAP_WRITE_DISCARD, 0, &ms);
+HRESULT Rendering::UploadSlice(const MonitorData& Monitor, UINT Top, UINT Rows)
+{
+    PD_TRACE_SPAN("UploadSlice");
+
+    // a texture that can't be mapped takes rows anywhere in it, and the frame goes on in the same one
+    HRESULT hr = PrepareTexture(Monitor.GetWidth(), Monitor.GetHeight(),
+        Protocol::PixelFormat(Monitor.GetDescriptor().Format), D3D11_USAGE_DEFAULT);
     if (FAILED(hr)) { return hr; }
-    memcpy(ms.pData, data, size_t(pitch) * ScreenHeight);
-    m_DeviceContext->Unmap(m_TextureBuffer.Get(), 0);
 
-    float color[] = { 0, 0, 0, 1 };
-    m_DeviceContext->ClearRenderTargetView(m_RenderTarget.Get(), color);
-    m_DeviceContext->Draw(4, 0);
-    hr = m_SwapChain->Present(1, 0);
-    return hr;
+    if (Monitor.GetDescriptor().Sequence != m_SlicedSequence)
+    {
+        m_SlicedSequence = Monitor.GetDescriptor().Sequence;
+        m_SlicedRows = 0;
+    }
+    D3D11_BOX Box = { 0, Top, 0, Monitor.GetWidth(), Top + Rows, 1 };
+    m_DeviceContext->UpdateSubresource(m_TextureBuffer.Get(), 0, &Box,
+        Monitor.GetData() + size_t(Top) * Monitor.GetPitch(), Monitor.GetPitch(), 0);
+    m_SlicedRows += Rows;
+    return S_OK;
 }
 
-bool Rendering::PreviousConfig::LoadOrUpdate(UINT& rScreenWidth, UINT& rScreenHeight, UINT& rWindowWidth, UINT& rWindowHeight)
+HRESULT Rendering::UpdateFrame(const MonitorData& Monitor)
 {
-    bool updated = false;
-#define UpdateSingle(v)  \
-    do {                                       \
-        if (r##v == 0 && m_##v != 0)           \
-            r##v = m_##v;                      \
-        else if (r##v != m_##v)                \
-            m_##v = r##v, updated = true;      \
-        else if (m_##v == 0)                   \
-            m_##v = r##v = 1, updated = true;  \
-    } while (false)
-
-    UpdateSingle(ScreenWidth);
-    UpdateSingle(ScreenHeight);
-    UpdateSingle(WindowWidth);
-    UpdateSingle(WindowHeight);
-#undef UpdateSingle
-    return updated;
+    PD_TRACE_SPAN("UpdateFrame");
+
+    UINT TextureWidth = Monitor.GetWidth();
+    UINT TextureHeight = Monitor.GetHeight();
+    Protocol::PixelFormat Format = Protocol::PixelFormat(Monitor.GetDescriptor().Format);
+
+    // whole frames keep to the texture slices left behind rather than creating one back and forth
+    HRESULT hr = PrepareTexture(TextureWidth, TextureHeight, Format, m_TextureUsage);
+    if (FAILED(hr)) { return hr; }
+
+    // viewports are laid out on the display size, which a downscaled frame only covers once stretched back
+    UINT Downscale = Protocol::GetDownscale(Monitor.GetDescriptor());
+    if ((TextureWidth << Downscale) != m_FrameWidth || (TextureHeight << Downscale) != m_FrameHeight)
+    {
+        // every viewport has to be laid out again
+        m_FrameWidth = TextureWidth << Downscale;
+        m_FrameHeight = TextureHeight << Downscale;
+        for (auto& View : m_Viewports)
+        {
+            View->ConfigChanged = true;
+        }
+    }
+
+    // no data means the frame did not change, present the texture as it is
+    if (Monitor.HasData())
+    {
+        // a frame whose slices all came in is uploaded already
+        bool Uploaded = Monitor.GetDescriptor().Sequence == m_SlicedSequence && m_SlicedRows >= TextureHeight;
+        if (Uploaded)
+        {
+            m_SlicedRows = 0;
+        }
+        else if (m_TextureUsage == D3D11_USAGE_DEFAULT)
+        {
+            m_DeviceContext->UpdateSubresource(m_TextureBuffer.Get(), 0, nullptr, Monitor.GetData(),
+                Monitor.GetPitch(), 0);
+        }
+        else
+        {
+            D3D11_MAPPED_SUBRESOURCE ms;
+            hr = m_DeviceContext->Map(m_TextureBuffer.Get(), 0, D3D11_MAP_WRITE_DISCARD, 0, &ms);
+            if (FAILED(hr)) { return hr; }
+            Kernels::CopyRows(Monitor.GetData(), Monitor.GetPitch(), ms.pData, ms.RowPitch,
+                size_t(TextureWidth) * Protocol::BytesPerPixel(Format), TextureHeight);
+            m_DeviceContext->Unmap(m_TextureBuffer.Get(), 0);
+        }
+
+        for (auto& View : m_Viewports)
+        {
+            View->Dirty |= Layout::IsDamaged(View->Source, Monitor.GetDescriptor(), Monitor.View.Damage);
+        }
+        if (m_PresentHook)
+        {
+            m_PresentHook();
+        }
+    }
+
+    hr = UpdateViewports();
+    if (FAILED(hr)) { return hr; }
+
+    Viewport* Last = nullptr;
+    for (auto& View : m_Viewports)
+    {
+        if (View->Visible && !View->Occluded && View->Dirty)
+        {
+            Last = View.get();
+        }
+    }
+
+    // only the last present waits for vblank, so a frame costs one refresh however many viewports it touched
+    for (auto& View : m_Viewports)
+    {
+        if (View->Visible && !View->Occluded && View->Dirty)
+        {
+            hr = Draw(*View, View.get() == Last ? 1 : 0);
+            if (FAILED(hr)) { return hr; }
+        }
+    }
+
+    // an occluded viewport alone leaves the others to present to
+    if (IsHidden())
+    {
+        return DXGI_STATUS_OCCLUDED;
+    }
+    hr = S_OK;
+
+    // keep pacing the loop to the display when no viewport needed a present
+    if (Last == nullptr && !m_Viewports.empty())
+    {
+        if (m_VBlankOutput == nullptr)
+        {
+            hr = m_Viewports.front()->SwapChain->GetContainingOutput(&m_VBlankOutput);
+            if (FAILED(hr)) { return hr; }
+        }
+        hr = m_VBlankOutput->WaitForVBlank();
+    }
+    return hr;
 }
\ No newline at end of file
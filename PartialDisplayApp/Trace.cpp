@@ -0,0 +1,269 @@
+#include "App.h"
+
+using namespace std;
+using namespace PartialDisplay;
+
+// The file is laid out as TraceFile.h describes; the recorder maps it in large steps and appends to the mapping, the
+// replayer maps it whole.
+
+constexpr UINT64 MappingGranularity = 64ull << 20;
+
+static inline UINT64 AlignUp(UINT64 Value, UINT64 Alignment)
+{
+    return (Value + Alignment - 1) / Alignment * Alignment;
+}
+
+#pragma region TraceRecorder
+
+TraceRecorder::~TraceRecorder()
+{
+    Close();
+}
+
+bool TraceRecorder::Open(const wstring& FileName)
+{
+    HANDLE hFile = CreateFile(FileName.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        printf("Can't create trace file: %#lx\n", GetLastError());
+        return false;
+    }
+    m_hFile.Attach(hFile);
+    m_hWakeEvent.Attach(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+
+    if (!Reserve(sizeof(Trace::FileHeader)))
+    {
+        m_hFile.Close();
+        return false;
+    }
+
+    LARGE_INTEGER Frequency;
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&m_Start);
+
+    auto* Header = reinterpret_cast<Trace::FileHeader*>(m_View);
+    Trace::InitHeader(*Header, Frequency.QuadPart);
+    m_Used = Header->DataEnd;
+
+    m_Stopping = false;
+    m_Writer = thread(&TraceRecorder::WriterLoop, this);
+    return true;
+}
+
+void TraceRecorder::Close()
+{
+    if (!m_Writer.joinable())
+    {
+        return;
+    }
+
+    m_Stopping = true;
+    SetEvent(m_hWakeEvent.Get());
+    m_Writer.join();
+
+    // Append the index and publish it in the header
+    UINT64 IndexOffset = m_Used;
+    UINT64 IndexSize = m_Index.size() * sizeof(Trace::IndexEntry);
+    if (Reserve(IndexOffset + IndexSize))
+    {
+        memcpy(m_View + IndexOffset, m_Index.data(), IndexSize);
+        m_Used += IndexSize;
+
+        auto* Header = reinterpret_cast<Trace::FileHeader*>(m_View);
+        Header->FrameCount = m_Index.size();
+        Header->IndexOffset = IndexOffset;
+    }
+
+    Unmap();
+
+    // The mapping grows in large steps, cut the file back to what was actually written
+    LARGE_INTEGER End;
+    End.QuadPart = m_Used;
+    SetFilePointerEx(m_hFile.Get(), End, nullptr, FILE_BEGIN);
+    SetEndOfFile(m_hFile.Get());
+    m_hFile.Close();
+
+    printf("Trace closed: %zu frames, %llu dropped\n", m_Index.size(), m_Dropped.load());
+    m_Index.clear();
+}
+
+void TraceRecorder::Record(const MonitorData& Monitor)
+{
+    if (!m_Writer.joinable() || !Monitor.HasData())
+    {
+        return;
+    }
+
+    // Only this thread advances the head, so a full ring means the writer is behind: drop rather than wait for it.
+    size_t Head = m_Head.load(memory_order_relaxed);
+    if (Head - m_Tail.load(memory_order_acquire) >= SlotCount)
+    {
+        m_Dropped++;
+        return;
+    }
+
+    LARGE_INTEGER Now;
+    QueryPerformanceCounter(&Now);
+
+    Slot& Target = m_Slots[Head % SlotCount];
+    Target.Data.assign(Monitor.Buffer->GetData(), Monitor.Buffer->GetData() + Monitor.Length);
+    Target.Timestamp = Now.QuadPart - m_Start.QuadPart;
+
+    m_Head.store(Head + 1, memory_order_release);
+    SetEvent(m_hWakeEvent.Get());
+}
+
+void TraceRecorder::WriterLoop()
+{
+    for (;;)
+    {
+        size_t Tail = m_Tail.load(memory_order_relaxed);
+        if (Tail == m_Head.load(memory_order_acquire))
+        {
+            if (m_Stopping)
+            {
+                break;
+            }
+            WaitForSingleObject(m_hWakeEvent.Get(), INFINITE);
+            continue;
+        }
+
+        if (!Append(m_Slots[Tail % SlotCount]))
+        {
+            m_Dropped++;
+        }
+        m_Tail.store(Tail + 1, memory_order_release);
+    }
+}
+
+bool TraceRecorder::Append(const Slot& Frame)
+{
+    UINT64 RecordSize = Trace::GetRecordSize(Frame.Data.data(), Frame.Data.size());
+    if (RecordSize == 0 || !Reserve(m_Used + RecordSize))
+    {
+        return false;
+    }
+
+    Trace::WriteRecord(m_View + m_Used, Frame.Data.data(), Frame.Data.size(), Frame.Timestamp);
+    m_Index.push_back({ m_Used, Frame.Timestamp });
+    m_Used += RecordSize;
+    reinterpret_cast<Trace::FileHeader*>(m_View)->DataEnd = m_Used;
+    return true;
+}
+
+bool TraceRecorder::Reserve(UINT64 Required)
+{
+    if (Required <= m_Capacity)
+    {
+        return true;
+    }
+
+    // Mapping a larger section extends the file, so grow in big steps to keep remapping rare
+    UINT64 Capacity = AlignUp(max(Required, m_Capacity * 2), MappingGranularity);
+    Unmap();
+
+    m_hMapping = CreateFileMapping(m_hFile.Get(), nullptr, PAGE_READWRITE,
+        DWORD(Capacity >> 32), DWORD(Capacity), nullptr);
+    if (m_hMapping == nullptr)
+    {
+        printf("Can't map trace file: %#lx\n", GetLastError());
+        return false;
+    }
+
+    m_View = static_cast<char*>(MapViewOfFile(m_hMapping, FILE_MAP_WRITE, 0, 0, 0));
+    if (m_View == nullptr)
+    {
+        printf("Can't map trace file view: %#lx\n", GetLastError());
+        Unmap();
+        return false;
+    }
+
+    m_Capacity = Capacity;
+    return true;
+}
+
+void TraceRecorder::Unmap()
+{
+    if (m_View != nullptr)
+    {
+        UnmapViewOfFile(m_View);
+        m_View = nullptr;
+    }
+    if (m_hMapping != nullptr)
+    {
+        CloseHandle(m_hMapping);
+        m_hMapping = nullptr;
+    }
+    m_Capacity = 0;
+}
+
+#pragma endregion
+
+#pragma region TraceReplayer
+
+bool TraceReplayer::Open(const wstring& FileName, bool MaxSpeed)
+{
+    if (!m_File.Open(FileName))
+    {
+        printf("Can't open trace file: %#lx\n", GetLastError());
+        return false;
+    }
+    if (!m_Reader.Open(m_File.GetData(), m_File.GetSize()))
+    {
+        printf("Not a trace file or unsupported version.\n");
+        return false;
+    }
+    if (m_Reader.GetFrameCount() == 0)
+    {
+        printf("Trace file contains no frames.\n");
+        return false;
+    }
+
+    m_MaxSpeed = MaxSpeed;
+    printf("Replaying %zu frames\n", m_Reader.GetFrameCount());
+    return true;
+}
+
+bool TraceReplayer::RefreshMonitorData()
+{
+    if (m_Next >= m_Reader.GetFrameCount())
+    {
+        m_Next = 0;
+    }
+
+    Trace::Frame Frame;
+    if (!m_Reader.GetFrame(m_Next, Frame))
+    {
+        m_Next++;
+        return false;
+    }
+
+    if (m_Next == 0)
+    {
+        m_FirstTimestamp = Frame.Timestamp;
+        QueryPerformanceCounter(&m_Start);
+    }
+    else if (!m_MaxSpeed)
+    {
+        // Wait until the frame is due relative to the first frame of this pass
+        LARGE_INTEGER Now;
+        QueryPerformanceCounter(&Now);
+        INT64 Due = INT64(Frame.Timestamp - m_FirstTimestamp) - (Now.QuadPart - m_Start.QuadPart);
+        if (Due > 0)
+        {
+            Sleep(DWORD(Due * 1000 / m_Reader.GetFrequency()));
+        }
+    }
+
+    if (!ReserveFrame(Frame.Size))
+    {
+        return false;
+    }
+    memcpy(m_Monitor.Buffer->GetData(), Frame.Response, Frame.Size);
+    m_Monitor.Length = Frame.Size;
+    m_Next++;
+    return m_Monitor.Parse() && m_Monitor.HasData();
+}
+
+#pragma endregion
\ No newline at end of file
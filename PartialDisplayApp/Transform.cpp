@@ -0,0 +1,100 @@
+#include "App.h"
+
+using namespace std;
+using namespace PartialDisplay;
+
+static bool ClampRect(Protocol::DamageRect& Rect, UINT Width, UINT Height)
+{
+    Rect.Left = max(Rect.Left, 0);
+    Rect.Top = max(Rect.Top, 0);
+    Rect.Right = min(Rect.Right, int32_t(Width));
+    Rect.Bottom = min(Rect.Bottom, int32_t(Height));
+    return Rect.Left < Rect.Right && Rect.Top < Rect.Bottom;
+}
+
+MonitorData& FrameTransform::Apply(MonitorData& Monitor)
+{
+    if (m_Transform == Kernels::Orientation::Identity)
+    {
+        return Monitor;
+    }
+    if (!Monitor.HasData())
+    {
+        // Nothing changed, the frame transformed last time is still current
+        return m_Valid ? m_Output : Monitor;
+    }
+
+    // The kernels move whole 32-bit pixels, half-float and 16-bit frames are shown as they are
+    const Protocol::FrameDescriptor& Source = Monitor.GetDescriptor();
+    if (Protocol::BytesPerPixel(Protocol::PixelFormat(Source.Format)) != sizeof(UINT32))
+    {
+        m_Valid = false;
+        return Monitor;
+    }
+
+    bool Swap = Kernels::SwapsAxes(m_Transform);
+    UINT Width = Swap ? Source.Height : Source.Width;
+    UINT Height = Swap ? Source.Width : Source.Height;
+    UINT Pitch = (Width * sizeof(UINT32) + 63) & ~63u;
+
+    // The header is always reserved at its largest so the pixels stay put whatever the damage count
+    size_t Required = Protocol::MaxHeaderSize + size_t(Pitch) * Height;
+    if (!m_Output.Buffer || m_Output.Buffer->GetCapacity() < Required)
+    {
+        m_Valid = false;
+        m_Output.Buffer = make_unique<Memory::FrameBuffer>(Required, false);
+        if (!m_Output.Buffer->IsValid())
+        {
+            m_Output.Buffer.reset();
+            return Monitor;
+        }
+    }
+
+    // Damage is relative to the previous frame we were given; a sequence going backwards means a replay restarted
+    bool Incremental = m_Valid && Monitor.View.Damage != nullptr && !(Source.Flags & Protocol::FrameFullDamage)
+        && Source.Sequence > m_Sequence && m_Output.GetWidth() == Width && m_Output.GetHeight() == Height
+        && m_Output.GetDescriptor().Format == Source.Format;
+
+    char* Base = m_Output.Buffer->GetData();
+    auto* Descriptor = reinterpret_cast<Protocol::FrameDescriptor*>(Base);
+    auto* Damage = reinterpret_cast<Protocol::DamageRect*>(Descriptor + 1);
+    char* Data = Base + Protocol::MaxHeaderSize;
+
+    UINT DamageCount = 0;
+    for (UINT i = 0; Monitor.View.Damage != nullptr && i < Source.DamageCount; i++)
+    {
+        Protocol::DamageRect Rect = Monitor.View.Damage[i];
+        if (!ClampRect(Rect, Source.Width, Source.Height))
+        {
+            continue;
+        }
+
+        Protocol::DamageRect Target = Kernels::TransformRect(Rect, Source.Width, Source.Height, m_Transform);
+        if (Incremental)
+        {
+            Kernels::TransformPixels32(Monitor.GetData() + Rect.Top * size_t(Source.Pitch) + Rect.Left * sizeof(UINT32),
+                Source.Pitch, Data + Target.Top * size_t(Pitch) + Target.Left * sizeof(UINT32), Pitch,
+                Rect.Right - Rect.Left, Rect.Bottom - Rect.Top, m_Transform);
+        }
+        Damage[DamageCount++] = Target;
+    }
+
+    if (!Incremental)
+    {
+        Kernels::TransformPixels32(Monitor.GetData(), Source.Pitch, Data, Pitch, Source.Width, Source.Height,
+            m_Transform);
+    }
+
+    *Descriptor = Source;
+    Descriptor->HeaderSize = uint16_t(Protocol::MaxHeaderSize);
+    Descriptor->Width = Width;
+    Descriptor->Height = Height;
+    Descriptor->Pitch = Pitch;
+    Descriptor->DamageCount = DamageCount;
+    Descriptor->DataSize = size_t(Pitch) * Height;
+
+    m_Output.Length = Protocol::MaxHeaderSize + Descriptor->DataSize;
+    m_Valid = m_Output.Parse();
+    m_Sequence = Source.Sequence;
+    return m_Valid ? m_Output : Monitor;
+}
\ No newline at end of file
@@ -1,4 +1,5 @@
 float4 _Config : register(c0);  // [X Offset] [Y Offset] [X Scale] [Y Scale]
+float4 _Source : register(c1);  // [U Offset] [V Offset] [U Scale] [V Scale] of the viewport within the frame
 
 struct V2P
 {
@@ -10,6 +11,6 @@ V2P main(float2 position : POSITION)
 {
     V2P v2p;
     v2p.position = float4(position * _Config.zw + _Config.xy, 0, 1);
-    v2p.uv = float2(1.0 + position.x, 1.0 - position.y) / 2;
+    v2p.uv = _Source.xy + float2(1.0 + position.x, 1.0 - position.y) / 2 * _Source.zw;
     return v2p;
 }
\ No newline at end of file
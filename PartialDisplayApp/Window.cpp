@@ -3,9 +3,7 @@
 using namespace std;
 using namespace PartialDisplay;
 
-static weak_ptr<Window> s_Instance;
-
-Window::Window() : m_hWnd()
+Window::Window() : m_hWnd(), m_Tray()
 {
 }
 
@@ -13,21 +11,22 @@ Window::~Window()
 {
     if (m_hWnd != nullptr)
     {
-        CreateMyTray(m_hWnd, false);
+        // the window may outlive us until the process exits, stop routing its messages here
+        SetWindowLongPtr(m_hWnd, GWLP_USERDATA, 0);
+        if (m_Tray)
+        {
+            CreateMyTray(m_hWnd, false);
+        }
     }
 }
 
-shared_ptr<Window> Window::CreateMyWindow(HINSTANCE hInstance, HMONITOR hMonitor)
+shared_ptr<Window> Window::CreateMyWindow(HINSTANCE hInstance, HMONITOR hMonitor,
+    shared_ptr<Rendering> Renderer, const Layout::SourceRect& Source, bool Tray)
 {
-    if (!s_Instance.expired())
-    {
-        printf("Window already created.\n");
-        return nullptr;
-    }
-
     auto instance = make_shared<Window>();
-    s_Instance = instance;
-    if (!instance->InitMyWindow(hInstance, hMonitor))
+    instance->m_Rendering = move(Renderer);
+    instance->m_Tray = Tray;
+    if (!instance->InitMyWindow(hInstance, hMonitor, Source))
     {
         return nullptr;
     }
@@ -35,17 +34,22 @@ shared_ptr<Window> Window::CreateMyWindow(HINSTANCE hInstance, HMONITOR hMonitor
     return instance;
 }
 
-bool Window::InitMyWindow(HINSTANCE hInstance, HMONITOR hMonitor)
+bool Window::InitMyWindow(HINSTANCE hInstance, HMONITOR hMonitor, const Layout::SourceRect& Source)
 {
-    WNDCLASSEX wc = {};
-    wc.cbSize = sizeof(WNDCLASSEX);
-    wc.style = CS_HREDRAW | CS_VREDRAW;
-    wc.lpfnWndProc = WindowProc;
-    wc.hInstance = hInstance;
-    wc.hCursor = LoadCursor(NULL, IDC_ARROW);
-    wc.lpszClassName = L"WindowClass";
-    ATOM cls = RegisterClassEx(&wc);
-    if (cls == 0) { return false; }
+    // every viewport window shares the class
+    static ATOM cls = 0;
+    if (cls == 0)
+    {
+        WNDCLASSEX wc = {};
+        wc.cbSize = sizeof(WNDCLASSEX);
+        wc.style = CS_HREDRAW | CS_VREDRAW;
+        wc.lpfnWndProc = WindowProc;
+        wc.hInstance = hInstance;
+        wc.hCursor = LoadCursor(NULL, IDC_ARROW);
+        wc.lpszClassName = L"WindowClass";
+        cls = RegisterClassEx(&wc);
+        if (cls == 0) { return false; }
+    }
 
     MONITORINFO mi = {};
     mi.cbSize = sizeof(MONITORINFO);
@@ -65,7 +69,7 @@ bool Window::InitMyWindow(HINSTANCE hInstance, HMONITOR hMonitor)
         nullptr,
         nullptr,
         hInstance,
-        nullptr);
+        this);
 
     if (m_hWnd == nullptr)
     {
@@ -73,11 +77,9 @@ bool Window::InitMyWindow(HINSTANCE hInstance, HMONITOR hMonitor)
         return false;
     }
 
-    m_Rendering.emplace();
-    if (FAILED(m_Rendering->InitD3D(m_hWnd, wr.right - wr.left, wr.bottom - wr.top)))
+    if (FAILED(m_Rendering->AddViewport(m_hWnd, wr.right - wr.left, wr.bottom - wr.top, Source)))
     {
         printf("D3D init failure.\n");
-        m_Rendering.reset();
         return false;
     }
 
@@ -97,17 +99,15 @@ int Window::MainLoop()
     return (int)msg.wParam;
 }
 
-bool Window::UpdateFrame(Ioctl& ioctl)
-{
-    return m_Rendering.has_value()
-        && ioctl.RefreshMonitorData()
-        && SUCCEEDED(m_Rendering->UpdateFrame(ioctl.m_Monitor.GetWidth(), ioctl.m_Monitor.GetHeight(),
-            ioctl.m_Monitor.GetPitch(), ioctl.m_Monitor.GetData()));
-}
-
 LRESULT CALLBACK Window::WindowProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 {
-    auto instance = s_Instance.lock();
+    if (message == WM_NCCREATE)
+    {
+        auto* cs = reinterpret_cast<CREATESTRUCT*>(lParam);
+        SetWindowLongPtr(hWnd, GWLP_USERDATA, reinterpret_cast<LONG_PTR>(cs->lpCreateParams));
+    }
+
+    auto instance = reinterpret_cast<Window*>(GetWindowLongPtr(hWnd, GWLP_USERDATA));
     if (instance == nullptr)
     {
         return DefWindowProc(hWnd, message, wParam, lParam);
@@ -118,14 +118,14 @@ LRESULT CALLBACK Window::WindowProc(HWND hWnd, UINT message, WPARAM wParam, LPAR
     switch (message)
     {
     case WM_CREATE:
-        instance->CreateMyTray(hWnd, true);
+        if (instance->m_Tray)
+        {
+            instance->CreateMyTray(hWnd, true);
+        }
         return 0;
 
     case WM_SIZE:
-        if (instance->m_Rendering)
-        {
-            instance->m_Rendering->OnSize(LOWORD(lParam), HIWORD(lParam));
-        }
+        instance->m_Rendering->OnSize(hWnd, LOWORD(lParam), HIWORD(lParam));
         return 0;
 
     case WM_USER:
@@ -133,12 +133,12 @@ LRESULT CALLBACK Window::WindowProc(HWND hWnd, UINT message, WPARAM wParam, LPAR
         return 0;
 
     case WM_DESTROY:
-        s_Instance.reset();
+        SetWindowLongPtr(hWnd, GWLP_USERDATA, 0);
         PostQuitMessage(0);
         return 0;
 
     default:
-        if (message == WmTaskbarCreated)
+        if (message == WmTaskbarCreated && instance->m_Tray)
         {
             instance->CreateMyTray(hWnd, true);
             return 0;
@@ -169,6 +169,10 @@ bool Window::HandleTrayMessage(WPARAM wParam, LPARAM lParam)
     {
         HandleT<Helper::HMENU_Traits> hMenu(CreatePopupMenu());
         if (!hMenu.IsValid()) { return false; }
+        if (m_TraceToggle)
+        {
+            AppendMenu(hMenu.Get(), MF_STRING, 2, m_Tracing ? L"Stop tracing and save" : L"Start tracing");
+        }
         AppendMenu(hMenu.Get(), MF_STRING, 1, L"Exit");
 
         POINT cursor = {};
@@ -181,6 +185,13 @@ bool Window::HandleTrayMessage(WPARAM wParam, LPARAM lParam)
             PostQuitMessage(0);
             return true;
         }
+        if (selection == 2)
+        {
+            // stopping always ends the session, even if saving failed
+            bool succeeded = m_TraceToggle(!m_Tracing);
+            m_Tracing = !m_Tracing && succeeded;
+            return succeeded;
+        }
 
         return true;
     }
@@ -1,4 +1,6 @@
 #include "App.h"
+#include "Quality.h"
+#include "Readiness.h"
 #include <thread>
 #include <conio.h>
 
@@ -10,6 +12,7 @@ struct MonitorEnumData
     HMONITOR selected;
     LONG x;
     LONG y;
+    vector<HMONITOR> monitors;
 };
 
 BOOL MonitorEnumProc(HMONITOR hMonitor, HDC, LPRECT lpRect, LPARAM lParam)
@@ -21,53 +24,545 @@ BOOL MonitorEnumProc(HMONITOR hMonitor, HDC, LPRECT lpRect, LPARAM lParam)
         data->x = lpRect->left;
         data->y = lpRect->top;
     }
+    data->monitors.push_back(hMonitor);
     return true;
 }
 
-int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow)
+struct Options
 {
-    SetProcessDPIAware();
+    wstring RecordFile;
+    wstring ReplayFile;
+    bool MaxSpeed = false;
+    bool LargePages = false;
+    UINT Rotation = 0;
+    bool Mirror = false;
+    vector<Layout::ViewportSpec> Viewports;
+    Scheduling::ThreadPolicy RenderPolicy;  // Its MmcssTask points into MmcssTask once parsing is done
+    wstring MmcssTask = L"Playback";
+    bool AdaptiveQuality = false;
+    UINT TileQuality = 0;
+    Kernels::Isa MaxIsa = Kernels::Isa::Avx512;
+    UINT Slices = 0;
+    bool LatencyProbe = false;
+    bool Stats = false;
+};
 
-    Ioctl ioctl;
-    if (!ioctl.CreateDevice()) { return 1; }
-    if (!ioctl.GetDeviceFileName()) { return 1; }
+static bool ParsePriority(const wstring& Text, Scheduling::ThreadPriority& Priority)
+{
+    const pair<const wchar_t*, Scheduling::ThreadPriority> Names[] =
+    {
+        { L"normal", Scheduling::ThreadPriority::Normal },
+        { L"above", Scheduling::ThreadPriority::AboveNormal },
+        { L"high", Scheduling::ThreadPriority::High },
+        { L"realtime", Scheduling::ThreadPriority::Realtime },
+    };
+    for (const auto& Name : Names)
+    {
+        if (Text == Name.first)
+        {
+            Priority = Name.second;
+            return true;
+        }
+    }
+    return false;
+}
 
-    Sleep(1500);
+static bool ParseIsa(const wstring& Text, Kernels::Isa& Level)
+{
+    for (uint32_t i = 0; i < Kernels::IsaCount; i++)
+    {
+        string name = Kernels::GetIsaName(Kernels::Isa(i));
+        if (Text == wstring(name.begin(), name.end()))
+        {
+            Level = Kernels::Isa(i);
+            return true;
+        }
+    }
+    return false;
+}
 
-    bool handleOpened = false;
-    for (int retry = 0; retry < 10; retry++)
+static Options ParseCommandLine()
+{
+    Options options;
+    int argc = 0;
+    LPWSTR* argv = CommandLineToArgvW(GetCommandLineW(), &argc);
+    for (int i = 1; i < argc; i++)
     {
-        Sleep(500);
-        if (ioctl.TryOpenHandle())
+        wstring arg = argv[i];
+        if (arg == L"--record" && i + 1 < argc)
+        {
+            options.RecordFile = argv[++i];
+        }
+        else if (arg == L"--replay" && i + 1 < argc)
+        {
+            options.ReplayFile = argv[++i];
+        }
+        else if (arg == L"--max-speed")
+        {
+            options.MaxSpeed = true;
+        }
+        else if (arg == L"--large-pages")
+        {
+            options.LargePages = true;
+        }
+        else if (arg == L"--rotate" && i + 1 < argc)
+        {
+            options.Rotation = wcstoul(argv[++i], nullptr, 10);
+            if (options.Rotation % 90 != 0 || options.Rotation >= 360)
+            {
+                printf("Rotation must be 0, 90, 180 or 270, ignoring %ws\n", argv[i]);
+                options.Rotation = 0;
+            }
+        }
+        else if (arg == L"--mirror")
+        {
+            options.Mirror = true;
+        }
+        else if (arg == L"--priority" && i + 1 < argc)
+        {
+            if (!ParsePriority(argv[++i], options.RenderPolicy.Priority))
+            {
+                printf("Priority must be normal, above, high or realtime, ignoring %ws\n", argv[i]);
+            }
+        }
+        else if (arg == L"--affinity" && i + 1 < argc)
+        {
+            options.RenderPolicy.Affinity = wcstoull(argv[++i], nullptr, 16);
+        }
+        else if (arg == L"--mmcss" && i + 1 < argc)
+        {
+            options.MmcssTask = argv[++i];
+        }
+        else if (arg == L"--lock-memory")
+        {
+            options.RenderPolicy.LockMemory = true;
+        }
+        else if (arg == L"--adaptive-quality")
+        {
+            options.AdaptiveQuality = true;
+        }
+        else if (arg == L"--tiles" && i + 1 < argc)
+        {
+            options.TileQuality = wcstoul(argv[++i], nullptr, 10);
+            if (options.TileQuality < 1 || options.TileQuality > 100)
+            {
+                printf("Tile quality must be between 1 and 100, ignoring %ws\n", argv[i]);
+                options.TileQuality = 0;
+            }
+        }
+        else if (arg == L"--slices" && i + 1 < argc)
+        {
+            options.Slices = wcstoul(argv[++i], nullptr, 10);
+            if (options.Slices < 1 || options.Slices > Protocol::MaxSlices)
+            {
+                printf("Slices must be between 1 and %u, ignoring %ws\n", Protocol::MaxSlices, argv[i]);
+                options.Slices = 0;
+            }
+        }
+        else if (arg == L"--probe")
+        {
+            options.LatencyProbe = true;
+        }
+        else if (arg == L"--isa" && i + 1 < argc)
+        {
+            if (!ParseIsa(argv[++i], options.MaxIsa))
+            {
+                printf("Instruction set must be scalar, sse2, sse4.1, avx2 or avx512, ignoring %ws\n", argv[i]);
+            }
+        }
+        else if (arg == L"--stats")
+        {
+            options.Stats = true;
+        }
+        else if (arg == L"--viewport" && i + 1 < argc)
+        {
+            Layout::ViewportSpec spec;
+            if (Layout::ParseViewport(argv[++i], spec))
+            {
+                options.Viewports.push_back(spec);
+            }
+            else
+            {
+                printf("Viewport must be Left,Top,Width,Height[@Monitor], ignoring %ws\n", argv[i]);
+            }
+        }
+        else
         {
-            handleOpened = true;
-            break;
+            printf("Unknown argument: %ws\n", argv[i]);
         }
     }
+    LocalFree(argv);
+    return options;
+}
+
+static Kernels::Orientation GetOrientation(const Options& options)
+{
+    const Kernels::Orientation Rotations[] =
+    {
+        Kernels::Orientation::Identity,
+        Kernels::Orientation::Rotate90,
+        Kernels::Orientation::Rotate180,
+        Kernels::Orientation::Rotate270,
+    };
+
+    // Mirroring the rotated frame horizontally flips what becomes its X axis
+    uint32_t Orientation = uint32_t(Rotations[options.Rotation / 90]);
+    if (options.Mirror)
+    {
+        Orientation ^= (Orientation & Kernels::OrientationSwapAxes) ? Kernels::OrientationFlipY : Kernels::OrientationFlipX;
+    }
+    return Kernels::Orientation(Orientation);
+}
+
+static UINT64 ToNanoseconds(chrono::steady_clock::duration duration)
+{
+    return UINT64(chrono::duration_cast<chrono::nanoseconds>(duration).count());
+}
+
+static Quality::ControllerConfig GetQualityConfig(const Options& options)
+{
+    Quality::ControllerConfig config;
+    DEVMODE mode = {};
+    mode.dmSize = sizeof(mode);
+    if (EnumDisplaySettings(nullptr, ENUM_CURRENT_SETTINGS, &mode) && mode.dmDisplayFrequency > 1)
+    {
+        config.FrameBudget = 1'000'000'000 / mode.dmDisplayFrequency;
+    }
+
+    // rotating needs 32-bit pixels, so the ladder goes without the 16-bit format
+    config.AllowReducedFormat = GetOrientation(options) == Kernels::Orientation::Identity;
+    return config;
+}
+
+static void UpdateQuality(Quality::Controller& quality, FrameSource& source, chrono::steady_clock::time_point fetchStart,
+    UINT64& lastSequence)
+{
+    auto now = chrono::steady_clock::now();
+    UINT64 sequence = source.m_Monitor.GetDescriptor().Sequence;
+    UINT64 skipped = lastSequence != 0 && sequence > lastSequence + 1 ? sequence - lastSequence - 1 : 0;
+    lastSequence = sequence;
 
-    if (!handleOpened) { return 1; }
+    if (quality.OnFrame(ToNanoseconds(now.time_since_epoch()), ToNanoseconds(now - fetchStart), skipped))
+    {
+        const Quality::Level& level = quality.GetLevel();
+        printf("Quality level: %s\n", level.Name);
+        source.RequestQuality(level.Format, level.Downscale);
+    }
+}
+
+static void PrintStatistics(FrameSource& source)
+{
+    Protocol::PipelineStatistics statistics;
+    if (!source.GetStatistics(statistics))
+    {
+        return;
+    }
+
+    printf("Driver pipeline at frame %llu, %llu heap allocations so far\n", (unsigned long long)statistics.Sequence,
+        (unsigned long long)statistics.Allocations);
+    for (UINT i = 0; i < statistics.StageCount && i < Protocol::MaxStages; i++)
+    {
+        const Protocol::StageStatistics& stage = statistics.Stages[i];
+        printf("  %-10.16s %10llu frames %8llu dropped %8.2f ms each, %u queued (most %u)\n", stage.Name,
+            (unsigned long long)stage.Processed, (unsigned long long)stage.Dropped,
+            stage.Processed != 0 ? stage.BusyNs / 1e6 / stage.Processed : 0.0, stage.Depth, stage.MaxDepth);
+    }
+
+    const Protocol::CopyStatistics& copy = statistics.Copy;
+    if (copy.Width != 0)
+    {
+        printf("  Readback of %ux%u with %s stores on %u threads, %u rows at a time, %.2f ms a frame (%s)\n",
+            copy.Width, copy.Height, Tuning::GetMethodName(Tuning::CopyMethod(copy.Method)), copy.Threads,
+            copy.ChunkRows, copy.FrameNs / 1e6, copy.Calibrated ? "calibrated" : "stored");
+    }
+}
+
+// Latencies from the QPC time the OS presented a frame, read from the marker the driver stamps into it, to the moment
+// the frame is uploaded and about to be presented
+struct LatencyProbe
+{
+    Probe::LatencyHistogram histogram;
+    UINT64 pending = 0;  // Marker of the frame being rendered, 0 if it carries none
+    UINT64 unreadable = 0;
+    LARGE_INTEGER frequency = {};
+};
+
+static void ReadLatencyMarker(LatencyProbe& probe, const MonitorData& monitor)
+{
+    // read before the frame is rotated, the marker is in the corner the driver put it in
+    probe.pending = 0;
+    if (!monitor.HasData())
+    {
+        return;
+    }
+    const Protocol::FrameDescriptor& descriptor = monitor.GetDescriptor();
+    UINT64 value;
+    if (Probe::ReadMarker(monitor.GetData(), descriptor.Pitch, descriptor.Width, descriptor.Height,
+        Protocol::PixelFormat(descriptor.Format), Protocol::GetDownscale(descriptor), value))
+    {
+        probe.pending = value;
+    }
+    else
+    {
+        probe.unreadable++;
+    }
+}
+
+static void RecordLatency(LatencyProbe& probe)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    if (probe.pending != 0 && UINT64(now.QuadPart) >= probe.pending)
+    {
+        probe.histogram.Add(UINT64((now.QuadPart - probe.pending) * 1e9 / probe.frequency.QuadPart));
+    }
+    probe.pending = 0;
+}
+
+static void PrintLatency(LatencyProbe& probe)
+{
+    const Probe::LatencyHistogram& histogram = probe.histogram;
+    printf("Latency over %llu frames: min %.2f, p50 %.2f, p90 %.2f, p99 %.2f, max %.2f ms, %llu without a marker\n",
+        (unsigned long long)histogram.GetCount(), histogram.GetMin() / 1e6, histogram.GetPercentile(0.5) / 1e6,
+        histogram.GetPercentile(0.9) / 1e6, histogram.GetPercentile(0.99) / 1e6, histogram.GetMax() / 1e6,
+        (unsigned long long)probe.unreadable);
+    probe.histogram.Clear();
+    probe.unreadable = 0;
+}
+
+static bool ToggleTrace(FrameSource& source, bool start)
+{
+    if (start)
+    {
+        Tracing::Start();
+        if (!source.ControlTrace(Protocol::TraceCommand::Start, nullptr))
+        {
+            printf("Driver can't be traced, tracing the app only.\n");
+        }
+        return true;
+    }
+
+    Tracing::Stop();
+    string events = Tracing::ExportChromeEvents(GetCurrentProcessId(), "PartialDisplayApp");
+    string driverEvents;
+    if (source.ControlTrace(Protocol::TraceCommand::Stop, nullptr)
+        && source.ControlTrace(Protocol::TraceCommand::Read, &driverEvents) && !driverEvents.empty())
+    {
+        events += ",";
+        events += driverEvents;
+    }
+    string trace = Tracing::WrapChromeTrace(events);
+
+    SYSTEMTIME now;
+    GetLocalTime(&now);
+    WCHAR fileName[64];
+    swprintf_s(fileName, L"trace-%04u%02u%02u-%02u%02u%02u.json",
+        now.wYear, now.wMonth, now.wDay, now.wHour, now.wMinute, now.wSecond);
+
+    unique_handle file(CreateFile(fileName, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+    DWORD written;
+    if (!file.IsValid() || !WriteFile(file.Get(), trace.data(), DWORD(trace.size()), &written, nullptr))
+    {
+        printf("Can't write %ws: %#lx\n", fileName, GetLastError());
+        return false;
+    }
+    printf("Trace saved to %ws\n", fileName);
+    return true;
+}
+
+static unique_ptr<FrameSource> OpenDevice(UINT tileQuality, bool latencyProbe, UINT slices)
+{
+    auto ioctl = make_unique<Ioctl>();
+    ioctl->SetTileQuality(tileQuality);
+    ioctl->SetLatencyProbe(latencyProbe);
+    ioctl->SetSlices(slices);
+    auto start = chrono::steady_clock::now();
+    if (!ioctl->Attach()) { return nullptr; }
+    printf("Device ready in %.1f ms\n", chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+    return ioctl;
+}
+
+static unique_ptr<FrameSource> OpenTrace(const wstring& FileName, bool MaxSpeed)
+{
+    auto replayer = make_unique<TraceReplayer>();
+    if (!replayer->Open(FileName, MaxSpeed)) { return nullptr; }
+    return replayer;
+}
+
+int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow)
+{
+    SetProcessDPIAware();
+
+    Options options = ParseCommandLine();
+    options.RenderPolicy.MmcssTask = options.MmcssTask == L"none" ? nullptr : options.MmcssTask.c_str();
+    Kernels::SelectIsa(options.MaxIsa);
+    if (options.LatencyProbe && !options.ReplayFile.empty())
+    {
+        // recorded markers hold present times of a past run
+        printf("The latency probe needs the driver, ignoring --probe\n");
+        options.LatencyProbe = false;
+    }
+    if (options.Slices != 0 && (options.TileQuality != 0 || !options.ReplayFile.empty()
+        || GetOrientation(options) != Kernels::Orientation::Identity))
+    {
+        // slices are uploaded as they come, before anything could decode or rotate them
+        printf("Slices need whole untransformed frames from the driver, ignoring --slices\n");
+        options.Slices = 0;
+    }
+
+    unique_ptr<FrameSource> source = options.ReplayFile.empty()
+        ? OpenDevice(options.TileQuality, options.LatencyProbe, options.Slices)
+        : OpenTrace(options.ReplayFile, options.MaxSpeed);
+    if (!source) { return 1; }
+    if (options.LargePages && !source->m_Pool.EnableLargePages())
+    {
+        printf("Large pages unavailable, frames use normal pages\n");
+    }
+    if (options.RenderPolicy.LockMemory) { source->m_Pool.EnableMemoryLocking(); }
+
+    TraceRecorder recorder;
+    if (!options.RecordFile.empty() && !recorder.Open(options.RecordFile)) { return 1; }
 
     MonitorEnumData data = {};
     EnumDisplayMonitors(nullptr, nullptr, MonitorEnumProc, (LPARAM)&data);
 
-    auto window = Window::CreateMyWindow(hInstance, data.selected);
-    if (!window) { return 1; }
+    // without --viewport the whole frame goes to the default monitor
+    if (options.Viewports.empty())
+    {
+        options.Viewports.emplace_back();
+    }
+
+    auto renderer = make_shared<Rendering>();
+    if (FAILED(renderer->InitD3D()))
+    {
+        printf("D3D init failure.\n");
+        return 1;
+    }
+
+    vector<shared_ptr<Window>> windows;
+    for (const Layout::ViewportSpec& spec : options.Viewports)
+    {
+        HMONITOR monitor = spec.Monitor < data.monitors.size() ? data.monitors[spec.Monitor] : data.selected;
+        auto window = Window::CreateMyWindow(hInstance, monitor, renderer, spec.Source, windows.empty());
+        if (!window) { return 1; }
+        windows.push_back(move(window));
+    }
+    windows.front()->SetTraceToggle([&source](bool start) { return ToggleTrace(*source, start); });
+
+    FrameDecoder decoder;
+    FrameTransform transform(GetOrientation(options));
+    optional<Quality::Controller> quality;
+    if (options.AdaptiveQuality)
+    {
+        quality.emplace(GetQualityConfig(options));
+    }
+    optional<LatencyProbe> probe;
+    if (options.LatencyProbe)
+    {
+        probe.emplace();
+        QueryPerformanceFrequency(&probe->frequency);
+        renderer->SetPresentHook([&probe] { RecordLatency(*probe); });
+    }
+    source->SetSliceHook([&renderer](const MonitorData& monitor, UINT top, UINT rows)
+        {
+            renderer->UploadSlice(monitor, top, rows);
+        });
 
     bool rendering = true;
-    thread renderingThread([&rendering, &window, &ioctl]
+    thread renderingThread([&rendering, &renderer, &source, &recorder, &decoder, &transform, &quality, &probe,
+        &options]
         {
+            Scheduling::ScopedThreadPolicy policy(options.RenderPolicy);
+            if (policy.GetFailures() != 0)
+            {
+                printf("Rendering thread policy partially applied, failures %#x\n", policy.GetFailures());
+            }
+
+            // Until the driver has a swap-chain there are no frames; start polling fast and slow down from there
+            Readiness::Backoff retry;
+            UINT64 lastSequence = 0;
+            auto nextStatistics = chrono::steady_clock::now();
+            auto nextLatency = nextStatistics + 5s;
+
+            // While no window can be seen no frames are fetched, which in turn lets the driver stop capturing them
+            Demand::VisibilityGate visibility(ToNanoseconds(100ms));
             while (rendering)
             {
-                if (!window->UpdateFrame(ioctl))
+                auto fetchStart = chrono::steady_clock::now();
+                if (options.Stats && fetchStart >= nextStatistics)
+                {
+                    PrintStatistics(*source);
+                    nextStatistics = fetchStart + 5s;
+                }
+                if (probe && fetchStart >= nextLatency)
+                {
+                    PrintLatency(*probe);
+                    nextLatency = fetchStart + 5s;
+                }
+                if (!visibility.ShouldFetch())
+                {
+                    UINT64 now = ToNanoseconds(fetchStart.time_since_epoch());
+                    if (visibility.ShouldTest(now))
+                    {
+                        visibility.OnPresent(renderer->TestPresent() != S_OK, now);
+                        if (visibility.ShouldFetch())
+                        {
+                            printf("Visible again, fetching frames\n");
+                            continue;
+                        }
+                    }
+                    this_thread::sleep_for(chrono::nanoseconds(visibility.GetNextTest() - now));
+                    continue;
+                }
+                if (!source->RefreshMonitorData())
+                {
+                    this_thread::sleep_for(chrono::nanoseconds(retry.Next()));
+                    continue;
+                }
+                retry.Reset();
+
+                recorder.Record(source->m_Monitor);
+                MonitorData* decoded = decoder.Apply(source->m_Monitor);
+                if (!decoded)
+                {
+                    // the tiles can't be patched into what we hold, start over from a whole frame
+                    source->RequestKeyFrame();
+                    continue;
+                }
+                if (probe)
+                {
+                    ReadLatencyMarker(*probe, *decoded);
+                }
+                MonitorData& frame = transform.Apply(*decoded);
+                if (quality)
+                {
+                    UpdateQuality(*quality, *source, fetchStart, lastSequence);
+                }
+
+                HRESULT hr = renderer->UpdateFrame(frame);
+                auto presented = chrono::steady_clock::now();
+                visibility.OnPresent(hr == DXGI_STATUS_OCCLUDED, ToNanoseconds(presented.time_since_epoch()));
+                if (!visibility.ShouldFetch())
+                {
+                    // the skipped frames aren't the link falling behind
+                    printf("Nothing visible, pausing until a window can be seen\n");
+                    lastSequence = 0;
+                }
+                else if (FAILED(hr))
                 {
                     this_thread::sleep_for(1s);
                 }
+                else if (quality && quality->GetLevel().FrameInterval != 0)
+                {
+                    this_thread::sleep_until(fetchStart + chrono::nanoseconds(quality->GetLevel().FrameInterval));
+                }
             }
         });
 
-    int ret = window->MainLoop();
+    int ret = Window::MainLoop();
     rendering = false;
     renderingThread.join();
+    recorder.Close();
 
     return ret;
 }
\ No newline at end of file
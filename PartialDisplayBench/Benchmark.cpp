@@ -0,0 +1,4093 @@
+#include "Benchmark.h"
+#include "../PartialDisplayClient/PartialDisplayClient.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define PD_BENCH_TSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PD_BENCH_TSC 1
+#else
+#define PD_BENCH_TSC 0
+#endif
+
+using namespace std;
+using namespace std::chrono;
+using namespace PartialDisplay;
+using namespace PartialDisplay::Scheduling;
+
+namespace
+{
+    constexpr size_t JitterSamples = 2000;
+    constexpr auto JitterInterval = 1ms;
+
+    /// <summary>
+    /// Keeps every logical processor busy for as long as it lives.
+    /// </summary>
+    class CpuLoad
+    {
+    public:
+        CpuLoad()
+        {
+            unsigned Count = max(thread::hardware_concurrency(), 1u);
+            for (unsigned i = 0; i < Count; i++)
+            {
+                m_Threads.emplace_back([this]
+                    {
+                        volatile uint64_t Sink = 0;
+                        while (!m_Stop.load(memory_order_relaxed))
+                        {
+                            Sink = Sink * 6364136223846793005ull + 1442695040888963407ull;
+                        }
+                    });
+            }
+        }
+
+        ~CpuLoad()
+        {
+            m_Stop = true;
+            for (auto& Thread : m_Threads)
+            {
+                Thread.join();
+            }
+        }
+
+    private:
+        atomic<bool> m_Stop = false;
+        vector<thread> m_Threads;
+    };
+
+    /// <summary>
+    /// Signals a waiter once per interval and collects the delay between the signal and the waiter running, in
+    /// microseconds and sorted.
+    /// </summary>
+    vector<double> MeasureWakeLatency(const ThreadPolicy& Policy)
+    {
+        mutex Mutex;
+        condition_variable Signal;
+        steady_clock::time_point Stamp;
+        bool Pending = false;
+        bool Done = false;
+        vector<double> Latencies;
+        Latencies.reserve(JitterSamples);
+
+        thread Waiter([&]
+            {
+                ScopedThreadPolicy Applied(Policy);
+                unique_lock<mutex> Lock(Mutex);
+                while (true)
+                {
+                    Signal.wait(Lock, [&] { return Pending || Done; });
+                    if (!Pending)
+                    {
+                        break;
+                    }
+                    Latencies.push_back(duration<double, micro>(steady_clock::now() - Stamp).count());
+                    Pending = false;
+                }
+            });
+
+        for (size_t i = 0; i < JitterSamples; i++)
+        {
+            this_thread::sleep_for(JitterInterval);
+            {
+                lock_guard<mutex> Lock(Mutex);
+                if (Pending)
+                {
+                    // The waiter has not even run since the last signal, that sample is already the worst case
+                    continue;
+                }
+                Pending = true;
+                Stamp = steady_clock::now();
+            }
+            Signal.notify_one();
+        }
+
+        {
+            lock_guard<mutex> Lock(Mutex);
+            Done = true;
+        }
+        Signal.notify_one();
+        Waiter.join();
+
+        sort(Latencies.begin(), Latencies.end());
+        return Latencies;
+    }
+
+    constexpr size_t TracingIterations = 10'000'000;
+
+    /// <summary>
+    /// Nanoseconds per iteration of a loop opening and closing one span.
+    /// </summary>
+    double MeasureSpan()
+    {
+        auto Start = steady_clock::now();
+        for (size_t i = 0; i < TracingIterations; i++)
+        {
+            PD_TRACE_SPAN("Benchmark");
+        }
+        return duration<double, nano>(steady_clock::now() - Start).count() / TracingIterations;
+    }
+
+    constexpr uint32_t CodecWidth = 3840;
+    constexpr uint32_t CodecHeight = 2160;
+    constexpr uint32_t CodecRuns = 5;
+    constexpr size_t ClassifierSamples = 20000;
+
+    inline uint32_t MakePixel(double B, double G, double R)
+    {
+        auto Channel = [](double Value) { return uint32_t(clamp(Value, 0.0, 255.0) + 0.5); };
+        return Channel(B) | (Channel(G) << 8) | (Channel(R) << 16) | 0xFF000000;
+    }
+
+    /// <summary>
+    /// Stands in for camera or video content: smooth waves in every channel plus sensor noise.
+    /// </summary>
+    void FillPhoto(uint32_t* Pixels, size_t Stride, uint32_t Width, uint32_t Height, mt19937& Random)
+    {
+        uniform_real_distribution<double> Phase(0, 6.28), Frequency(0.005, 0.08);
+        normal_distribution<double> Noise(0, 2.5);
+        double Fx[3], Fy[3], P[3];
+        for (int c = 0; c < 3; c++)
+        {
+            Fx[c] = Frequency(Random);
+            Fy[c] = Frequency(Random);
+            P[c] = Phase(Random);
+        }
+        for (uint32_t y = 0; y < Height; y++)
+        {
+            for (uint32_t x = 0; x < Width; x++)
+            {
+                double V[3];
+                for (int c = 0; c < 3; c++)
+                {
+                    V[c] = 128 + 90 * sin(x * Fx[c] + P[c]) * cos(y * Fy[c] + P[c]) + Noise(Random);
+                }
+                Pixels[y * Stride + x] = MakePixel(V[0], V[1], V[2]);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Stands in for text and UI: a flat or gently graded background with anti-aliased strokes in one colour.
+    /// </summary>
+    void FillText(uint32_t* Pixels, size_t Stride, uint32_t Width, uint32_t Height, mt19937& Random)
+    {
+        uniform_real_distribution<double> Color(0, 255), Unit(0, 1);
+        double Back[3] = { Color(Random), Color(Random), Color(Random) };
+        double Fore[3] = { Color(Random), Color(Random), Color(Random) };
+        double Grade = Unit(Random) < 0.3 ? 2.0 : 0.0;  // Per row, like a title bar gradient
+        for (uint32_t y = 0; y < Height; y++)
+        {
+            for (uint32_t x = 0; x < Width; x++)
+            {
+                Pixels[y * Stride + x] = MakePixel(Back[0] + y * Grade, Back[1] + y * Grade, Back[2] + y * Grade);
+            }
+        }
+
+        // Vertical and horizontal stems with a fractional edge on each side, as ClearType-less rendering leaves them
+        uniform_int_distribution<uint32_t> Strokes(1, 4);
+        for (uint32_t s = Strokes(Random); s > 0; s--)
+        {
+            bool Vertical = Unit(Random) < 0.5;
+            double Start = Unit(Random) * (Vertical ? Width : Height);
+            double Thickness = 1 + Unit(Random) * 2;
+            for (uint32_t y = 0; y < Height; y++)
+            {
+                for (uint32_t x = 0; x < Width; x++)
+                {
+                    double Position = Vertical ? x : y;
+                    double Cover = clamp(min(Position + 1 - Start, Start + Thickness - Position), 0.0, 1.0);
+                    if (Cover <= 0)
+                    {
+                        continue;
+                    }
+                    uint32_t Old = Pixels[y * Stride + x];
+                    double B = Old & 0xFF, G = (Old >> 8) & 0xFF, R = (Old >> 16) & 0xFF;
+                    Pixels[y * Stride + x] = MakePixel(B + (Fore[0] - B) * Cover, G + (Fore[1] - G) * Cover,
+                        R + (Fore[2] - R) * Cover);
+                }
+            }
+        }
+    }
+
+    constexpr uint32_t DesktopWidth = 1920;
+    constexpr uint32_t DesktopHeight = 1080;
+    constexpr uint32_t DesktopFrames = 600;
+    constexpr uint32_t GlyphCount = 48;
+
+    /// <summary>
+    /// A scripted desktop session: two pages of text switched every few seconds, a popup menu opening and closing, a
+    /// blinking caret and a small video playing on the first page, at 30 frames a second.
+    /// </summary>
+    class SyntheticDesktop
+    {
+    public:
+        SyntheticDesktop() : m_Random(7), m_Frame(size_t(DesktopWidth) * DesktopHeight)
+        {
+            const uint32_t Tile = Protocol::TileSize;
+            vector<uint32_t> Glyphs(size_t(GlyphCount) * Tile * Tile);
+            for (uint32_t i = 0; i < GlyphCount; i++)
+            {
+                FillText(&Glyphs[size_t(i) * Tile * Tile], Tile, Tile, Tile, m_Random);
+            }
+
+            // Lines of glyph tiles with ragged ends on a flat background
+            uniform_int_distribution<uint32_t> Glyph(0, GlyphCount - 1), LineEnd(20, DesktopWidth / Tile - 4);
+            for (uint32_t p = 0; p < 2; p++)
+            {
+                vector<uint32_t>& Page = m_Pages[p];
+                Page.assign(m_Frame.size(), p == 0 ? 0xFFFFFFFF : 0xFF202020);
+                for (uint32_t Row = 4; Row < DesktopHeight / Tile - 2; Row += 2)
+                {
+                    for (uint32_t Column = 4, End = LineEnd(m_Random); Column < End; Column++)
+                    {
+                        Kernels::CopyRows(&Glyphs[size_t(Glyph(m_Random)) * Tile * Tile], Tile * 4,
+                            &Page[size_t(Row) * Tile * DesktopWidth + Column * Tile], DesktopWidth * 4, Tile * 4, Tile);
+                    }
+                }
+            }
+
+            m_Popup.resize(size_t(PopupWidth) * PopupHeight);
+            FillText(m_Popup.data(), PopupWidth, PopupWidth, PopupHeight, m_Random);
+        }
+
+        bool Next(Benchmark::CacheFrame& Frame)
+        {
+            if (m_Index == DesktopFrames)
+            {
+                return false;
+            }
+
+            uint32_t i = m_Index++;
+            m_Damage.clear();
+            bool Switch = i % 90 == 0;
+            if (Switch)
+            {
+                m_Page = (i / 90) % 2;
+                m_Frame = m_Pages[m_Page];
+                m_PopupShown = false;
+                m_CaretShown = false;
+            }
+            if (i % 40 == 20)
+            {
+                m_PopupShown = !m_PopupShown;
+                Draw(PopupRect, m_PopupShown ? m_Popup.data() : nullptr, PopupWidth);
+            }
+            if (i % 15 == 0)
+            {
+                m_CaretShown = !m_CaretShown;
+                uint32_t Caret[2 * 18];
+                fill(begin(Caret), end(Caret), m_Page == 0 ? 0xFF000000 : 0xFFFFFFFF);
+                Draw(CaretRect, m_CaretShown ? Caret : nullptr, 2);
+            }
+            if (m_Page == 0)
+            {
+                const Protocol::DamageRect& Video = VideoRect;
+                FillPhoto(&m_Frame[size_t(Video.Top) * DesktopWidth + Video.Left], DesktopWidth,
+                    Video.Right - Video.Left, Video.Bottom - Video.Top, m_Random);
+                m_Damage.push_back(Video);
+            }
+
+            Frame = { m_Frame.data(), DesktopWidth * 4, DesktopWidth, DesktopHeight,
+                Switch ? nullptr : m_Damage.data(), uint32_t(m_Damage.size()) };
+            return true;
+        }
+
+    private:
+        static constexpr uint32_t PopupWidth = 320;
+        static constexpr uint32_t PopupHeight = 400;
+        static constexpr Protocol::DamageRect PopupRect = { 200, 120, 200 + PopupWidth, 120 + PopupHeight };
+        static constexpr Protocol::DamageRect CaretRect = { 900, 500, 902, 518 };
+        static constexpr Protocol::DamageRect VideoRect = { 1400, 600, 1720, 780 };
+
+        mt19937 m_Random;
+        vector<uint32_t> m_Pages[2];
+        vector<uint32_t> m_Popup;
+        vector<uint32_t> m_Frame;
+        vector<Protocol::DamageRect> m_Damage;
+        uint32_t m_Index = 0;
+        uint32_t m_Page = 0;
+        bool m_PopupShown = false;
+        bool m_CaretShown = false;
+
+        // Draws Pixels into Rect, or puts the page back when null
+        void Draw(const Protocol::DamageRect& Rect, const uint32_t* Pixels, size_t Stride)
+        {
+            size_t Offset = size_t(Rect.Top) * DesktopWidth + Rect.Left;
+            if (Pixels == nullptr)
+            {
+                Pixels = &m_Pages[m_Page][Offset];
+                Stride = DesktopWidth;
+            }
+            Kernels::CopyRows(Pixels, Stride * 4, &m_Frame[Offset], DesktopWidth * 4,
+                size_t(Rect.Right - Rect.Left) * 4, Rect.Bottom - Rect.Top);
+            m_Damage.push_back(Rect);
+        }
+    };
+
+    constexpr uint32_t ProtocolWidth = 333, ProtocolHeight = 17;  // Odd sizes, pitch padded past the row
+    constexpr uint32_t ProtocolSeed = 28;
+
+    constexpr uint32_t TracePlainFrames = 16;  // Plain frames of the session are 8 MB each, the first few will do
+    constexpr uint64_t TraceFrequency = 1'000'000'000;
+    constexpr uint64_t TraceInterval = TraceFrequency / 30;
+    constexpr uint32_t TraceReplaySampling = 20;  // Every so many replayed frames is compared with the session's
+    constexpr double TraceReplayPsnr = 30;
+
+    /// <summary>
+    /// Answers frame requests for the scripted desktop session the way the driver does, with plain BGRA8 frames or
+    /// with tile streams against a mirror of the client's tile cache, the same responses on every run.
+    /// </summary>
+    class SessionResponses
+    {
+    public:
+        SessionResponses(bool Tiles, uint32_t Frames) : m_Tiles(Tiles), m_Frames(Frames),
+            m_Mirror(Protocol::TileCacheSize, false), m_Response(Protocol::MaxHeaderSize
+                + max(Codec::GetMaxStreamSize(DesktopWidth, DesktopHeight), size_t(DesktopWidth) * DesktopHeight * 4))
+        {
+        }
+
+        /// <summary>
+        /// The next response and its timestamp, false at the end of the session. The response stays valid until the
+        /// next call.
+        /// </summary>
+        bool Next(const uint8_t*& Response, size_t& Size, uint64_t& Timestamp)
+        {
+            Benchmark::CacheFrame Frame;
+            if (m_Sequence == m_Frames || !m_Desktop.Next(Frame))
+            {
+                return false;
+            }
+            m_Sequence++;
+
+            bool Full = Frame.Damage == nullptr;
+            auto* Descriptor = reinterpret_cast<Protocol::FrameDescriptor*>(m_Response.data());
+            *Descriptor = {};
+            Descriptor->Magic = Protocol::FrameDescriptorMagic;
+            Descriptor->Version = Protocol::Version;
+            Descriptor->Format = uint32_t(Protocol::PixelFormat::BGRA8);
+            Descriptor->Width = DesktopWidth;
+            Descriptor->Height = DesktopHeight;
+            Descriptor->Pitch = DesktopWidth * 4;
+            Descriptor->Sequence = m_Sequence;
+            Descriptor->Timestamp = m_Sequence * TraceInterval;
+            Descriptor->Flags = Full ? uint32_t(Protocol::FrameFullDamage) : 0u;
+            Descriptor->DamageCount = Full ? 0 : Frame.DamageCount;
+            Descriptor->HeaderSize = uint16_t(Protocol::GetHeaderSize(Descriptor->DamageCount));
+            Protocol::PackHeader(m_Response.data(), Frame.Damage);
+
+            uint8_t* Data = m_Response.data() + Descriptor->HeaderSize;
+            if (m_Tiles)
+            {
+                Descriptor->Compression = Protocol::CompressionTiles | Protocol::CompressionTileCache;
+                Descriptor->DataSize = Codec::EncodeTiles(Frame.Pixels, Frame.Pitch, DesktopWidth, DesktopHeight,
+                    Frame.Damage, Frame.DamageCount, 0, nullptr, &m_Mirror, nullptr, Data,
+                    m_Response.size() - Descriptor->HeaderSize);
+            }
+            else
+            {
+                Descriptor->DataSize = uint64_t(Descriptor->Pitch) * DesktopHeight;
+                Kernels::CopyRows(Frame.Pixels, Frame.Pitch, Data, Descriptor->Pitch, DesktopWidth * 4, DesktopHeight);
+            }
+
+            Response = m_Response.data();
+            Size = size_t(Protocol::GetResponseSize(*Descriptor));
+            Timestamp = Descriptor->Timestamp;
+            return true;
+        }
+
+    private:
+        bool m_Tiles;
+        uint32_t m_Frames;
+        uint32_t m_Sequence = 0;
+        SyntheticDesktop m_Desktop;
+        Codec::TileCache m_Mirror;
+        vector<uint8_t> m_Response;
+    };
+
+    /// <summary>
+    /// A response as it was handed to the trace, to tell it from what reads back.
+    /// </summary>
+    struct TracedResponse
+    {
+        size_t Size;
+        uint64_t Timestamp;
+        uint64_t Hash;
+    };
+
+    uint64_t HashResponse(const void* Response, size_t Size)
+    {
+        uint64_t Hash = 14695981039346656037ull;
+        for (size_t i = 0; i < Size; i++)
+        {
+            Hash = (Hash ^ static_cast<const uint8_t*>(Response)[i]) * 1099511628211ull;
+        }
+        return Hash;
+    }
+
+    /// <summary>
+    /// Whether Reader holds exactly the first Frames responses traced, with their timestamps.
+    /// </summary>
+    bool ReadsBack(const Trace::Reader& Reader, const vector<TracedResponse>& Traced, size_t Frames)
+    {
+        if (Reader.GetFrameCount() != Frames || Reader.GetFrequency() != TraceFrequency)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < Frames; i++)
+        {
+            Trace::Frame Frame;
+            if (!Reader.GetFrame(i, Frame) || Frame.Size != Traced[i].Size || Frame.Timestamp != Traced[i].Timestamp
+                || HashResponse(Frame.Response, Frame.Size) != Traced[i].Hash)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    constexpr uint32_t ReadersWidth = 1920;
+    constexpr uint32_t ReadersHeight = 1080;
+    constexpr auto ReadersFrameInterval = 16ms;
+    constexpr auto ReadersMapStall = 1ms;
+    constexpr auto ReadersDuration = 1s;
+
+    /// <summary>
+    /// Stands in for the driver's staging surface. Mapping it waits as a map waits for the GPU copy, and like the
+    /// device context it is used through, it is mapped by one caller at a time.
+    /// </summary>
+    class MockSurface
+    {
+    public:
+        MockSurface() : m_Pixels(size_t(ReadersWidth) * ReadersHeight, 0xFF202020) {}
+
+        uint64_t GetSequence() const { return m_Sequence.load(memory_order_acquire); }
+
+        void Present()
+        {
+            lock_guard<mutex> Lock(m_Mutex);
+            m_Pixels[m_Sequence % m_Pixels.size()]++;
+            m_Sequence++;
+        }
+
+        /// <summary>
+        /// Maps the surface and hands Read its pixels and pitch while it stays mapped.
+        /// </summary>
+        template <typename Function> void Map(Function&& Read)
+        {
+            lock_guard<mutex> Lock(m_Mutex);
+            auto Until = steady_clock::now() + ReadersMapStall;
+            while (steady_clock::now() < Until)
+            {
+            }
+            Read(m_Pixels.data(), ReadersWidth * 4);
+        }
+
+    private:
+        mutex m_Mutex;
+        vector<uint32_t> m_Pixels;
+        atomic<uint64_t> m_Sequence = 1;
+    };
+
+    struct ReadersResult
+    {
+        uint64_t Requests = 0;
+        uint64_t Readbacks = 0;
+        vector<double> Latencies;  // Microseconds, sorted
+    };
+
+    /// <summary>
+    /// Runs Readers threads that request the current frame of a surface presenting at 60 Hz, as fast as they can, and
+    /// copy it out as a passthrough request would.
+    /// </summary>
+    ReadersResult MeasureReaders(uint32_t Readers, bool Cached)
+    {
+        MockSurface Surface;
+        Readback::FrameCache Cache;
+        atomic<bool> Stop = false;
+        atomic<uint64_t> Readbacks = 0;
+        mutex ResultMutex;
+        ReadersResult Result;
+
+        thread Producer([&]
+            {
+                while (!Stop.load(memory_order_relaxed))
+                {
+                    this_thread::sleep_for(ReadersFrameInterval);
+                    Surface.Present();
+                }
+            });
+
+        vector<thread> Threads;
+        for (uint32_t i = 0; i < Readers; i++)
+        {
+            Threads.emplace_back([&]
+                {
+                    vector<uint32_t> Output(size_t(ReadersWidth) * ReadersHeight);
+                    const size_t Bytes = Output.size() * 4;
+                    vector<double> Latencies;
+                    while (!Stop.load(memory_order_relaxed))
+                    {
+                        auto Start = steady_clock::now();
+                        uint64_t Sequence = Surface.GetSequence();
+                        if (Cached)
+                        {
+                            auto Frame = Cache.Get(Sequence, [&](Readback::Frame& Target)
+                                {
+                                    Surface.Map([&](const void* Pixels, uint32_t Pitch)
+                                        {
+                                            Target.Width = ReadersWidth;
+                                            Target.Height = ReadersHeight;
+                                            Target.Pitch = Pitch;
+                                            Target.Pixels.resize(size_t(Pitch) * ReadersHeight);
+                                            memcpy(Target.Pixels.data(), Pixels, Target.Pixels.size());
+                                        });
+                                    return true;
+                                });
+                            memcpy(Output.data(), Frame->Pixels.data(), Bytes);
+                        }
+                        else
+                        {
+                            Surface.Map([&](const void* Pixels, uint32_t) { memcpy(Output.data(), Pixels, Bytes); });
+                            Readbacks.fetch_add(1, memory_order_relaxed);
+                        }
+                        Latencies.push_back(duration<double, micro>(steady_clock::now() - Start).count());
+                    }
+
+                    lock_guard<mutex> Lock(ResultMutex);
+                    Result.Requests += Latencies.size();
+                    Result.Latencies.insert(Result.Latencies.end(), Latencies.begin(), Latencies.end());
+                });
+        }
+
+        this_thread::sleep_for(ReadersDuration);
+        Stop = true;
+        for (auto& Thread : Threads)
+        {
+            Thread.join();
+        }
+        Producer.join();
+
+        Result.Readbacks = Cached ? Cache.GetReadbacks() : Readbacks.load();
+        sort(Result.Latencies.begin(), Result.Latencies.end());
+        return Result;
+    }
+
+    constexpr size_t TaskTiles = 8160;  // A 1920x1088 frame of 16x16 tiles
+    constexpr auto TaskTileWork = 5us;
+    constexpr uint32_t TaskRuns = 5;
+    constexpr size_t WakeSamples = 200;
+
+    /// <summary>
+    /// Stands in for the work on one tile, Weight times the usual amount.
+    /// </summary>
+    void SpinTile(uint32_t Weight)
+    {
+        auto Until = steady_clock::now() + TaskTileWork * Weight;
+        while (steady_clock::now() < Until)
+        {
+        }
+    }
+
+    /// <summary>
+    /// Best ms of TaskRuns for one frame of synthetic tiles; skewed frames have a heavy tile in every sixteen, bunched
+    /// together as the busy part of a screen is.
+    /// </summary>
+    double MeasureTileFrame(Scheduling::TaskScheduler& Tasks, bool Skewed)
+    {
+        double Best = 1e9;
+        for (uint32_t Run = 0; Run < TaskRuns; Run++)
+        {
+            auto Start = steady_clock::now();
+            Tasks.ParallelFor(TaskTiles, 8, [&](size_t Begin, size_t End)
+                {
+                    for (size_t i = Begin; i < End; i++)
+                    {
+                        SpinTile(Skewed && i < TaskTiles / 16 ? 10 : 1);
+                    }
+                });
+            Best = min(Best, duration<double, milli>(steady_clock::now() - Start).count());
+        }
+        return Best;
+    }
+
+    /// <summary>
+    /// Microseconds from forking a task to it starting on a worker, sorted, with the workers idle for Idle before.
+    /// </summary>
+    vector<double> MeasureTaskWake(Scheduling::TaskScheduler& Tasks, microseconds Idle)
+    {
+        vector<double> Latencies;
+        for (size_t i = 0; i < WakeSamples; i++)
+        {
+            this_thread::sleep_for(Idle);
+            atomic<int64_t> Started = 0;
+            Scheduling::TaskGroup Group(Tasks);
+            auto Forked = steady_clock::now();
+            Group.Run([&] { Started = (steady_clock::now() - Forked).count(); });
+
+            // Left for a worker to take, unless there is none to take it
+            while (Tasks.GetWorkerCount() != 0 && Started.load() == 0)
+            {
+                this_thread::yield();
+            }
+            Group.Wait();
+            Latencies.push_back(duration<double, micro>(steady_clock::duration(Started.load())).count());
+        }
+        sort(Latencies.begin(), Latencies.end());
+        return Latencies;
+    }
+
+    double MeasurePsnr(const vector<uint32_t>& A, const vector<uint32_t>& B)
+    {
+        double Error = 0;
+        for (size_t i = 0; i < A.size(); i++)
+        {
+            for (int Shift = 0; Shift < 24; Shift += 8)
+            {
+                double D = double((A[i] >> Shift) & 0xFF) - double((B[i] >> Shift) & 0xFF);
+                Error += D * D;
+            }
+        }
+        double Mse = Error / (A.size() * 3.0);
+        return Mse == 0 ? 99.0 : 10 * log10(255.0 * 255.0 / Mse);
+    }
+
+    void PrintLatencies(const char* Name, const vector<double>& Latencies)
+    {
+        if (Latencies.empty())
+        {
+            printf("%-24s no samples\n", Name);
+            return;
+        }
+
+        auto Percentile = [&](double Fraction) { return Latencies[size_t(Fraction * (Latencies.size() - 1))]; };
+        printf("%-24s %9.1f %9.1f %9.1f %9.1f\n", Name, Percentile(0.5), Percentile(0.99), Percentile(0.999),
+            Latencies.back());
+    }
+
+    constexpr auto PipelineMapStall = 1ms;
+    constexpr uint32_t PipelineSurfaces = 3;
+
+    struct PipelineFrame
+    {
+        uint64_t Sequence = 0;
+        steady_clock::time_point Acquired;
+        shared_ptr<vector<uint32_t>> Surface;  // Stands in for the staging surface
+        shared_ptr<vector<uint32_t>> Pixels;   // Read back
+        vector<Protocol::DamageRect> Damage;
+        bool Full = false;
+        size_t StreamSize = 0;
+        uint64_t StreamHash = 0;
+    };
+
+    uint64_t MeasureDamage(const PipelineFrame& Frame)
+    {
+        uint64_t Pixels = Frame.Full ? uint64_t(DesktopWidth) * DesktopHeight : 0;
+        for (const Protocol::DamageRect& Rect : Frame.Damage)
+        {
+            Pixels += uint64_t(max(Rect.Right - Rect.Left, 0)) * max(Rect.Bottom - Rect.Top, 0);
+        }
+        return Pixels;
+    }
+
+    /// <summary>
+    /// The driver's stages over the scripted desktop session: acquire copies each frame into a free staging buffer,
+    /// readback waits as long as a map does and copies it out, diff narrows its damage against the frame before,
+    /// encode produces the tile stream with the cache, and publish takes note of the result. Called one after the
+    /// other for a serial run or from a stage graph; either way each stage runs on one thread at a time.
+    /// </summary>
+    class PipelineSession
+    {
+    public:
+        PipelineSession() : m_Stream(Codec::GetMaxStreamSize(DesktopWidth, DesktopHeight)),
+            m_Mirror(Protocol::TileCacheSize, false)
+        {
+            // One readback more than surfaces, the diff holds on to the frame before
+            for (uint32_t i = 0; i < PipelineSurfaces; i++)
+            {
+                m_Surfaces.push_back(make_shared<vector<uint32_t>>(size_t(DesktopWidth) * DesktopHeight));
+            }
+            for (uint32_t i = 0; i <= PipelineSurfaces + 1; i++)
+            {
+                m_Readbacks.push_back(make_shared<vector<uint32_t>>(size_t(DesktopWidth) * DesktopHeight));
+            }
+        }
+
+        bool Acquire(PipelineFrame& Frame)
+        {
+            Benchmark::CacheFrame Source;
+            if (!m_Desktop.Next(Source))
+            {
+                return false;
+            }
+            Frame.Sequence = ++m_Sequence;
+            Frame.Acquired = steady_clock::now();
+            Frame.Surface = TakeFree(m_Surfaces);
+            memcpy(Frame.Surface->data(), Source.Pixels, Frame.Surface->size() * 4);
+            Frame.Full = Source.Damage == nullptr;
+            Frame.Damage.assign(Source.Damage, Source.Damage + (Frame.Full ? 0 : Source.DamageCount));
+            m_RawDamage += MeasureDamage(Frame);
+            return true;
+        }
+
+        bool Readback(PipelineFrame& Frame)
+        {
+            this_thread::sleep_for(PipelineMapStall);
+            Frame.Pixels = TakeFree(m_Readbacks);
+            *Frame.Pixels = *Frame.Surface;
+            Frame.Surface.reset();
+            return true;
+        }
+
+        bool Diff(PipelineFrame& Frame)
+        {
+            shared_ptr<vector<uint32_t>> Base = move(m_DiffBase);
+            m_DiffBase = Frame.Pixels;
+            if (Base == nullptr)
+            {
+                return true;
+            }
+            Protocol::DamageRect Rects[Protocol::MaxDamageRects];
+            uint32_t Count = Kernels::DiffDamage(Base->data(), Frame.Pixels->data(), DesktopWidth * 4, DesktopWidth,
+                DesktopHeight, 4, Frame.Full ? nullptr : Frame.Damage.data(), uint32_t(Frame.Damage.size()), Rects,
+                Protocol::MaxDamageRects);
+            Frame.Damage.assign(Rects, Rects + Count);
+            Frame.Full = false;
+            return true;
+        }
+
+        bool Encode(PipelineFrame& Frame)
+        {
+            static const Protocol::DamageRect NoDamage = {};
+            const Protocol::DamageRect* Damage = Frame.Full ? nullptr
+                : Frame.Damage.empty() ? &NoDamage : Frame.Damage.data();
+            Frame.StreamSize = Codec::EncodeTiles(Frame.Pixels->data(), DesktopWidth * 4, DesktopWidth, DesktopHeight,
+                Damage, uint32_t(Frame.Damage.size()), 0, nullptr, &m_Mirror, nullptr, m_Stream.data(),
+                m_Stream.size());
+            Frame.StreamHash = 14695981039346656037ull;
+            for (size_t i = 0; i < Frame.StreamSize; i++)
+            {
+                Frame.StreamHash = (Frame.StreamHash ^ m_Stream[i]) * 1099511628211ull;
+            }
+            return true;
+        }
+
+        bool Publish(PipelineFrame& Frame)
+        {
+            m_Latencies.push_back(duration<double, milli>(steady_clock::now() - Frame.Acquired).count());
+            m_Hashes.push_back(Frame.StreamHash);
+            m_NarrowedDamage += MeasureDamage(Frame);
+            m_Bytes += Frame.StreamSize;
+            Frame.Pixels.reset();
+            return true;
+        }
+
+        const vector<double>& GetLatencies() const { return m_Latencies; }
+        const vector<uint64_t>& GetHashes() const { return m_Hashes; }
+        uint64_t GetRawDamage() const { return m_RawDamage; }
+        uint64_t GetNarrowedDamage() const { return m_NarrowedDamage; }
+        uint64_t GetBytes() const { return m_Bytes; }
+
+    private:
+        SyntheticDesktop m_Desktop;
+        vector<shared_ptr<vector<uint32_t>>> m_Surfaces;   // Acquire only
+        vector<shared_ptr<vector<uint32_t>>> m_Readbacks;  // Readback only
+        shared_ptr<vector<uint32_t>> m_DiffBase;
+        vector<uint8_t> m_Stream;
+        Codec::TileCache m_Mirror;
+        uint64_t m_Sequence = 0;
+        uint64_t m_RawDamage = 0;
+        uint64_t m_NarrowedDamage = 0;
+        uint64_t m_Bytes = 0;
+        vector<double> m_Latencies;
+        vector<uint64_t> m_Hashes;
+
+        // Like the driver's staging surfaces, a buffer only the ring holds can't be taken by anyone else meanwhile
+        static shared_ptr<vector<uint32_t>> TakeFree(const vector<shared_ptr<vector<uint32_t>>>& Ring)
+        {
+            for (;;)
+            {
+                for (auto& Buffer : Ring)
+                {
+                    if (Buffer.use_count() == 1)
+                    {
+                        return Buffer;
+                    }
+                }
+                this_thread::yield();
+            }
+        }
+    };
+
+    struct PipelineResult
+    {
+        double Seconds = 0;
+        double AcquireMs = 0;
+        vector<Pipeline::StageStats> Stages;
+        vector<double> Latencies;
+        vector<uint64_t> Hashes;
+        uint64_t RawDamage = 0;
+        uint64_t NarrowedDamage = 0;
+        uint64_t Bytes = 0;
+    };
+
+    PipelineResult MeasurePipeline(bool Pipelined)
+    {
+        PipelineSession Session;
+        PipelineResult Result;
+        Pipeline::StageGraph<PipelineFrame> Graph;
+        Graph.AddStage("readback", [&](PipelineFrame& Frame) { return Session.Readback(Frame); }, PipelineSurfaces);
+        Graph.AddStage("diff", [&](PipelineFrame& Frame) { return Session.Diff(Frame); }, PipelineSurfaces);
+        Graph.AddStage("encode", [&](PipelineFrame& Frame) { return Session.Encode(Frame); }, PipelineSurfaces);
+        Graph.AddStage("publish", [&](PipelineFrame& Frame) { return Session.Publish(Frame); }, PipelineSurfaces);
+        if (Pipelined)
+        {
+            Graph.Start();
+        }
+
+        auto Start = steady_clock::now();
+        double Acquire = 0;
+        PipelineFrame Frame;
+        for (;;)
+        {
+            auto AcquireStart = steady_clock::now();
+            if (!Session.Acquire(Frame))
+            {
+                break;
+            }
+            Acquire += duration<double, milli>(steady_clock::now() - AcquireStart).count();
+            if (Pipelined)
+            {
+                Graph.Submit(move(Frame));
+            }
+            else
+            {
+                Session.Readback(Frame) && Session.Diff(Frame) && Session.Encode(Frame) && Session.Publish(Frame);
+            }
+            Frame = {};
+        }
+        Graph.WaitIdle();
+        Result.Seconds = duration<double>(steady_clock::now() - Start).count();
+        Result.Stages = Graph.GetStats();
+        Graph.Stop();
+
+        Result.Latencies = Session.GetLatencies();
+        Result.AcquireMs = Acquire / max<size_t>(Result.Latencies.size(), 1);
+        sort(Result.Latencies.begin(), Result.Latencies.end());
+        Result.Hashes = Session.GetHashes();
+        Result.RawDamage = Session.GetRawDamage();
+        Result.NarrowedDamage = Session.GetNarrowedDamage();
+        Result.Bytes = Session.GetBytes();
+        return Result;
+    }
+
+    constexpr auto KernelMinTime = 50ms;  // Each case repeats for at least this long...
+    constexpr uint32_t KernelMinRuns = 3; // ...and this many times, and the best run counts
+    constexpr uint32_t KernelHeaders = 4096;
+
+    uint64_t ReadCycles()
+    {
+#if PD_BENCH_TSC
+        return __rdtsc();
+#else
+        return 0;
+#endif
+    }
+
+    /// <summary>
+    /// Pixels at a 64-byte aligned address, or Offset bytes past one.
+    /// </summary>
+    struct KernelBuffer
+    {
+        KernelBuffer(size_t Pitch, uint32_t Height, size_t Offset) : Storage(Pitch * Height + 128), Pitch(Pitch)
+        {
+            size_t Misalignment = reinterpret_cast<uintptr_t>(Storage.data()) % 64;
+            Data = Storage.data() + (64 - Misalignment) % 64 + Offset;
+        }
+
+        vector<uint8_t> Storage;
+        uint8_t* Data;
+        size_t Pitch;
+    };
+
+    struct KernelCase
+    {
+        string Name;
+        const char* Unit;  // What Items counts
+        double Items;      // Per run
+        double Bytes;      // Read and written per run
+        function<void()> Run;
+    };
+
+    struct KernelTiming
+    {
+        double Seconds;
+        double Cycles;
+    };
+
+    KernelTiming MeasureKernel(const function<void()>& Run)
+    {
+        // One run first so the buffers are paged in and the caches hold what they will for the timed ones
+        Run();
+        KernelTiming Best = { 1e9, 0 };
+        auto Until = steady_clock::now() + KernelMinTime;
+        for (uint32_t i = 0; i < KernelMinRuns || steady_clock::now() < Until; i++)
+        {
+            uint64_t StartCycles = ReadCycles();
+            auto Start = steady_clock::now();
+            Run();
+            double Seconds = duration<double>(steady_clock::now() - Start).count();
+            uint64_t Cycles = ReadCycles() - StartCycles;
+            if (Seconds < Best.Seconds)
+            {
+                Best = { Seconds, double(Cycles) };
+            }
+        }
+        return Best;
+    }
+
+    /// <summary>
+    /// The kernels of the frame path on Width x Height frames. Misaligned cases start 4 bytes past a cache line and
+    /// pad every row by 4 bytes, the way a staging surface with an odd pitch would.
+    /// </summary>
+    void AddKernelCases(uint32_t Width, uint32_t Height, bool Misaligned, vector<KernelCase>& Cases)
+    {
+        const size_t Offset = Misaligned ? 4 : 0;
+        auto MakePitch = [&](size_t RowBytes) { return Misaligned ? RowBytes + 4 : (RowBytes + 255) / 256 * 256; };
+        auto Bgra = make_shared<KernelBuffer>(MakePitch(Width * 4), Height, Offset);
+        auto Copy = make_shared<KernelBuffer>(MakePitch(Width * 4), Height, Offset);
+        auto Half = make_shared<KernelBuffer>(MakePitch(Width * 8), Height, Offset);
+        auto Hdr10 = make_shared<KernelBuffer>(MakePitch(Width * 4), Height, Offset);
+        // Big enough for the rotated frame as well
+        const uint32_t Side = max(Width, Height);
+        auto Out = make_shared<KernelBuffer>(MakePitch(Side * 4), Side, Offset);
+
+        mt19937 Random(1);
+        for (uint32_t y = 0; y < Height; y++)
+        {
+            FillPhoto(reinterpret_cast<uint32_t*>(Bgra->Data + y * Bgra->Pitch), Width, Width, 1, Random);
+            memcpy(Copy->Data + y * Copy->Pitch, Bgra->Data + y * Bgra->Pitch, Width * 4);
+            auto* Halves = reinterpret_cast<uint16_t*>(Half->Data + y * Half->Pitch);
+            auto* Words = reinterpret_cast<uint32_t*>(Hdr10->Data + y * Hdr10->Pitch);
+            for (uint32_t x = 0; x < Width; x++)
+            {
+                // Colours from 0 up to just under 1.0, opaque
+                for (uint32_t c = 0; c < 3; c++)
+                {
+                    Halves[x * 4 + c] = uint16_t(Random() % 0x3C00);
+                }
+                Halves[x * 4 + 3] = 0x3C00;
+                Words[x] = uint32_t(Random());
+            }
+        }
+
+        uint16_t Ramp[3][256];
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            Ramp[0][i] = Ramp[1][i] = Ramp[2][i] = uint16_t(pow(i / 255.0, 1.2) * 65535 + 0.5);
+        }
+        auto Lut = make_shared<Kernels::ChannelLut>();
+        Kernels::BuildChannelLut(Ramp, *Lut);
+
+        const double Pixels = double(Width) * Height;
+        char Suffix[32];
+        snprintf(Suffix, sizeof(Suffix), "/%ux%u/%s", Width, Height, Misaligned ? "misaligned" : "aligned");
+        auto Add = [&](const char* Name, double Bytes, function<void()> Run)
+            {
+                Cases.push_back({ string(Name) + Suffix, "px", Pixels, Bytes, move(Run) });
+            };
+
+        Add("copy", Pixels * 8, [=]
+            {
+                Kernels::CopyRows(Bgra->Data, Bgra->Pitch, Out->Data, Out->Pitch, Width * 4, Height);
+            });
+        // Identical frames, so every byte is compared
+        Add("diff", Pixels * 8, [=]
+            {
+                Protocol::DamageRect Rects[Protocol::MaxDamageRects];
+                Kernels::DiffDamage(Bgra->Data, Copy->Data, Bgra->Pitch, Width, Height, 4, nullptr, 0, Rects,
+                    Protocol::MaxDamageRects);
+            });
+        Add("hash", Pixels * 4, [=]
+            {
+                const uint32_t Tile = Protocol::TileSize;
+                volatile uint64_t Sink = 0;
+                for (uint32_t y = 0; y < Height; y += Tile)
+                {
+                    for (uint32_t x = 0; x < Width; x += Tile)
+                    {
+                        Sink = Sink ^ Codec::HashTile(Bgra->Data + y * Bgra->Pitch + x * 4, Bgra->Pitch,
+                            min(Tile, Width - x), min(Tile, Height - y), Protocol::DefaultTileQuality);
+                    }
+                }
+            });
+        Add("scrgb-bgra8", Pixels * 12, [=]
+            {
+                Kernels::ScRgbToBgra8(Half->Data, Half->Pitch, Out->Data, Out->Pitch, Width, Height);
+            });
+        Add("scrgb-hdr10", Pixels * 12, [=]
+            {
+                Kernels::ScRgbToHdr10(Half->Data, Half->Pitch, Out->Data, Out->Pitch, Width, Height);
+            });
+        Add("hdr10-bgra8", Pixels * 8, [=]
+            {
+                Kernels::Hdr10ToBgra8(Hdr10->Data, Hdr10->Pitch, Out->Data, Out->Pitch, Width, Height);
+            });
+        Add("bgra8-565", Pixels * 6, [=]
+            {
+                Kernels::Bgra8ToB5G6R5(Bgra->Data, Bgra->Pitch, Out->Data, Out->Pitch, Width, Height, nullptr);
+            });
+        Add("lut", Pixels * 8, [=]
+            {
+                Kernels::ApplyChannelLut(Bgra->Data, Bgra->Pitch, Out->Data, Out->Pitch, Width, Height, *Lut);
+            });
+        Add("downscale", Pixels * 5, [=]
+            {
+                Kernels::DownscaleBgra8(Bgra->Data, Bgra->Pitch, Out->Data, Out->Pitch, Width / 2, Height / 2, 1);
+            });
+        Add("rotate90", Pixels * 8, [=]
+            {
+                Kernels::TransformPixels32(Bgra->Data, Bgra->Pitch, Out->Data, Out->Pitch, Width, Height,
+                    Kernels::Orientation::Rotate90);
+            });
+    }
+
+    /// <summary>
+    /// Packing a response header with every damage rect the protocol allows and parsing it back, as the driver and
+    /// the app do once per frame.
+    /// </summary>
+    void AddHeaderCase(vector<KernelCase>& Cases)
+    {
+        auto Buffer = make_shared<vector<uint64_t>>(Protocol::MaxHeaderSize / 8);
+        auto Damage = make_shared<vector<Protocol::DamageRect>>();
+        for (int32_t i = 0; i < int32_t(Protocol::MaxDamageRects); i++)
+        {
+            Damage->push_back({ i * 16, i * 8, i * 16 + 64, i * 8 + 32 });
+        }
+
+        const double Bytes = double(Protocol::MaxHeaderSize) * 2 * KernelHeaders;
+        Cases.push_back({ "header/max-rects", "hdr", double(KernelHeaders), Bytes, [=]
+            {
+                volatile uint64_t Sink = 0;
+                for (uint32_t i = 0; i < KernelHeaders; i++)
+                {
+                    auto* Descriptor = reinterpret_cast<Protocol::FrameDescriptor*>(Buffer->data());
+                    *Descriptor = {};
+                    Descriptor->Magic = Protocol::FrameDescriptorMagic;
+                    Descriptor->Version = Protocol::Version;
+                    Descriptor->Sequence = i;
+                    Descriptor->DamageCount = Protocol::MaxDamageRects;
+                    Descriptor->HeaderSize = uint16_t(Protocol::MaxHeaderSize);
+                    Protocol::PackHeader(Buffer->data(), Damage->data());
+
+                    Protocol::FrameView View;
+                    if (Protocol::ParseFrame(Buffer->data(), Protocol::MaxHeaderSize, View))
+                    {
+                        Sink = Sink + View.Descriptor->Sequence + View.Damage[i % Protocol::MaxDamageRects].Right;
+                    }
+                }
+            } });
+    }
+
+    /// <summary>
+    /// Reads "name GB/s" lines, skipping blank ones and comments starting with #.
+    /// </summary>
+    map<string, double> ParseKernelBaseline(const string& Text)
+    {
+        map<string, double> Baseline;
+        istringstream Lines(Text);
+        string Line;
+        while (getline(Lines, Line))
+        {
+            istringstream Fields(Line);
+            string Name;
+            double Value;
+            if (Fields >> Name >> Value && Name[0] != '#')
+            {
+                Baseline[Name] = Value;
+            }
+        }
+        return Baseline;
+    }
+
+    constexpr uint32_t IsaWidths[] = { 1, 3, 4, 7, 8, 15, 16, 17, 31, 32, 33, 63, 64, 65, 130, 257 };
+    constexpr uint32_t IsaHeights[] = { 1, 2, 7 };
+
+    struct IsaKernel
+    {
+        string Name;
+        uint32_t SrcBytes;  // Per source pixel
+        function<void(const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width, uint32_t Height)>
+            Run;            // Width and Height are the source size
+    };
+
+    vector<IsaKernel> GetIsaKernels()
+    {
+        uint16_t Ramp[3][256];
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            Ramp[0][i] = Ramp[1][i] = Ramp[2][i] = uint16_t(pow(i / 255.0, 1.2) * 65535 + 0.5);
+        }
+        auto Lut = make_shared<Kernels::ChannelLut>();
+        Kernels::BuildChannelLut(Ramp, *Lut);
+
+        vector<IsaKernel> List =
+        {
+            { "scrgb-bgra8", 8, Kernels::ScRgbToBgra8 },
+            { "scrgb-hdr10", 8, Kernels::ScRgbToHdr10 },
+            { "hdr10-bgra8", 4, Kernels::Hdr10ToBgra8 },
+            { "stream-rows", 4, [](const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width,
+                uint32_t Height) { Kernels::StreamRows(Src, SrcPitch, Dst, DstPitch, size_t(Width) * 4, Height); } },
+            { "gamma", 4, [Lut](const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width,
+                uint32_t Height) { Kernels::ApplyChannelLut(Src, SrcPitch, Dst, DstPitch, Width, Height, *Lut); } },
+            { "bgra8-565", 4, [](const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width,
+                uint32_t Height) { Kernels::Bgra8ToB5G6R5(Src, SrcPitch, Dst, DstPitch, Width, Height, nullptr); } },
+            { "bgra8-565-lut", 4, [Lut](const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width,
+                uint32_t Height) { Kernels::Bgra8ToB5G6R5(Src, SrcPitch, Dst, DstPitch, Width, Height, Lut.get()); } },
+            { "downscale", 4, [](const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch, uint32_t Width,
+                uint32_t Height) { Kernels::DownscaleBgra8(Src, SrcPitch, Dst, DstPitch, Width / 2, Height / 2, 1); } },
+        };
+        for (uint32_t i = 0; i < 8; i++)
+        {
+            auto Transform = Kernels::Orientation(i);
+            List.push_back({ "transform" + to_string(i), 4, [Transform](const void* Src, size_t SrcPitch, void* Dst,
+                size_t DstPitch, uint32_t Width, uint32_t Height)
+                {
+                    Kernels::TransformPixels32(Src, SrcPitch, Dst, DstPitch, Width, Height, Transform);
+                } });
+        }
+        return List;
+    }
+
+    /// <summary>
+    /// Runs Kernel under Level and under Scalar on the same random Width x Height pixels, Offset bytes past a cache
+    /// line and with rows padded by as much, and compares the whole destination, padding included.
+    /// </summary>
+    bool MatchesScalar(const IsaKernel& Kernel, Kernels::Isa Level, uint32_t Width, uint32_t Height, size_t Offset,
+        mt19937& Random)
+    {
+        const size_t SrcPitch = size_t(Width) * Kernel.SrcBytes + Offset;
+        const uint32_t Side = max(Width, Height);
+        const size_t DstPitch = size_t(Side) * 4 + Offset;
+        KernelBuffer Src(SrcPitch, Height, Offset);
+        generate(Src.Storage.begin(), Src.Storage.end(), [&] { return uint8_t(Random()); });
+        KernelBuffer Expected(DstPitch, Side, Offset), Actual(DstPitch, Side, Offset);
+        fill(Expected.Storage.begin(), Expected.Storage.end(), uint8_t(0xCD));
+        fill(Actual.Storage.begin(), Actual.Storage.end(), uint8_t(0xCD));
+
+        Kernels::SelectIsa(Kernels::Isa::Scalar);
+        Kernel.Run(Src.Data, SrcPitch, Expected.Data, DstPitch, Width, Height);
+        Kernels::SelectIsa(Level);
+        Kernel.Run(Src.Data, SrcPitch, Actual.Data, DstPitch, Width, Height);
+        return memcmp(Expected.Data, Actual.Data, DstPitch * Side) == 0;
+    }
+
+    // The conversions' transfer functions in double precision, to hold the kernels' tables against
+    constexpr double SdrWhiteScRgb = 2.5, ToneMapKnee = 0.8, NitsPerScRgb = 80, PqMaxNits = 10000;
+    constexpr double PqM1 = 2610.0 / 16384, PqM2 = 2523.0 / 4096 * 128;
+    constexpr double PqC1 = 3424.0 / 4096, PqC2 = 2413.0 / 4096 * 32, PqC3 = 2392.0 / 4096 * 32;
+    constexpr uint32_t ConversionWidth = 3840, ConversionHeight = 2160;
+    constexpr double ConversionPixelError = 1 + 1.0 / 16;  // A dither step, plus what float tables may be off by
+    constexpr double ConversionMeanError = 1.0 / 16;       // Over a 4x4 block, where the dither averages out
+    constexpr double ConversionTransportError = 1;         // Of an 8-bit step, once through the 10-bit transport
+
+    double HalfToDouble(uint16_t Half)
+    {
+        uint32_t Exponent = (Half >> 10) & 0x1F, Mantissa = Half & 0x3FF;
+        double Magnitude = Exponent == 0 ? ldexp(double(Mantissa), -24)
+            : Exponent == 31 ? HUGE_VAL : ldexp(double(Mantissa | 0x400), int(Exponent) - 25);
+        return (Half & 0x8000) ? -Magnitude : Magnitude;
+    }
+
+    double PqEncodeReference(double Nits)
+    {
+        double L = pow(min(max(Nits / PqMaxNits, 0.0), 1.0), PqM1);
+        return pow((PqC1 + PqC2 * L) / (1 + PqC3 * L), PqM2);
+    }
+
+    double PqDecodeReference(double Code)
+    {
+        double E = pow(Code, 1 / PqM2);
+        return PqMaxNits * pow(max(E - PqC1, 0.0) / (PqC2 - PqC3 * E), 1 / PqM1);
+    }
+
+    /// <summary>
+    /// Linear light relative to SDR white, tone mapped and sRGB encoded, in 8-bit steps.
+    /// </summary>
+    double SdrReference(double Linear)
+    {
+        double Mapped = Linear <= ToneMapKnee ? max(Linear, 0.0)
+            : ToneMapKnee + (1 - ToneMapKnee) * (1 - exp(-(Linear - ToneMapKnee) / (1 - ToneMapKnee)));
+        return 255 * (Mapped <= 0.0031308 ? Mapped * 12.92 : 1.055 * pow(Mapped, 1 / 2.4) - 0.055);
+    }
+
+    double ScRgbToSdrReference(uint16_t Half)
+    {
+        return SdrReference(min(HalfToDouble(Half), PqMaxNits / NitsPerScRgb) / SdrWhiteScRgb);
+    }
+
+    double PqToSdrReference(uint32_t Code)
+    {
+        return SdrReference(PqDecodeReference(Code / 1023.0) / NitsPerScRgb / SdrWhiteScRgb);
+    }
+
+    /// <summary>
+    /// How far 8-bit output strays from the reference values it was converted from, in 8-bit steps. Each value fills
+    /// a 4x4 block, so every dither threshold is applied to it once and its mean can be compared as well.
+    /// </summary>
+    struct ConversionError
+    {
+        double Pixel = 0;
+        double Mean = 0;
+
+        void Add(const uint32_t* Out, size_t Pitch, uint32_t Block, uint32_t Shift, double Reference)
+        {
+            double Sum = 0;
+            for (uint32_t y = 0; y < 4; y++)
+            {
+                for (uint32_t x = 0; x < 4; x++)
+                {
+                    double Value = (Out[y * Pitch + Block * 4 + x] >> Shift) & 0xFF;
+                    Pixel = max(Pixel, abs(Value - Reference));
+                    Sum += Value;
+                }
+            }
+            Mean = max(Mean, abs(Sum / 16 - Reference));
+        }
+    };
+
+    constexpr uint32_t GammaWidth = 3840, GammaHeight = 2160;
+    constexpr double GammaFrameBudget = 1000.0 / 60;  // ms
+
+    /// <summary>
+    /// A night light ramp as the OS hands it over: blue and green pulled down, red left alone, on a slight gamma.
+    /// </summary>
+    void MakeNightLightRamp(uint16_t (&Ramp)[3][256])
+    {
+        const double Gains[3] = { 1.0, 0.82, 0.58 };
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            for (uint32_t c = 0; c < 3; c++)
+            {
+                Ramp[c][i] = uint16_t(lround(Gains[c] * pow(i / 255.0, 1.1) * 65535));
+            }
+        }
+    }
+
+    constexpr uint32_t TransformWidth = 3840, TransformHeight = 2160;
+    constexpr uint32_t TransformEdgeWidth = 333, TransformEdgeHeight = 37;  // Neither a multiple of any block
+
+    const char* const OrientationNames[] =
+    {
+        "identity", "flip horizontal", "flip vertical", "rotate 180", "transpose", "rotate 270", "rotate 90",
+        "transverse",
+    };
+
+    /// <summary>
+    /// TransformPixels32 one pixel at a time, straight from the definition of the orientation bits.
+    /// </summary>
+    void TransformReference(const uint8_t* Src, size_t SrcPitch, uint8_t* Dst, size_t DstPitch, uint32_t Width,
+        uint32_t Height, Kernels::Orientation Transform)
+    {
+        const bool FlipX = (uint32_t(Transform) & Kernels::OrientationFlipX) != 0;
+        const bool FlipY = (uint32_t(Transform) & Kernels::OrientationFlipY) != 0;
+        const bool Swap = Kernels::SwapsAxes(Transform);
+        const uint32_t OutWidth = Swap ? Height : Width, OutHeight = Swap ? Width : Height;
+        for (uint32_t y = 0; y < OutHeight; y++)
+        {
+            auto* Out = reinterpret_cast<uint32_t*>(Dst + y * DstPitch);
+            for (uint32_t x = 0; x < OutWidth; x++)
+            {
+                uint32_t SrcX = Swap ? y : x, SrcY = Swap ? x : y;
+                SrcX = FlipX ? Width - 1 - SrcX : SrcX;
+                SrcY = FlipY ? Height - 1 - SrcY : SrcY;
+                Out[x] = reinterpret_cast<const uint32_t*>(Src + SrcY * SrcPitch)[SrcX];
+            }
+        }
+    }
+
+    constexpr uint32_t SteadyWarmupFrames = 100;     // A full frame, a page switch and the popup coming and going
+    constexpr uint32_t SteadyFrames = 300;
+    constexpr uint32_t SteadyPipelinedWarmup = 50;   // Frames in flight need spares that one at a time doesn't
+    constexpr uint32_t SteadyPipelinedFrames = 150;  // The four together play the whole session
+
+    enum SteadyPhase : uint32_t
+    {
+        PhaseStages,     // Readback, diff and publish on the stage graph, one frame at a time
+        PhaseEncode,     // Response header and tile stream
+        PhaseDecode,     // Parsing the response and patching the tiles in
+        PhaseConvert,    // Downscaled B5G6R5, gamma and rotation
+        PhasePipelined,  // The stages again with frames overlapping
+        PhaseCount,
+    };
+
+    const char* const SteadyPhaseNames[PhaseCount] = { "stages", "encode", "decode", "convert", "pipelined" };
+
+    struct SteadyFrame
+    {
+        uint64_t Sequence = 0;
+        shared_ptr<vector<uint32_t>> Surface;
+        shared_ptr<const Readback::Frame> Pixels;
+        Protocol::DamageRect Damage[Protocol::MaxDamageRects];
+        uint32_t DamageCount = 0;
+        bool Full = false;
+    };
+
+    /// <summary>
+    /// The driver's frame path and the client's over the scripted desktop session, set up the way the driver and
+    /// the app set it up: staging buffers from a ring, read back through the frame cache, diffed and published on a
+    /// stage graph, then encoded, decoded and converted with scratch memory that is kept. Counts the allocations of
+    /// each phase once every buffer has grown to the session.
+    /// </summary>
+    class SteadySession
+    {
+    public:
+        SteadySession() : m_Mirror(Protocol::TileCacheSize, false), m_Consumer(Protocol::TileCacheSize, true),
+            m_Tasks(max(TaskScheduler::GetDefaultWorkerCount(), 2u))
+        {
+            for (uint32_t i = 0; i < PipelineSurfaces; i++)
+            {
+                m_Surfaces.push_back(make_shared<vector<uint32_t>>(size_t(DesktopWidth) * DesktopHeight));
+            }
+            m_Response.resize(Protocol::MaxHeaderSize + Codec::GetMaxStreamSize(DesktopWidth, DesktopHeight));
+            m_Decoded.resize(size_t(DesktopWidth) * DesktopHeight);
+            m_Converted.resize(size_t(DesktopWidth) * DesktopHeight);
+            uint16_t Ramp[3][256];
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                Ramp[0][i] = Ramp[1][i] = Ramp[2][i] = uint16_t(pow(i / 255.0, 0.8) * 65535);
+            }
+            Kernels::BuildChannelLut(Ramp, m_Lut);
+
+            m_Graph.AddStage("readback", [this](SteadyFrame& Frame) { return Readback(Frame); }, PipelineSurfaces);
+            m_Graph.AddStage("diff", [this](SteadyFrame& Frame) { return Diff(Frame); }, PipelineSurfaces);
+            m_Graph.AddStage("publish", [this](SteadyFrame& Frame) { return Publish(Frame); }, PipelineSurfaces);
+            m_Graph.Start();
+        }
+
+        /// <summary>
+        /// Plays Frames frames, each through the whole path or, Pipelined, through the stages alone without waiting
+        /// for the one before. Returns false when the session ran out of frames or a frame didn't come through.
+        /// </summary>
+        bool Play(uint32_t Frames, bool Pipelined, Allocation::Counts (&Phases)[PhaseCount])
+        {
+            for (uint32_t i = 0; i < Frames; i++)
+            {
+                Benchmark::CacheFrame Source;
+                if (!m_Desktop.Next(Source))
+                {
+                    return false;
+                }
+                SteadyFrame Frame;
+                Frame.Sequence = ++m_Sequence;
+                Frame.Surface = TakeFree();
+                memcpy(Frame.Surface->data(), Source.Pixels, Frame.Surface->size() * 4);
+                Frame.Full = Source.Damage == nullptr;
+                Frame.DamageCount = Frame.Full ? 0 : min(Source.DamageCount, Protocol::MaxDamageRects);
+                copy(Source.Damage, Source.Damage + Frame.DamageCount, Frame.Damage);
+
+                Measure(Phases[Pipelined ? PhasePipelined : PhaseStages], [&]
+                    {
+                        m_Graph.Submit(move(Frame));
+                        if (!Pipelined)
+                        {
+                            m_Graph.WaitIdle();
+                        }
+                    });
+                if (!Pipelined && !Request(Phases))
+                {
+                    return false;
+                }
+            }
+            m_Graph.WaitIdle();
+            return true;
+        }
+
+    private:
+        SyntheticDesktop m_Desktop;
+        vector<shared_ptr<vector<uint32_t>>> m_Surfaces;
+        Readback::FrameCache m_Cache;
+        shared_ptr<const Readback::Frame> m_DiffBase;
+        Pipeline::StageGraph<SteadyFrame> m_Graph;
+        uint64_t m_Sequence = 0;
+
+        mutex m_PublishedMutex;
+        SteadyFrame m_Published;
+        uint64_t m_LastSequence = 0;  // The client's
+
+        Codec::TileCache m_Mirror;
+        Codec::TileCache m_Consumer;
+        Codec::TileScratch m_EncodeScratch;
+        Codec::TileScratch m_DecodeScratch;
+        TaskScheduler m_Tasks;
+        vector<uint8_t> m_Response;
+        vector<uint32_t> m_Decoded;
+        vector<uint32_t> m_Converted;
+        Kernels::ChannelLut m_Lut;
+
+        template <typename Function>
+        static void Measure(Allocation::Counts& Total, const Function& Body)
+        {
+            Allocation::Counts Before = Allocation::GetCounts();
+            Body();
+            Allocation::Counts After = Allocation::GetCounts();
+            Total.Allocations += After.Allocations - Before.Allocations;
+            Total.Bytes += After.Bytes - Before.Bytes;
+        }
+
+        shared_ptr<vector<uint32_t>> TakeFree()
+        {
+            for (;;)
+            {
+                for (auto& Buffer : m_Surfaces)
+                {
+                    if (Buffer.use_count() == 1)
+                    {
+                        return Buffer;
+                    }
+                }
+                this_thread::yield();
+            }
+        }
+
+        bool Readback(SteadyFrame& Frame)
+        {
+            const vector<uint32_t>& Surface = *Frame.Surface;
+            Frame.Pixels = m_Cache.Get(Frame.Sequence, [&](Readback::Frame& Target)
+                {
+                    Target.Width = DesktopWidth;
+                    Target.Height = DesktopHeight;
+                    Target.Pitch = DesktopWidth * 4;
+                    Target.Pixels.resize(Surface.size() * 4);
+                    memcpy(Target.Pixels.data(), Surface.data(), Target.Pixels.size());
+                    return true;
+                });
+            Frame.Surface.reset();
+            return Frame.Pixels != nullptr;
+        }
+
+        bool Diff(SteadyFrame& Frame)
+        {
+            shared_ptr<const Readback::Frame> Base = move(m_DiffBase);
+            m_DiffBase = Frame.Pixels;
+            if (Base != nullptr)
+            {
+                Frame.DamageCount = Kernels::DiffDamage(Base->Pixels.data(), Frame.Pixels->Pixels.data(),
+                    Frame.Pixels->Pitch, DesktopWidth, DesktopHeight, 4, Frame.Full ? nullptr : Frame.Damage,
+                    Frame.DamageCount, Frame.Damage, Protocol::MaxDamageRects);
+                Frame.Full = false;
+            }
+            return true;
+        }
+
+        bool Publish(SteadyFrame& Frame)
+        {
+            lock_guard<mutex> Lock(m_PublishedMutex);
+            m_Published = move(Frame);
+            return true;
+        }
+
+        // What a request for the published frame and the client receiving it do, a tile stream over the cache
+        // followed by the conversions of the other output formats
+        bool Request(Allocation::Counts (&Phases)[PhaseCount])
+        {
+            shared_ptr<const Readback::Frame> Pixels;
+            Protocol::DamageRect Damage[Protocol::MaxDamageRects];
+            uint32_t DamageCount;
+            bool Full;
+            {
+                lock_guard<mutex> Lock(m_PublishedMutex);
+                Pixels = m_Published.Pixels;
+                DamageCount = m_Published.DamageCount;
+                Full = m_Published.Full || m_Published.Sequence != m_LastSequence + 1;
+                copy(m_Published.Damage, m_Published.Damage + DamageCount, Damage);
+                m_LastSequence = m_Published.Sequence;
+            }
+            if (Pixels == nullptr)
+            {
+                return false;
+            }
+
+            auto* Descriptor = reinterpret_cast<Protocol::FrameDescriptor*>(m_Response.data());
+            size_t Length = 0;
+            Measure(Phases[PhaseEncode], [&]
+                {
+                    *Descriptor = {};
+                    Descriptor->Magic = Protocol::FrameDescriptorMagic;
+                    Descriptor->Version = Protocol::Version;
+                    Descriptor->Width = DesktopWidth;
+                    Descriptor->Height = DesktopHeight;
+                    Descriptor->Sequence = m_LastSequence;
+                    Descriptor->Flags = Full ? uint32_t(Protocol::FrameFullDamage) : 0u;
+                    Descriptor->Compression = Protocol::CompressionTiles;
+                    Descriptor->Pitch = DesktopWidth * 4;
+                    Descriptor->DamageCount = Full ? 0 : DamageCount;
+                    Descriptor->HeaderSize = uint16_t(Protocol::GetHeaderSize(Descriptor->DamageCount));
+                    Protocol::PackHeader(m_Response.data(), Damage);
+                    Descriptor->DataSize = Codec::EncodeTiles(Pixels->Pixels.data(), Pixels->Pitch, DesktopWidth,
+                        DesktopHeight, Full ? nullptr : Damage, DamageCount, 0, nullptr, &m_Mirror, &m_Tasks,
+                        m_Response.data() + Descriptor->HeaderSize, m_Response.size() - Descriptor->HeaderSize,
+                        &m_EncodeScratch);
+                    Length = size_t(Protocol::GetResponseSize(*Descriptor));
+                });
+
+            bool Decoded = false;
+            Measure(Phases[PhaseDecode], [&]
+                {
+                    Protocol::FrameView View;
+                    Decoded = Protocol::ParseFrame(m_Response.data(), Length, View) && View.Data != nullptr
+                        && Codec::DecodeTiles(View.Data, size_t(View.Descriptor->DataSize), m_Decoded.data(),
+                            DesktopWidth * 4, DesktopWidth, DesktopHeight, &m_Consumer, &m_Tasks, &m_DecodeScratch);
+                });
+
+            Measure(Phases[PhaseConvert], [&]
+                {
+                    // Like the driver, shrunk and packed a piece of a row at a time through the stack
+                    uint32_t Row[256];
+                    auto* Packed = reinterpret_cast<uint16_t*>(m_Converted.data());
+                    for (uint32_t y = 0; y < DesktopHeight / 2; y++)
+                    {
+                        const uint8_t* Source = Pixels->Pixels.data() + size_t(y) * 2 * Pixels->Pitch;
+                        for (uint32_t x = 0; x < DesktopWidth / 2; x += 256)
+                        {
+                            uint32_t Count = min(DesktopWidth / 2 - x, 256u);
+                            Kernels::DownscaleBgra8(Source + size_t(x) * 8, Pixels->Pitch, Row, 0, Count, 1, 1);
+                            Kernels::Bgra8ToB5G6R5(Row, 0, Packed + size_t(y) * DesktopWidth / 2 + x, 0, Count, 1,
+                                &m_Lut);
+                        }
+                    }
+                    Kernels::ApplyChannelLut(Pixels->Pixels.data(), Pixels->Pitch, m_Converted.data(),
+                        DesktopWidth * 4, DesktopWidth, DesktopHeight, m_Lut);
+                    Kernels::TransformPixels32(Pixels->Pixels.data(), Pixels->Pitch, m_Converted.data(),
+                        DesktopHeight * 4, DesktopWidth, DesktopHeight, Kernels::Orientation::Rotate90);
+                });
+            return Decoded;
+        }
+    };
+
+    constexpr uint32_t PoolModes[][2] = { { 1920, 1080 }, { 2560, 1440 }, { 3840, 2160 }, { 1280, 720 } };
+    constexpr uint32_t PoolFramesPerMode = 10;
+    constexpr uint32_t PoolCycles = 4;  // Through every mode, the first to warm up
+
+    /// <summary>
+    /// What the viewer did before the frame pool: a vector that only learns a frame is larger from a round trip that
+    /// fails for lack of room, is then grown, zero-filling the difference, and is cut to what the frame used.
+    /// </summary>
+    class VectorReceiver
+    {
+    public:
+        void Receive(const uint8_t* Response, size_t Size)
+        {
+            if (m_Buffer.size() < Size)
+            {
+                const char* Before = m_Buffer.data();
+                m_RoundTrips++;
+                m_ZeroFilled += Size - m_Buffer.size();
+                m_Buffer.resize(Size);
+                m_Allocations += m_Buffer.data() != Before;
+            }
+            memcpy(m_Buffer.data(), Response, Size);
+            m_Buffer.resize(Size);
+        }
+
+        uint64_t GetAllocations() const { return m_Allocations; }
+        uint64_t GetRoundTrips() const { return m_RoundTrips; }
+        uint64_t GetZeroFilled() const { return m_ZeroFilled; }
+
+    private:
+        vector<char> m_Buffer;
+        uint64_t m_Allocations = 0;
+        uint64_t m_RoundTrips = 0;
+        uint64_t m_ZeroFilled = 0;
+    };
+
+    /// <summary>
+    /// What the viewer does now: a buffer from the frame pool, sized once from the capability query, the way
+    /// FrameSource::ReserveFrame takes it.
+    /// </summary>
+    class PoolReceiver
+    {
+    public:
+        explicit PoolReceiver(size_t Capacity) { m_Pool.SetCapacity(Capacity); }
+        ~PoolReceiver() { m_Pool.Release(move(m_Buffer)); }
+
+        bool Receive(const uint8_t* Response, size_t Size)
+        {
+            if (m_Buffer == nullptr || m_Buffer->GetCapacity() < Size)
+            {
+                auto Buffer = m_Pool.Acquire(Size);
+                if (Buffer == nullptr)
+                {
+                    return false;
+                }
+                m_Pool.Release(move(m_Buffer));
+                m_Buffer = move(Buffer);
+            }
+            memcpy(m_Buffer->GetData(), Response, Size);
+            return true;
+        }
+
+        uint64_t GetAllocations() const { return m_Pool.GetAllocationCount(); }
+
+    private:
+        Memory::FramePool m_Pool;
+        unique_ptr<Memory::FrameBuffer> m_Buffer;
+    };
+
+    constexpr auto MockDeviceCost = 40ms;  // Roughly what a factory, an adapter lookup and a device take to create
+    constexpr uint32_t DeviceSwitches = 20;
+
+    struct MockDevice
+    {
+        uint64_t Adapter = 0;
+        uint32_t Serial = 0;  // Order of creation, from 1
+        atomic<bool> Lost = false;
+    };
+
+    /// <summary>
+    /// Stands in for DXGI and D3D11: creating a device takes a while, an adapter can be made to fail creation and a
+    /// device can be marked lost.
+    /// </summary>
+    class MockDeviceFactory
+    {
+    public:
+        shared_ptr<MockDevice> Create(uint64_t Adapter)
+        {
+            this_thread::sleep_for(MockDeviceCost);
+            if (Adapter == m_Failing.load())
+            {
+                return nullptr;
+            }
+            auto Device = make_shared<MockDevice>();
+            Device->Adapter = Adapter;
+            Device->Serial = m_Created.fetch_add(1) + 1;
+            return Device;
+        }
+
+        void SetFailing(uint64_t Adapter) { m_Failing = Adapter; }
+        uint32_t GetCreated() const { return m_Created.load(); }
+
+    private:
+        atomic<uint64_t> m_Failing = ~0ull;
+        atomic<uint32_t> m_Created = 0;
+    };
+
+    constexpr uint32_t LatencyFrames = 240;
+    constexpr auto LatencyFrameInterval = 16667us;
+    constexpr auto LatencyPollInterval = 1ms;  // What the app's backoff settles on while frames keep coming
+    constexpr uint32_t MarkerCheckWidth = 640;
+    constexpr uint32_t MarkerCheckHeight = 16;
+
+    struct LatencyResults
+    {
+        Probe::LatencyHistogram Latency;
+        uint64_t Received = 0;
+        uint64_t Unreadable = 0;  // Frames whose marker didn't read back
+        uint64_t Stale = 0;       // Frames showing the marker of another frame
+    };
+
+    /// <summary>
+    /// The scripted desktop session presented at 60 Hz, every frame stamped with its present time the way the driver
+    /// stamps it, and a client polling for frames the way the app does. Each frame is received as a tile stream over
+    /// the cache or downscaled to B5G6R5, and its marker is read back where the app would present it.
+    /// </summary>
+    class LatencySession
+    {
+    public:
+        LatencySession() : m_Frame(size_t(DesktopWidth) * DesktopHeight), m_Mirror(Protocol::TileCacheSize, false),
+            m_Consumer(Protocol::TileCacheSize, true), m_Stream(Codec::GetMaxStreamSize(DesktopWidth, DesktopHeight)),
+            m_Decoded(size_t(DesktopWidth) * DesktopHeight), m_Packed(size_t(DesktopWidth / 2) * (DesktopHeight / 2))
+        {
+        }
+
+        void Run(bool Tiles, LatencyResults& Results)
+        {
+            atomic<bool> Presenting = true;
+            thread Producer([&]
+                {
+                    auto Next = steady_clock::now();
+                    for (uint32_t i = 0; i < LatencyFrames; i++, Next += LatencyFrameInterval)
+                    {
+                        this_thread::sleep_until(Next);
+                        if (!Present())
+                        {
+                            break;
+                        }
+                    }
+                    Presenting = false;
+                });
+
+            uint64_t LastSequence = 0;
+            for (;;)
+            {
+                uint64_t Stamp;
+                {
+                    unique_lock<mutex> Lock(m_Mutex);
+                    if (m_Sequence == LastSequence)
+                    {
+                        Lock.unlock();
+                        if (!Presenting)
+                        {
+                            break;
+                        }
+                        this_thread::sleep_for(LatencyPollInterval);
+                        continue;
+                    }
+                    LastSequence = m_Sequence;
+                    Stamp = m_Stamp;
+                    Request(Tiles);
+                }
+
+                uint64_t Value;
+                bool Read = Tiles
+                    ? Codec::DecodeTiles(m_Stream.data(), m_StreamSize, m_Decoded.data(), DesktopWidth * 4,
+                        DesktopWidth, DesktopHeight, &m_Consumer, nullptr, &m_DecodeScratch)
+                        && Probe::ReadMarker(m_Decoded.data(), DesktopWidth * 4, DesktopWidth, DesktopHeight,
+                            Protocol::PixelFormat::BGRA8, 0, Value)
+                    : Probe::ReadMarker(m_Packed.data(), DesktopWidth, DesktopWidth / 2, DesktopHeight / 2,
+                        Protocol::PixelFormat::B5G6R5, 1, Value);
+                uint64_t Now = uint64_t(duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count());
+                Results.Received++;
+                if (!Read)
+                {
+                    Results.Unreadable++;
+                }
+                else if (Value != Stamp)
+                {
+                    Results.Stale++;
+                }
+                else
+                {
+                    Results.Latency.Add(Now - Value);
+                }
+            }
+            Producer.join();
+        }
+
+    private:
+        SyntheticDesktop m_Desktop;
+        mutex m_Mutex;
+        vector<uint32_t> m_Frame;
+        uint64_t m_Sequence = 0;
+        uint64_t m_Stamp = 0;
+        Protocol::DamageRect m_Damage[Protocol::MaxDamageRects];  // Since the client's last frame
+        uint32_t m_DamageCount = 0;
+        bool m_Full = true;
+
+        Codec::TileCache m_Mirror;
+        Codec::TileCache m_Consumer;
+        Codec::TileScratch m_EncodeScratch;
+        Codec::TileScratch m_DecodeScratch;
+        vector<uint8_t> m_Stream;
+        size_t m_StreamSize = 0;
+        vector<uint32_t> m_Decoded;
+        vector<uint16_t> m_Packed;
+
+        bool Present()
+        {
+            Benchmark::CacheFrame Source;
+            if (!m_Desktop.Next(Source))
+            {
+                return false;
+            }
+
+            // The present time is taken first, so the latency includes reading the frame back like the driver's
+            lock_guard<mutex> Lock(m_Mutex);
+            m_Stamp = uint64_t(duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count());
+            memcpy(m_Frame.data(), Source.Pixels, m_Frame.size() * 4);
+            Probe::StampMarker(m_Frame.data(), DesktopWidth * 4, DesktopWidth, DesktopHeight,
+                Protocol::PixelFormat::BGRA8, m_Stamp);
+            m_Sequence++;
+            if (Source.Damage == nullptr || m_DamageCount + Source.DamageCount + 1 > Protocol::MaxDamageRects)
+            {
+                m_Full = true;
+                m_DamageCount = 0;
+            }
+            else if (!m_Full)
+            {
+                copy(Source.Damage, Source.Damage + Source.DamageCount, m_Damage + m_DamageCount);
+                m_DamageCount += Source.DamageCount;
+                m_Damage[m_DamageCount++] = Probe::MarkerRect;
+            }
+            return true;
+        }
+
+        // What the driver does for a request, under the lock like it holds the published frame
+        void Request(bool Tiles)
+        {
+            if (Tiles)
+            {
+                m_StreamSize = Codec::EncodeTiles(m_Frame.data(), DesktopWidth * 4, DesktopWidth, DesktopHeight,
+                    m_Full ? nullptr : m_Damage, m_DamageCount, 0, nullptr, &m_Mirror, nullptr, m_Stream.data(),
+                    m_Stream.size(), &m_EncodeScratch);
+            }
+            else
+            {
+                uint32_t* Shrunk = m_Decoded.data();
+                Kernels::DownscaleBgra8(m_Frame.data(), DesktopWidth * 4, Shrunk, DesktopWidth * 2, DesktopWidth / 2,
+                    DesktopHeight / 2, 1);
+                Kernels::Bgra8ToB5G6R5(Shrunk, DesktopWidth * 2, m_Packed.data(), DesktopWidth, DesktopWidth / 2,
+                    DesktopHeight / 2, nullptr);
+            }
+            m_Full = false;
+            m_DamageCount = 0;
+        }
+    };
+
+    /// <summary>
+    /// Stamps a marker in Format, runs Convert over it and reads it back as Output. Convert gets the stamped pixels
+    /// and their pitch and writes the converted ones; without it the stamped pixels are read back directly.
+    /// </summary>
+    bool CheckMarker(Protocol::PixelFormat Format, Protocol::PixelFormat Output, uint32_t Shift,
+        const function<void(const void*, size_t, void*, size_t)>& Convert)
+    {
+        const uint64_t Value = 0x0123456789ABCDEFull;
+        const size_t Pitch = size_t(MarkerCheckWidth) * Protocol::BytesPerPixel(Format);
+        const size_t OutputPitch = size_t(MarkerCheckWidth >> Shift) * Protocol::BytesPerPixel(Output);
+        vector<uint8_t> Stamped(Pitch * MarkerCheckHeight), Converted(OutputPitch * (MarkerCheckHeight >> Shift));
+        if (!Probe::StampMarker(Stamped.data(), Pitch, MarkerCheckWidth, MarkerCheckHeight, Format, Value))
+        {
+            return false;
+        }
+        if (Convert)
+        {
+            Convert(Stamped.data(), Pitch, Converted.data(), OutputPitch);
+        }
+        uint64_t Read = 0;
+        return Probe::ReadMarker(Convert ? Converted.data() : Stamped.data(), Convert ? OutputPitch : Pitch,
+            MarkerCheckWidth >> Shift, MarkerCheckHeight >> Shift, Output, Shift, Read) && Read == Value;
+    }
+
+    // The demand session, in simulated milliseconds: the window shown for 5 s, hidden for 7 s and shown again, while
+    // the desktop goes still from 10.5 s to 14 s so the frame the app resumes on was presented while it was hidden
+    constexpr uint64_t DemandDuration = 20'000;
+    constexpr uint64_t DemandHiddenFrom = 5'000, DemandHiddenUntil = 12'000;
+    constexpr uint64_t DemandStillFrom = 10'500, DemandStillUntil = 14'000;
+    constexpr uint64_t DemandWindow = 1'000;     // The driver's
+    constexpr uint64_t DemandTestInterval = 100;  // The app's
+    constexpr uint64_t DemandPollInterval = 16;
+
+    struct DemandResults
+    {
+        uint64_t Presented = 0;
+        uint64_t Captured = 0;
+        uint64_t CapturedHidden = 0;  // Captured more than the demand window into the pause
+        uint64_t Held = 0;
+        uint64_t Fetched = 0;
+        uint64_t Tests = 0;
+        uint64_t Wakeups = 0;
+        uint64_t Pauses = 0;
+        uint64_t PausedAt = 0;       // When the app noticed it was hidden, 0 if it never did
+        uint64_t ResumedAt = 0;      // When it fetched again after the pause
+        uint64_t ResumedFrame = 0;   // What it fetched next, a poll later
+        uint64_t LastPresented = 0;  // What the OS had presented last by then
+    };
+
+    /// <summary>
+    /// The driver's demand tracking and the app's visibility gate driven by each other over simulated time, one
+    /// millisecond at a time. Frames are numbered from 1 as presented; what the app fetches is the number captured
+    /// last, the way a request returns the frame read back last.
+    /// </summary>
+    void RunDemandSession(bool Throttled, DemandResults& Results)
+    {
+        Demand::DemandTracker Tracker(DemandWindow);
+        Demand::VisibilityGate Gate(DemandTestInterval);
+        uint64_t Captured = 0, Held = 0, NextPresent = 0, NextPoll = 0;
+        for (uint64_t Now = 1; Now <= DemandDuration; Now++)
+        {
+            bool Hidden = Now >= DemandHiddenFrom && Now < DemandHiddenUntil;
+            bool Still = Now >= DemandStillFrom && Now < DemandStillUntil;
+
+            // The OS presents at 60 Hz unless the desktop is still, when there's nothing new to present
+            if (Now >= NextPresent)
+            {
+                NextPresent = Now + 1000 / 60 + (Results.Presented % 3 == 0 ? 1 : 0);
+                if (!Still)
+                {
+                    uint64_t Frame = ++Results.Presented;
+                    if (!Throttled || Tracker.IsActive(Now))
+                    {
+                        Captured = Frame;
+                        Held = 0;
+                        Results.Captured++;
+                        Results.CapturedHidden += Hidden && Now > DemandHiddenFrom + DemandWindow;
+                    }
+                    else
+                    {
+                        Held = Frame;
+                        Results.Held++;
+                    }
+                }
+            }
+
+            if (Now < NextPoll)
+            {
+                continue;
+            }
+            NextPoll = Now + DemandPollInterval;
+            if (Throttled && !Gate.ShouldFetch())
+            {
+                if (Gate.ShouldTest(Now))
+                {
+                    Results.Tests++;
+                    Gate.OnPresent(Hidden, Now);
+                }
+                NextPoll = Gate.ShouldFetch() ? Now : Gate.GetNextTest();
+                continue;
+            }
+
+            // A request returns the frame read back last, and if it ends a pause has the held one read back for the
+            // next, which is what signalling the driver's capture thread comes to
+            uint64_t Fetched = Captured;
+            bool Woke = Tracker.OnRequest(Now);
+            if (Throttled && Woke && Held != 0)
+            {
+                Captured = Held;
+                Held = 0;
+                Results.Captured++;
+            }
+            Results.Fetched++;
+            if (Results.PausedAt != 0 && Results.ResumedAt == 0)
+            {
+                Results.ResumedAt = Now;
+            }
+            else if (Results.ResumedAt != 0 && Results.ResumedFrame == 0)
+            {
+                Results.ResumedFrame = Fetched;
+                Results.LastPresented = Results.Presented;
+            }
+
+            if (Throttled)
+            {
+                Gate.OnPresent(Hidden, Now);
+                if (!Gate.ShouldFetch() && Results.PausedAt == 0)
+                {
+                    Results.PausedAt = Now;
+                }
+            }
+        }
+        Results.Wakeups = Tracker.GetWakeups();
+        Results.Pauses = Gate.GetPauses();
+    }
+
+    // Frames read back and uploaded the way the driver and the app pass them in slices. Reading a band back first
+    // waits for its transfer, the way mapping staging memory waits for the GPU to copy it, which leaves the processor
+    // to the app meanwhile
+    constexpr uint32_t SliceWidth = 3840, SliceHeight = 2160;
+    constexpr uint32_t SlicePitch = SliceWidth * 4;
+    constexpr uint32_t SliceFrames = 12;
+    constexpr auto SliceBandTransfer = 250us;
+    constexpr uint32_t SliceCounts[] = { 1, 2, 4, 8, 16 };  // 1 is the whole frame at once
+
+    struct SliceResults
+    {
+        uint64_t Completed = 0;
+        uint64_t Superseded = 0;
+        uint64_t Torn = 0;  // Completed but not all of one frame
+    };
+
+    /// <summary>
+    /// Reads frame Sequence back into Staging band by band, publishing each as it lands. Frames alternate between
+    /// the two Sources.
+    /// </summary>
+    void ReadBackSlices(Slices::SliceBoard& Board, const vector<uint8_t>* Sources, vector<uint8_t>& Staging,
+        uint64_t Sequence, bool Paced)
+    {
+        Slices::SliceFrame Frame;
+        Frame.Sequence = Sequence;
+        Frame.Width = SliceWidth;
+        Frame.Height = SliceHeight;
+        Frame.Pitch = SlicePitch;
+        Frame.Format = uint32_t(Protocol::PixelFormat::BGRA8);
+        Frame.Pixels = Staging.data();
+        Board.Begin(Frame);
+
+        const vector<uint8_t>& Source = Sources[Sequence % 2];
+        for (uint32_t Band = 0; Band < Slices::SliceBoard::BandCount; Band++)
+        {
+            uint32_t Top, Rows;
+            Protocol::GetSliceRows(SliceHeight, Slices::SliceBoard::BandCount, Band, Top, Rows);
+            auto Until = steady_clock::now() + SliceBandTransfer;
+            while (Paced && steady_clock::now() < Until)
+            {
+                this_thread::yield();
+            }
+            Kernels::CopyRows(&Source[size_t(Top) * SlicePitch], SlicePitch, &Staging[size_t(Top) * SlicePitch],
+                SlicePitch, SlicePitch, Rows);
+            Board.Publish(Band);
+        }
+    }
+
+    /// <summary>
+    /// Receives the newest frame after Sequence in Count slices into Texture, uploading each as it comes. Returns the
+    /// frame's sequence, 0 if there was none or it was superseded halfway.
+    /// </summary>
+    uint64_t ReceiveSlices(Slices::SliceBoard& Board, uint64_t Sequence, uint32_t Count, uint32_t TimeoutMs,
+        vector<uint8_t>& Texture, SliceResults& Results)
+    {
+        Slices::SliceLease Lease;
+        uint64_t Receiving = Sequence;
+        for (uint32_t Slice = 0; Slice < Count; Slice++)
+        {
+            Slices::WaitResult Result = Board.Acquire(Receiving, Slice, Count, TimeoutMs, Lease);
+            if (Result != Slices::WaitResult::Ready)
+            {
+                Results.Superseded += Result == Slices::WaitResult::Superseded;
+                return 0;
+            }
+            const Slices::SliceFrame& Frame = Lease.GetFrame();
+            Receiving = Frame.Sequence;
+            uint32_t Top, Rows;
+            Protocol::GetSliceRows(Frame.Height, Count, Slice, Top, Rows);
+            Kernels::CopyRows(Frame.Pixels + size_t(Top) * Frame.Pitch, Frame.Pitch,
+                &Texture[size_t(Top) * SlicePitch], SlicePitch, size_t(Frame.Width) * 4, Rows);
+            Lease.Release();
+        }
+        return Receiving;
+    }
+
+    /// <summary>
+    /// Reads SliceFrames frames back one after the other, each once the last is uploaded in Count slices, and
+    /// returns the median milliseconds from the start of a readback to the end of its upload.
+    /// </summary>
+    double MeasureSlices(Slices::SliceBoard& Board, const vector<uint8_t>* Sources, vector<uint8_t>& Staging,
+        vector<uint8_t>& Texture, uint32_t Count, uint64_t& Sequence, SliceResults& Results)
+    {
+        vector<double> Latencies;
+        steady_clock::time_point Start;  // Set before each frame is put on the board, which orders it for the reader
+        uint64_t First = Sequence;
+        atomic<uint64_t> Uploaded = First;
+        atomic<bool> Done = false;
+        thread Consumer([&]
+            {
+                uint64_t Last = First;
+                for (uint32_t i = 0; i < SliceFrames; i++)
+                {
+                    // Polling like the app, which hears of no frame after the one it holds right away
+                    auto GiveUp = steady_clock::now() + 1s;
+                    uint64_t Received = 0;
+                    while (Received == 0 && steady_clock::now() < GiveUp)
+                    {
+                        Received = ReceiveSlices(Board, Last, Count, 1000, Texture, Results);
+                        this_thread::yield();
+                    }
+                    if (Received == 0)
+                    {
+                        break;
+                    }
+                    Latencies.push_back(duration<double, milli>(steady_clock::now() - Start).count());
+                    Results.Completed++;
+                    Results.Torn += memcmp(Texture.data(), Sources[Received % 2].data(), Texture.size()) != 0;
+                    Last = Received;
+                    Uploaded = Received;
+                }
+                Done = true;
+            });
+        for (uint32_t i = 0; i < SliceFrames && !Done; i++)
+        {
+            Start = steady_clock::now();
+            ReadBackSlices(Board, Sources, Staging, ++Sequence, true);
+            while (Uploaded != Sequence && !Done)
+            {
+                this_thread::yield();
+            }
+        }
+        Consumer.join();
+
+        if (Latencies.empty())
+        {
+            return 0;
+        }
+        sort(Latencies.begin(), Latencies.end());
+        return Latencies[Latencies.size() / 2];
+    }
+
+    /// <summary>
+    /// Reads frames back as fast as it can while a reader takes whichever is newest in Count slices, so frames are
+    /// replaced under the reader and the writer waits on its leases.
+    /// </summary>
+    void StreamSlices(Slices::SliceBoard& Board, const vector<uint8_t>* Sources, vector<uint8_t>& Staging,
+        vector<uint8_t>& Texture, uint32_t Count, uint64_t& Sequence, SliceResults& Results)
+    {
+        atomic<bool> Writing = true;
+        thread Consumer([&]
+            {
+                uint64_t Last = Board.GetSequence();
+                while (Writing || Board.GetSequence() != Last)
+                {
+                    uint64_t Received = ReceiveSlices(Board, Last, Count, 100, Texture, Results);
+                    if (Received == 0)
+                    {
+                        this_thread::yield();
+                        continue;
+                    }
+                    Results.Completed++;
+                    Results.Torn += memcmp(Texture.data(), Sources[Received % 2].data(), Texture.size()) != 0;
+                    Last = Received;
+                }
+            });
+        for (uint32_t i = 0; i < SliceFrames * 4; i++)
+        {
+            ReadBackSlices(Board, Sources, Staging, ++Sequence, false);
+        }
+        Writing = false;
+        Consumer.join();
+    }
+
+    // Copy strategies are checked on rows of different pitches, off a cache line and not a multiple of any chunk,
+    // then tuned for the usual desktop sizes in the bands the driver reads frames back in
+    constexpr uint32_t TunerSizes[][2] = { { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 } };
+    constexpr uint32_t TunerBytesPerPixel = 4;
+
+    bool CopiesExactly(const Tuning::CopyTuner& Tuner, const Tuning::CopyStrategy& Strategy, mt19937& Random)
+    {
+        const uint32_t Width = 1921, Height = 77;
+        const size_t RowBytes = size_t(Width) * 4, SrcPitch = RowBytes + 36, DstPitch = RowBytes + 68;
+        KernelBuffer Src(SrcPitch, Height, 4), Expected(DstPitch, Height, 4), Actual(DstPitch, Height, 4);
+        generate(Src.Storage.begin(), Src.Storage.end(), [&] { return uint8_t(Random()); });
+        fill(Expected.Storage.begin(), Expected.Storage.end(), uint8_t(0xCD));
+        fill(Actual.Storage.begin(), Actual.Storage.end(), uint8_t(0xCD));
+        Kernels::CopyRows(Src.Data, SrcPitch, Expected.Data, DstPitch, RowBytes, Height);
+        Tuner.Copy(Strategy, Src.Data, SrcPitch, Actual.Data, DstPitch, RowBytes, Height);
+        return memcmp(Expected.Data, Actual.Data, DstPitch * Height) == 0;
+    }
+
+    bool SameStrategy(const Tuning::CopyStrategy& A, const Tuning::CopyStrategy& B)
+    {
+        return A.Method == B.Method && A.Threads == B.Threads && A.ChunkRows == B.ChunkRows;
+    }
+
+    /// <summary>
+    /// Best time to copy a frame in bands with Strategy, as the driver reads one back.
+    /// </summary>
+    double MeasureFrameCopy(const Tuning::CopyTuner& Tuner, const Tuning::CopyStrategy& Strategy,
+        const KernelBuffer& Src, KernelBuffer& Dst, size_t RowBytes, uint32_t Height)
+    {
+        return MeasureKernel([&]
+            {
+                for (uint32_t Band = 0; Band < Slices::SliceBoard::BandCount; Band++)
+                {
+                    uint32_t Top, Rows;
+                    Protocol::GetSliceRows(Height, Slices::SliceBoard::BandCount, Band, Top, Rows);
+                    Tuner.Copy(Strategy, Src.Data + size_t(Top) * Src.Pitch, Src.Pitch,
+                        Dst.Data + size_t(Top) * Dst.Pitch, Dst.Pitch, RowBytes, Rows);
+                }
+            }).Seconds;
+    }
+
+    // The client library against its synthetic source, at a frame interval short enough to skip frames now and then
+    constexpr uint32_t ClientWidth = 1280, ClientHeight = 720;
+    constexpr uint32_t ClientInterval = 5;
+    constexpr auto ClientStream = 500ms;
+
+    uint64_t HashFrame(const PdFrame& Frame)
+    {
+        uint64_t Hash = 14695981039346656037ull;
+        for (uint32_t y = 0; y < Frame.Height; y++)
+        {
+            const uint8_t* Row = Frame.Pixels + size_t(y) * Frame.Pitch;
+            for (uint32_t x = 0; x < Frame.Width * 4; x++)
+            {
+                Hash = (Hash ^ Row[x]) * 1099511628211ull;
+            }
+        }
+        return Hash;
+    }
+
+    /// <summary>
+    /// Whether every pixel of After that differs from Before lies in one of After's damage rects.
+    /// </summary>
+    bool CoversChanges(const PdFrame& Before, const PdFrame& After)
+    {
+        if (After.Flags & PdFrameFullDamage)
+        {
+            return true;
+        }
+        for (uint32_t y = 0; y < After.Height; y++)
+        {
+            const uint8_t* Old = Before.Pixels + size_t(y) * Before.Pitch;
+            const uint8_t* New = After.Pixels + size_t(y) * After.Pitch;
+            if (memcmp(Old, New, size_t(After.Width) * 4) == 0)
+            {
+                continue;
+            }
+            for (uint32_t x = 0; x < After.Width; x++)
+            {
+                if (memcmp(Old + x * 4, New + x * 4, 4) == 0)
+                {
+                    continue;
+                }
+                bool Covered = false;
+                for (uint32_t i = 0; i < After.DamageCount && !Covered; i++)
+                {
+                    const PdRect& Rect = After.Damage[i];
+                    Covered = int32_t(x) >= Rect.Left && int32_t(x) < Rect.Right && int32_t(y) >= Rect.Top
+                        && int32_t(y) < Rect.Bottom;
+                }
+                if (!Covered)
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+}
+
+namespace PartialDisplay::Benchmark
+{
+    int RunJitter(const ThreadPolicy& Policy)
+    {
+        printf("Wake-up latency, %zu samples each (us)\n", JitterSamples);
+        printf("%-24s %9s %9s %9s %9s\n", "", "p50", "p99", "p99.9", "max");
+
+        {
+            ScopedThreadPolicy Applied(Policy);
+            if (Applied.GetFailures() != 0)
+            {
+                printf("Policy only partially applies (failures %#x), results reflect what could be set\n",
+                    Applied.GetFailures());
+            }
+        }
+
+        PrintLatencies("idle, default", MeasureWakeLatency(ThreadPolicy()));
+        PrintLatencies("idle, policy", MeasureWakeLatency(Policy));
+
+        CpuLoad Load;
+        PrintLatencies("loaded, default", MeasureWakeLatency(ThreadPolicy()));
+        PrintLatencies("loaded, policy", MeasureWakeLatency(Policy));
+        return 0;
+    }
+
+    int RunTracing()
+    {
+#if PD_TRACING
+        printf("Trace span cost over %zu spans\n", TracingIterations);
+        printf("%-24s %9.2f ns\n", "stopped", MeasureSpan());
+        Tracing::Start();
+        printf("%-24s %9.2f ns\n", "running", MeasureSpan());
+        Tracing::Stop();
+#else
+        printf("Built with PD_TRACING=0, spans compile to nothing\n");
+#endif
+        return 0;
+    }
+
+    int RunCodec()
+    {
+        const uint32_t Tile = Protocol::TileSize;
+        mt19937 Random(1);
+
+        size_t Correct[2] = {}, Total[2] = {};
+        vector<uint32_t> TilePixels(Tile * Tile);
+        for (size_t i = 0; i < ClassifierSamples; i++)
+        {
+            auto Truth = Codec::TileClass(i & 1);
+            if (Truth == Codec::TileClass::Photo)
+            {
+                FillPhoto(TilePixels.data(), Tile, Tile, Tile, Random);
+            }
+            else
+            {
+                FillText(TilePixels.data(), Tile, Tile, Tile, Random);
+            }
+            Total[i & 1]++;
+            Correct[i & 1] += Codec::ClassifyTile(TilePixels.data(), Tile * 4, Tile, Tile) == Truth;
+        }
+        printf("Classifier on %zu synthetic tiles\n", ClassifierSamples);
+        printf("%-24s %8.2f %%\n", "text/UI kept lossless", 100.0 * Correct[0] / Total[0]);
+        printf("%-24s %8.2f %%\n", "photo coded lossy", 100.0 * Correct[1] / Total[1]);
+
+        vector<uint32_t> Frame(size_t(CodecWidth) * CodecHeight);
+        FillPhoto(Frame.data(), CodecWidth, CodecWidth, CodecHeight, Random);
+        vector<uint8_t> Stream(Codec::GetMaxStreamSize(CodecWidth, CodecHeight));
+        vector<uint32_t> Decoded(Frame.size());
+        const size_t RawSize = Frame.size() * 4;
+
+        printf("\nPhotographic %ux%u frame, best of %u runs\n", CodecWidth, CodecHeight, CodecRuns);
+        printf("%-8s %10s %10s %10s %10s\n", "quality", "encode ms", "decode ms", "ratio", "PSNR dB");
+        for (uint32_t Quality : { 25u, 50u, 75u, 90u })
+        {
+            double Encode = 1e9, Decode = 1e9;
+            size_t Size = 0;
+            for (uint32_t Run = 0; Run < CodecRuns; Run++)
+            {
+                auto Start = steady_clock::now();
+                Size = Codec::EncodeTiles(Frame.data(), CodecWidth * 4, CodecWidth, CodecHeight, nullptr, 0, Quality,
+                    nullptr, nullptr, nullptr, Stream.data(), Stream.size());
+                auto Middle = steady_clock::now();
+                if (Size == 0 || !Codec::DecodeTiles(Stream.data(), Size, Decoded.data(), CodecWidth * 4, CodecWidth,
+                    CodecHeight, nullptr, nullptr))
+                {
+                    printf("Codec failed at quality %u\n", Quality);
+                    return 1;
+                }
+                auto End = steady_clock::now();
+                Encode = min(Encode, duration<double, milli>(Middle - Start).count());
+                Decode = min(Decode, duration<double, milli>(End - Middle).count());
+            }
+            printf("%-8u %10.1f %10.1f %9.1fx %10.2f\n", Quality, Encode, Decode, double(RawSize) / Size,
+                MeasurePsnr(Frame, Decoded));
+        }
+        return 0;
+    }
+
+    int RunTileCache(const function<bool(CacheFrame&)>& Next)
+    {
+        optional<SyntheticDesktop> Desktop;
+        if (!Next)
+        {
+            printf("Building a synthetic %ux%u desktop session\n", DesktopWidth, DesktopHeight);
+            Desktop.emplace();
+        }
+
+        // The same frames go through the codec with and without the cache; both must decode to the same pixels
+        Codec::TileCache Mirror(Protocol::TileCacheSize, false), Store(Protocol::TileCacheSize, true);
+        vector<uint8_t> Stream;
+        vector<uint32_t> Plain, Cached;
+        uint32_t Width = 0, Height = 0;
+        size_t Frames = 0, Mismatches = 0;
+        uint64_t PlainBytes = 0, CachedBytes = 0, Pixels = 0;
+        double PlainEncode = 0, CachedEncode = 0, PlainDecode = 0, CachedDecode = 0;
+
+        CacheFrame Frame;
+        while (Desktop ? Desktop->Next(Frame) : Next(Frame))
+        {
+            if (Frame.Width != Width || Frame.Height != Height)
+            {
+                Width = Frame.Width;
+                Height = Frame.Height;
+                Stream.resize(Codec::GetMaxStreamSize(Width, Height));
+                Plain.assign(size_t(Width) * Height, 0);
+                Cached.assign(size_t(Width) * Height, 0);
+                Mirror.Reset();
+                Frame.Damage = nullptr;
+            }
+            for (uint32_t i = 0; Frame.Damage != nullptr && i < Frame.DamageCount; i++)
+            {
+                const Protocol::DamageRect& Rect = Frame.Damage[i];
+                Pixels += uint64_t(max(Rect.Right - Rect.Left, 0)) * max(Rect.Bottom - Rect.Top, 0);
+            }
+            Pixels += Frame.Damage == nullptr ? uint64_t(Width) * Height : 0;
+
+            auto Start = steady_clock::now();
+            size_t Size = Codec::EncodeTiles(Frame.Pixels, Frame.Pitch, Width, Height, Frame.Damage, Frame.DamageCount,
+                0, nullptr, nullptr, nullptr, Stream.data(), Stream.size());
+            auto Encoded = steady_clock::now();
+            bool Decoded = Codec::DecodeTiles(Stream.data(), Size, Plain.data(), Width * 4, Width, Height, nullptr,
+                nullptr);
+            auto End = steady_clock::now();
+            PlainEncode += duration<double, milli>(Encoded - Start).count();
+            PlainDecode += duration<double, milli>(End - Encoded).count();
+            PlainBytes += Size;
+
+            Start = steady_clock::now();
+            Size = Codec::EncodeTiles(Frame.Pixels, Frame.Pitch, Width, Height, Frame.Damage, Frame.DamageCount,
+                0, nullptr, &Mirror, nullptr, Stream.data(), Stream.size());
+            Encoded = steady_clock::now();
+            Decoded = Codec::DecodeTiles(Stream.data(), Size, Cached.data(), Width * 4, Width, Height, &Store,
+                nullptr) && Decoded;
+            End = steady_clock::now();
+            CachedEncode += duration<double, milli>(Encoded - Start).count();
+            CachedDecode += duration<double, milli>(End - Encoded).count();
+            CachedBytes += Size;
+
+            if (!Decoded)
+            {
+                printf("Frame %zu failed to decode\n", Frames);
+                return 1;
+            }
+            Mismatches += Plain != Cached;
+            Frames++;
+        }
+        if (Frames == 0)
+        {
+            printf("No frames to replay\n");
+            return 1;
+        }
+
+        printf("%zu frames, %.1f Mpixels damaged, %u tile cache\n", Frames, Pixels / 1e6, Protocol::TileCacheSize);
+        printf("%-24s %8.2f %%\n", "tile cache hit rate",
+            100.0 * Mirror.GetHits() / max<uint64_t>(Mirror.GetLookups(), 1));
+        printf("%-24s %10s %10s %14s %14s\n", "", "MB", "ratio", "encode ms/f", "decode ms/f");
+        printf("%-24s %10.1f %9.1fx %14.2f %14.2f\n", "without cache", PlainBytes / 1e6, Pixels * 4.0 / PlainBytes,
+            PlainEncode / Frames, PlainDecode / Frames);
+        printf("%-24s %10.1f %9.1fx %14.2f %14.2f\n", "with cache", CachedBytes / 1e6, Pixels * 4.0 / CachedBytes,
+            CachedEncode / Frames, CachedDecode / Frames);
+        printf("%-24s %8zu\n", "frames decoded apart", Mismatches);
+        return Mismatches == 0 ? 0 : 1;
+    }
+
+    bool TraceFrames::Next(CacheFrame& Frame)
+    {
+        while (m_Next < m_Reader.GetFrameCount())
+        {
+            Trace::Frame Recorded;
+            Protocol::FrameView View;
+            if (!m_Reader.GetFrame(m_Next++, Recorded) || !Protocol::ParseFrame(Recorded.Response, Recorded.Size, View)
+                || View.Data == nullptr)
+            {
+                m_Skipped++;
+                continue;
+            }
+
+            const Protocol::FrameDescriptor& Descriptor = *View.Descriptor;
+            uint32_t Width = Descriptor.Width, Height = Descriptor.Height;
+            bool Full = (Descriptor.Flags & Protocol::FrameFullDamage) || View.Damage == nullptr;
+            bool Tiles = (Descriptor.Compression & Protocol::CompressionTiles) != 0;
+            if (Descriptor.Format != uint32_t(Protocol::PixelFormat::BGRA8) || Protocol::GetDownscale(Descriptor) != 0
+                || (!Tiles && Descriptor.Pitch < Width * 4))
+            {
+                m_Skipped++;
+                continue;
+            }
+
+            const void* Pixels = View.Data;
+            size_t Pitch = Descriptor.Pitch;
+            if (Tiles)
+            {
+                // A stream of damaged tiles only patches the frame decoded from the stream before it
+                if (!Full && !(m_Valid && Descriptor.Sequence > m_Sequence && Width == m_Width && Height == m_Height))
+                {
+                    m_Valid = false;
+                    m_Skipped++;
+                    continue;
+                }
+                if (!m_Cache)
+                {
+                    m_Cache = make_unique<Codec::TileCache>(Protocol::TileCacheSize, true);
+                }
+                m_Decoded.resize(size_t(Width) * Height);
+                m_Valid = Codec::DecodeTiles(View.Data, size_t(Descriptor.DataSize), m_Decoded.data(), Width * 4,
+                    Width, Height, m_Cache.get(), nullptr, &m_Scratch);
+                if (!m_Valid)
+                {
+                    m_Skipped++;
+                    continue;
+                }
+                m_Width = Width;
+                m_Height = Height;
+                m_Sequence = Descriptor.Sequence;
+                Pixels = m_Decoded.data();
+                Pitch = size_t(Width) * 4;
+            }
+
+            Frame = { Pixels, Pitch, Width, Height, Full ? nullptr : View.Damage, Descriptor.DamageCount };
+            return true;
+        }
+        return false;
+    }
+
+    int RunProtocol()
+    {
+        bool Passed = true;
+        auto Check = [&](const char* What, bool Ok)
+            {
+                printf("%-44s %s\n", What, Ok ? "ok" : "FAILED");
+                Passed &= Ok;
+            };
+
+        // A response as the driver writes it: the descriptor, DamageCount rects, zeroed padding and Pitch * Height
+        // bytes of rows, over a buffer that held something else before
+        mt19937 Random(ProtocolSeed);
+        auto Build = [&](vector<uint8_t>& Response, uint32_t DamageCount, vector<Protocol::DamageRect>& Damage)
+            {
+                Protocol::FrameDescriptor Descriptor = {};
+                Descriptor.Magic = Protocol::FrameDescriptorMagic;
+                Descriptor.Version = Protocol::Version;
+                Descriptor.HeaderSize = uint16_t(Protocol::GetHeaderSize(DamageCount));
+                Descriptor.Format = uint32_t(Protocol::PixelFormat::R10G10B10A2);
+                Descriptor.Width = ProtocolWidth;
+                Descriptor.Height = ProtocolHeight;
+                Descriptor.Pitch = ProtocolWidth * 4 + 12;
+                Descriptor.DamageCount = DamageCount;
+                Descriptor.Sequence = 0x0123456789ABCDEFull;
+                Descriptor.Timestamp = 0xFEDCBA9876543210ull;
+                Descriptor.DataSize = uint64_t(Descriptor.Pitch) * ProtocolHeight;
+                Descriptor.Flags = DamageCount == 0 ? uint32_t(Protocol::FrameFullDamage) : 0u;
+                Descriptor.ColorSpace = uint32_t(Protocol::ColorSpace::Hdr10);
+
+                Damage.resize(DamageCount);
+                uniform_int_distribution<int32_t> Coordinate(0, ProtocolWidth);
+                for (Protocol::DamageRect& Rect : Damage)
+                {
+                    Rect = { Coordinate(Random), Coordinate(Random), Coordinate(Random), Coordinate(Random) };
+                }
+                Response.assign(size_t(Protocol::GetResponseSize(Descriptor)), 0xCD);
+                memcpy(Response.data(), &Descriptor, sizeof(Descriptor));
+                Protocol::PackHeader(Response.data(), Damage.data());
+                for (size_t i = Descriptor.HeaderSize; i < Response.size(); i++)
+                {
+                    Response[i] = uint8_t(i * 7);
+                }
+                return Descriptor;
+            };
+
+        vector<uint8_t> Response;
+        vector<Protocol::DamageRect> Damage;
+        bool RoundTrips = true, Padded = true;
+        for (uint32_t DamageCount : { 0u, 1u, 3u, 4u, 5u, Protocol::MaxDamageRects })
+        {
+            Protocol::FrameDescriptor Sent = Build(Response, DamageCount, Damage);
+            Protocol::FrameView View;
+            RoundTrips &= Protocol::ParseFrame(Response.data(), Response.size(), View)
+                && memcmp(View.Descriptor, &Sent, sizeof(Sent)) == 0 && View.Damage != nullptr
+                && (DamageCount == 0 || memcmp(View.Damage, Damage.data(), DamageCount * sizeof(Damage[0])) == 0)
+                && View.Data == Response.data() + Sent.HeaderSize
+                && Protocol::GetResponseSize(*View.Descriptor) == Response.size();
+            Padded &= Sent.HeaderSize % Protocol::HeaderAlignment == 0 && all_of(Response.begin()
+                + ptrdiff_t(sizeof(Sent) + DamageCount * sizeof(Damage[0])), Response.begin() + Sent.HeaderSize,
+                [](uint8_t Byte) { return Byte == 0; });
+        }
+        Check("descriptors and damage parse back as packed", RoundTrips);
+        Check("headers are padded with zeros to alignment", Padded);
+
+        Protocol::FrameDescriptor Sent = Build(Response, 3, Damage);
+        Protocol::FrameView View;
+        Check("cut to the header, parses without its data", Protocol::ParseFrame(Response.data(), Sent.HeaderSize, View)
+            && View.Damage != nullptr && View.Data == nullptr);
+        Check("cut to the descriptor, without its damage", Protocol::ParseFrame(Response.data(),
+            sizeof(Protocol::FrameDescriptor), View) && View.Damage == nullptr && View.Data == nullptr);
+        Check("cut into the descriptor, is refused", !Protocol::ParseFrame(Response.data(),
+            sizeof(Protocol::FrameDescriptor) - 1, View));
+
+        // Each breaks one field of a good response, which must then be refused
+        auto* Descriptor = reinterpret_cast<Protocol::FrameDescriptor*>(Response.data());
+        auto Refused = [&](auto&& Break)
+            {
+                Protocol::FrameDescriptor Saved = *Descriptor;
+                Break(*Descriptor);
+                bool Parsed = Protocol::ParseFrame(Response.data(), Response.size(), View);
+                *Descriptor = Saved;
+                return !Parsed;
+            };
+        Check("foreign magic and versions are refused",
+            Refused([](Protocol::FrameDescriptor& D) { D.Magic ^= 1; })
+            && Refused([](Protocol::FrameDescriptor& D) { D.Version++; }));
+        Check("damage past the header is refused",
+            Refused([](Protocol::FrameDescriptor& D) { D.DamageCount = Protocol::MaxDamageRects + 1; })
+            && Refused([](Protocol::FrameDescriptor& D) { D.HeaderSize = uint16_t(sizeof(D)); }));
+        Check("sizes wrapping around are refused",
+            Refused([](Protocol::FrameDescriptor& D) { D.DataSize = UINT64_MAX - D.HeaderSize + 1; })
+            && Refused([](Protocol::FrameDescriptor& D)
+                {
+                    D.Compression = Protocol::CompressionTiles;
+                    D.DataSize = UINT64_MAX;
+                }));
+        Check("rows past the data are refused",
+            Refused([](Protocol::FrameDescriptor& D) { D.DataSize--; })
+            && Refused([](Protocol::FrameDescriptor& D) { D.Height++; })
+            && Refused([](Protocol::FrameDescriptor& D) { D.Pitch = D.Width * 4 - 4; }));
+
+        // Tile streams are as long as they came out of the encoder, and an unchanged frame has nothing after it
+        Descriptor->Compression = Protocol::CompressionTiles;
+        Descriptor->DataSize = Sent.DataSize / 3;
+        Check("compressed data of any size parses", Protocol::ParseFrame(Response.data(), Response.size(), View)
+            && View.Data == Response.data() + Sent.HeaderSize);
+        Descriptor->Compression = Protocol::CompressionNone;
+        Descriptor->DataSize = 0;
+        Descriptor->Flags = Protocol::FrameUnchanged;
+        Check("an unchanged frame parses without data", Protocol::ParseFrame(Response.data(), Sent.HeaderSize, View)
+            && View.Data == nullptr && Protocol::GetResponseSize(*View.Descriptor) == Sent.HeaderSize);
+        return Passed ? 0 : 1;
+    }
+
+    int RunTrace()
+    {
+        bool Passed = true;
+        auto Check = [&](const char* What, bool Ok)
+            {
+                printf("%-44s %s\n", What, Ok ? "ok" : "FAILED");
+                Passed &= Ok;
+            };
+
+        string Path = (filesystem::temp_directory_path() / "PartialDisplayBench.trace").string();
+        for (bool Tiles : { false, true })
+        {
+            uint32_t Frames = Tiles ? DesktopFrames : TracePlainFrames;
+            printf("\n%u frames of the %ux%u desktop session as %s\n", Frames, DesktopWidth, DesktopHeight,
+                Tiles ? "tile streams" : "plain frames");
+
+            // Written the way the recorder appends to its mapping, a record at a time after the header
+            vector<uint8_t> Image(size_t(Trace::AlignRecord(sizeof(Trace::FileHeader))));
+            Trace::InitHeader(*reinterpret_cast<Trace::FileHeader*>(Image.data()), TraceFrequency);
+            vector<Trace::IndexEntry> Index;
+            vector<TracedResponse> Traced;
+            SessionResponses Session(Tiles, Frames);
+            const uint8_t* Response;
+            size_t Size;
+            uint64_t Timestamp;
+            double WriteSeconds = 0;
+            while (Session.Next(Response, Size, Timestamp))
+            {
+                auto Start = steady_clock::now();
+                uint64_t Offset = Image.size();
+                Image.resize(size_t(Offset + Trace::GetRecordSize(Response, Size)));
+                Trace::WriteRecord(Image.data() + Offset, Response, Size, Timestamp);
+                Index.push_back({ Offset, Timestamp });
+                reinterpret_cast<Trace::FileHeader*>(Image.data())->DataEnd = Image.size();
+                WriteSeconds += duration<double>(steady_clock::now() - Start).count();
+                Traced.push_back({ Size, Timestamp, HashResponse(Response, Size) });
+            }
+            uint64_t DataEnd = Image.size();
+            Image.resize(Image.size() + Index.size() * sizeof(Trace::IndexEntry));
+            memcpy(Image.data() + DataEnd, Index.data(), Index.size() * sizeof(Trace::IndexEntry));
+            auto* Header = reinterpret_cast<Trace::FileHeader*>(Image.data());
+            Header->IndexOffset = DataEnd;
+            Header->FrameCount = Index.size();
+
+            bool Saved = bool(ofstream(Path, ios::binary | ios::trunc).write(reinterpret_cast<const char*>(
+                Image.data()), streamsize(Image.size())));
+            Trace::MappedFile File;
+            Trace::Reader Reader;
+            Check("the trace file maps back", Saved && File.Open(Path) && File.GetSize() == Image.size()
+                && Reader.Open(File.GetData(), File.GetSize()));
+            auto Start = steady_clock::now();
+            Check("every frame reads back through the index", ReadsBack(Reader, Traced, Frames));
+            double ReadSeconds = duration<double>(steady_clock::now() - Start).count();
+
+            // As left by a recorder that was stopped before it wrote the index
+            vector<uint8_t> Unindexed(Image.begin(), Image.begin() + ptrdiff_t(DataEnd));
+            reinterpret_cast<Trace::FileHeader*>(Unindexed.data())->IndexOffset = 0;
+            reinterpret_cast<Trace::FileHeader*>(Unindexed.data())->FrameCount = 0;
+            Start = steady_clock::now();
+            bool Walked = Reader.Open(Unindexed.data(), Unindexed.size());
+            double WalkSeconds = duration<double>(steady_clock::now() - Start).count();
+            Check("without the index by walking the records", Walked && ReadsBack(Reader, Traced, Frames));
+
+            // And by one whose file was cut off in the middle of the last frame
+            reinterpret_cast<Trace::FileHeader*>(Unindexed.data())->DataEnd = DataEnd * 2;
+            Unindexed.resize(size_t(Index.back().Offset + sizeof(Trace::FrameHeader) + 16));
+            Check("cut short up to the last whole frame", Reader.Open(Unindexed.data(), Unindexed.size())
+                && ReadsBack(Reader, Traced, Frames - 1));
+            Unindexed[0] ^= 0xFF;
+            Check("anything else is refused", !Reader.Open(Unindexed.data(), Unindexed.size()));
+
+            printf("%.1f MB written at %.0f MB/s, read back at %.0f MB/s, indexed without the index in %.2f ms\n",
+                Image.size() / 1e6, Image.size() / 1e6 / WriteSeconds, Image.size() / 1e6 / ReadSeconds,
+                WalkSeconds * 1e3);
+
+            if (Tiles && Reader.Open(File.GetData(), File.GetSize()))
+            {
+                // What --bench-cache --replay feeds the tile cache benchmark must be the session's own frames, as
+                // close to them as the encoder's default quality leaves photographic tiles
+                SyntheticDesktop Desktop;
+                TraceFrames Replayed(Reader);
+                CacheFrame Expected, Actual;
+                vector<uint32_t> ExpectedPixels(size_t(DesktopWidth) * DesktopHeight), ActualPixels(ExpectedPixels);
+                double WorstPsnr = 99;
+                uint32_t Count = 0;
+                while (Desktop.Next(Expected) && Replayed.Next(Actual))
+                {
+                    if (Count++ % TraceReplaySampling == 0)
+                    {
+                        Kernels::CopyRows(Expected.Pixels, Expected.Pitch, ExpectedPixels.data(), DesktopWidth * 4,
+                            DesktopWidth * 4, DesktopHeight);
+                        Kernels::CopyRows(Actual.Pixels, Actual.Pitch, ActualPixels.data(), DesktopWidth * 4,
+                            DesktopWidth * 4, DesktopHeight);
+                        WorstPsnr = min(WorstPsnr, MeasurePsnr(ExpectedPixels, ActualPixels));
+                    }
+                }
+                printf("%u frames replayed, %.2f dB PSNR at worst\n", Count, WorstPsnr);
+                Check("tile streams replay as the frames recorded", WorstPsnr >= TraceReplayPsnr && Count == Frames
+                    && Replayed.GetSkipped() == 0);
+            }
+        }
+        remove(Path.c_str());
+        return Passed ? 0 : 1;
+    }
+
+    int RunTasks()
+    {
+        uint32_t MaxWorkers = max(thread::hardware_concurrency(), 4u);
+        vector<uint32_t> WorkerCounts;
+        for (uint32_t Workers = 0; Workers < MaxWorkers - 1; Workers = Workers == 0 ? 1 : Workers * 2)
+        {
+            WorkerCounts.push_back(Workers);
+        }
+        WorkerCounts.push_back(MaxWorkers - 1);
+
+        mt19937 Random(1);
+        vector<uint32_t> Frame(size_t(CodecWidth) * CodecHeight);
+        FillPhoto(Frame.data(), CodecWidth, CodecWidth, CodecHeight, Random);
+        vector<uint8_t> Serial(Codec::GetMaxStreamSize(CodecWidth, CodecHeight)), Stream(Serial.size());
+        vector<uint32_t> Decoded(Frame.size());
+        size_t SerialSize = Codec::EncodeTiles(Frame.data(), CodecWidth * 4, CodecWidth, CodecHeight, nullptr, 0, 0,
+            nullptr, nullptr, nullptr, Serial.data(), Serial.size());
+
+        printf("%zu tiles of %lld us, %u logical processors, best of %u runs (ms)\n", TaskTiles,
+            (long long)TaskTileWork.count(), thread::hardware_concurrency(), TaskRuns);
+        printf("%-8s %10s %10s %12s %12s %10s\n", "workers", "even", "skewed", "4K encode", "4K decode", "steals");
+        size_t Mismatches = 0;
+        for (uint32_t Workers : WorkerCounts)
+        {
+            Scheduling::TaskScheduler Tasks(Workers);
+            double Even = MeasureTileFrame(Tasks, false);
+            double Skewed = MeasureTileFrame(Tasks, true);
+
+            double Encode = 1e9, Decode = 1e9;
+            for (uint32_t Run = 0; Run < TaskRuns; Run++)
+            {
+                auto Start = steady_clock::now();
+                size_t Size = Codec::EncodeTiles(Frame.data(), CodecWidth * 4, CodecWidth, CodecHeight, nullptr, 0, 0,
+                    nullptr, nullptr, &Tasks, Stream.data(), Stream.size());
+                auto Middle = steady_clock::now();
+                bool Valid = Codec::DecodeTiles(Stream.data(), Size, Decoded.data(), CodecWidth * 4, CodecWidth,
+                    CodecHeight, nullptr, &Tasks);
+                auto End = steady_clock::now();
+                Mismatches += !Valid || Size != SerialSize || memcmp(Stream.data(), Serial.data(), Size) != 0;
+                Encode = min(Encode, duration<double, milli>(Middle - Start).count());
+                Decode = min(Decode, duration<double, milli>(End - Middle).count());
+            }
+            printf("%-8u %10.2f %10.2f %12.1f %12.1f %10llu\n", Workers, Even, Skewed, Encode, Decode,
+                (unsigned long long)Tasks.GetSteals());
+        }
+        printf("%-24s %8zu\n", "streams differing", Mismatches);
+
+        Scheduling::TaskScheduler Tasks(max(WorkerCounts.back(), 1u));
+        printf("\nFork to start on a worker, %zu samples each (us)\n", WakeSamples);
+        printf("%-24s %9s %9s %9s %9s\n", "", "p50", "p99", "p99.9", "max");
+        PrintLatencies("idle 20 us, spinning", MeasureTaskWake(Tasks, 20us));
+        PrintLatencies("idle 2 ms, asleep", MeasureTaskWake(Tasks, 2ms));
+        return Mismatches == 0 ? 0 : 1;
+    }
+
+    int RunReaders()
+    {
+        const double Seconds = duration<double>(ReadersDuration).count();
+        printf("%ux%u surface at 60 Hz, %lld ms per map, %.0f s per run\n", ReadersWidth, ReadersHeight,
+            (long long)ReadersMapStall.count(), Seconds);
+        printf("%-8s %-12s %12s %12s %10s %10s\n", "readers", "", "requests/s", "readbacks/s", "p50 us", "p99 us");
+        for (uint32_t Readers : { 1u, 2u, 4u, 8u })
+        {
+            for (bool Cached : { false, true })
+            {
+                ReadersResult Result = MeasureReaders(Readers, Cached);
+                auto Percentile = [&](double Fraction)
+                    {
+                        return Result.Latencies.empty() ? 0.0
+                            : Result.Latencies[size_t(Fraction * (Result.Latencies.size() - 1))];
+                    };
+                printf("%-8u %-12s %12.0f %12.0f %10.0f %10.0f\n", Readers, Cached ? "cached" : "per request",
+                    Result.Requests / Seconds, Result.Readbacks / Seconds, Percentile(0.5), Percentile(0.99));
+            }
+        }
+        return 0;
+    }
+
+    int RunPipeline()
+    {
+        printf("Synthetic %ux%u desktop session of %u frames, %lld ms per map, %u staging buffers\n", DesktopWidth,
+            DesktopHeight, DesktopFrames, (long long)PipelineMapStall.count(), PipelineSurfaces);
+        PipelineResult Serial = MeasurePipeline(false);
+        PipelineResult Pipelined = MeasurePipeline(true);
+
+        printf("%-12s %10s %12s %12s %12s\n", "", "frames/s", "p50 ms", "p99 ms", "max ms");
+        for (const PipelineResult* Result : { &Serial, &Pipelined })
+        {
+            const vector<double>& Latencies = Result->Latencies;
+            auto Percentile = [&](double Fraction)
+                {
+                    return Latencies.empty() ? 0.0 : Latencies[size_t(Fraction * (Latencies.size() - 1))];
+                };
+            printf("%-12s %10.1f %12.2f %12.2f %12.2f\n", Result == &Serial ? "serial" : "pipelined",
+                Latencies.size() / Result->Seconds, Percentile(0.5), Percentile(0.99),
+                Latencies.empty() ? 0.0 : Latencies.back());
+        }
+
+        printf("\n%-12s %12s %12s %12s\n", "stage", "ms each", "dropped", "max queued");
+        printf("%-12s %12.2f %12u %12s\n", "acquire", Pipelined.AcquireMs, 0u, "-");
+        for (const Pipeline::StageStats& Stage : Pipelined.Stages)
+        {
+            printf("%-12s %12.2f %12llu %12u\n", Stage.Name,
+                Stage.Processed != 0 ? Stage.BusyNs / 1e6 / Stage.Processed : 0.0,
+                (unsigned long long)Stage.Dropped, Stage.MaxDepth);
+        }
+
+        printf("\n%-24s %8.1f Mpixels, %.1f after diff\n", "damage", Pipelined.RawDamage / 1e6,
+            Pipelined.NarrowedDamage / 1e6);
+        printf("%-24s %8.1f MB\n", "tile streams", Pipelined.Bytes / 1e6);
+        bool Match = Serial.Hashes == Pipelined.Hashes && Serial.Hashes.size() == DesktopFrames;
+        printf("%-24s %8s\n", "streams match serial", Match ? "yes" : "no");
+        return Match ? 0 : 1;
+    }
+
+    int RunKernels(const string& Baseline, double Threshold, string* Measured)
+    {
+        vector<KernelCase> Cases;
+        for (auto [Width, Height] : { pair(1280u, 720u), pair(1920u, 1080u), pair(3840u, 2160u) })
+        {
+            for (bool Misaligned : { false, true })
+            {
+                AddKernelCases(Width, Height, Misaligned, Cases);
+            }
+        }
+        AddHeaderCase(Cases);
+
+        map<string, double> Expected = ParseKernelBaseline(Baseline);
+#if PD_BENCH_TSC
+        const char* CycleUnit = "ref cycles";
+#else
+        const char* CycleUnit = "no cycle counter, ns";
+#endif
+        printf("%zu kernel cases under %s, best of at least %u runs and %lld ms each, %s per item\n", Cases.size(),
+            Kernels::GetIsaName(Kernels::GetIsa()), KernelMinRuns, (long long)KernelMinTime.count(), CycleUnit);
+        if (!Expected.empty())
+        {
+            printf("Flagging cases more than %.0f %% below the baseline\n", Threshold * 100);
+        }
+        printf("%-36s %10s %12s %10s %9s\n", "", "GB/s", "cycles/item", "baseline", "change");
+
+        size_t Regressions = 0;
+        string Results = "# PartialDisplay kernel baseline, GB/s\n";
+        for (const KernelCase& Case : Cases)
+        {
+            KernelTiming Timing = MeasureKernel(Case.Run);
+            double Rate = Case.Bytes / Timing.Seconds / 1e9;
+#if PD_BENCH_TSC
+            double PerItem = Timing.Cycles / Case.Items;
+#else
+            double PerItem = Timing.Seconds * 1e9 / Case.Items;
+#endif
+            char Line[128];
+            snprintf(Line, sizeof(Line), "%s %.3f\n", Case.Name.c_str(), Rate);
+            Results += Line;
+
+            auto Found = Expected.find(Case.Name);
+            if (Found == Expected.end())
+            {
+                printf("%-36s %10.2f %8.2f/%-3s %10s %9s\n", Case.Name.c_str(), Rate, PerItem, Case.Unit, "-", "-");
+                continue;
+            }
+            double Change = Rate / Found->second - 1;
+            bool Regressed = Change < -Threshold;
+            Regressions += Regressed;
+            printf("%-36s %10.2f %8.2f/%-3s %10.2f %8.1f%%%s\n", Case.Name.c_str(), Rate, PerItem, Case.Unit,
+                Found->second, Change * 100, Regressed ? "  REGRESSED" : "");
+        }
+
+        if (Measured != nullptr)
+        {
+            *Measured = Results;
+        }
+        if (!Expected.empty())
+        {
+            printf("%-24s %8zu\n", "regressions", Regressions);
+        }
+        return Regressions == 0 ? 0 : 1;
+    }
+
+    int RunIsa()
+    {
+        const Kernels::Isa Detected = Kernels::DetectIsa(), Selected = Kernels::GetIsa();
+        const vector<IsaKernel> List = GetIsaKernels();
+        printf("Highest tier supported %s, selected %s\n", Kernels::GetIsaName(Detected),
+            Kernels::GetIsaName(Selected));
+
+        mt19937 Random(1);
+        size_t Cases = 0, Mismatches = 0;
+        for (uint32_t Level = uint32_t(Kernels::Isa::Sse2); Level <= uint32_t(Detected); Level++)
+        {
+            for (const IsaKernel& Kernel : List)
+            {
+                for (uint32_t Width : IsaWidths)
+                {
+                    for (uint32_t Height : IsaHeights)
+                    {
+                        for (size_t Offset : { 0, 4 })
+                        {
+                            Cases++;
+                            if (!MatchesScalar(Kernel, Kernels::Isa(Level), Width, Height, Offset, Random)
+                                && ++Mismatches <= 10)
+                            {
+                                printf("%s under %s differs from scalar at %ux%u, offset %zu\n", Kernel.Name.c_str(),
+                                    Kernels::GetIsaName(Kernels::Isa(Level)), Width, Height, Offset);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        printf("%zu cases compared with scalar, %zu differing\n", Cases, Mismatches);
+
+        const uint32_t Width = 1920, Height = 1080;
+        // Wide and high enough for the transposed frame as well
+        KernelBuffer Src(size_t(Width) * 8, Height, 0), Dst(size_t(Width) * 4, Width, 0);
+        generate(Src.Storage.begin(), Src.Storage.end(), [&] { return uint8_t(Random()); });
+        printf("\n%ux%u, best of at least %u runs (ms)\n%-16s", Width, Height, KernelMinRuns, "");
+        for (uint32_t Level = 0; Level <= uint32_t(Detected); Level++)
+        {
+            printf(" %9s", Kernels::GetIsaName(Kernels::Isa(Level)));
+        }
+        printf("\n");
+        for (const IsaKernel& Kernel : List)
+        {
+            printf("%-16s", Kernel.Name.c_str());
+            const size_t SrcPitch = size_t(Width) * Kernel.SrcBytes;
+            for (uint32_t Level = 0; Level <= uint32_t(Detected); Level++)
+            {
+                Kernels::SelectIsa(Kernels::Isa(Level));
+                KernelTiming Timing = MeasureKernel([&]
+                    {
+                        Kernel.Run(Src.Data, SrcPitch, Dst.Data, Dst.Pitch, Width, Height);
+                    });
+                printf(" %9.2f", Timing.Seconds * 1e3);
+            }
+            printf("\n");
+        }
+
+        Kernels::SelectIsa(Selected);
+        return Mismatches == 0 ? 0 : 1;
+    }
+
+    int RunConversions()
+    {
+        bool Passed = true;
+        auto Check = [&](const char* What, bool Ok)
+            {
+                printf("%-44s %s\n", What, Ok ? "ok" : "FAILED");
+                Passed &= Ok;
+            };
+
+        // Every non-negative finite half, each in a 4x4 block; green and blue are offset so a swap would show
+        constexpr uint32_t Halves = 0x7C00;
+        vector<uint16_t> ScRgb(size_t(Halves) * 4 * 4 * 4);
+        auto HalfOf = [](uint32_t Block, uint32_t Channel) { return uint16_t((Block + Channel * 0x1357) % Halves); };
+        for (uint32_t y = 0; y < 4; y++)
+        {
+            for (uint32_t x = 0; x < Halves * 4; x++)
+            {
+                uint16_t* Pixel = &ScRgb[(size_t(y) * Halves * 4 + x) * 4];
+                for (uint32_t c = 0; c < 3; c++)
+                {
+                    Pixel[c] = HalfOf(x / 4, c);
+                }
+                Pixel[3] = 0x3C00;
+            }
+        }
+
+        const size_t ScRgbPitch = size_t(Halves) * 4 * 8, OutPitch = size_t(Halves) * 4 * 4;
+        vector<uint32_t> Sdr(size_t(Halves) * 4 * 4), Hdr10(Sdr.size()), Transported(Sdr.size());
+        Kernels::ScRgbToBgra8(ScRgb.data(), ScRgbPitch, Sdr.data(), OutPitch, Halves * 4, 4);
+        Kernels::ScRgbToHdr10(ScRgb.data(), ScRgbPitch, Hdr10.data(), OutPitch, Halves * 4, 4);
+        Kernels::Hdr10ToBgra8(Hdr10.data(), OutPitch, Transported.data(), OutPitch, Halves * 4, 4);
+
+        ConversionError Tonemapped;
+        double PqCodes = 0, Transport = 0;
+        bool Opaque = true;
+        for (uint32_t Block = 0; Block < Halves; Block++)
+        {
+            for (uint32_t c = 0; c < 3; c++)
+            {
+                // BGRA bytes and R10G10B10A2 fields run in opposite channel orders
+                uint16_t Half = HalfOf(Block, c);
+                Tonemapped.Add(Sdr.data(), size_t(Halves) * 4, Block, 16 - c * 8, ScRgbToSdrReference(Half));
+                double Code = (Hdr10[Block * 4] >> (c * 10)) & 0x3FF;
+                double Expected = 1023 * PqEncodeReference(min(HalfToDouble(Half), PqMaxNits / NitsPerScRgb)
+                    * NitsPerScRgb);
+                PqCodes = max(PqCodes, abs(Code - Expected));
+
+                // Compared block mean with block mean, so the dither of each side cancels out
+                double Direct = 0, Through = 0;
+                for (uint32_t i = 0; i < 16; i++)
+                {
+                    size_t At = (i / 4) * size_t(Halves) * 4 + Block * 4 + i % 4;
+                    Direct += (Sdr[At] >> (16 - c * 8)) & 0xFF;
+                    Through += (Transported[At] >> (16 - c * 8)) & 0xFF;
+                }
+                if (HalfToDouble(Half) <= SdrWhiteScRgb)
+                {
+                    Transport = max(Transport, abs(Direct - Through) / 16);
+                }
+            }
+            Opaque &= (Sdr[Block * 4] >> 24) == 0xFF && (Hdr10[Block * 4] >> 30) == 3;
+        }
+
+        // Every 10-bit PQ code, the same way
+        vector<uint32_t> Pq(1024 * 4 * 4), PqSdr(Pq.size());
+        auto CodeOf = [](uint32_t Block, uint32_t Channel) { return (Block + Channel * 0x155) % 1024; };
+        for (uint32_t y = 0; y < 4; y++)
+        {
+            for (uint32_t x = 0; x < 1024 * 4; x++)
+            {
+                Pq[y * 1024 * 4 + x] = CodeOf(x / 4, 0) | (CodeOf(x / 4, 1) << 10) | (CodeOf(x / 4, 2) << 20)
+                    | (3u << 30);
+            }
+        }
+        Kernels::Hdr10ToBgra8(Pq.data(), 1024 * 4 * 4, PqSdr.data(), 1024 * 4 * 4, 1024 * 4, 4);
+        ConversionError Decoded;
+        for (uint32_t Block = 0; Block < 1024; Block++)
+        {
+            for (uint32_t c = 0; c < 3; c++)
+            {
+                Decoded.Add(PqSdr.data(), 1024 * 4, Block, 16 - c * 8, PqToSdrReference(CodeOf(Block, c)));
+            }
+            Opaque &= (PqSdr[Block * 4] >> 24) == 0xFF;
+        }
+
+        // Out of gamut: negatives are black, infinities and NaNs as bright as PQ goes
+        const uint16_t Extremes[][4] = { { 0x8001, 0xBC00, 0xFC00, 0x3C00 }, { 0x7C00, 0x7E00, 0x7BFF, 0x3C00 } };
+        uint32_t ExtremeSdr[2] = {}, ExtremePq[2] = {};
+        Kernels::ScRgbToBgra8(Extremes, 8, ExtremeSdr, 4, 1, 2);
+        Kernels::ScRgbToHdr10(Extremes, 8, ExtremePq, 4, 1, 2);
+
+        printf("Every finite half and every 10-bit PQ code, under %s\n", Kernels::GetIsaName(Kernels::GetIsa()));
+        printf("%-16s %14s %14s\n", "", "pixel error", "block error");
+        printf("%-16s %14.3f %14.3f\n", "scrgb-bgra8", Tonemapped.Pixel, Tonemapped.Mean);
+        printf("%-16s %14.3f %14.3f\n", "hdr10-bgra8", Decoded.Pixel, Decoded.Mean);
+        printf("%-16s %14.3f %14s  (PQ codes)\n", "scrgb-hdr10", PqCodes, "");
+        printf("%-16s %14s %14.3f  (SDR range, against scrgb-bgra8)\n", "through hdr10", "", Transport);
+        Check("tone mapping is within a step per pixel", Tonemapped.Pixel <= ConversionPixelError
+            && Decoded.Pixel <= ConversionPixelError);
+        Check("dithering keeps the mean of every block", Tonemapped.Mean <= ConversionMeanError
+            && Decoded.Mean <= ConversionMeanError);
+        Check("PQ encoding is within a code", PqCodes <= 1);
+        Check("the 10-bit transport keeps SDR within a step", Transport <= ConversionTransportError);
+        Check("output is opaque", Opaque);
+        Check("out of gamut clips to black and to peak", ExtremeSdr[0] == 0xFF000000 && ExtremeSdr[1] == 0xFFFFFFFF
+            && ExtremePq[0] == 0xC0000000 && ExtremePq[1] == 0xFFFFFFFF);
+
+        // Throughput on 4K frames of HDR content up to 1000 nits, under every tier
+        const Kernels::Isa Selected = Kernels::GetIsa();
+        mt19937 Random(29);
+        KernelBuffer Half(size_t(ConversionWidth) * 8, ConversionHeight, 0);
+        KernelBuffer Packed(size_t(ConversionWidth) * 4, ConversionHeight, 0), Out(Packed.Pitch, ConversionHeight, 0);
+        auto* Values = reinterpret_cast<uint16_t*>(Half.Data);
+        for (size_t i = 0; i < size_t(ConversionWidth) * ConversionHeight * 4; i++)
+        {
+            Values[i] = i % 4 == 3 ? uint16_t(0x3C00) : uint16_t(Random() % 0x4A40);  // 12.5, 1000 nits
+        }
+        Kernels::ScRgbToHdr10(Half.Data, Half.Pitch, Packed.Data, Packed.Pitch, ConversionWidth, ConversionHeight);
+
+        const pair<const char*, function<void()>> Conversions[] =
+        {
+            { "scrgb-bgra8", [&] { Kernels::ScRgbToBgra8(Half.Data, Half.Pitch, Out.Data, Out.Pitch, ConversionWidth,
+                ConversionHeight); } },
+            { "scrgb-hdr10", [&] { Kernels::ScRgbToHdr10(Half.Data, Half.Pitch, Out.Data, Out.Pitch, ConversionWidth,
+                ConversionHeight); } },
+            { "hdr10-bgra8", [&] { Kernels::Hdr10ToBgra8(Packed.Data, Packed.Pitch, Out.Data, Out.Pitch,
+                ConversionWidth, ConversionHeight); } },
+        };
+        printf("\n%ux%u, best of at least %u runs (Mpixels/s)\n%-16s", ConversionWidth, ConversionHeight,
+            KernelMinRuns, "");
+        for (uint32_t Level = 0; Level <= uint32_t(Kernels::DetectIsa()); Level++)
+        {
+            printf(" %9s", Kernels::GetIsaName(Kernels::Isa(Level)));
+        }
+        printf("\n");
+        for (const auto& [Name, Run] : Conversions)
+        {
+            printf("%-16s", Name);
+            for (uint32_t Level = 0; Level <= uint32_t(Kernels::DetectIsa()); Level++)
+            {
+                Kernels::SelectIsa(Kernels::Isa(Level));
+                printf(" %9.0f", double(ConversionWidth) * ConversionHeight / MeasureKernel(Run).Seconds / 1e6);
+            }
+            printf("\n");
+        }
+        Kernels::SelectIsa(Selected);
+        return Passed ? 0 : 1;
+    }
+
+    int RunGamma()
+    {
+        bool Passed = true;
+        auto Check = [&](const char* What, bool Ok)
+            {
+                printf("%-44s %s\n", What, Ok ? "ok" : "FAILED");
+                Passed &= Ok;
+            };
+
+        uint16_t Identity[3][256], Ramp[3][256];
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            Identity[0][i] = Identity[1][i] = Identity[2][i] = uint16_t(i * 257);
+        }
+        MakeNightLightRamp(Ramp);
+        Kernels::ChannelLut Lut;
+        Check("the identity ramp skips the stage", !Kernels::BuildChannelLut(Identity, Lut));
+        Check("a night light ramp doesn't", Kernels::BuildChannelLut(Ramp, Lut));
+
+        mt19937 Random(30);
+        KernelBuffer Src(size_t(GammaWidth) * 4 + 64, GammaHeight, 0), Dst(Src.Pitch, GammaHeight, 0);
+        KernelBuffer InPlace(Src.Pitch, GammaHeight, 0);
+        for (uint32_t y = 0; y < GammaHeight; y++)
+        {
+            FillPhoto(reinterpret_cast<uint32_t*>(Src.Data + y * Src.Pitch), GammaWidth, GammaWidth, 1, Random);
+            auto* Row = reinterpret_cast<uint32_t*>(Src.Data + y * Src.Pitch);
+            for (uint32_t x = 0; x < GammaWidth; x++)
+            {
+                Row[x] = (Row[x] & 0x00FFFFFF) | (uint32_t(Random()) << 24);  // Alpha must come through as it was
+            }
+        }
+        memcpy(InPlace.Data, Src.Data, Src.Pitch * GammaHeight);
+
+        // Every channel of every pixel against the ramp itself, rounded to 8 bits
+        Kernels::ApplyChannelLut(Src.Data, Src.Pitch, Dst.Data, Dst.Pitch, GammaWidth, GammaHeight, Lut);
+        Kernels::ApplyChannelLut(InPlace.Data, InPlace.Pitch, InPlace.Data, InPlace.Pitch, GammaWidth, GammaHeight,
+            Lut);
+        bool Mapped = true;
+        for (uint32_t y = 0; y < GammaHeight && Mapped; y++)
+        {
+            auto* In = reinterpret_cast<const uint32_t*>(Src.Data + y * Src.Pitch);
+            auto* Out = reinterpret_cast<const uint32_t*>(Dst.Data + y * Dst.Pitch);
+            for (uint32_t x = 0; x < GammaWidth; x++)
+            {
+                uint32_t Expected = In[x] & 0xFF000000;
+                for (uint32_t c = 0; c < 3; c++)
+                {
+                    uint32_t Value = (In[x] >> (16 - c * 8)) & 0xFF;
+                    Expected |= uint32_t(lround(Ramp[c][Value] * 255.0 / 65535)) << (16 - c * 8);
+                }
+                Mapped &= Out[x] == Expected;
+            }
+        }
+        Check("every pixel maps through the ramp", Mapped);
+        Check("in place maps the same", memcmp(InPlace.Data, Dst.Data, Dst.Pitch * GammaHeight) == 0);
+
+        // Packing to B5G6R5 applies the ramp on the way rather than as a stage of its own
+        KernelBuffer Packed(size_t(GammaWidth) * 2, GammaHeight, 0), Expected(Packed.Pitch, GammaHeight, 0);
+        Kernels::Bgra8ToB5G6R5(Src.Data, Src.Pitch, Packed.Data, Packed.Pitch, GammaWidth, GammaHeight, &Lut);
+        Kernels::Bgra8ToB5G6R5(Dst.Data, Dst.Pitch, Expected.Data, Expected.Pitch, GammaWidth, GammaHeight, nullptr);
+        Check("B5G6R5 packing applies it the same",
+            memcmp(Packed.Data, Expected.Data, Packed.Pitch * GammaHeight) == 0);
+
+        const pair<const char*, function<void()>> Cases[] =
+        {
+            { "memcpy", [&] { Kernels::CopyRows(Src.Data, Src.Pitch, Dst.Data, Dst.Pitch, size_t(GammaWidth) * 4,
+                GammaHeight); } },
+            { "gamma", [&] { Kernels::ApplyChannelLut(Src.Data, Src.Pitch, Dst.Data, Dst.Pitch, GammaWidth,
+                GammaHeight, Lut); } },
+            { "gamma in place", [&] { Kernels::ApplyChannelLut(InPlace.Data, InPlace.Pitch, InPlace.Data,
+                InPlace.Pitch, GammaWidth, GammaHeight, Lut); } },
+            { "b5g6r5", [&] { Kernels::Bgra8ToB5G6R5(Src.Data, Src.Pitch, Packed.Data, Packed.Pitch, GammaWidth,
+                GammaHeight, nullptr); } },
+            { "b5g6r5 + gamma", [&] { Kernels::Bgra8ToB5G6R5(Src.Data, Src.Pitch, Packed.Data, Packed.Pitch,
+                GammaWidth, GammaHeight, &Lut); } },
+        };
+        printf("\n%ux%u under %s, best of at least %u runs\n", GammaWidth, GammaHeight,
+            Kernels::GetIsaName(Kernels::GetIsa()), KernelMinRuns);
+        printf("%-16s %10s %10s %16s\n", "", "ms", "GB/s", "of a 60 Hz frame");
+        for (const auto& [Name, Run] : Cases)
+        {
+            double Seconds = MeasureKernel(Run).Seconds;
+            printf("%-16s %10.2f %10.2f %15.1f%%\n", Name, Seconds * 1e3,
+                double(GammaWidth) * GammaHeight * 8 / Seconds / 1e9, Seconds * 1e3 / GammaFrameBudget * 100);
+        }
+        printf("%-16s %10s %10s %16s\n", "identity ramp", "skipped", "", "0%");
+        return Passed ? 0 : 1;
+    }
+
+    int RunTransform()
+    {
+        bool Passed = true;
+        auto Check = [&](const char* What, bool Ok)
+            {
+                printf("%-44s %s\n", What, Ok ? "ok" : "FAILED");
+                Passed &= Ok;
+            };
+
+        // Pitches padded past the frame and off any power of two, as a real surface's may be
+        mt19937 Random(31);
+        const size_t Pitch = size_t(TransformWidth) * 4 + 64;
+        KernelBuffer Src(Pitch, TransformWidth, 0), Dst(Pitch, TransformWidth, 0), Expected(Pitch, TransformWidth, 0);
+        generate(Src.Storage.begin(), Src.Storage.end(), [&Random] { return uint8_t(Random()); });
+
+        auto Matches = [&](uint32_t Width, uint32_t Height)
+            {
+                bool Ok = true;
+                for (uint32_t i = 0; i < 8; i++)
+                {
+                    auto Transform = Kernels::Orientation(i);
+                    uint32_t OutWidth = Kernels::SwapsAxes(Transform) ? Height : Width;
+                    uint32_t OutHeight = Kernels::SwapsAxes(Transform) ? Width : Height;
+                    Kernels::TransformPixels32(Src.Data, Src.Pitch, Dst.Data, Dst.Pitch, Width, Height, Transform);
+                    TransformReference(Src.Data, Src.Pitch, Expected.Data, Expected.Pitch, Width, Height, Transform);
+                    for (uint32_t y = 0; y < OutHeight; y++)
+                    {
+                        Ok &= memcmp(Dst.Data + y * Dst.Pitch, Expected.Data + y * Expected.Pitch,
+                            size_t(OutWidth) * 4) == 0;
+                    }
+                }
+                return Ok;
+            };
+        Check("every orientation matches the reference at 4K", Matches(TransformWidth, TransformHeight));
+        Check("and on a frame of partial blocks", Matches(TransformEdgeWidth, TransformEdgeHeight));
+
+        // Damage is transformed on its own: the rect's pixels must land exactly on the mapped rect of the whole frame
+        const Protocol::DamageRect Damage = { 1001, 37, 1517, 1390 };
+        const uint32_t DamageWidth = uint32_t(Damage.Right - Damage.Left);
+        const uint32_t DamageHeight = uint32_t(Damage.Bottom - Damage.Top);
+        KernelBuffer Part(Pitch, TransformWidth, 0);
+        bool Mapped = true;
+        for (uint32_t i = 0; i < 8; i++)
+        {
+            auto Transform = Kernels::Orientation(i);
+            Kernels::TransformPixels32(Src.Data, Src.Pitch, Dst.Data, Dst.Pitch, TransformWidth, TransformHeight,
+                Transform);
+            Kernels::TransformPixels32(Src.Data + Damage.Top * Src.Pitch + Damage.Left * 4, Src.Pitch, Part.Data,
+                Part.Pitch, DamageWidth, DamageHeight, Transform);
+            Protocol::DamageRect Rect = Kernels::TransformRect(Damage, TransformWidth, TransformHeight, Transform);
+            for (int32_t y = Rect.Top; y < Rect.Bottom; y++)
+            {
+                Mapped &= memcmp(Part.Data + (y - Rect.Top) * Part.Pitch, Dst.Data + y * Dst.Pitch + Rect.Left * 4,
+                    size_t(Rect.Right - Rect.Left) * 4) == 0;
+            }
+        }
+        Check("damage transforms alone to its mapped rect", Mapped);
+
+        printf("\n%ux%u under %s, best of at least %u runs\n", TransformWidth, TransformHeight,
+            Kernels::GetIsaName(Kernels::GetIsa()), KernelMinRuns);
+        printf("%-16s %10s %10s %10s\n", "", "ms", "GB/s", "x memcpy");
+        const double Bytes = double(TransformWidth) * TransformHeight * 8;
+        double Copy = MeasureKernel([&]
+            {
+                Kernels::CopyRows(Src.Data, Src.Pitch, Dst.Data, Dst.Pitch, size_t(TransformWidth) * 4,
+                    TransformHeight);
+            }).Seconds;
+        printf("%-16s %10.2f %10.2f %10.2f\n", "memcpy", Copy * 1e3, Bytes / Copy / 1e9, 1.0);
+        for (uint32_t i = 0; i < 8; i++)
+        {
+            auto Transform = Kernels::Orientation(i);
+            double Seconds = MeasureKernel([&]
+                {
+                    Kernels::TransformPixels32(Src.Data, Src.Pitch, Dst.Data, Dst.Pitch, TransformWidth,
+                        TransformHeight, Transform);
+                }).Seconds;
+            printf("%-16s %10.2f %10.2f %10.2f\n", OrientationNames[i], Seconds * 1e3, Bytes / Seconds / 1e9,
+                Seconds / Copy);
+        }
+        return Passed ? 0 : 1;
+    }
+
+    int RunViewports()
+    {
+        bool Passed = true;
+        auto Check = [&](const char* What, bool Ok)
+            {
+                printf("%-44s %s\n", What, Ok ? "ok" : "FAILED");
+                Passed &= Ok;
+            };
+
+        Layout::ViewportSpec Spec;
+        Check("a viewport parses",
+            Layout::ParseViewport(L"10,20,300,400", Spec) && Spec.Source.Left == 10 && Spec.Source.Top == 20
+            && Spec.Source.Width == 300 && Spec.Source.Height == 400 && Spec.Monitor == UINT32_MAX);
+        Check("with its monitor", Layout::ParseViewport(L"0,0,640,480@2", Spec) && Spec.Monitor == 2);
+        bool Rejected = true;
+        for (const wchar_t* Text : { L"", L"10,20,300", L"10,20,0,400", L"10,20,300,400@", L"10,20,300,400x",
+            L"10;20;300;400", L"a,b,c,d" })
+        {
+            Rejected &= !Layout::ParseViewport(Text, Spec);
+        }
+        Check("malformed ones don't", Rejected);
+
+        // Sources are clipped to whatever the frame is now, and a mode change may leave nothing of them
+        Layout::SourceRect Source;
+        Check("no size is the whole frame", Layout::ResolveSource({}, 1920, 1080, Source) && Source.Left == 0
+            && Source.Top == 0 && Source.Width == 1920 && Source.Height == 1080);
+        Check("a source is clipped to the frame", Layout::ResolveSource({ 1800, 1000, 400, 400 }, 1920, 1080, Source)
+            && Source.Left == 1800 && Source.Top == 1000 && Source.Width == 120 && Source.Height == 80);
+        Check("one off the frame isn't shown", !Layout::ResolveSource({ 1920, 0, 100, 100 }, 1920, 1080, Source)
+            && !Layout::ResolveSource({ 0, 2000, 100, 100 }, 1920, 1080, Source));
+
+        // The right half of a 1920x1080 frame is narrower than a square window, the whole frame wider
+        auto Near = [](float Value, double Expected) { return abs(Value - Expected) < 1e-5; };
+        Layout::ViewportConstants Narrow = Layout::GetViewportConstants({ 960, 0, 960, 1080 }, 1920, 1080, 1000, 1000);
+        Check("a narrow source is pillarboxed", Near(Narrow.XScale, 960.0 / 1080) && Near(Narrow.YScale, 1)
+            && Near(Narrow.XOffset, 1 - 960.0 / 1080) && Near(Narrow.YOffset, 0));
+        Check("and samples its part of the frame", Near(Narrow.U, 0.5) && Near(Narrow.V, 0)
+            && Near(Narrow.UScale, 0.5) && Near(Narrow.VScale, 1));
+        Layout::ViewportConstants Wide = Layout::GetViewportConstants({ 0, 0, 1920, 1080 }, 1920, 1080, 1000, 1000);
+        Check("a wide one is letterboxed", Near(Wide.XScale, 1) && Near(Wide.YScale, 1080.0 / 1920)
+            && Near(Wide.XOffset, 0) && Near(Wide.YOffset, 0));
+        Layout::ViewportConstants Minimized = Layout::GetViewportConstants({ 0, 0, 1920, 1080 }, 1920, 1080, 0, 0);
+        Check("a minimized window gets finite constants", isfinite(Minimized.XScale) && isfinite(Minimized.YScale)
+            && isfinite(Minimized.XOffset) && isfinite(Minimized.YOffset));
+
+        // Three windows on one frame: the left half, the bottom right corner and a strip along the top, odd in height
+        // so that halving rounds it. Each damage list redraws exactly the windows it touches, rect edges being
+        // exclusive.
+        const Layout::SourceRect Views[] = { { 0, 0, 960, 1080 }, { 1800, 1000, 120, 80 }, { 0, 0, 1920, 101 } };
+        const Protocol::DamageRect NoDamage = {};
+        struct Route
+        {
+            const char* What;
+            uint32_t Flags;
+            vector<Protocol::DamageRect> Damage;
+            bool Null;
+            bool Expected[3];
+        };
+        const uint32_t Halved = 1u << Protocol::FrameDownscaleShift;
+        const Route Routes[] =
+        {
+            { "damage redraws only the windows it touches", 0, { { 100, 200, 300, 400 } }, false,
+                { true, false, false } },
+            { "damage along an edge redraws neither side", 0, { { 960, 101, 1000, 200 }, { 1700, 900, 1800, 1000 } },
+                false, { false, false, false } },
+            { "several rects redraw all they touch", 0, { { 1000, 50, 1010, 60 }, { 1919, 1079, 1920, 1080 } }, false,
+                { false, true, true } },
+            { "no damage redraws nothing", 0, {}, false, { false, false, false } },
+            { "full damage redraws everything", Protocol::FrameFullDamage, {}, false, { true, true, true } },
+            { "damage unknown redraws everything", 0, {}, true, { true, true, true } },
+            { "downscaled damage is in shrunk pixels", Halved, { { 899, 499, 901, 501 } }, false,
+                { false, true, false } },
+            { "and rounds windows outwards", Halved, { { 479, 50, 480, 51 } }, false, { true, false, true } },
+        };
+        for (const Route& Case : Routes)
+        {
+            Protocol::FrameDescriptor Descriptor = {};
+            Descriptor.Flags = Case.Flags;
+            Descriptor.DamageCount = uint32_t(Case.Damage.size());
+            bool Routed = true;
+            for (size_t i = 0; i < size(Views); i++)
+            {
+                const Protocol::DamageRect* Damage = Case.Damage.empty() ? &NoDamage : Case.Damage.data();
+                Routed &= Layout::IsDamaged(Views[i], Descriptor, Case.Null ? nullptr : Damage) == Case.Expected[i];
+            }
+            Check(Case.What, Routed);
+        }
+        return Passed ? 0 : 1;
+    }
+
+    int RunAllocations()
+    {
+        if (!Allocation::IsTracking())
+        {
+            printf("Built with PD_ALLOCATION_TRACKING=0, allocations can't be counted\n");
+            return 1;
+        }
+        printf("Synthetic %ux%u desktop session, %u frames to warm up then %u counted, then %u and %u overlapping\n",
+            DesktopWidth, DesktopHeight, SteadyWarmupFrames, SteadyFrames, SteadyPipelinedWarmup,
+            SteadyPipelinedFrames);
+
+        SteadySession Session;
+        Allocation::Counts Warmup[PhaseCount] = {}, Counted[PhaseCount] = {};
+        bool Played = Session.Play(SteadyWarmupFrames, false, Warmup) && Session.Play(SteadyFrames, false, Counted)
+            && Session.Play(SteadyPipelinedWarmup, true, Warmup) && Session.Play(SteadyPipelinedFrames, true, Counted);
+        if (!Played)
+        {
+            printf("FAILED: a frame didn't make it through the path intact\n");
+            return 1;
+        }
+
+        printf("%-10s %14s %14s %14s\n", "phase", "warm-up allocs", "counted allocs", "counted bytes");
+        bool Clean = true;
+        for (uint32_t i = 0; i < PhaseCount; i++)
+        {
+            printf("%-10s %14llu %14llu %14llu%s\n", SteadyPhaseNames[i], (unsigned long long)Warmup[i].Allocations,
+                (unsigned long long)Counted[i].Allocations, (unsigned long long)Counted[i].Bytes,
+                Counted[i].Allocations != 0 ? "  ALLOCATES" : "");
+            Clean &= Counted[i].Allocations == 0;
+        }
+        printf(Clean ? "No allocations after warm-up\n" : "FAILED: the steady state allocates\n");
+        return Clean ? 0 : 1;
+    }
+
+    int RunFramePool()
+    {
+        size_t Capacity = 0;
+        for (const auto& Mode : PoolModes)
+        {
+            Capacity = max(Capacity, Protocol::MaxHeaderSize + size_t(Mode[0]) * Mode[1] * 4);
+        }
+        vector<uint8_t> Response(Capacity, 0x5A);
+        printf("%u frames in each of %zu modes, %u times over, the first to warm up\n", PoolFramesPerMode,
+            size(PoolModes), PoolCycles);
+
+        // The warm-up cycle is counted on its own, the others from its end to the end of the last one
+        struct Counted
+        {
+            uint64_t Allocations = 0, Faults = 0, RoundTrips = 0, ZeroFilled = 0;
+            double Seconds = 0;
+        };
+        auto Play = [&](auto&& Receive, auto&& Snapshot, Counted (&Phases)[2])
+            {
+                uint64_t Faults = Memory::GetPageFaultCount();
+                for (uint32_t Cycle = 0; Cycle < PoolCycles; Cycle++)
+                {
+                    auto Start = steady_clock::now();
+                    for (const auto& Mode : PoolModes)
+                    {
+                        size_t Size = Protocol::MaxHeaderSize + size_t(Mode[0]) * Mode[1] * 4;
+                        for (uint32_t i = 0; i < PoolFramesPerMode; i++)
+                        {
+                            if (!Receive(Response.data(), Size))
+                            {
+                                return false;
+                            }
+                        }
+                    }
+                    Counted& Now = Phases[Cycle == 0 ? 0 : 1];
+                    Now.Seconds += duration<double>(steady_clock::now() - Start).count();
+                    Snapshot(Now);
+                    Now.Faults = Memory::GetPageFaultCount() - Faults;
+                }
+                Phases[1].Allocations -= Phases[0].Allocations;
+                Phases[1].Faults -= Phases[0].Faults;
+                Phases[1].RoundTrips -= Phases[0].RoundTrips;
+                Phases[1].ZeroFilled -= Phases[0].ZeroFilled;
+                return true;
+            };
+
+        Counted Grown[2], Pooled[2];
+        VectorReceiver Vector;
+        Play([&](const uint8_t* Data, size_t Size) { Vector.Receive(Data, Size); return true; },
+            [&](Counted& Now)
+            {
+                Now.Allocations = Vector.GetAllocations();
+                Now.RoundTrips = Vector.GetRoundTrips();
+                Now.ZeroFilled = Vector.GetZeroFilled();
+            }, Grown);
+        PoolReceiver Pool(Capacity);
+        if (!Play([&](const uint8_t* Data, size_t Size) { return Pool.Receive(Data, Size); },
+            [&](Counted& Now) { Now.Allocations = Pool.GetAllocations(); }, Pooled))
+        {
+            printf("FAILED: the pool can't allocate %zu bytes\n", Capacity);
+            return 1;
+        }
+
+        const uint32_t Frames[2] = { uint32_t(size(PoolModes)) * PoolFramesPerMode,
+            uint32_t(size(PoolModes)) * PoolFramesPerMode * (PoolCycles - 1) };
+        printf("%-18s %12s %12s %14s %12s %10s\n", "buffer", "allocations", "page faults", "zero-filled MB",
+            "round trips", "ms/frame");
+        for (const auto& [Name, Phases] : { pair<const char*, const Counted*>{ "vector", Grown },
+            pair<const char*, const Counted*>{ "pool", Pooled } })
+        {
+            for (uint32_t i = 0; i < 2; i++)
+            {
+                string Label = string(Name) + (i == 0 ? ", warming up" : "");
+                printf("%-18s %12llu %12llu %14.1f %12llu %10.3f\n", Label.c_str(),
+                    (unsigned long long)Phases[i].Allocations, (unsigned long long)Phases[i].Faults,
+                    Phases[i].ZeroFilled / 1e6, (unsigned long long)Phases[i].RoundTrips,
+                    Phases[i].Seconds * 1e3 / Frames[i]);
+            }
+        }
+
+        bool Passed = true;
+        auto Check = [&](const char* What, bool Ok)
+            {
+                printf("%-44s %s\n", What, Ok ? "ok" : "FAILED");
+                Passed &= Ok;
+            };
+        Check("the pool allocates once for every mode", Pooled[0].Allocations == 1 && Pooled[1].Allocations == 0);
+        Check("no page faults once the pool is warm", Pooled[1].Faults == 0);
+        return Passed ? 0 : 1;
+    }
+
+    int RunDevices()
+    {
+        MockDeviceFactory Factory;
+        Devices::DeviceCache<MockDevice> Cache([&](uint64_t Adapter) { return Factory.Create(Adapter); },
+            [](const MockDevice& Device) { return !Device.Lost.load(); });
+        const uint64_t First = Devices::MakeAdapterKey(0, 0x1234), Second = Devices::MakeAdapterKey(1, 0x1234);
+        const uint64_t Broken = Devices::MakeAdapterKey(-1, 7);
+
+        bool Passed = true;
+        auto Check = [&](const char* What, bool Ok)
+            {
+                printf("%-44s %s\n", What, Ok ? "ok" : "FAILED");
+                Passed &= Ok;
+            };
+
+        auto Device = Cache.Get(First);
+        Check("first request creates the device", Device != nullptr && Device->Adapter == First
+            && Factory.GetCreated() == 1);
+        Check("later requests share it", Cache.Get(First) == Device && Factory.GetCreated() == 1);
+        auto Other = Cache.Get(Second);
+        Check("LUIDs differing in the high part are apart", Other != nullptr && Other != Device
+            && Other->Adapter == Second);
+
+        Device->Lost = true;
+        auto Replaced = Cache.Get(First);
+        Check("a lost device is replaced", Replaced != nullptr && Replaced != Device && Cache.GetLosses() == 1);
+        Check("the other adapter keeps its device", Cache.Get(Second) == Other);
+
+        Cache.Discard(First, Device.get());
+        Check("discarding a replaced device does nothing", Cache.Get(First) == Replaced && Cache.GetDiscards() == 0);
+        Cache.Discard(First, Replaced.get());
+        auto Recreated = Cache.Get(First);
+        Check("a discarded device is replaced", Recreated != nullptr && Recreated != Replaced
+            && Cache.GetDiscards() == 1);
+
+        Factory.SetFailing(Broken);
+        uint32_t Before = Factory.GetCreated();
+        bool Failed = Cache.Get(Broken) == nullptr && Cache.Get(Broken) == nullptr;
+        Check("failures are returned and not cached", Failed && Cache.GetSize() == 2 && Factory.GetCreated() == Before);
+
+        // Monitors on one adapter getting their swap-chains at the same time, as after a resume
+        const uint64_t Shared = Devices::MakeAdapterKey(0, 0x5678);
+        vector<shared_ptr<MockDevice>> Results(8);
+        vector<thread> Threads;
+        for (size_t i = 0; i < Results.size(); i++)
+        {
+            Threads.emplace_back([&, i] { Results[i] = Cache.Get(Shared); });
+        }
+        for (auto& Current : Threads)
+        {
+            Current.join();
+        }
+        Check("concurrent requests create one device", Results[0] != nullptr
+            && count(Results.begin(), Results.end(), Results[0]) == ptrdiff_t(Results.size()));
+
+        // Swap-chain reassignments as a run of mode changes causes them, each taking a device for its adapter
+        auto Switch = [&](bool Cached)
+            {
+                auto Start = steady_clock::now();
+                for (uint32_t i = 0; i < DeviceSwitches; i++)
+                {
+                    auto Current = Cached ? Cache.Get(First) : Factory.Create(First);
+                    if (Current == nullptr)
+                    {
+                        return -1.0;
+                    }
+                }
+                return duration<double, milli>(steady_clock::now() - Start).count() / DeviceSwitches;
+            };
+        double Uncached = Switch(false), Cached = Switch(true);
+        printf("\n%u swap-chain reassignments, %lld ms to create a mock device\n", DeviceSwitches,
+            (long long)MockDeviceCost.count());
+        printf("%-12s %10.2f ms each\n", "new device", Uncached);
+        printf("%-12s %10.2f ms each\n", "cached", Cached);
+        Check("cached reassignments skip creation", Cached >= 0 && Cached < Uncached / 10);
+
+        printf(Passed ? "Device cache behaves\n" : "FAILED: the device cache misbehaves\n");
+        return Passed ? 0 : 1;
+    }
+
+    int RunLatency()
+    {
+        using Protocol::PixelFormat;
+        const uint32_t Width = MarkerCheckWidth, Height = MarkerCheckHeight;
+
+        bool Passed = true;
+        auto Check = [&](const char* What, bool Ok)
+            {
+                printf("%-44s %s\n", What, Ok ? "ok" : "FAILED");
+                Passed &= Ok;
+            };
+
+        Check("marker in BGRA8", CheckMarker(PixelFormat::BGRA8, PixelFormat::BGRA8, 0, nullptr));
+        Check("marker in R10G10B10A2", CheckMarker(PixelFormat::R10G10B10A2, PixelFormat::R10G10B10A2, 0, nullptr));
+        Check("marker in RGBA16F", CheckMarker(PixelFormat::RGBA16F, PixelFormat::RGBA16F, 0, nullptr));
+        Check("marker in B5G6R5", CheckMarker(PixelFormat::B5G6R5, PixelFormat::B5G6R5, 0, nullptr));
+        Check("marker through scRGB tone mapping", CheckMarker(PixelFormat::RGBA16F, PixelFormat::BGRA8, 0,
+            [&](const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch)
+            {
+                Kernels::ScRgbToBgra8(Src, SrcPitch, Dst, DstPitch, Width, Height);
+            }));
+        Check("marker through scRGB to HDR10", CheckMarker(PixelFormat::RGBA16F, PixelFormat::R10G10B10A2, 0,
+            [&](const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch)
+            {
+                Kernels::ScRgbToHdr10(Src, SrcPitch, Dst, DstPitch, Width, Height);
+            }));
+        Check("marker through HDR10 tone mapping", CheckMarker(PixelFormat::R10G10B10A2, PixelFormat::BGRA8, 0,
+            [&](const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch)
+            {
+                Kernels::Hdr10ToBgra8(Src, SrcPitch, Dst, DstPitch, Width, Height);
+            }));
+        Check("marker through B5G6R5 packing", CheckMarker(PixelFormat::BGRA8, PixelFormat::B5G6R5, 0,
+            [&](const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch)
+            {
+                Kernels::Bgra8ToB5G6R5(Src, SrcPitch, Dst, DstPitch, Width, Height, nullptr);
+            }));
+        for (uint32_t Shift = 1; Shift <= Protocol::MaxDownscale; Shift++)
+        {
+            string What = "marker through downscaling by " + to_string(1u << Shift);
+            Check(What.c_str(), CheckMarker(PixelFormat::BGRA8, PixelFormat::BGRA8, Shift,
+                [&](const void* Src, size_t SrcPitch, void* Dst, size_t DstPitch)
+                {
+                    Kernels::DownscaleBgra8(Src, SrcPitch, Dst, DstPitch, Width >> Shift, Height >> Shift, Shift);
+                }));
+        }
+        vector<uint32_t> Blank(size_t(Width) * Height, 0xFFFFFFFF);
+        uint64_t Value;
+        Check("no marker on a blank frame", !Probe::ReadMarker(Blank.data(), Width * 4, Width, Height,
+            PixelFormat::BGRA8, 0, Value));
+
+        printf("\nSynthetic %ux%u desktop session of %u frames presented every %.2f ms, polled every %lld ms\n",
+            DesktopWidth, DesktopHeight, LatencyFrames, duration<double, milli>(LatencyFrameInterval).count(),
+            (long long)LatencyPollInterval.count());
+        printf("%-14s %8s %10s %8s %8s %8s %8s %8s %10s %6s\n", "path", "frames", "min ms", "mean", "p50", "p90",
+            "p99", "max", "unreadable", "stale");
+        for (bool Tiles : { true, false })
+        {
+            LatencySession Session;
+            LatencyResults Results;
+            Session.Run(Tiles, Results);
+            const Probe::LatencyHistogram& Latency = Results.Latency;
+            printf("%-14s %8llu %10.2f %8.2f %8.2f %8.2f %8.2f %8.2f %10llu %6llu\n", Tiles ? "tiles" : "half 565",
+                (unsigned long long)Results.Received, Latency.GetMin() / 1e6, Latency.GetMean() / 1e6,
+                Latency.GetPercentile(0.5) / 1e6, Latency.GetPercentile(0.9) / 1e6, Latency.GetPercentile(0.99) / 1e6,
+                Latency.GetMax() / 1e6, (unsigned long long)Results.Unreadable, (unsigned long long)Results.Stale);
+            Passed &= Results.Received != 0 && Results.Unreadable == 0 && Results.Stale == 0;
+        }
+
+        printf(Passed ? "Every frame carried its own marker\n" : "FAILED: markers were lost or stale\n");
+        return Passed ? 0 : 1;
+    }
+
+    int RunDemand()
+    {
+        bool Passed = true;
+        auto Check = [&](const char* What, bool Ok)
+            {
+                printf("%-44s %s\n", What, Ok ? "ok" : "FAILED");
+                Passed &= Ok;
+            };
+
+        Demand::DemandTracker Tracker(DemandWindow);
+        Check("idle before the first request", !Tracker.IsActive(1));
+        Check("the first request wakes capture", Tracker.OnRequest(100));
+        Check("active through the window", Tracker.IsActive(100) && Tracker.IsActive(100 + DemandWindow));
+        Check("requests within the window don't wake it", !Tracker.OnRequest(100 + DemandWindow));
+        Check("idle once the window is over", !Tracker.IsActive(101 + 2 * DemandWindow));
+        Check("a request after the window wakes it", Tracker.OnRequest(102 + 2 * DemandWindow));
+        Check("wakeups counted", Tracker.GetWakeups() == 2);
+
+        Demand::VisibilityGate Gate(DemandTestInterval);
+        Gate.OnPresent(false, 10);
+        Check("fetching while visible", Gate.ShouldFetch() && !Gate.ShouldTest(10));
+        Gate.OnPresent(true, 20);
+        Check("paused once occluded", !Gate.ShouldFetch() && Gate.GetPauses() == 1);
+        Check("no test before the interval", !Gate.ShouldTest(19 + DemandTestInterval));
+        Check("a test at the interval", Gate.ShouldTest(20 + DemandTestInterval));
+        Gate.OnPresent(true, 20 + DemandTestInterval);
+        Check("a failed test waits another interval", !Gate.ShouldTest(19 + 2 * DemandTestInterval) &&
+            Gate.GetNextTest() == 20 + 2 * DemandTestInterval && Gate.GetPauses() == 1);
+        Gate.OnPresent(false, 20 + 2 * DemandTestInterval);
+        Check("fetching again once visible", Gate.ShouldFetch() && !Gate.ShouldTest(UINT64_MAX));
+
+        DemandResults Always, Throttled;
+        RunDemandSession(false, Always);
+        RunDemandSession(true, Throttled);
+        printf("\nSimulated %.0f s at 60 Hz, the window hidden from %.1f s to %.1f s, the desktop still from %.1f s to "
+            "%.1f s\n", DemandDuration / 1e3, DemandHiddenFrom / 1e3, DemandHiddenUntil / 1e3, DemandStillFrom / 1e3,
+            DemandStillUntil / 1e3);
+        printf("%-10s %9s %9s %6s %8s %6s %8s\n", "", "presented", "captured", "held", "fetched", "tests", "wakeups");
+        for (const DemandResults* Results : { &Always, &Throttled })
+        {
+            printf("%-10s %9llu %9llu %6llu %8llu %6llu %8llu\n", Results == &Always ? "always" : "throttled",
+                (unsigned long long)Results->Presented, (unsigned long long)Results->Captured,
+                (unsigned long long)Results->Held, (unsigned long long)Results->Fetched,
+                (unsigned long long)Results->Tests, (unsigned long long)Results->Wakeups);
+        }
+        printf("Paused %llu ms after being hidden, fetched again %llu ms after being shown\n",
+            (unsigned long long)(Throttled.PausedAt - DemandHiddenFrom),
+            (unsigned long long)(Throttled.ResumedAt - DemandHiddenUntil));
+
+        Check("paused on the first hidden present", Throttled.Pauses == 1 &&
+            Throttled.PausedAt >= DemandHiddenFrom && Throttled.PausedAt < DemandHiddenFrom + DemandPollInterval);
+        Check("resumed within a test interval", Throttled.ResumedAt >= DemandHiddenUntil &&
+            Throttled.ResumedAt <= DemandHiddenUntil + DemandTestInterval);
+        Check("no captures once demand is over", Throttled.CapturedHidden == 0);
+        Check("a wakeup at the start and on resuming", Throttled.Wakeups == 2);
+        Check("the held frame captured on wakeup", Throttled.ResumedFrame != 0 &&
+            Throttled.ResumedFrame == Throttled.LastPresented);
+        Check("every frame captured when not throttled", Always.Captured == Always.Presented);
+        Check("fewer fetches and captures when throttled", Throttled.Fetched < Always.Fetched &&
+            Throttled.Captured < Always.Captured);
+
+        printf(Passed ? "Capture follows demand\n" : "FAILED: capture doesn't follow demand\n");
+        return Passed ? 0 : 1;
+    }
+
+    int RunSlices()
+    {
+        bool Passed = true;
+        auto Check = [&](const char* What, bool Ok)
+            {
+                printf("%-44s %s\n", What, Ok ? "ok" : "FAILED");
+                Passed &= Ok;
+            };
+
+        // Two frames told apart in every pixel, so one mixed up with the other shows up anywhere
+        vector<uint8_t> Sources[2];
+        for (uint32_t i = 0; i < 2; i++)
+        {
+            Sources[i].resize(size_t(SlicePitch) * SliceHeight);
+            for (size_t Offset = 0; Offset < Sources[i].size(); Offset += 4)
+            {
+                uint32_t Pixel = uint32_t(Offset / 4 * 2654435761u) ^ (i != 0 ? 0xA5A5A5A5 : 0x5A5A5A5A);
+                memcpy(&Sources[i][Offset], &Pixel, 4);
+            }
+        }
+        vector<uint8_t> Staging(Sources[0].size());
+        vector<uint8_t> Texture(Sources[0].size());
+
+        Slices::SliceBoard Board;
+        Slices::SliceLease Lease;
+        Slices::SliceFrame Frame = { 1, 0, SliceWidth, SliceHeight, SlicePitch,
+            uint32_t(Protocol::PixelFormat::BGRA8), Staging.data() };
+        Check("unchanged before the first frame", Board.Acquire(0, 0, 4, 0, Lease) == Slices::WaitResult::Unchanged);
+        Board.Begin(Frame);
+        Check("a slice not read back times out", Board.Acquire(0, 0, 4, 20, Lease) == Slices::WaitResult::TimedOut);
+        for (uint32_t Band = 0; Band < 4; Band++)
+        {
+            Board.Publish(Band);
+        }
+        Check("a slice is ready once its bands are", Board.Acquire(0, 0, 4, 0, Lease) == Slices::WaitResult::Ready
+            && Lease.GetFrame().Sequence == 1);
+        Slices::SliceLease Later;
+        Check("a later slice waits for its own bands", Board.Acquire(1, 1, 4, 0, Later)
+            == Slices::WaitResult::TimedOut);
+
+        atomic<bool> Begun = false;
+        Frame.Sequence = 2;
+        thread Writer([&]
+            {
+                Board.Begin(Frame);
+                Begun = true;
+            });
+        this_thread::sleep_for(20ms);
+        Check("the writer waits for a leased slice", !Begun);
+        Lease.Release();
+        Writer.join();
+        Check("and goes on once it is released", Begun && Board.GetWriterWaits() == 1);
+        Check("slices of a replaced frame are superseded", Board.Acquire(1, 1, 4, 0, Lease)
+            == Slices::WaitResult::Superseded);
+        for (uint32_t Band = 0; Band < Slices::SliceBoard::BandCount; Band++)
+        {
+            Board.Publish(Band);
+        }
+        Check("the frame held is unchanged", Board.Acquire(2, 0, 4, 0, Lease) == Slices::WaitResult::Unchanged);
+        Board.Close();
+        Check("slices of a closed frame are superseded", Board.Acquire(2, 1, 4, 0, Lease)
+            == Slices::WaitResult::Superseded);
+
+        // A reader waiting for bands when the writer goes away is let go rather than left to time out
+        {
+            Slices::SliceBoard Retired;
+            Slices::SliceLease Waiting;
+            Retired.Begin(Frame);
+            atomic<Slices::WaitResult> Result = Slices::WaitResult::Ready;
+            auto Start = steady_clock::now();
+            thread Reader([&] { Result = Retired.Acquire(0, 0, 4, 5000, Waiting); });
+            this_thread::sleep_for(20ms);
+            Retired.Shutdown();
+            Reader.join();
+            Check("shutting the board down wakes its readers", Result == Slices::WaitResult::Shutdown
+                && steady_clock::now() - Start < 2s);
+            Check("and later ones don't wait", Retired.Acquire(0, 0, 4, 5000, Waiting)
+                == Slices::WaitResult::Shutdown);
+        }
+
+        printf("\n%u frames of %ux%u read back in %u bands, %lld us of transfer each, then uploaded\n", SliceFrames,
+            SliceWidth, SliceHeight, Slices::SliceBoard::BandCount, (long long)SliceBandTransfer.count());
+        printf("%-8s %12s %10s\n", "slices", "latency ms", "vs whole");
+        uint64_t Sequence = Board.GetSequence();
+        SliceResults Measured;
+        double Whole = 0, Best = 0;
+        for (uint32_t Count : SliceCounts)
+        {
+            double Latency = MeasureSlices(Board, Sources, Staging, Texture, Count, Sequence, Measured);
+            Whole = Count == 1 ? Latency : Whole;
+            Best = Count == 1 ? Latency : min(Best, Latency);
+            printf("%-8u %12.2f %9.0f%%\n", Count, Latency, Whole != 0 ? 100 * Latency / Whole : 0);
+        }
+        Check("every frame received whole", Measured.Completed == SliceFrames * size(SliceCounts)
+            && Measured.Torn == 0);
+        if (thread::hardware_concurrency() > 1)
+        {
+            Check("slices take latency off a whole frame", Best < Whole * 0.9);
+        }
+        else
+        {
+            // Uploading overlaps the readback's copies only on another processor
+            printf("%-44s %s\n", "slices take latency off a whole frame", "skipped, one processor");
+        }
+
+        SliceResults Streamed;
+        uint64_t Waits = Board.GetWriterWaits();
+        StreamSlices(Board, Sources, Staging, Texture, 8, Sequence, Streamed);
+        printf("\nStreaming %u frames in 8 slices: %llu received, %llu superseded, %llu writer waits\n",
+            SliceFrames * 4, (unsigned long long)Streamed.Completed, (unsigned long long)Streamed.Superseded,
+            (unsigned long long)(Board.GetWriterWaits() - Waits));
+        Check("no torn frames while streaming", Streamed.Completed != 0 && Streamed.Torn == 0);
+
+        printf(Passed ? "Slices arrive whole and early\n" : "FAILED: slices arrive torn or late\n");
+        return Passed ? 0 : 1;
+    }
+
+    int RunClient()
+    {
+        bool Passed = true;
+        auto Check = [&](const char* What, bool Ok)
+            {
+                printf("%-44s %s\n", What, Ok ? "ok" : "FAILED");
+                Passed &= Ok;
+            };
+
+        Check("the library is the header's version", PdGetVersion() == PD_CLIENT_VERSION);
+        PdOpenOptions Options = {};
+        Options.Size = sizeof(Options);
+        Options.Source = PdSourceSynthetic;
+        Options.Formats = PD_FORMAT_BIT(PdFormatRgba16F);
+        Options.SyntheticWidth = ClientWidth;
+        Options.SyntheticHeight = ClientHeight;
+        Options.SyntheticIntervalMs = ClientInterval;
+        PdClient* Client = nullptr;
+        PdOpenOptions Bad = Options;
+        Bad.Size = 0;
+        Check("options of an unknown size are refused", PdOpen(&Bad, &Client) == PdInvalidArgument
+            && Client == nullptr);
+        Bad = Options;
+        Bad.Monitor = 1;
+        Check("a missing monitor is not found", PdOpen(&Bad, &Client) == PdNotFound);
+        Check("the synthetic source opens", PdOpen(&Options, &Client) == PdOk && Client != nullptr);
+        if (Client == nullptr)
+        {
+            printf("FAILED: the client library doesn't open\n");
+            return 1;
+        }
+
+        PdCapabilities Capabilities = {};
+        Capabilities.Size = sizeof(Capabilities);
+        Check("formats negotiated to what both support", PdGetCapabilities(Client, &Capabilities) == PdOk
+            && Capabilities.Formats == PD_FORMAT_BIT(PdFormatBgra8) && Capabilities.Width == ClientWidth
+            && Capabilities.Height == ClientHeight);
+
+        // A caller built against a newer header passes larger structs, whose fields past ours are left alone
+        struct
+        {
+            PdCapabilities Capabilities;
+            uint32_t Newer;
+        } Larger = {};
+        Larger.Capabilities.Size = sizeof(Larger);
+        Larger.Newer = 0xCDCDCDCD;
+        PdCapabilities Smaller = {};
+        Smaller.Size = PD_CAPABILITIES_V1_SIZE - 1;
+        Check("structs are taken from their version 1 size", PdGetCapabilities(Client, &Larger.Capabilities) == PdOk
+            && Larger.Capabilities.Width == ClientWidth && Larger.Newer == 0xCDCDCDCD
+            && PdGetCapabilities(Client, &Smaller) == PdInvalidArgument);
+        Check("a format the source lacks is refused", PdSetFormat(Client, PdFormatRgba16F) == PdUnsupported);
+
+        PdFrame First = {}, Second = {}, Third = {};
+        First.Size = Second.Size = Third.Size = sizeof(PdFrame);
+        Check("the first frame is whole", PdWaitFrame(Client, 1000, &First) == PdOk && First.Pixels != nullptr
+            && (First.Flags & PdFrameFullDamage) && First.Width == ClientWidth && First.Height == ClientHeight
+            && First.Pitch >= ClientWidth * 4 && First.Format == PdFormatBgra8);
+        uint64_t FirstHash = First.Pixels != nullptr ? HashFrame(First) : 0;
+        Check("the next frame is a newer one", PdWaitFrame(Client, 1000, &Second) == PdOk
+            && Second.Sequence > First.Sequence && Second.Pixels != First.Pixels);
+        if (First.Pixels == nullptr || Second.Pixels == nullptr)
+        {
+            PdClose(Client);
+            printf("FAILED: the client library doesn't deliver frames\n");
+            return 1;
+        }
+        Check("a held frame stays as it was received", HashFrame(First) == FirstHash);
+        Check("damage covers every changed pixel", !(Second.Flags & PdFrameFullDamage) && Second.DamageCount != 0
+            && CoversChanges(First, Second));
+        Check("busy while every buffer is held", PdWaitFrame(Client, 0, &Third) == PdBusy);
+        Check("a frame is released once only", PdReleaseFrame(Client, &First) == PdOk
+            && PdReleaseFrame(Client, &First) == PdInvalidArgument);
+        Check("a released buffer receives again", PdWaitFrame(Client, 1000, &Third) == PdOk
+            && Third.Sequence > Second.Sequence && Third.Buffer == First.Buffer);
+        Check("damage is against the frame received last", Third.Pixels != nullptr && CoversChanges(Second, Third));
+        PdReleaseFrame(Client, &Second);
+        PdReleaseFrame(Client, &Third);
+
+        // Received and released right away, the way a recorder keeps up with the source
+        uint32_t Received = 0, Failed = 0;
+        uint64_t Skipped = 0, Last = Third.Sequence;
+        auto Start = steady_clock::now();
+        while (steady_clock::now() - Start < ClientStream)
+        {
+            PdFrame Frame = {};
+            Frame.Size = sizeof(Frame);
+            PdStatus Status = PdWaitFrame(Client, 100, &Frame);
+            if (Status != PdOk)
+            {
+                Failed++;
+                continue;
+            }
+            Received++;
+            Skipped += Frame.Sequence - Last - 1;
+            Last = Frame.Sequence;
+            PdReleaseFrame(Client, &Frame);
+        }
+        PdClose(Client);
+        printf("\nStreamed %u frames of %ux%u every %u ms for %lld ms, %llu skipped\n\n", Received, ClientWidth,
+            ClientHeight, ClientInterval, (long long)ClientStream.count(), (unsigned long long)Skipped);
+        Check("frames stream without failures", Received != 0 && Failed == 0);
+
+        Options.SyntheticIntervalMs = 60'000;
+        PdFrame Frame = {};
+        Frame.Size = sizeof(Frame);
+        Check("a still source times out", PdOpen(&Options, &Client) == PdOk
+            && PdWaitFrame(Client, 1000, &Frame) == PdOk && PdReleaseFrame(Client, &Frame) == PdOk
+            && PdWaitFrame(Client, 20, &Frame) == PdTimeout);
+        PdClose(Client);
+
+        // A mode past what was negotiated grows the receive buffer, whose last row then reads as rendered
+        Options.SyntheticIntervalMs = ClientInterval;
+        Options.SyntheticResizeAfter = 2;
+        bool Grown = PdOpen(&Options, &Client) == PdOk, Rendered = false;
+        for (uint32_t i = 0; Grown && !Rendered && i < 50; i++)
+        {
+            Frame = {};
+            Frame.Size = sizeof(Frame);
+            Grown = PdWaitFrame(Client, 1000, &Frame) == PdOk;
+            if (Grown && Frame.Height == ClientHeight * 2)
+            {
+                const uint32_t x = ClientWidth - 1, y = Frame.Height - 1;
+                uint32_t Last;
+                memcpy(&Last, Frame.Pixels + size_t(y) * Frame.Pitch + size_t(x) * 4, sizeof(Last));
+                Rendered = (Frame.Flags & PdFrameFullDamage)
+                    && Last == (0xFF000000 | (x & 0xFF) << 16 | (y & 0xFF) << 8 | ((x ^ y) & 0xFF));
+            }
+            Grown = Grown && PdReleaseFrame(Client, &Frame) == PdOk;
+        }
+        Check("a larger mode grows the buffer", Grown && Rendered);
+        PdClose(Client);
+        Options.SyntheticResizeAfter = 0;
+
+        Options.Source = PdSourceDevice;
+        Options.Formats = 0;
+        PdStatus Status = PdOpen(&Options, &Client);
+        printf("Opening the driver: %s\n", PdGetStatusText(Status));
+        PdClose(Status == PdOk ? Client : nullptr);
+
+        printf(Passed ? "The client library delivers frames in place\n" : "FAILED: the client library misbehaves\n");
+        return Passed ? 0 : 1;
+    }
+
+    int RunTuner(const string& Stored, string* Saved)
+    {
+        bool Passed = true;
+        auto Check = [&](const char* What, bool Ok)
+            {
+                printf("%-44s %s\n", What, Ok ? "ok" : "FAILED");
+                Passed &= Ok;
+            };
+
+        // Checked with enough workers for the threaded strategies even on a machine with few processors, tuned with
+        // as many as the driver has
+        TaskScheduler Checking(max(TaskScheduler::GetDefaultWorkerCount(), 3u));
+        Tuning::CopyTuner Checked(&Checking);
+        mt19937 Random(1);
+        bool Exact = true;
+        for (const Tuning::CopyStrategy& Strategy : Checked.GetCandidates())
+        {
+            Exact &= CopiesExactly(Checked, Strategy, Random);
+        }
+        Check("every strategy copies exactly", Exact);
+        Check("threaded candidates calibrate on own workers", Checked.Calibrate(256, 64, 4).Calibrated);
+
+        TaskScheduler Tasks(min(TaskScheduler::GetDefaultWorkerCount(), Tuning::MaxCopyThreads - 1));
+        Tuning::CopyTuner Tuner(&Tasks, Slices::SliceBoard::BandCount);
+        const vector<Tuning::CopyStrategy> Candidates = Tuner.GetCandidates();
+        printf("%zu candidate strategies under %s on %u threads\n", Candidates.size(),
+            Kernels::GetIsaName(Kernels::GetIsa()), Tasks.GetWorkerCount() + 1);
+        Check("the plain copy is a candidate", !Candidates.empty()
+            && SameStrategy(Candidates[0], Tuning::CopyStrategy()));
+
+        size_t Loaded = Tuner.Load(Stored);
+        size_t Known = 0;
+        for (const auto& Size : TunerSizes)
+        {
+            Tuning::TunedCopy Tuned;
+            Known += Tuner.Find(Size[0], Size[1], TunerBytesPerPixel, Tuned);
+        }
+        printf("%zu sizes stored by an earlier run\n\n%-10s %-10s %7s %6s %11s %9s %9s %8s\n", Loaded, "", "method",
+            "threads", "chunk", "", "ms", "plain ms", "speedup");
+        for (const auto& Size : TunerSizes)
+        {
+            const uint32_t Width = Size[0], Height = Size[1];
+            auto Start = steady_clock::now();
+            Tuning::TunedCopy Tuned = Tuner.Get(Width, Height, TunerBytesPerPixel);
+            auto Took = duration_cast<milliseconds>(steady_clock::now() - Start);
+
+            const size_t RowBytes = size_t(Width) * TunerBytesPerPixel;
+            KernelBuffer Src(RowBytes, Height, 0), Dst(RowBytes, Height, 0);
+            fill(Src.Storage.begin(), Src.Storage.end(), uint8_t(0x5A));
+            double Picked = MeasureFrameCopy(Tuner, Tuned.Strategy, Src, Dst, RowBytes, Height);
+            double Plain = MeasureFrameCopy(Tuner, Tuning::CopyStrategy(), Src, Dst, RowBytes, Height);
+            char Name[16], Source[32];
+            snprintf(Name, sizeof(Name), "%ux%u", Width, Height);
+            snprintf(Source, sizeof(Source), Tuned.Calibrated ? "in %lld ms" : "stored", (long long)Took.count());
+            printf("%-10s %-10s %7u %6u %11s %9.2f %9.2f %7.2fx\n", Name, Tuning::GetMethodName(Tuned.Strategy.Method),
+                Tuned.Strategy.Threads, Tuned.Strategy.ChunkRows, Source, Picked * 1e3, Plain * 1e3, Plain / Picked);
+        }
+        printf("\n");
+        Check("only sizes not stored are calibrated", Tuner.GetCalibrations() == size(TunerSizes) - Known);
+
+        string Text = Tuner.Save();
+        Tuning::CopyTuner Reloaded(&Tasks, Slices::SliceBoard::BandCount);
+        bool Kept = Reloaded.Load(Text) == size(TunerSizes);
+        for (const auto& Size : TunerSizes)
+        {
+            Tuning::TunedCopy Before, After;
+            Kept &= Tuner.Find(Size[0], Size[1], TunerBytesPerPixel, Before)
+                && Reloaded.Find(Size[0], Size[1], TunerBytesPerPixel, After)
+                && SameStrategy(Before.Strategy, After.Strategy) && Before.FrameNs == After.FrameNs
+                && !After.Calibrated;
+            Kept &= SameStrategy(Reloaded.Get(Size[0], Size[1], TunerBytesPerPixel).Strategy, After.Strategy);
+        }
+        Check("stored strategies load without calibrating", Kept && Reloaded.GetCalibrations() == 0);
+
+        size_t Machine = Text.find("machine ");
+        string Elsewhere = Text.substr(0, Machine) + "machine elsewhere 0" + Text.substr(Text.find('\n', Machine));
+        Tuning::CopyTuner Other(&Tasks, Slices::SliceBoard::BandCount);
+        Check("another machine's strategies are dropped", Machine != string::npos && Other.Load(Elsewhere) == 0);
+        string Unrunnable = Text.substr(0, Text.find('\n', Machine) + 1)
+            + "1920 1080 4 cached 999 0 1000\n1920 1080 4 sideways 1 0 1000\n0 1080 4 cached 1 0 1000\n1920 1080\n";
+        Check("strategies that can't run are skipped", Other.Load(Unrunnable) == 0);
+
+        Tuning::TunedCopy Again = Tuner.Calibrate(TunerSizes[0][0], TunerSizes[0][1], TunerBytesPerPixel);
+        Check("calibrating a size again replaces it", Again.Calibrated
+            && Tuner.GetTuned().size() == size(TunerSizes));
+
+        // As the driver reads frames back: a new size is copied the plain way until its calibration is stored
+        Tuning::CopyTuner Background(&Tasks, Slices::SliceBoard::BandCount);
+        atomic<uint32_t> Saves{ 0 };
+        Background.SetOnCalibrated([&Saves] { Saves++; });
+        const uint32_t Width = TunerSizes[0][0], Height = TunerSizes[0][1];
+        Tuning::TunedCopy Meanwhile = Background.GetWithoutWaiting(Width, Height, TunerBytesPerPixel);
+        bool Plain = !Meanwhile.Calibrated && SameStrategy(Meanwhile.Strategy, Tuning::CopyStrategy());
+        Tuning::TunedCopy Calibrated;
+        auto Asked = steady_clock::now();
+        while (!Background.Find(Width, Height, TunerBytesPerPixel, Calibrated) && steady_clock::now() - Asked < 30s)
+        {
+            Plain &= !Background.GetWithoutWaiting(Width, Height, TunerBytesPerPixel).Calibrated;
+            this_thread::sleep_for(1ms);
+        }
+        while (Saves == 0 && steady_clock::now() - Asked < 30s)
+        {
+            this_thread::sleep_for(1ms);
+        }
+        Check("a new size copies plainly meanwhile", Plain);
+        Check("then as calibrated in the background", Calibrated.Calibrated
+            && SameStrategy(Background.GetWithoutWaiting(Width, Height, TunerBytesPerPixel).Strategy,
+                Calibrated.Strategy)
+            && Background.GetCalibrations() == 1);
+        Check("and is saved from the calibration thread", Saves == 1);
+
+        if (Saved != nullptr)
+        {
+            *Saved = Tuner.Save();
+        }
+        printf(Passed ? "Copies are tuned to this machine\n" : "FAILED: the copy tuner misbehaves\n");
+        return Passed ? 0 : 1;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,231 @@
+#pragma once
+
+// Benchmarks and self-checks run by PartialDisplayBench, a console program of their own so that none of them ships
+// in the viewer. They only use the standard library and the shared headers so they build and run off-target as well.
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../Common/AllocationTracking.h"
+#include "../Common/CopyTuner.h"
+#include "../Common/Demand.h"
+#include "../Common/DeviceCache.h"
+#include "../Common/FrameCache.h"
+#include "../Common/FramePool.h"
+#include "../Common/LatencyProbe.h"
+#include "../Common/SliceBoard.h"
+#include "../Common/StageGraph.h"
+#include "../Common/TaskScheduler.h"
+#include "../Common/ThreadPolicy.h"
+#include "../Common/Tracing.h"
+#include "../Common/TileCodec.h"
+#include "../Common/TraceFile.h"
+#include "../Common/Viewport.h"
+
+namespace PartialDisplay::Benchmark
+{
+    /// <summary>
+    /// Measures how late a waiting thread wakes after being signalled, idle and with every processor kept busy, under
+    /// the default policy and under the given one. Prints percentiles and returns a process exit code.
+    /// </summary>
+    int RunJitter(const Scheduling::ThreadPolicy& Policy);
+
+    /// <summary>
+    /// Measures what a trace span costs with tracing stopped and running. Prints nanoseconds per span and returns a
+    /// process exit code.
+    /// </summary>
+    int RunTracing();
+
+    /// <summary>
+    /// Measures how well the tile classifier separates synthetic text and UI tiles from photographic ones, and how
+    /// fast and how faithfully the tile codec handles a photographic 4K frame at several qualities.
+    /// </summary>
+    int RunCodec();
+
+    /// <summary>
+    /// A BGRA8 frame for RunTileCache. Damage is null when the whole frame changed.
+    /// </summary>
+    struct CacheFrame
+    {
+        const void* Pixels;
+        size_t Pitch;
+        uint32_t Width;
+        uint32_t Height;
+        const Protocol::DamageRect* Damage;
+        uint32_t DamageCount;
+    };
+
+    /// <summary>
+    /// Sends frames through the tile codec with and without the tile cache and compares the hit rate, the stream
+    /// sizes and the encode and decode times. Next returns false when it runs out of frames; without it a scripted
+    /// desktop session is played. Returns a process exit code, failing if the two paths decode differently.
+    /// </summary>
+    int RunTileCache(const std::function<bool(CacheFrame&)>& Next);
+
+    /// <summary>
+    /// Hands out the frames of a recorded trace for RunTileCache. Tile streams are decoded back to BGRA8 first;
+    /// frames in other formats, downscaled, damaged or whose stream can't be applied to the frame before are skipped.
+    /// </summary>
+    class TraceFrames
+    {
+    public:
+        explicit TraceFrames(const Trace::Reader& Reader) : m_Reader(Reader) {}
+        bool Next(CacheFrame& Frame);
+        size_t GetSkipped() const { return m_Skipped; }
+
+    private:
+        const Trace::Reader& m_Reader;
+        size_t m_Next = 0;
+        size_t m_Skipped = 0;
+        std::vector<uint32_t> m_Decoded;
+        std::unique_ptr<Codec::TileCache> m_Cache;  // Created with the first stream
+        Codec::TileScratch m_Scratch;
+        uint32_t m_Width = 0;
+        uint32_t m_Height = 0;
+        uint64_t m_Sequence = 0;
+        bool m_Valid = false;
+    };
+
+    /// <summary>
+    /// Packs frame responses with up to MaxDamageRects damage rects and parses them back, whole, cut short and with
+    /// each field broken in turn, and checks that they read back as packed and that every malformed one is refused.
+    /// Returns a process exit code.
+    /// </summary>
+    int RunProtocol();
+
+    /// <summary>
+    /// Records the scripted desktop session as traces in the viewer's format, as plain frames and as tile streams,
+    /// maps them back from a file and checks every frame reads back as written: through the index, by walking the
+    /// records when the recorder didn't get to write the index, and up to the last whole frame of a file cut short.
+    /// Then decodes the tile trace the way --bench-cache --replay does. Prints how fast traces are written and read
+    /// and returns a process exit code.
+    /// </summary>
+    int RunTrace();
+
+    /// <summary>
+    /// Serves 1 to 8 polling readers from a mock staging surface, mapping it for every request and through the
+    /// frame cache. Prints requests and read backs per second and request latencies, and returns a process exit code.
+    /// </summary>
+    int RunReaders();
+
+    /// <summary>
+    /// Runs synthetic tile workloads, even and skewed, and the tile codec on a photographic 4K frame over a task
+    /// scheduler with a growing number of workers, and measures how soon a sleeping worker picks up new work. Returns
+    /// a process exit code, failing if a stream differs from the one encoded without workers.
+    /// </summary>
+    int RunTasks();
+
+    /// <summary>
+    /// Plays the scripted desktop session through acquire, read back, diff, encode and publish stages, first one
+    /// after the other and then on a stage graph, and prints throughput, latency from acquire to publish and the
+    /// counters of each stage. Returns a process exit code, failing if the graph encodes a stream differently.
+    /// </summary>
+    int RunPipeline();
+
+    /// <summary>
+    /// Times every kernel on the frame path, pitched copy, diff, tile hash, format conversions, gamma lookup,
+    /// downscale and rotation, over three resolutions with aligned and misaligned rows, plus packing and parsing a
+    /// response header. Prints GB/s and cycles per pixel. Baseline holds "name GB/s" lines from an earlier run;
+    /// cases more than Threshold, a fraction, slower than theirs are flagged and fail the run. Measured, if not null,
+    /// receives this run in the same format. Returns a process exit code.
+    /// </summary>
+    int RunKernels(const std::string& Baseline, double Threshold, std::string* Measured);
+
+    /// <summary>
+    /// Runs the kernels that come in several instruction set tiers under every tier this processor supports, on
+    /// random pixels at assorted widths, heights and offsets, and compares each output byte for byte with the scalar
+    /// reference. Then times them per tier on a 1080p frame. Returns a process exit code, failing on any difference.
+    /// </summary>
+    int RunIsa();
+
+    /// <summary>
+    /// Converts every non-negative half and every 10-bit PQ code through the HDR conversions and holds the output
+    /// against the transfer functions in double precision: per pixel, per dithered 4x4 block, and through the 10-bit
+    /// transport and back. Then times each conversion on a 4K frame under every tier. Returns a process exit code,
+    /// failing if a conversion strays further than its dithering accounts for.
+    /// </summary>
+    int RunConversions();
+
+    /// <summary>
+    /// Builds gamma lookup tables from the identity ramp and a night light one and applies them to a photographic 4K
+    /// frame, checking every pixel against the ramp, in place and folded into B5G6R5 packing. Then times the stage
+    /// against a plain copy of the frame. Returns a process exit code.
+    /// </summary>
+    int RunGamma();
+
+    /// <summary>
+    /// Rotates and mirrors a 4K frame every way there is and checks each against the pixel by pixel definition, on
+    /// a frame of partial blocks as well, and that damage transformed on its own lands on its mapped rect. Then times
+    /// every orientation against a plain copy of the frame. Returns a process exit code.
+    /// </summary>
+    int RunTransform();
+
+    /// <summary>
+    /// Checks the viewport layout: parsing viewport arguments, clipping them to the frame and fitting them into their
+    /// windows. Then routes damage of full size and downscaled frames to several viewports of one frame and checks
+    /// which of them redraw. Returns a process exit code.
+    /// </summary>
+    int RunViewports();
+
+    /// <summary>
+    /// Plays the scripted desktop session through the driver's stages, a tile stream request, the client decoding it
+    /// and the other conversions, and counts heap allocations per phase once everything has warmed up, one frame at
+    /// a time and with frames overlapping. Returns a process exit code, failing on any allocation after warm-up.
+    /// </summary>
+    int RunAllocations();
+
+    /// <summary>
+    /// Receives frames through mode changes into a vector grown to each frame the way the viewer used to, and into
+    /// the frame pool sized from the capability query. Prints allocations, page faults, bytes zero-filled, failed
+    /// round trips and time per frame, and returns a process exit code, failing if the pool allocates more than once
+    /// or faults once warm.
+    /// </summary>
+    int RunFramePool();
+
+    /// <summary>
+    /// Drives the device cache with mock devices through sharing, device loss, discards, failed creation and
+    /// concurrent requests, then times swap-chain reassignments with and without it. Returns a process exit code,
+    /// failing if the cache misbehaves.
+    /// </summary>
+    int RunDevices();
+
+    /// <summary>
+    /// Checks the latency marker survives every conversion frames go through, then plays the synthetic desktop
+    /// session with every frame stamped at present and reads the markers back on a polling client, reporting the
+    /// latency distribution over a tile stream and over a downscaled B5G6R5 frame. Returns a process exit code,
+    /// failing if a marker didn't come through or came with the wrong frame.
+    /// </summary>
+    int RunLatency();
+
+    /// <summary>
+    /// Checks the demand tracker and the visibility gate, then plays a simulated session in which the app's window is
+    /// hidden for a while, with the driver capturing on demand and the app fetching only while visible, against one
+    /// in which everything is captured and fetched. Returns a process exit code, failing if capture keeps going
+    /// without demand or doesn't resume on the frame presented last.
+    /// </summary>
+    int RunDemand();
+
+    /// <summary>
+    /// Checks the slice board's readiness, leases and supersession, then reads 4K frames back band by band while a
+    /// reader uploads them in slices, against reading each back whole first. Returns a process exit code, failing if
+    /// a frame arrives torn or slices don't cut the latency.
+    /// </summary>
+    int RunSlices();
+
+    /// <summary>
+    /// Drives the client library through its C API against the synthetic source: negotiation, frames held in place
+    /// while others arrive, damage against the frame received last, then a stream of frames. Returns a process exit
+    /// code, failing on any frame or status the API doesn't promise.
+    /// </summary>
+    int RunClient();
+
+    /// <summary>
+    /// Checks that every copy strategy the tuner may pick copies exactly, then tunes the copy of frames at three
+    /// resolutions, starting from Stored, which holds what an earlier run saved, and checks that what it picked
+    /// survives being stored. Saved, if not null, receives what was picked for the next run. Prints the strategies
+    /// with their speed against a plain copy on one thread and returns a process exit code.
+    /// </summary>
+    int RunTuner(const std::string& Stored, std::string* Saved);
+}
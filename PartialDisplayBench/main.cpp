@@ -0,0 +1,306 @@
+#include "Benchmark.h"
+#include "../Common/PixelKernels.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace PartialDisplay;
+
+struct Options
+{
+    vector<string> Modes;
+    Scheduling::ThreadPolicy Policy;  // Its MmcssTask points into MmcssTask once parsing is done
+    wstring MmcssTask = L"Playback";
+    string ReplayFile;
+    string KernelBaseline;
+    string SaveKernelBaseline;
+    double KernelThreshold = 0.15;
+    Kernels::Isa MaxIsa = Kernels::Isa::Avx512;
+    string CopyTuning;
+};
+
+static bool ReadTextFile(const string& path, string& text)
+{
+    ifstream file(path, ios::binary);
+    ostringstream contents;
+    if (!file || !(contents << file.rdbuf()))
+    {
+        printf("Can't read %s\n", path.c_str());
+        return false;
+    }
+    text = contents.str();
+    return true;
+}
+
+static bool WriteTextFile(const string& path, const string& text)
+{
+    ofstream file(path, ios::binary | ios::trunc);
+    if (!file || !file.write(text.data(), streamsize(text.size())))
+    {
+        printf("Can't write %s\n", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+static int BenchmarkTileCache(const Options& options)
+{
+    if (options.ReplayFile.empty())
+    {
+        return Benchmark::RunTileCache(nullptr);
+    }
+
+    // one pass over a recorded session, tile streams decoded back to plain frames first
+    Trace::MappedFile file;
+    Trace::Reader reader;
+    if (!file.Open(options.ReplayFile) || !reader.Open(file.GetData(), file.GetSize()))
+    {
+        printf("Can't read %s as a trace\n", options.ReplayFile.c_str());
+        return 1;
+    }
+    Benchmark::TraceFrames frames(reader);
+    int result = Benchmark::RunTileCache([&frames](Benchmark::CacheFrame& frame) { return frames.Next(frame); });
+    printf("%zu of %zu recorded frames skipped\n", frames.GetSkipped(), reader.GetFrameCount());
+    return result;
+}
+
+static int BenchmarkKernels(const Options& options)
+{
+    string baseline;
+    if (!options.KernelBaseline.empty() && !ReadTextFile(options.KernelBaseline, baseline))
+    {
+        return 1;
+    }
+
+    string measured;
+    int result = Benchmark::RunKernels(baseline, options.KernelThreshold, &measured);
+    if (!options.SaveKernelBaseline.empty())
+    {
+        if (!WriteTextFile(options.SaveKernelBaseline, measured))
+        {
+            return 1;
+        }
+        printf("Baseline saved to %s\n", options.SaveKernelBaseline.c_str());
+    }
+    return result;
+}
+
+static int BenchmarkTuner(const Options& options)
+{
+    // A file that isn't there yet is the first run, which calibrates everything and creates it
+    string stored;
+    if (!options.CopyTuning.empty() && ifstream(options.CopyTuning) && !ReadTextFile(options.CopyTuning, stored))
+    {
+        return 1;
+    }
+
+    string saved;
+    int result = Benchmark::RunTuner(stored, &saved);
+    if (!options.CopyTuning.empty())
+    {
+        if (!WriteTextFile(options.CopyTuning, saved))
+        {
+            return 1;
+        }
+        printf("Copy strategies saved to %s\n", options.CopyTuning.c_str());
+    }
+    return result;
+}
+
+struct Mode
+{
+    const char* Name;
+    int (*Run)(const Options& options);
+};
+
+static const Mode Modes[] =
+{
+    { "--bench-jitter", [](const Options& options) { return Benchmark::RunJitter(options.Policy); } },
+    { "--bench-tracing", [](const Options&) { return Benchmark::RunTracing(); } },
+    { "--bench-codec", [](const Options&) { return Benchmark::RunCodec(); } },
+    { "--bench-cache", BenchmarkTileCache },
+    { "--bench-readers", [](const Options&) { return Benchmark::RunReaders(); } },
+    { "--bench-tasks", [](const Options&) { return Benchmark::RunTasks(); } },
+    { "--bench-pipeline", [](const Options&) { return Benchmark::RunPipeline(); } },
+    { "--bench-kernels", BenchmarkKernels },
+    { "--bench-isa", [](const Options&) { return Benchmark::RunIsa(); } },
+    { "--bench-conversions", [](const Options&) { return Benchmark::RunConversions(); } },
+    { "--bench-gamma", [](const Options&) { return Benchmark::RunGamma(); } },
+    { "--bench-transform", [](const Options&) { return Benchmark::RunTransform(); } },
+    { "--bench-viewports", [](const Options&) { return Benchmark::RunViewports(); } },
+    { "--bench-allocations", [](const Options&) { return Benchmark::RunAllocations(); } },
+    { "--bench-frames", [](const Options&) { return Benchmark::RunFramePool(); } },
+    { "--bench-devices", [](const Options&) { return Benchmark::RunDevices(); } },
+    { "--bench-latency", [](const Options&) { return Benchmark::RunLatency(); } },
+    { "--bench-demand", [](const Options&) { return Benchmark::RunDemand(); } },
+    { "--bench-slices", [](const Options&) { return Benchmark::RunSlices(); } },
+    { "--bench-client", [](const Options&) { return Benchmark::RunClient(); } },
+    { "--bench-tuner", BenchmarkTuner },
+    { "--bench-protocol", [](const Options&) { return Benchmark::RunProtocol(); } },
+    { "--bench-trace", [](const Options&) { return Benchmark::RunTrace(); } },
+};
+
+static bool ParsePriority(const string& Text, Scheduling::ThreadPriority& Priority)
+{
+    const pair<const char*, Scheduling::ThreadPriority> Names[] =
+    {
+        { "normal", Scheduling::ThreadPriority::Normal },
+        { "above", Scheduling::ThreadPriority::AboveNormal },
+        { "high", Scheduling::ThreadPriority::High },
+        { "realtime", Scheduling::ThreadPriority::Realtime },
+    };
+    for (const auto& Name : Names)
+    {
+        if (Text == Name.first)
+        {
+            Priority = Name.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool ParseIsa(const string& Text, Kernels::Isa& Level)
+{
+    for (uint32_t i = 0; i < Kernels::IsaCount; i++)
+    {
+        if (Text == Kernels::GetIsaName(Kernels::Isa(i)))
+        {
+            Level = Kernels::Isa(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+static const Mode* FindMode(const string& Name)
+{
+    for (const Mode& mode : Modes)
+    {
+        if (Name == mode.Name)
+        {
+            return &mode;
+        }
+    }
+    return nullptr;
+}
+
+static bool ParseCommandLine(int argc, char* argv[], Options& options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (FindMode(arg))
+        {
+            options.Modes.push_back(arg);
+        }
+        else if (arg == "--priority" && i + 1 < argc)
+        {
+            if (!ParsePriority(argv[++i], options.Policy.Priority))
+            {
+                printf("Priority must be normal, above, high or realtime, ignoring %s\n", argv[i]);
+            }
+        }
+        else if (arg == "--affinity" && i + 1 < argc)
+        {
+            options.Policy.Affinity = strtoull(argv[++i], nullptr, 16);
+        }
+        else if (arg == "--mmcss" && i + 1 < argc)
+        {
+            string task = argv[++i];
+            options.MmcssTask.assign(task.begin(), task.end());
+        }
+        else if (arg == "--lock-memory")
+        {
+            options.Policy.LockMemory = true;
+        }
+        else if (arg == "--replay" && i + 1 < argc)
+        {
+            options.ReplayFile = argv[++i];
+        }
+        else if (arg == "--kernel-baseline" && i + 1 < argc)
+        {
+            options.KernelBaseline = argv[++i];
+        }
+        else if (arg == "--save-kernel-baseline" && i + 1 < argc)
+        {
+            options.SaveKernelBaseline = argv[++i];
+        }
+        else if (arg == "--kernel-threshold" && i + 1 < argc)
+        {
+            double percent = strtod(argv[++i], nullptr);
+            if (percent > 0 && percent < 100)
+            {
+                options.KernelThreshold = percent / 100;
+            }
+            else
+            {
+                printf("Kernel threshold must be a percentage between 0 and 100, ignoring %s\n", argv[i]);
+            }
+        }
+        else if (arg == "--isa" && i + 1 < argc)
+        {
+            if (!ParseIsa(argv[++i], options.MaxIsa))
+            {
+                printf("Instruction set must be scalar, sse2, sse4.1, avx2 or avx512, ignoring %s\n", argv[i]);
+            }
+        }
+        else if (arg == "--copy-tuning" && i + 1 < argc)
+        {
+            options.CopyTuning = argv[++i];
+        }
+        else
+        {
+            printf("Unknown argument: %s\n", argv[i]);
+            return false;
+        }
+    }
+    return !options.Modes.empty();
+}
+
+static void PrintUsage()
+{
+    printf("Usage: PartialDisplayBench MODE... [OPTION...]\n\nModes, run in the order given:\n");
+    for (const Mode& mode : Modes)
+    {
+        printf("  %s\n", mode.Name);
+    }
+    printf("\nOptions:\n"
+        "  --priority LEVEL               normal, above, high or realtime, in the policy --bench-jitter compares\n"
+        "  --affinity HEXMASK             processors that policy pins the thread to\n"
+        "  --mmcss TASK                   MMCSS task of that policy, Playback by default, none for none\n"
+        "  --lock-memory                  that policy locks the process memory as well\n"
+        "  --replay FILE                  trace recorded by the viewer for --bench-cache to play\n"
+        "  --kernel-baseline FILE         kernel speeds to compare with, as saved by --save-kernel-baseline\n"
+        "  --save-kernel-baseline FILE    where to save the kernel speeds measured\n"
+        "  --kernel-threshold PERCENT     how much slower than its baseline a kernel may get, 15 by default\n"
+        "  --isa LEVEL                    highest instruction set the kernels may use\n"
+        "  --copy-tuning FILE             copy strategies the tuner starts from and saves to\n");
+}
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    if (!ParseCommandLine(argc, argv, options))
+    {
+        PrintUsage();
+        return 2;
+    }
+    options.Policy.MmcssTask = options.MmcssTask == L"none" ? nullptr : options.MmcssTask.c_str();
+    Kernels::SelectIsa(options.MaxIsa);
+
+    int result = 0;
+    for (const string& name : options.Modes)
+    {
+        if (FindMode(name)->Run(options) != 0)
+        {
+            result = 1;
+        }
+    }
+    return result;
+}
\ No newline at end of file
@@ -0,0 +1,374 @@
+#include "PartialDisplayClient.h"
+#include "Transport.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace PartialDisplay;
+
+static_assert(PdFormatBgra8 == uint32_t(Protocol::PixelFormat::BGRA8), "PdPixelFormat out of step");
+static_assert(PdFormatR10G10B10A2 == uint32_t(Protocol::PixelFormat::R10G10B10A2), "PdPixelFormat out of step");
+static_assert(PdFormatRgba16F == uint32_t(Protocol::PixelFormat::RGBA16F), "PdPixelFormat out of step");
+static_assert(PdFormatB5G6R5 == uint32_t(Protocol::PixelFormat::B5G6R5), "PdPixelFormat out of step");
+static_assert(PdColorHdr10 == uint32_t(Protocol::ColorSpace::Hdr10), "PdColorSpace out of step");
+static_assert(sizeof(PdRect) == sizeof(Protocol::DamageRect), "PdRect out of step");
+// Version 1 as it shipped; fields go after these, never between
+static_assert(PD_OPEN_OPTIONS_V1_SIZE == 32, "PdOpenOptions version 1 changed");
+static_assert(PD_CAPABILITIES_V1_SIZE == 24, "PdCapabilities version 1 changed");
+static_assert(PD_FRAME_V1_SIZE == 56 + 2 * sizeof(void*), "PdFrame version 1 changed");
+
+/// <summary>
+/// A client and the buffers frames are received into. A frame handed out points into its buffer, which isn't
+/// received into again until the frame is released.
+/// </summary>
+struct PdClient
+{
+    struct FrameBuffer
+    {
+        // Allocated on first use and again if a mode outgrows it, uninitialized: every frame overwrites what it reads
+        unique_ptr<uint8_t[]> Data;
+        size_t Capacity = 0;
+        bool Held = false;
+    };
+
+    unique_ptr<Client::Transport> Source;
+    Protocol::ServerHello Server = {};
+    uint32_t Format = uint32_t(Protocol::PixelFormat::BGRA8);
+    uint64_t LastSequence = 0;  // Of the frame received last, which damage is reported against
+    vector<FrameBuffer> Buffers;
+};
+
+namespace
+{
+    constexpr uint32_t DefaultFrameBuffers = 2;
+    constexpr uint32_t MaxFrameBuffers = 8;
+    constexpr uint32_t FormatMask = 0xF;
+    constexpr uint32_t DefaultSyntheticWidth = 1920, DefaultSyntheticHeight = 1080;
+    constexpr uint32_t DefaultSyntheticInterval = 16;
+    constexpr uint32_t MinSyntheticSize = 128, MaxSyntheticSize = 16384;
+
+    // The driver answers at once whether or not there is a new frame, so waiting for one is asking again shortly
+    constexpr auto PollInterval = chrono::milliseconds(2);
+
+    /// <summary>
+    /// Runs the body of an exported call, whose failures must come back as a status rather than cross the ABI.
+    /// </summary>
+    template <typename F>
+    PdStatus Guard(F&& Body)
+    {
+        try
+        {
+            return Body();
+        }
+        catch (const bad_alloc&)
+        {
+            return PdNoMemory;
+        }
+        catch (...)
+        {
+            return PdDeviceError;
+        }
+    }
+
+    /// <summary>
+    /// The caller's struct as far as its Size reaches, the fields it was built without zero.
+    /// </summary>
+    template <typename T>
+    T ReadWithin(const T& Caller)
+    {
+        T Known = {};
+        memcpy(&Known, &Caller, min<size_t>(Caller.Size, sizeof(T)));
+        return Known;
+    }
+
+    /// <summary>
+    /// Writes a filled struct out to the caller's, all but the Size leading both and no further than it reaches.
+    /// </summary>
+    template <typename T>
+    void WriteWithin(T& Caller, const T& Filled)
+    {
+        constexpr size_t Start = sizeof(Filled.Size);
+        memcpy(reinterpret_cast<uint8_t*>(&Caller) + Start, reinterpret_cast<const uint8_t*>(&Filled) + Start,
+            min<size_t>(Caller.Size, sizeof(T)) - Start);
+    }
+
+    unique_ptr<Client::Transport> OpenSource(const PdOpenOptions& Options, PdStatus& Status)
+    {
+        Status = PdNotFound;
+        if (Options.Source == PdSourceDevice)
+        {
+            return Client::OpenDevice(Options.Monitor);
+        }
+
+        Client::SyntheticOptions Synthetic;
+        Synthetic.Width = Options.SyntheticWidth != 0 ? Options.SyntheticWidth : DefaultSyntheticWidth;
+        Synthetic.Height = Options.SyntheticHeight != 0 ? Options.SyntheticHeight : DefaultSyntheticHeight;
+        Synthetic.IntervalMs = Options.SyntheticIntervalMs != 0 ? Options.SyntheticIntervalMs
+            : DefaultSyntheticInterval;
+        Synthetic.ResizeAfter = Options.SyntheticResizeAfter;
+        uint32_t MaxHeight = Synthetic.ResizeAfter != 0 ? Synthetic.Height * 2 : Synthetic.Height;
+        if (Synthetic.Width < MinSyntheticSize || Synthetic.Width > MaxSyntheticSize
+            || Synthetic.Height < MinSyntheticSize || MaxHeight > MaxSyntheticSize)
+        {
+            Status = PdInvalidArgument;
+            return nullptr;
+        }
+        return Options.Monitor == 0 ? Client::OpenSynthetic(Synthetic) : nullptr;
+    }
+
+    /// <summary>
+    /// Fills a frame in from a response that carries one, pointing into the response. Returns false if the frame
+    /// isn't what was asked for or doesn't fit its data.
+    /// </summary>
+    bool FillFrame(const PdClient& Client, const Protocol::FrameView& View, PdFrame& Frame)
+    {
+        const Protocol::FrameDescriptor& Descriptor = *View.Descriptor;
+        if (Descriptor.Format != Client.Format || Descriptor.Compression != Protocol::CompressionNone
+            || Protocol::GetDownscale(Descriptor) != 0 || Descriptor.Height == 0
+            || uint64_t(Descriptor.Width) * Protocol::BytesPerPixel(Protocol::PixelFormat(Client.Format))
+                > Descriptor.Pitch
+            || uint64_t(Descriptor.Pitch) * Descriptor.Height > Descriptor.DataSize)
+        {
+            return false;
+        }
+
+        bool FullDamage = (Descriptor.Flags & Protocol::FrameFullDamage) || Descriptor.DamageCount == 0;
+        Frame.Format = Descriptor.Format;
+        Frame.ColorSpace = Descriptor.ColorSpace;
+        Frame.Width = Descriptor.Width;
+        Frame.Height = Descriptor.Height;
+        Frame.Pitch = Descriptor.Pitch;
+        Frame.Flags = FullDamage ? PdFrameFullDamage : 0;
+        Frame.DamageCount = FullDamage ? 0 : Descriptor.DamageCount;
+        Frame.Sequence = Descriptor.Sequence;
+        Frame.Timestamp = Descriptor.Timestamp;
+        Frame.Pixels = View.Data;
+        Frame.Damage = FullDamage ? nullptr : reinterpret_cast<const PdRect*>(View.Damage);
+        return true;
+    }
+}
+
+extern "C"
+{
+    PD_API uint32_t PD_CALL PdGetVersion(void)
+    {
+        return PD_CLIENT_VERSION;
+    }
+
+    PD_API const char* PD_CALL PdGetStatusText(PdStatus Status)
+    {
+        switch (Status)
+        {
+        case PdOk: return "ok";
+        case PdTimeout: return "no new frame in time";
+        case PdInvalidArgument: return "invalid argument";
+        case PdNotFound: return "no such monitor";
+        case PdUnsupported: return "not supported by the source";
+        case PdNoMemory: return "out of memory";
+        case PdBusy: return "every frame buffer is held";
+        case PdDeviceError: return "the source failed";
+        }
+        return "unknown status";
+    }
+
+    PD_API PdStatus PD_CALL PdOpen(const PdOpenOptions* Options, PdClient** Client)
+    {
+        if (Client != nullptr)
+        {
+            *Client = nullptr;
+        }
+        if (Options == nullptr || Client == nullptr || Options->Size < PD_OPEN_OPTIONS_V1_SIZE)
+        {
+            return PdInvalidArgument;
+        }
+        const PdOpenOptions Known = ReadWithin(*Options);
+        if ((Known.Source != PdSourceDevice && Known.Source != PdSourceSynthetic)
+            || (Known.Formats & ~FormatMask) != 0 || Known.FrameBuffers > MaxFrameBuffers)
+        {
+            return PdInvalidArgument;
+        }
+
+        return Guard([&]
+            {
+                auto Opened = make_unique<PdClient>();
+                PdStatus Status;
+                Opened->Source = OpenSource(Known, Status);
+                if (!Opened->Source)
+                {
+                    return Status;
+                }
+
+                // Raw frames only, so they can be handed out where they land; tiles would need decoding into a copy
+                Protocol::ClientHello Hello = {};
+                Hello.Size = sizeof(Hello);
+                Hello.Version = Protocol::Version;
+                Hello.Formats = Known.Formats | Protocol::FormatBit(Protocol::PixelFormat::BGRA8);
+                Hello.Compression = Protocol::CompressionNone;
+                Hello.Features = Protocol::FeatureDamageRects | Protocol::FeatureSkipUnchanged;
+                if (!Opened->Source->Negotiate(Hello, Opened->Server))
+                {
+                    return PdDeviceError;
+                }
+                if (Opened->Server.Version != Protocol::Version
+                    || !(Opened->Server.Formats & Protocol::FormatBit(Protocol::PixelFormat::BGRA8)))
+                {
+                    return PdUnsupported;
+                }
+
+                Opened->Buffers.resize(Known.FrameBuffers != 0 ? Known.FrameBuffers : DefaultFrameBuffers);
+                *Client = Opened.release();
+                return PdOk;
+            });
+    }
+
+    PD_API void PD_CALL PdClose(PdClient* Client)
+    {
+        delete Client;
+    }
+
+    PD_API PdStatus PD_CALL PdGetCapabilities(PdClient* Client, PdCapabilities* Capabilities)
+    {
+        if (Client == nullptr || Capabilities == nullptr || Capabilities->Size < PD_CAPABILITIES_V1_SIZE)
+        {
+            return PdInvalidArgument;
+        }
+        PdCapabilities Filled = {};
+        Filled.Formats = Client->Server.Formats & FormatMask;
+        Filled.MaxWidth = Client->Server.MaxWidth;
+        Filled.MaxHeight = Client->Server.MaxHeight;
+        Filled.Width = Client->Server.CurrentWidth;
+        Filled.Height = Client->Server.CurrentHeight;
+        WriteWithin(*Capabilities, Filled);
+        return PdOk;
+    }
+
+    PD_API PdStatus PD_CALL PdSetFormat(PdClient* Client, uint32_t Format)
+    {
+        if (Client == nullptr || Format > PdFormatB5G6R5)
+        {
+            return PdInvalidArgument;
+        }
+        if (!(Client->Server.Formats & Protocol::FormatBit(Protocol::PixelFormat(Format))))
+        {
+            return PdUnsupported;
+        }
+
+        // Damage against a frame in another format means nothing
+        if (Format != Client->Format)
+        {
+            Client->Format = Format;
+            Client->LastSequence = 0;
+        }
+        return PdOk;
+    }
+
+    PD_API PdStatus PD_CALL PdWaitFrame(PdClient* Client, uint32_t TimeoutMs, PdFrame* Frame)
+    {
+        if (Client == nullptr || Frame == nullptr || Frame->Size < PD_FRAME_V1_SIZE)
+        {
+            return PdInvalidArgument;
+        }
+        uint32_t Index = 0;
+        while (Index < Client->Buffers.size() && Client->Buffers[Index].Held)
+        {
+            Index++;
+        }
+        if (Index == Client->Buffers.size())
+        {
+            return PdBusy;
+        }
+
+        return Guard([&]
+            {
+                PdClient::FrameBuffer& Buffer = Client->Buffers[Index];
+                if (!Buffer.Data)
+                {
+                    Buffer.Capacity = size_t(max<uint64_t>(Client->Server.MaxResponseSize, Protocol::MaxHeaderSize));
+                    Buffer.Data.reset(new uint8_t[Buffer.Capacity]);
+                }
+
+                Protocol::FrameRequest Request = {};
+                Request.Size = sizeof(Request);
+                Request.Version = Protocol::Version;
+                Request.Format = Client->Format;
+                Request.Compression = Protocol::CompressionNone;
+                Request.Features = Client->Server.Features
+                    & (Protocol::FeatureDamageRects | Protocol::FeatureSkipUnchanged);
+                Request.LastSequence = Client->LastSequence;
+
+                auto Deadline = chrono::steady_clock::now() + chrono::milliseconds(TimeoutMs);
+                for (;;)
+                {
+                    size_t Returned = 0;
+                    Protocol::FrameView View;
+                    if (!Client->Source->GetFrame(Request, Buffer.Data.get(), Buffer.Capacity, Returned)
+                        || !Protocol::ParseFrame(Buffer.Data.get(), Returned, View))
+                    {
+                        return PdDeviceError;
+                    }
+
+                    // Without FeatureSkipUnchanged the frame held comes back whole, which is no newer either
+                    const Protocol::FrameDescriptor& Descriptor = *View.Descriptor;
+                    bool Unchanged = (Descriptor.Flags & Protocol::FrameUnchanged)
+                        || (Client->LastSequence != 0 && Descriptor.Sequence <= Client->LastSequence);
+                    if (!Unchanged && View.Data == nullptr)
+                    {
+                        // The mode outgrew the buffer, which is grown to the response and asked again
+                        // Descriptor lies in the buffer, so the size is taken before the buffer is replaced
+                        size_t Needed = size_t(Protocol::GetResponseSize(Descriptor));
+                        if (Descriptor.DataSize == 0 || Needed <= Buffer.Capacity)
+                        {
+                            return PdDeviceError;
+                        }
+                        Buffer.Data.reset(new uint8_t[Needed]);
+                        Buffer.Capacity = Needed;
+                        continue;
+                    }
+                    if (!Unchanged)
+                    {
+                        PdFrame Filled = {};
+                        if (!FillFrame(*Client, View, Filled))
+                        {
+                            return PdDeviceError;
+                        }
+                        Filled.Buffer = Index;
+                        WriteWithin(*Frame, Filled);
+                        Buffer.Held = true;
+                        Client->LastSequence = Descriptor.Sequence;
+                        return PdOk;
+                    }
+
+                    auto Now = chrono::steady_clock::now();
+                    if (Now >= Deadline)
+                    {
+                        return PdTimeout;
+                    }
+                    this_thread::sleep_for(min<chrono::steady_clock::duration>(PollInterval, Deadline - Now));
+                }
+            });
+    }
+
+    PD_API PdStatus PD_CALL PdReleaseFrame(PdClient* Client, const PdFrame* Frame)
+    {
+        if (Client == nullptr || Frame == nullptr || Frame->Size < PD_FRAME_V1_SIZE
+            || Frame->Buffer >= Client->Buffers.size())
+        {
+            return PdInvalidArgument;
+        }
+
+        // Only a frame handed out from that buffer, and not released since
+        PdClient::FrameBuffer& Buffer = Client->Buffers[Frame->Buffer];
+        const uint8_t* Begin = Buffer.Data.get();
+        if (!Buffer.Held || Frame->Pixels < Begin || Frame->Pixels >= Begin + Buffer.Capacity)
+        {
+            return PdInvalidArgument;
+        }
+        Buffer.Held = false;
+        return PdOk;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,95 @@
+#ifdef _WIN32
+
+// Ahead of the protocol, which only declares the device interface once GUID is defined
+#define NOMINMAX
+#include <windows.h>
+#include <winioctl.h>
+#include <cfgmgr32.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "Transport.h"
+
+using namespace std;
+using namespace PartialDisplay;
+
+namespace
+{
+    class DeviceTransport : public Client::Transport
+    {
+    public:
+        explicit DeviceTransport(HANDLE hDevice) : m_hDevice(hDevice) {}
+        ~DeviceTransport() override { CloseHandle(m_hDevice); }
+
+        bool Negotiate(const Protocol::ClientHello& Client, Protocol::ServerHello& Server) override
+        {
+            DWORD Returned;
+            return DeviceIoControl(m_hDevice, IOCTL_Custom_Negotiate, const_cast<Protocol::ClientHello*>(&Client),
+                sizeof(Client), &Server, sizeof(Server), &Returned, nullptr) && Returned >= sizeof(Server);
+        }
+
+        bool GetFrame(const Protocol::FrameRequest& Request, void* Buffer, size_t Capacity, size_t& Returned) override
+        {
+            DWORD Length;
+            if (!DeviceIoControl(m_hDevice, IOCTL_Custom_GetMonitorData, const_cast<Protocol::FrameRequest*>(&Request),
+                sizeof(Request), Buffer, DWORD(min<size_t>(Capacity, MAXDWORD)), &Length, nullptr))
+            {
+                return false;
+            }
+            Returned = Length;
+            return true;
+        }
+
+    private:
+        HANDLE m_hDevice;
+    };
+}
+
+namespace PartialDisplay::Client
+{
+    unique_ptr<Transport> OpenDevice(uint32_t Monitor)
+    {
+        // The driver serves its first monitor alone. Creating the device is left to the app that owns it, a client
+        // only finds it once the driver has started it
+        if (Monitor != 0)
+        {
+            return nullptr;
+        }
+        GUID Interface = Protocol::DeviceInterface;
+        ULONG Length = 0;
+        if (CM_Get_Device_Interface_List_SizeW(&Length, &Interface, nullptr, CM_GET_DEVICE_INTERFACE_LIST_PRESENT)
+            != CR_SUCCESS || Length <= 1)
+        {
+            return nullptr;
+        }
+        vector<WCHAR> List(Length);
+        if (CM_Get_Device_Interface_ListW(&Interface, nullptr, List.data(), Length,
+            CM_GET_DEVICE_INTERFACE_LIST_PRESENT) != CR_SUCCESS || List[0] == L'\0')
+        {
+            return nullptr;
+        }
+
+        HANDLE hDevice = CreateFileW(List.data(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+            nullptr, OPEN_EXISTING, 0, nullptr);
+        if (hDevice == INVALID_HANDLE_VALUE)
+        {
+            return nullptr;
+        }
+        return make_unique<DeviceTransport>(hDevice);
+    }
+}
+
+#else
+
+#include "Transport.h"
+
+namespace PartialDisplay::Client
+{
+    std::unique_ptr<Transport> OpenDevice(uint32_t)
+    {
+        return nullptr;
+    }
+}
+
+#endif
\ No newline at end of file
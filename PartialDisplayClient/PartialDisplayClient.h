@@ -0,0 +1,182 @@
+#pragma once
+
+// Client library for consuming the frames of a partial display from C or any language that can call C. A client
+// opens a monitor, negotiates the pixel formats both sides support, then waits for frames and reads them out of the
+// library's receive buffers. Each frame is copied once, by the driver's I/O into a buffer allocated when it is first
+// used; a frame handed out is a read-only view of it, pixels and damage rects alike, valid until it is released, and
+// receiving allocates nothing more until a mode outgrows the buffer. The calls only take and return the plain types
+// declared here, and every struct starts with its own size, so the ABI stays stable as fields are added at the end.
+//
+// Besides the driver, a client can open a synthetic source that answers the way the driver does, for trying the
+// library out and testing against it on any platform.
+//
+// Calls on one client must not overlap; different clients are independent.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) && !defined(PD_CLIENT_STATIC)
+#ifdef PD_CLIENT_EXPORTS
+#define PD_API __declspec(dllexport)
+#else
+#define PD_API __declspec(dllimport)
+#endif
+#else
+#define PD_API
+#endif
+
+#ifdef _WIN32
+#define PD_CALL __cdecl
+#else
+#define PD_CALL
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Raised whenever the ABI changes incompatibly; PdGetVersion returns what the library was built with.
+#define PD_CLIENT_VERSION 1
+
+typedef struct PdClient PdClient;
+
+typedef enum PdStatus
+{
+    PdOk = 0,
+    PdTimeout = 1,            // No new frame in time
+    PdInvalidArgument = -1,
+    PdNotFound = -2,          // No such monitor, or the driver isn't running
+    PdUnsupported = -3,       // Not something both sides support
+    PdNoMemory = -4,
+    PdBusy = -5,              // Every frame buffer is held, release a frame first
+    PdDeviceError = -6,       // The source failed or answered malformed, the client is best closed
+} PdStatus;
+
+// The values are the driver's protocol's.
+typedef enum PdPixelFormat
+{
+    PdFormatBgra8 = 0,        // 8-bit sRGB, HDR content is tone mapped
+    PdFormatR10G10B10A2 = 1,  // Packed 10-bit HDR10
+    PdFormatRgba16F = 2,      // Half-float scRGB
+    PdFormatB5G6R5 = 3,       // Dithered 16-bit sRGB
+} PdPixelFormat;
+
+#define PD_FORMAT_BIT(Format) (1u << (uint32_t)(Format))
+
+typedef enum PdColorSpace
+{
+    PdColorSrgb = 0,
+    PdColorScRgb = 1,
+    PdColorHdr10 = 2,
+} PdColorSpace;
+
+typedef enum PdSource
+{
+    PdSourceDevice = 0,     // The driver, on Windows
+    PdSourceSynthetic = 1,  // Generated frames of a moving box, everywhere
+} PdSource;
+
+typedef enum PdFrameFlags
+{
+    PdFrameFullDamage = 1u << 0,  // Damage is unknown, treat the whole frame as changed; DamageCount is 0
+} PdFrameFlags;
+
+typedef struct PdOpenOptions
+{
+    uint32_t Size;                  // sizeof(PdOpenOptions), PD_OPEN_OPTIONS_V1_SIZE at least
+    uint32_t Source;                // PdSource
+    uint32_t Monitor;               // Index of the monitor, only 0 for now
+    uint32_t Formats;               // PD_FORMAT_BIT of the formats the caller consumes besides BGRA8, which all do
+    uint32_t FrameBuffers;          // Frames the caller holds at once at most, 1 to 8, 0 for 2
+    uint32_t SyntheticWidth;        // Size of synthetic frames, 0 for 1920 x 1080
+    uint32_t SyntheticHeight;
+    uint32_t SyntheticIntervalMs;   // Time between synthetic frames, 0 for 16
+    uint32_t SyntheticResizeAfter;  // Frames after which the synthetic mode changes to twice the height, 0 for never
+} PdOpenOptions;
+
+typedef struct PdCapabilities
+{
+    uint32_t Size;       // sizeof(PdCapabilities) set by the caller, PD_CAPABILITIES_V1_SIZE at least
+    uint32_t Formats;    // PD_FORMAT_BIT of what both sides support, BGRA8 always among them
+    uint32_t MaxWidth;
+    uint32_t MaxHeight;
+    uint32_t Width;      // Of the current mode as of opening, 0 while the monitor shows nothing
+    uint32_t Height;
+} PdCapabilities;
+
+typedef struct PdRect
+{
+    int32_t Left;
+    int32_t Top;
+    int32_t Right;
+    int32_t Bottom;
+} PdRect;
+
+typedef struct PdFrame
+{
+    uint32_t Size;              // sizeof(PdFrame) set by the caller, PD_FRAME_V1_SIZE at least
+    uint32_t Format;            // PdPixelFormat
+    uint32_t ColorSpace;        // PdColorSpace
+    uint32_t Width;
+    uint32_t Height;
+    uint32_t Pitch;             // Bytes from one row to the next
+    uint32_t Flags;             // PdFrameFlags
+    uint32_t DamageCount;
+    uint64_t Sequence;          // Increases with every frame the source produced; gaps are frames skipped
+    uint64_t Timestamp;         // When the frame was presented: QPC ticks from the driver, ns from the synthetic
+    const uint8_t* Pixels;      // Height rows of Pitch bytes, read only and valid until the frame is released
+    const PdRect* Damage;       // What changed since the frame received before this one, as valid as Pixels
+    uint32_t Buffer;            // The library's, leave as is
+    uint32_t Reserved;
+} PdFrame;
+
+// Sizes of the structs as version 1 of the library declared them, the least their Size may be. Fields are only ever
+// added at the end, so these stay put; the library reads and writes nothing past the Size it is given, which lets
+// callers built against an older or a newer header share it.
+#define PD_OPEN_OPTIONS_V1_SIZE (offsetof(PdOpenOptions, SyntheticIntervalMs) + sizeof(uint32_t))
+#define PD_CAPABILITIES_V1_SIZE (offsetof(PdCapabilities, Height) + sizeof(uint32_t))
+#define PD_FRAME_V1_SIZE (offsetof(PdFrame, Reserved) + sizeof(uint32_t))
+
+/// <summary>
+/// PD_CLIENT_VERSION of the library, to compare with the header the caller was built with.
+/// </summary>
+PD_API uint32_t PD_CALL PdGetVersion(void);
+
+/// <summary>
+/// Short English description of a status, for logs.
+/// </summary>
+PD_API const char* PD_CALL PdGetStatusText(PdStatus Status);
+
+/// <summary>
+/// Opens a monitor and negotiates with its source. Returns PdNotFound if there is none, PdUnsupported if the source
+/// produces none of the requested formats.
+/// </summary>
+PD_API PdStatus PD_CALL PdOpen(const PdOpenOptions* Options, PdClient** Client);
+
+/// <summary>
+/// Closes a client. Frames still held are gone with it.
+/// </summary>
+PD_API void PD_CALL PdClose(PdClient* Client);
+
+PD_API PdStatus PD_CALL PdGetCapabilities(PdClient* Client, PdCapabilities* Capabilities);
+
+/// <summary>
+/// Picks the format of frames from the negotiated ones, BGRA8 until called. The next frame is whole.
+/// </summary>
+PD_API PdStatus PD_CALL PdSetFormat(PdClient* Client, uint32_t Format);
+
+/// <summary>
+/// Waits up to TimeoutMs for a frame after the one received last and fills Frame in with a view of it. The source is
+/// asked every 2 ms until one comes, so a frame is seen up to that much after it was presented. Returns PdTimeout
+/// if none came, PdBusy if the caller holds as many frames as it has buffers.
+/// </summary>
+PD_API PdStatus PD_CALL PdWaitFrame(PdClient* Client, uint32_t TimeoutMs, PdFrame* Frame);
+
+/// <summary>
+/// Hands the buffer of a frame back for receiving into; its view is invalid from then on.
+/// </summary>
+PD_API PdStatus PD_CALL PdReleaseFrame(PdClient* Client, const PdFrame* Frame);
+
+#ifdef __cplusplus
+}
+#endif
\ No newline at end of file
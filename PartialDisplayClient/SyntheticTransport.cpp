@@ -0,0 +1,154 @@
+#include "Transport.h"
+
+#include <chrono>
+#include <cstring>
+
+using namespace std;
+using namespace PartialDisplay;
+
+namespace
+{
+    constexpr uint32_t BoxSize = 64;
+    constexpr uint32_t PitchAlignment = 256;  // Like the staging surfaces the driver maps
+
+    class SyntheticTransport : public Client::Transport
+    {
+    public:
+        explicit SyntheticTransport(const Client::SyntheticOptions& Options) : m_Options(Options),
+            m_Pitch((Options.Width * 4 + PitchAlignment - 1) / PitchAlignment * PitchAlignment),
+            m_Start(chrono::steady_clock::now()) {}
+
+        bool Negotiate(const Protocol::ClientHello& Client, Protocol::ServerHello& Server) override
+        {
+            if (Client.Size < sizeof(Client) || Client.Version != Protocol::Version)
+            {
+                return false;
+            }
+            Server = {};
+            Server.Size = sizeof(Server);
+            Server.Version = Protocol::Version;
+            Server.Formats = Client.Formats & Protocol::FormatBit(Protocol::PixelFormat::BGRA8);
+            Server.Compression = Protocol::CompressionNone;
+            Server.Features = Client.Features & (Protocol::FeatureDamageRects | Protocol::FeatureSkipUnchanged);
+            Server.MaxWidth = Server.CurrentWidth = m_Options.Width;
+            Server.MaxHeight = Server.CurrentHeight = m_Options.Height;
+            Server.CurrentPitch = m_Pitch;
+            Server.MaxResponseSize = Protocol::MaxHeaderSize + uint64_t(m_Pitch) * m_Options.Height;
+            return true;
+        }
+
+        bool GetFrame(const Protocol::FrameRequest& Request, void* Buffer, size_t Capacity, size_t& Returned) override
+        {
+            if (Request.Size < sizeof(Request) || Request.Version != Protocol::Version
+                || Request.Format != uint32_t(Protocol::PixelFormat::BGRA8)
+                || Request.Compression != Protocol::CompressionNone || Request.Downscale != 0
+                || Capacity < sizeof(Protocol::FrameDescriptor))
+            {
+                return false;
+            }
+
+            uint64_t Sequence = GetSequence();
+            uint64_t Last = Request.LastSequence;
+            uint32_t Height = GetHeight(Sequence);
+            Protocol::FrameDescriptor Descriptor = {};
+            Descriptor.Magic = Protocol::FrameDescriptorMagic;
+            Descriptor.Version = Protocol::Version;
+            Descriptor.HeaderSize = uint16_t(Protocol::GetHeaderSize(0));
+            Descriptor.Format = Request.Format;
+            Descriptor.Compression = Protocol::CompressionNone;
+            Descriptor.Width = m_Options.Width;
+            Descriptor.Height = Height;
+            Descriptor.Pitch = m_Pitch;
+            Descriptor.Sequence = Sequence;
+            Descriptor.Timestamp = uint64_t(chrono::duration_cast<chrono::nanoseconds>(m_Start.time_since_epoch()
+                + chrono::milliseconds((Sequence - 1) * m_Options.IntervalMs)).count());
+            Descriptor.ColorSpace = uint32_t(Protocol::ColorSpace::Srgb);
+            if ((Request.Features & Protocol::FeatureSkipUnchanged) && Last == Sequence)
+            {
+                Descriptor.Flags = Protocol::FrameUnchanged;
+                memcpy(Buffer, &Descriptor, sizeof(Descriptor));
+                Returned = sizeof(Descriptor);
+                return true;
+            }
+
+            // Only the box moves: where it was in the frame the client holds and where it is now. A new mode is whole.
+            Protocol::DamageRect Damage[2] = { GetBox(Last), GetBox(Sequence) };
+            if ((Request.Features & Protocol::FeatureDamageRects) && Last != 0 && Last < Sequence
+                && GetHeight(Last) == Height)
+            {
+                Descriptor.DamageCount = 2;
+                Descriptor.HeaderSize = uint16_t(Protocol::GetHeaderSize(2));
+            }
+            else
+            {
+                Descriptor.Flags = Protocol::FrameFullDamage;
+            }
+            Descriptor.DataSize = uint64_t(m_Pitch) * Height;
+            if (Capacity < Protocol::GetResponseSize(Descriptor))
+            {
+                memcpy(Buffer, &Descriptor, sizeof(Descriptor));
+                Returned = sizeof(Descriptor);
+                return true;
+            }
+
+            memcpy(Buffer, &Descriptor, sizeof(Descriptor));
+            Protocol::PackHeader(Buffer, Damage);
+            Render(Sequence, Height, static_cast<uint8_t*>(Buffer) + Descriptor.HeaderSize);
+            Returned = size_t(Protocol::GetResponseSize(Descriptor));
+            return true;
+        }
+
+    private:
+        Client::SyntheticOptions m_Options;
+        uint32_t m_Pitch;
+        chrono::steady_clock::time_point m_Start;
+
+        uint64_t GetSequence() const
+        {
+            auto Elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - m_Start);
+            return 1 + uint64_t(Elapsed.count()) / m_Options.IntervalMs;
+        }
+
+        uint32_t GetHeight(uint64_t Sequence) const
+        {
+            return m_Options.ResizeAfter != 0 && Sequence > m_Options.ResizeAfter ? m_Options.Height * 2
+                : m_Options.Height;
+        }
+
+        Protocol::DamageRect GetBox(uint64_t Sequence) const
+        {
+            int32_t Left = int32_t(Sequence * 37 % (m_Options.Width - BoxSize));
+            int32_t Top = int32_t(Sequence * 23 % (m_Options.Height - BoxSize));
+            return { Left, Top, Left + int32_t(BoxSize), Top + int32_t(BoxSize) };
+        }
+
+        void Render(uint64_t Sequence, uint32_t Height, uint8_t* Pixels) const
+        {
+            Protocol::DamageRect Box = GetBox(Sequence);
+            uint32_t Color = 0xFF000000 | uint32_t(Sequence * 0x9E3779B1) >> 8;
+            for (uint32_t y = 0; y < Height; y++)
+            {
+                auto* Row = reinterpret_cast<uint32_t*>(Pixels + size_t(y) * m_Pitch);
+                for (uint32_t x = 0; x < m_Options.Width; x++)
+                {
+                    Row[x] = 0xFF000000 | (x & 0xFF) << 16 | (y & 0xFF) << 8 | ((x ^ y) & 0xFF);
+                }
+                if (int32_t(y) >= Box.Top && int32_t(y) < Box.Bottom)
+                {
+                    for (int32_t x = Box.Left; x < Box.Right; x++)
+                    {
+                        Row[x] = Color;
+                    }
+                }
+            }
+        }
+    };
+}
+
+namespace PartialDisplay::Client
+{
+    unique_ptr<Transport> OpenSynthetic(const SyntheticOptions& Options)
+    {
+        return make_unique<SyntheticTransport>(Options);
+    }
+}
\ No newline at end of file
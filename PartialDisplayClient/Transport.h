@@ -0,0 +1,50 @@
+#pragma once
+
+// What a client talks to: the driver's IOCTLs, or a synthetic source answering them the way the driver would.
+// Requests and responses are the protocol's, so everything above a transport is the same for both.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "../Common/Protocol.h"
+
+namespace PartialDisplay::Client
+{
+    class Transport
+    {
+    public:
+        virtual ~Transport() = default;
+
+        /// <summary>
+        /// IOCTL_Custom_Negotiate. Returns false if the request failed.
+        /// </summary>
+        virtual bool Negotiate(const Protocol::ClientHello& Client, Protocol::ServerHello& Server) = 0;
+
+        /// <summary>
+        /// IOCTL_Custom_GetMonitorData, the response written straight into Buffer and its length into Returned.
+        /// Returns false if the request failed.
+        /// </summary>
+        virtual bool GetFrame(const Protocol::FrameRequest& Request, void* Buffer, size_t Capacity,
+            size_t& Returned) = 0;
+    };
+
+    struct SyntheticOptions
+    {
+        uint32_t Width;
+        uint32_t Height;
+        uint32_t IntervalMs;
+        uint32_t ResizeAfter;  // Frames after which the mode turns twice as tall, past what was negotiated; 0 for never
+    };
+
+    /// <summary>
+    /// Opens the driver's device for Monitor. Returns null if there is none, always off Windows.
+    /// </summary>
+    std::unique_ptr<Transport> OpenDevice(uint32_t Monitor);
+
+    /// <summary>
+    /// A source of BGRA8 frames of a box moving over a still background, a new one every IntervalMs, with the
+    /// damage of the box's moves since the frame the client holds.
+    /// </summary>
+    std::unique_ptr<Transport> OpenSynthetic(const SyntheticOptions& Options);
+}
\ No newline at end of file
@@ -27,7 +27,7 @@ void IndirectDeviceContext::InitAdapter()
     // Declare basic feature support for the adapter (required)
     AdapterCaps.MaxMonitorsSupported = 1;
     AdapterCaps.EndPointDiagnostics.Size = sizeof(AdapterCaps.EndPointDiagnostics);
-    AdapterCaps.EndPointDiagnostics.GammaSupport = IDDCX_FEATURE_IMPLEMENTATION_NONE;
+    AdapterCaps.EndPointDiagnostics.GammaSupport = IDDCX_FEATURE_IMPLEMENTATION_SOFTWARE;
     AdapterCaps.EndPointDiagnostics.TransmissionType = IDDCX_TRANSMISSION_TYPE_WIRED_OTHER;
 
     // Declare your device strings for telemetry (required)
@@ -139,15 +139,39 @@ IndirectMonitorContext::IndirectMonitorContext(_In_ IDDCX_MONITOR Monitor) :
 
 IndirectMonitorContext::~IndirectMonitorContext()
 {
-    m_ProcessingThread.reset();
+    ReplaceSwapChainProcessor(nullptr);
+}
+
+shared_ptr<SwapChainProcessor> IndirectMonitorContext::GetSwapChainProcessor()
+{
+    lock_guard<mutex> Lock(m_ProcessorMutex);
+    return m_ProcessingThread;
+}
+
+void IndirectMonitorContext::ReplaceSwapChainProcessor(shared_ptr<SwapChainProcessor> Processor)
+{
+    shared_ptr<SwapChainProcessor> Previous;
+    {
+        lock_guard<mutex> Lock(m_ProcessorMutex);
+        Previous = move(m_ProcessingThread);
+        m_ProcessingThread = move(Processor);
+    }
+
+    // Stopped here rather than when the last reference goes, which an IOCTL may still hold for a while. Whoever
+    // releases it last waits for the processing thread.
+    if (Previous)
+    {
+        Previous->Stop();
+    }
 }
 
 void IndirectMonitorContext::AssignSwapChain(IDDCX_SWAPCHAIN SwapChain, LUID RenderAdapter, HANDLE NewFrameEvent)
 {
-    m_ProcessingThread.reset();
+    ReplaceSwapChainProcessor(nullptr);
 
-    auto Device = make_shared<Direct3DDevice>(RenderAdapter);
-    if (FAILED(Device->Init()))
+    // Usually the device the last swap-chain used, so a mode change or resume doesn't wait for a new one
+    auto Device = Direct3DDevice::Acquire(RenderAdapter);
+    if (Device == nullptr)
     {
         // It's important to delete the swap-chain if D3D initialization fails, so that the OS knows to generate a new
         // swap-chain and try again.
@@ -156,12 +180,48 @@ void IndirectMonitorContext::AssignSwapChain(IDDCX_SWAPCHAIN SwapChain, LUID Ren
     else
     {
         // Create a new swap-chain processing thread
-        m_ProcessingThread.reset(new SwapChainProcessor(SwapChain, Device, NewFrameEvent));
+        auto Processor = make_shared<SwapChainProcessor>(SwapChain, Device, NewFrameEvent);
+        Processor->SetGammaLut(m_GammaLut);
+        ReplaceSwapChainProcessor(move(Processor));
     }
 }
 
 void IndirectMonitorContext::UnassignSwapChain()
 {
     // Stop processing the last swap-chain
-    m_ProcessingThread.reset();
+    ReplaceSwapChainProcessor(nullptr);
+}
+
+NTSTATUS IndirectMonitorContext::SetGammaRamp(const IDARG_IN_SET_GAMMARAMP* pInArgs)
+{
+    shared_ptr<Kernels::ChannelLut> Lut;
+    switch (pInArgs->Type)
+    {
+    case IDDCX_GAMMARAMP_TYPE_DEFAULT:
+        // Identity ramp, frames skip the stage
+        break;
+
+    case IDDCX_GAMMARAMP_TYPE_RGB256x3x16:
+        if (pInArgs->GammaRampSizeInBytes < sizeof(UINT16[3][256]) || pInArgs->pGammaRampData == nullptr)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+        Lut = make_shared<Kernels::ChannelLut>();
+        if (!Kernels::BuildChannelLut(*static_cast<const UINT16(*)[3][256]>(pInArgs->pGammaRampData), *Lut))
+        {
+            Lut.reset();
+        }
+        break;
+
+    default:
+        // Only per-channel ramps are applied in software; colour space transform matrices are not supported
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    m_GammaLut = Lut;
+    if (auto Processor = GetSwapChainProcessor())
+    {
+        Processor->SetGammaLut(m_GammaLut);
+    }
+    return STATUS_SUCCESS;
 }
\ No newline at end of file
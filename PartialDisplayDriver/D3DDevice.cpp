@@ -1,8 +1,50 @@
 #include "Driver.h"
 
 using namespace std;
+using namespace Microsoft::WRL;
 using namespace PartialDisplay;
 
+static mutex s_FactoryMutex;
+static ComPtr<IDXGIFactory5> s_Factory;
+
+static HRESULT GetDxgiFactory(ComPtr<IDXGIFactory5>& Factory)
+{
+    // A factory only knows the adapters that were there when it was created, it stops being current once one comes
+    // or goes and is replaced then
+    lock_guard<mutex> Lock(s_FactoryMutex);
+    if (s_Factory == nullptr || !s_Factory->IsCurrent())
+    {
+        s_Factory.Reset();
+        HRESULT hr = CreateDXGIFactory2(0, IID_PPV_ARGS(&s_Factory));
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+    }
+    Factory = s_Factory;
+    return S_OK;
+}
+
+static uint64_t GetAdapterKey(LUID AdapterLuid)
+{
+    return Devices::MakeAdapterKey(AdapterLuid.HighPart, AdapterLuid.LowPart);
+}
+
+static Devices::DeviceCache<Direct3DDevice>& GetDeviceCache()
+{
+    static Devices::DeviceCache<Direct3DDevice> s_Devices(
+        [](uint64_t Adapter)
+        {
+            LUID AdapterLuid;
+            AdapterLuid.LowPart = DWORD(Adapter);
+            AdapterLuid.HighPart = LONG(Adapter >> 32);
+            auto Device = make_shared<Direct3DDevice>(AdapterLuid);
+            return SUCCEEDED(Device->Init()) ? Device : nullptr;
+        },
+        [](const Direct3DDevice& Device) { return !Device.IsLost(); });
+    return s_Devices;
+}
+
 Direct3DDevice::Direct3DDevice(LUID AdapterLuid) : AdapterLuid(AdapterLuid)
 {
 }
@@ -11,11 +53,24 @@ Direct3DDevice::Direct3DDevice() : AdapterLuid()
 {
 }
 
+shared_ptr<Direct3DDevice> Direct3DDevice::Acquire(LUID AdapterLuid)
+{
+    return GetDeviceCache().Get(GetAdapterKey(AdapterLuid));
+}
+
+void Direct3DDevice::Discard(const Direct3DDevice& Device)
+{
+    GetDeviceCache().Discard(GetAdapterKey(Device.AdapterLuid), &Device);
+}
+
+bool Direct3DDevice::IsLost() const
+{
+    return Device == nullptr || Device->GetDeviceRemovedReason() != S_OK;
+}
+
 HRESULT Direct3DDevice::Init()
 {
-    // The DXGI factory could be cached, but if a new render adapter appears on the system, a new factory needs to be
-    // created. If caching is desired, check DxgiFactory->IsCurrent() each time and recreate the factory if !IsCurrent.
-    HRESULT hr = CreateDXGIFactory2(0, IID_PPV_ARGS(&DxgiFactory));
+    HRESULT hr = GetDxgiFactory(DxgiFactory);
     if (FAILED(hr))
     {
         return hr;
@@ -38,5 +93,12 @@ HRESULT Direct3DDevice::Init()
         return hr;
     }
 
+    // Frames are copied on the swap-chain thread while earlier ones are mapped by the stages after it
+    Microsoft::WRL::ComPtr<ID3D11Multithread> Multithread;
+    if (SUCCEEDED(DeviceContext.As(&Multithread)))
+    {
+        Multithread->SetMultithreadProtected(TRUE);
+    }
+
     return S_OK;
 }
\ No newline at end of file
@@ -28,6 +28,9 @@ struct MonitorMode
     DWORD VSync;
 };
 
+DECLARE_CONST_UNICODE_STRING(s_CopyTuningValue, L"CopyTuning");
+static const ULONG MaxCopyTuningSize = 64 * 1024;
+
 static const MonitorMode s_SupportedModes[] =
 {
     { 1440, 1080, 60 },
@@ -76,6 +79,71 @@ static IDDCX_TARGET_MODE CreateIddCxTargetMode(DWORD Width, DWORD Height, DWORD
     return Mode;
 }
 
+void PartialDisplay::GetSupportedModeBounds(UINT& MaxWidth, UINT& MaxHeight)
+{
+    MaxWidth = MaxHeight = 0;
+    for (const auto& mode : s_SupportedModes)
+    {
+        MaxWidth = max<UINT>(MaxWidth, mode.Width);
+        MaxHeight = max<UINT>(MaxHeight, mode.Height);
+    }
+}
+
+static string ReadCopyTuning()
+{
+    WDFKEY Key;
+    string Text;
+    if (!NT_SUCCESS(WdfDriverOpenPersistentStateRegistryKey(WdfGetDriver(), KEY_QUERY_VALUE, WDF_NO_OBJECT_ATTRIBUTES,
+        &Key)))
+    {
+        return Text;
+    }
+
+    ULONG Length = 0, Type = REG_NONE;
+    NTSTATUS Status = WdfRegistryQueryValue(Key, &s_CopyTuningValue, 0, nullptr, &Length, &Type);
+    if (Status == STATUS_BUFFER_OVERFLOW && Type == REG_BINARY && Length <= MaxCopyTuningSize)
+    {
+        Text.resize(Length);
+        Status = WdfRegistryQueryValue(Key, &s_CopyTuningValue, Length, Text.data(), &Length, &Type);
+        Text.resize(NT_SUCCESS(Status) ? min<size_t>(Length, Text.size()) : 0);
+    }
+    WdfRegistryClose(Key);
+    return Text;
+}
+
+static void WriteCopyTuning(const string& Text)
+{
+    WDFKEY Key;
+    if (Text.size() > MaxCopyTuningSize || !NT_SUCCESS(WdfDriverOpenPersistentStateRegistryKey(WdfGetDriver(),
+        KEY_SET_VALUE, WDF_NO_OBJECT_ATTRIBUTES, &Key)))
+    {
+        return;
+    }
+    WdfRegistryAssignValue(Key, &s_CopyTuningValue, REG_BINARY, ULONG(Text.size()), const_cast<char*>(Text.data()));
+    WdfRegistryClose(Key);
+}
+
+Tuning::CopyTuner& PartialDisplay::GetCopyTuner()
+{
+    // Neither the workers nor the tuner's calibration thread are stopped: joining them while the host unloads the
+    // driver would wait on the loader lock. Bands are copied as ReadStaging copies them, one after the other.
+    static Scheduling::TaskScheduler* s_Tasks = new Scheduling::TaskScheduler(
+        min(Scheduling::TaskScheduler::GetDefaultWorkerCount(), Tuning::MaxCopyThreads - 1));
+    static Tuning::CopyTuner* s_Tuner = []
+        {
+            // Saved from the calibration thread, so no frame copy waits on the registry
+            auto* Tuner = new Tuning::CopyTuner(s_Tasks, Slices::SliceBoard::BandCount);
+            Tuner->SetOnCalibrated([Tuner] { WriteCopyTuning(Tuner->Save()); });
+            return Tuner;
+        }();
+    return *s_Tuner;
+}
+
+Tuning::TunedCopy PartialDisplay::GetCopyStrategy(UINT Width, UINT Height, UINT BytesPerPixel)
+{
+    return GetCopyTuner().GetWithoutWaiting(Width, Height, BytesPerPixel);
+}
+
 #pragma endregion
 
 extern "C" DRIVER_INITIALIZE DriverEntry;
@@ -94,6 +162,7 @@ EVT_IDD_CX_MONITOR_QUERY_TARGET_MODES PartialDisplayMonitorQueryModes;
 
 EVT_IDD_CX_MONITOR_ASSIGN_SWAPCHAIN PartialDisplayMonitorAssignSwapChain;
 EVT_IDD_CX_MONITOR_UNASSIGN_SWAPCHAIN PartialDisplayMonitorUnassignSwapChain;
+EVT_IDD_CX_MONITOR_SET_GAMMA_RAMP PartialDisplayMonitorSetGammaRamp;
 
 extern "C" BOOL WINAPI DllMain(
     _In_ HINSTANCE hInstance,
@@ -122,12 +191,18 @@ extern "C" NTSTATUS DriverEntry(
         PartialDisplayDeviceAdd
     );
 
+    // The pixel kernels run the widest variants this processor has, picked here once for the life of the host
+    Kernels::SelectIsa(Kernels::DetectIsa());
+
     Status = WdfDriverCreate(pDriverObject, pRegistryPath, &Attributes, &Config, WDF_NO_HANDLE);
     if (!NT_SUCCESS(Status))
     {
         return Status;
     }
 
+    // Copy strategies calibrated by an earlier run, which are dropped if the machine changed since, kernels included
+    GetCopyTuner().Load(ReadCopyTuning());
+
     return Status;
 }
 
@@ -159,6 +234,7 @@ NTSTATUS PartialDisplayDeviceAdd(WDFDRIVER Driver, PWDFDEVICE_INIT pDeviceInit)
     IddConfig.EvtIddCxAdapterCommitModes = PartialDisplayAdapterCommitModes;
     IddConfig.EvtIddCxMonitorAssignSwapChain = PartialDisplayMonitorAssignSwapChain;
     IddConfig.EvtIddCxMonitorUnassignSwapChain = PartialDisplayMonitorUnassignSwapChain;
+    IddConfig.EvtIddCxMonitorSetGammaRamp = PartialDisplayMonitorSetGammaRamp;
 
     Status = IddCxDeviceInitConfig(pDeviceInit, &IddConfig);
     if (!NT_SUCCESS(Status))
@@ -186,6 +262,17 @@ NTSTATUS PartialDisplayDeviceAdd(WDFDRIVER Driver, PWDFDEVICE_INIT pDeviceInit)
     }
 
     Status = IddCxDeviceInitialize(Device);
+    if (!NT_SUCCESS(Status))
+    {
+        return Status;
+    }
+
+    // Enabled by the framework once the device starts, its arrival tells clients the IOCTLs can be sent
+    Status = WdfDeviceCreateDeviceInterface(Device, &Protocol::DeviceInterface, nullptr);
+    if (!NT_SUCCESS(Status))
+    {
+        return Status;
+    }
 
     // Create a new device context object and attach it to the WDF device object
     auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(Device);
@@ -286,22 +373,20 @@ NTSTATUS PartialDisplayMonitorQueryModes(IDDCX_MONITOR MonitorObject, const IDAR
 {
     UNREFERENCED_PARAMETER(MonitorObject);
 
-    vector<IDDCX_TARGET_MODE> TargetModes;
-
     // Create a set of modes supported for frame processing and scan-out. These are typically not based on the
     // monitor's descriptor and instead are based on the static processing capability of the device. The OS will
     // report the available set of modes for a given output as the intersection of monitor modes with target modes.
+    // The list is fixed, so it is written straight into the caller's buffer without building it on the heap.
 
-    for (const auto& mode : s_SupportedModes)
-    {
-        TargetModes.push_back(CreateIddCxTargetMode(mode.Width, mode.Height, mode.VSync));
-    }
-
-    pOutArgs->TargetModeBufferOutputCount = (UINT) TargetModes.size();
+    pOutArgs->TargetModeBufferOutputCount = ARRAYSIZE(s_SupportedModes);
 
-    if (pInArgs->TargetModeBufferInputCount >= TargetModes.size())
+    if (pInArgs->TargetModeBufferInputCount >= ARRAYSIZE(s_SupportedModes))
     {
-        copy(TargetModes.begin(), TargetModes.end(), pInArgs->pTargetModes);
+        for (UINT i = 0; i < ARRAYSIZE(s_SupportedModes); i++)
+        {
+            const auto& mode = s_SupportedModes[i];
+            pInArgs->pTargetModes[i] = CreateIddCxTargetMode(mode.Width, mode.Height, mode.VSync);
+        }
     }
 
     return STATUS_SUCCESS;
@@ -321,4 +406,11 @@ NTSTATUS PartialDisplayMonitorUnassignSwapChain(IDDCX_MONITOR MonitorObject)
     auto* pMonitorContextWrapper = WdfObjectGet_IndirectMonitorContextWrapper(MonitorObject);
     pMonitorContextWrapper->pContext->UnassignSwapChain();
     return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS PartialDisplayMonitorSetGammaRamp(IDDCX_MONITOR MonitorObject, const IDARG_IN_SET_GAMMARAMP* pInArgs)
+{
+    auto* pMonitorContextWrapper = WdfObjectGet_IndirectMonitorContextWrapper(MonitorObject);
+    return pMonitorContextWrapper->pContext->SetGammaRamp(pInArgs);
 }
\ No newline at end of file
@@ -8,14 +8,30 @@
 #include <iddcx.h>
 
 #include <dxgi1_5.h>
-#include <d3d11_2.h>
+#include <d3d11_4.h>
 #include <avrt.h>
 #include <wrl.h>
 
+#include <atomic>
 #include <memory>
 #include <vector>
 #include <mutex>
 
+#include "../Common/Protocol.h"
+#include "../Common/PixelKernels.h"
+#include "../Common/TileCodec.h"
+#include "../Common/TaskScheduler.h"
+#include "../Common/FrameCache.h"
+#include "../Common/LatencyProbe.h"
+#include "../Common/StageGraph.h"
+#include "../Common/ThreadPolicy.h"
+#include "../Common/Tracing.h"
+#include "../Common/AllocationTracking.h"
+#include "../Common/DeviceCache.h"
+#include "../Common/Demand.h"
+#include "../Common/SliceBoard.h"
+#include "../Common/CopyTuner.h"
+
 namespace Microsoft::WRL::Wrappers
 {
     // Adds a wrapper for thread handles to the existing set of WRL handle wrapper classes
@@ -24,6 +40,23 @@ namespace Microsoft::WRL::Wrappers
 
 namespace PartialDisplay
 {
+    /// <summary>
+    /// Reports the largest resolution among the modes the driver offers to the OS.
+    /// </summary>
+    void GetSupportedModeBounds(UINT& MaxWidth, UINT& MaxHeight);
+
+    /// <summary>
+    /// How frames are read back, shared by every swap-chain. Strategies stored by an earlier run are loaded when the
+    /// driver starts.
+    /// </summary>
+    Tuning::CopyTuner& GetCopyTuner();
+
+    /// <summary>
+    /// The strategy for reading back frames of a mode, plain copies until the calibration started the first time the
+    /// mode comes up is done; what it picked is stored for the next time the driver loads.
+    /// </summary>
+    Tuning::TunedCopy GetCopyStrategy(UINT Width, UINT Height, UINT BytesPerPixel);
+
     /// <summary>
     /// Manages the creation and lifetime of a Direct3D render device.
     /// </summary>
@@ -33,6 +66,19 @@ namespace PartialDisplay
         Direct3DDevice();
         HRESULT Init();
 
+        /// <summary>
+        /// The shared device of a render adapter, created on first use and kept across swap-chains until it is lost.
+        /// Returns null if the device can't be created.
+        /// </summary>
+        static std::shared_ptr<Direct3DDevice> Acquire(LUID AdapterLuid);
+
+        /// <summary>
+        /// Stops handing out Device, for one the OS wouldn't take without reporting it lost.
+        /// </summary>
+        static void Discard(const Direct3DDevice& Device);
+
+        bool IsLost() const;
+
         LUID AdapterLuid;
         Microsoft::WRL::ComPtr<IDXGIFactory5> DxgiFactory;
         Microsoft::WRL::ComPtr<IDXGIAdapter1> Adapter;
@@ -49,15 +95,66 @@ namespace PartialDisplay
         SwapChainProcessor(IDDCX_SWAPCHAIN hSwapChain, std::shared_ptr<Direct3DDevice> Device, HANDLE NewFrameEvent);
         ~SwapChainProcessor();
 
-        NTSTATUS FillRetrievalResponse(void* Buffer, size_t Size);
+        /// <summary>
+        /// Tells the processing thread to finish and lets go of the requests waiting for slices. Requests still
+        /// holding the processor keep it alive until they return, which from now on they do at once.
+        /// </summary>
+        void Stop();
+
+        NTSTATUS FillRetrievalResponse(const Protocol::FrameRequest& Request, void* Buffer, size_t Size);
+        NTSTATUS FillSliceResponse(const Protocol::SliceRequest& Request, void* Buffer, size_t Size);
+        void GetFrameLayout(UINT& Width, UINT& Height, UINT& Pitch);
+        void SetGammaLut(std::shared_ptr<const Kernels::ChannelLut> GammaLut);
+        void GetStatistics(Protocol::PipelineStatistics& Statistics);
 
     private:
+        struct FrameDamage
+        {
+            UINT64 Sequence = 0;
+            bool Full = true;
+            UINT Count = 0;
+            Protocol::DamageRect Rects[Protocol::MaxDamageRects];
+        };
+
+        // A staging surface frames are copied into. It takes the next frame once the ring is all that holds it; the
+        // frame last published and frames still passing the stages keep theirs.
+        struct StagingSurface
+        {
+            Microsoft::WRL::ComPtr<ID3D11Texture2D> Texture;
+            Microsoft::WRL::ComPtr<IDXGISurface> Surface;  // The texture, queried once for mapping
+            D3D11_TEXTURE2D_DESC Desc;
+        };
+
+        // A frame on its way from the swap-chain to the requests. Damage.Sequence is the frame's.
+        struct PendingFrame
+        {
+            FrameDamage Damage;
+            UINT64 Timestamp = 0;
+            std::shared_ptr<StagingSurface> Surface;
+            std::shared_ptr<const Readback::Frame> Pixels;  // Set when read back ahead of the requests
+        };
+
+        constexpr static UINT DamageHistoryLength = 8;
+        constexpr static UINT StagingSurfaceCount = 3;
+        constexpr static ULONGLONG DemandWindow = 1000;  // ms after a request during which frames are captured
+        constexpr static UINT MaxSliceWait = 250;        // ms a slice request may wait for its rows
+
         static DWORD CALLBACK RunThread(LPVOID Argument);
 
         void Run();
         void RunCore();
 
-        HRESULT ProcessResource(IDXGIResource* resource);
+        void GetFrameDamage(const IDDCX_METADATA& MetaData, FrameDamage& Damage);
+        HRESULT ProcessResource(IDXGIResource* resource, const FrameDamage& Damage, UINT64 Timestamp);
+        HRESULT AcquireStagingSurface(const D3D11_TEXTURE2D_DESC& SurfaceDesc,
+            std::shared_ptr<StagingSurface>& Surface, bool& Recreated);
+        bool ReadAhead(PendingFrame& Frame);
+        bool NarrowDamage(PendingFrame& Frame);
+        bool Publish(PendingFrame& Frame);
+        bool CollectDamage(UINT64 LastSequence, Protocol::DamageRect* Rects, UINT& Count);
+        bool ReadStaging(const StagingSurface& Surface, UINT64 Sequence, UINT64 Timestamp, Readback::Frame& Target);
+        void OnRequest(UINT32 Features);
+        bool IsProbing() const;
 
         IDDCX_SWAPCHAIN m_hSwapChain;
         std::shared_ptr<Direct3DDevice> m_Device;
@@ -67,8 +164,38 @@ namespace PartialDisplay
 
         UINT m_Width;
         UINT m_Height;
-        Microsoft::WRL::ComPtr<ID3D11Texture2D> m_CopyBuffer;
+        UINT m_Pitch;
+        DXGI_FORMAT m_Format;
+        UINT64 m_Sequence;
+        UINT64 m_Timestamp;
+        FrameDamage m_DamageHistory[DamageHistoryLength];
+        std::shared_ptr<const Kernels::ChannelLut> m_GammaLut;
+        std::shared_ptr<StagingSurface> m_Published;
         std::mutex m_MutexMeta;
+
+        // The swap-chain thread copies each frame into a free staging surface and hands it to the stages, which read
+        // it back while requests come in, narrow its damage and publish it, each on a thread of its own
+        Pipeline::StageGraph<PendingFrame> m_Stages;
+        std::vector<std::shared_ptr<StagingSurface>> m_StagingSurfaces;  // Swap-chain thread only
+        std::shared_ptr<const Readback::Frame> m_DiffBase;              // Frame before the one being narrowed
+        Demand::DemandTracker m_Demand{ DemandWindow };
+        Demand::DemandTracker m_ProbeDemand{ DemandWindow };  // Requests asking for the latency marker
+        Microsoft::WRL::Wrappers::Event m_hDemandEvent;       // Set when a request ends a pause in capture
+        std::atomic<UINT64> m_Acquired = 0;
+        std::atomic<UINT64> m_Held = 0;  // Frames left on the swap-chain for lack of requests
+        std::atomic<UINT64> m_AcquireNs = 0;
+
+        // CPU copy of the latest frame, so the staging surface is mapped once per frame rather than once per request.
+        // Frames read back for a sequence go on the slice board as they are read, for slice requests to copy from.
+        Readback::FrameCache m_FrameCache;
+        Slices::SliceBoard m_Slices;
+
+        // Mirror of the client's tile cache, streams must be encoded against it one at a time. Each one is spread
+        // over workers started with the first and encoded in working memory kept for the next.
+        Codec::TileCache m_TileCache{ Protocol::TileCacheSize, false };
+        std::unique_ptr<Scheduling::TaskScheduler> m_TileTasks;
+        Codec::TileScratch m_TileScratch;
+        std::mutex m_MutexTiles;
     };
 
     /// <summary>
@@ -99,12 +226,20 @@ namespace PartialDisplay
 
         void AssignSwapChain(IDDCX_SWAPCHAIN SwapChain, LUID RenderAdapter, HANDLE NewFrameEvent);
         void UnassignSwapChain();
+        NTSTATUS SetGammaRamp(const IDARG_IN_SET_GAMMARAMP* pInArgs);
 
-        SwapChainProcessor* GetSwapChainProcessor() { return m_ProcessingThread.get(); }
+        /// <summary>
+        /// The processor of the current swap-chain, or nullptr. Holding it keeps it alive through a swap-chain change.
+        /// </summary>
+        std::shared_ptr<SwapChainProcessor> GetSwapChainProcessor();
 
     private:
+        void ReplaceSwapChainProcessor(std::shared_ptr<SwapChainProcessor> Processor);
+
         IDDCX_MONITOR m_Monitor;
-        std::unique_ptr<SwapChainProcessor> m_ProcessingThread;
+        std::mutex m_ProcessorMutex;  // Guards the pointer, IOCTLs take it while the OS swaps swap-chains
+        std::shared_ptr<SwapChainProcessor> m_ProcessingThread;
+        std::shared_ptr<const Kernels::ChannelLut> m_GammaLut;  // nullptr for the identity ramp
     };
 
     struct IndirectDeviceContextWrapper
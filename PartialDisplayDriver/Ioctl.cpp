@@ -1,7 +1,5 @@
 #include "Driver.h"
 
-#define IOCTL_Custom_GetMonitorData CTL_CODE(FILE_DEVICE_SCREEN, 0x842, METHOD_BUFFERED, FILE_READ_ACCESS)
-
 using namespace std;
 using namespace PartialDisplay;
 
@@ -10,6 +8,19 @@ EVT_IDD_CX_DEVICE_IO_CONTROL PartialDisplayDeviceIoControl;
 typedef NTSTATUS RequestHandler(WDFDEVICE Device, WDFREQUEST Request);
 static RequestHandler HandleInvalid;
 static RequestHandler HandleGetMonitorData;
+static RequestHandler HandleNegotiate;
+static RequestHandler HandleTrace;
+static RequestHandler HandleGetStatistics;
+static RequestHandler HandleGetSlice;
+
+// What this driver can produce, intersected with the client's capabilities during negotiation
+static const UINT32 s_SupportedFormats = Protocol::FormatBit(Protocol::PixelFormat::BGRA8)
+    | Protocol::FormatBit(Protocol::PixelFormat::R10G10B10A2)
+    | Protocol::FormatBit(Protocol::PixelFormat::RGBA16F)
+    | Protocol::FormatBit(Protocol::PixelFormat::B5G6R5);
+static const UINT32 s_SupportedCompression = Protocol::CompressionTiles | Protocol::CompressionTileCache;
+static const UINT32 s_SupportedFeatures = Protocol::FeatureDamageRects | Protocol::FeatureSkipUnchanged
+    | Protocol::FeatureDownscale | Protocol::FeatureLatencyProbe | Protocol::FeatureSlices;
 
 _Use_decl_annotations_
 VOID PartialDisplayDeviceIoControl(WDFDEVICE Device, WDFREQUEST Request, size_t, size_t, ULONG IoControlCode)
@@ -20,6 +31,14 @@ VOID PartialDisplayDeviceIoControl(WDFDEVICE Device, WDFREQUEST Request, size_t,
     {
     case IOCTL_Custom_GetMonitorData:
         Handler = HandleGetMonitorData; break;
+    case IOCTL_Custom_Negotiate:
+        Handler = HandleNegotiate; break;
+    case IOCTL_Custom_Trace:
+        Handler = HandleTrace; break;
+    case IOCTL_Custom_GetStatistics:
+        Handler = HandleGetStatistics; break;
+    case IOCTL_Custom_GetSlice:
+        Handler = HandleGetSlice; break;
     default:
         Handler = HandleInvalid; break;
     }
@@ -35,10 +54,11 @@ VOID PartialDisplayDeviceIoControl(WDFDEVICE Device, WDFREQUEST Request, size_t,
     }
 }
 
+// The processor is held for the whole request, so a swap-chain change meanwhile can't free it under the request
 static NTSTATUS GetSwapChainProcessor(
     WDFDEVICE Device,
     UINT ConnectorIndex,
-    SwapChainProcessor** ProcessorOut)
+    shared_ptr<SwapChainProcessor>* ProcessorOut)
 {
     IndirectDeviceContext* DeviceContext = WdfObjectGet_IndirectDeviceContextWrapper(Device)->pContext;
     IDDCX_MONITOR Monitor = DeviceContext->GetMonitorAt(ConnectorIndex);
@@ -47,13 +67,13 @@ static NTSTATUS GetSwapChainProcessor(
         return STATUS_INVALID_DEVICE_STATE;
     }
     IndirectMonitorContext* MonitorContext = WdfObjectGet_IndirectMonitorContextWrapper(Monitor)->pContext;
-    SwapChainProcessor* Processor = MonitorContext->GetSwapChainProcessor();
+    shared_ptr<SwapChainProcessor> Processor = MonitorContext->GetSwapChainProcessor();
     if (Processor == nullptr)
     {
         return STATUS_INVALID_DEVICE_STATE;
     }
 
-    if (ProcessorOut) *ProcessorOut = Processor;
+    if (ProcessorOut) *ProcessorOut = move(Processor);
     return STATUS_SUCCESS;
 }
 
@@ -65,16 +85,198 @@ static NTSTATUS HandleInvalid(WDFDEVICE, WDFREQUEST)
 static NTSTATUS HandleGetMonitorData(WDFDEVICE Device, WDFREQUEST Request)
 {
     NTSTATUS Status;
+    PVOID InputBuffer;
     PVOID OutputBuffer;
-    SwapChainProcessor* Processor;
+    shared_ptr<SwapChainProcessor> Processor;
+
+    // A request without input gets a plain BGRA frame
+    Protocol::FrameRequest FrameRequest = {};
+    FrameRequest.Size = sizeof(FrameRequest);
+    FrameRequest.Version = Protocol::Version;
+    FrameRequest.Format = UINT32(Protocol::PixelFormat::BGRA8);
+
+    size_t InputBufferLength;
+    Status = WdfRequestRetrieveInputBuffer(Request, sizeof(Protocol::FrameRequest), &InputBuffer, &InputBufferLength);
+    if (NT_SUCCESS(Status))
+    {
+        memcpy(&FrameRequest, InputBuffer, sizeof(FrameRequest));
+        if (FrameRequest.Version != Protocol::Version)
+        {
+            return STATUS_REVISION_MISMATCH;
+        }
+        if (FrameRequest.Format >= 32 || !(s_SupportedFormats & (1u << FrameRequest.Format))
+            || (FrameRequest.Compression & ~s_SupportedCompression)
+            || (FrameRequest.Features & ~s_SupportedFeatures)
+            || (FrameRequest.Downscale != 0 && !(FrameRequest.Features & Protocol::FeatureDownscale))
+            || FrameRequest.Downscale > Protocol::MaxDownscale
+            || FrameRequest.Quality > 100)
+        {
+            return STATUS_NOT_SUPPORTED;
+        }
+    }
 
     Status = GetSwapChainProcessor(Device, 0, &Processor);
     if (!NT_SUCCESS(Status)) return Status;
 
     size_t OutputBufferLength;
-    Status = WdfRequestRetrieveOutputBuffer(Request, sizeof(UINT[3]), &OutputBuffer, &OutputBufferLength);
+    Status = WdfRequestRetrieveOutputBuffer(Request, sizeof(Protocol::FrameDescriptor), &OutputBuffer, &OutputBufferLength);
     if (!NT_SUCCESS(Status)) return Status;
 
-    Status = Processor->FillRetrievalResponse(OutputBuffer, OutputBufferLength);
+    Status = Processor->FillRetrievalResponse(FrameRequest, OutputBuffer, OutputBufferLength);
     return Status;
+}
+
+static NTSTATUS HandleGetSlice(WDFDEVICE Device, WDFREQUEST Request)
+{
+    NTSTATUS Status;
+    PVOID InputBuffer;
+    PVOID OutputBuffer;
+    shared_ptr<SwapChainProcessor> Processor;
+
+    Status = WdfRequestRetrieveInputBuffer(Request, sizeof(Protocol::SliceRequest), &InputBuffer, nullptr);
+    if (!NT_SUCCESS(Status)) return Status;
+
+    Protocol::SliceRequest SliceRequest;
+    memcpy(&SliceRequest, InputBuffer, sizeof(SliceRequest));
+    if (SliceRequest.Version != Protocol::Version)
+    {
+        return STATUS_REVISION_MISMATCH;
+    }
+    if (SliceRequest.Format >= 32 || !(s_SupportedFormats & (1u << SliceRequest.Format))
+        || (SliceRequest.Features & ~Protocol::FeatureLatencyProbe)
+        || SliceRequest.SliceCount == 0 || SliceRequest.SliceCount > Protocol::MaxSlices
+        || SliceRequest.Slice >= SliceRequest.SliceCount
+        || (SliceRequest.Slice != 0 && SliceRequest.Sequence == 0))
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    Status = GetSwapChainProcessor(Device, 0, &Processor);
+    if (!NT_SUCCESS(Status)) return Status;
+
+    size_t OutputBufferLength;
+    Status = WdfRequestRetrieveOutputBuffer(Request, sizeof(Protocol::SliceDescriptor), &OutputBuffer,
+        &OutputBufferLength);
+    if (!NT_SUCCESS(Status)) return Status;
+
+    return Processor->FillSliceResponse(SliceRequest, OutputBuffer, OutputBufferLength);
+}
+
+static NTSTATUS HandleNegotiate(WDFDEVICE Device, WDFREQUEST Request)
+{
+    NTSTATUS Status;
+    PVOID InputBuffer;
+    PVOID OutputBuffer;
+
+    Status = WdfRequestRetrieveInputBuffer(Request, sizeof(Protocol::ClientHello), &InputBuffer, nullptr);
+    if (!NT_SUCCESS(Status)) return Status;
+    Status = WdfRequestRetrieveOutputBuffer(Request, sizeof(Protocol::ServerHello), &OutputBuffer, nullptr);
+    if (!NT_SUCCESS(Status)) return Status;
+
+    Protocol::ClientHello Client;
+    memcpy(&Client, InputBuffer, sizeof(Client));
+
+    Protocol::ServerHello Server = {};
+    Server.Size = sizeof(Server);
+    Server.Version = Protocol::Version;
+    if (Client.Version != Protocol::Version)
+    {
+        // Report our version with nothing in common, so the client can tell what went wrong
+        memcpy(OutputBuffer, &Server, sizeof(Server));
+        return sizeof(Server);
+    }
+
+    Server.Formats = Client.Formats & s_SupportedFormats;
+    Server.Compression = Client.Compression & s_SupportedCompression;
+    Server.Features = Client.Features & s_SupportedFeatures;
+    GetSupportedModeBounds(Server.MaxWidth, Server.MaxHeight);
+
+    shared_ptr<SwapChainProcessor> Processor;
+    if (NT_SUCCESS(GetSwapChainProcessor(Device, 0, &Processor)))
+    {
+        Processor->GetFrameLayout(Server.CurrentWidth, Server.CurrentHeight, Server.CurrentPitch);
+    }
+
+    // The staging pitch is only known once a surface has been mapped; until then assume rows padded to 256 bytes,
+    // which covers the alignment used by common drivers. A client that still gets a truncated frame re-sizes.
+    UINT64 BytesPerPixel = (Server.Formats & Protocol::FormatBit(Protocol::PixelFormat::RGBA16F)) ? 8 : 4;
+    UINT64 MaxPitch = max<UINT64>(Server.CurrentPitch, (UINT64(Server.MaxWidth) * BytesPerPixel + 255) & ~UINT64(255));
+    UINT64 MaxHeight = max<UINT64>(Server.CurrentHeight, Server.MaxHeight);
+    Server.MaxResponseSize = Protocol::MaxHeaderSize + MaxPitch * MaxHeight;
+    if (Server.Compression & Protocol::CompressionTiles)
+    {
+        UINT MaxWidth = max(Server.CurrentWidth, Server.MaxWidth);
+        Server.MaxResponseSize = max<UINT64>(Server.MaxResponseSize,
+            Protocol::MaxHeaderSize + Codec::GetMaxStreamSize(MaxWidth, UINT(MaxHeight)));
+    }
+
+    memcpy(OutputBuffer, &Server, sizeof(Server));
+    return sizeof(Server);
+}
+
+static NTSTATUS HandleTrace(WDFDEVICE, WDFREQUEST Request)
+{
+    NTSTATUS Status;
+    PVOID InputBuffer;
+    PVOID OutputBuffer;
+    size_t OutputBufferLength;
+
+    Status = WdfRequestRetrieveInputBuffer(Request, sizeof(Protocol::TraceRequest), &InputBuffer, nullptr);
+    if (!NT_SUCCESS(Status)) return Status;
+    Status = WdfRequestRetrieveOutputBuffer(Request, sizeof(Protocol::TraceResponse), &OutputBuffer, &OutputBufferLength);
+    if (!NT_SUCCESS(Status)) return Status;
+
+    Protocol::TraceRequest TraceRequest;
+    memcpy(&TraceRequest, InputBuffer, sizeof(TraceRequest));
+    if (TraceRequest.Version != Protocol::Version)
+    {
+        return STATUS_REVISION_MISMATCH;
+    }
+
+    string Events;
+    switch (Protocol::TraceCommand(TraceRequest.Command))
+    {
+    case Protocol::TraceCommand::Start:
+        Tracing::Start();
+        break;
+    case Protocol::TraceCommand::Stop:
+        Tracing::Stop();
+        break;
+    case Protocol::TraceCommand::Read:
+        Events = Tracing::ExportChromeEvents(GetCurrentProcessId(), "PartialDisplayDriver");
+        break;
+    default:
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Protocol::TraceResponse Response = {};
+    Response.Size = sizeof(Response);
+    Response.Version = Protocol::Version;
+    Response.Enabled = Tracing::IsEnabled();
+    Response.DataSize = Events.size();
+    memcpy(OutputBuffer, &Response, sizeof(Response));
+
+    if (OutputBufferLength < sizeof(Response) + Events.size())
+    {
+        return sizeof(Response);
+    }
+    memcpy((char*)OutputBuffer + sizeof(Response), Events.data(), Events.size());
+    return NTSTATUS(sizeof(Response) + Events.size());
+}
+
+static NTSTATUS HandleGetStatistics(WDFDEVICE Device, WDFREQUEST Request)
+{
+    NTSTATUS Status;
+    PVOID OutputBuffer;
+    shared_ptr<SwapChainProcessor> Processor;
+
+    Status = WdfRequestRetrieveOutputBuffer(Request, sizeof(Protocol::PipelineStatistics), &OutputBuffer, nullptr);
+    if (!NT_SUCCESS(Status)) return Status;
+    Status = GetSwapChainProcessor(Device, 0, &Processor);
+    if (!NT_SUCCESS(Status)) return Status;
+
+    Protocol::PipelineStatistics Statistics;
+    Processor->GetStatistics(Statistics);
+    memcpy(OutputBuffer, &Statistics, sizeof(Statistics));
+    return sizeof(Statistics);
 }
\ No newline at end of file
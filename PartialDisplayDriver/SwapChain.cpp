@@ -1,14 +1,135 @@
 #include "Driver.h"
+#include <chrono>
 #include <iomanip>
 
 using namespace std;
 using namespace Microsoft::WRL;
 using namespace PartialDisplay;
 
+// Frame sequence numbers are unique across swap-chains, so a client's LastSequence from a previous swap-chain never
+// matches the damage history of the current one.
+static atomic<UINT64> s_FrameSequence;
+
+static DXGI_FORMAT GetStagingFormat(DXGI_FORMAT SurfaceFormat)
+{
+    // FP16 and 10-bit surfaces are read back as they are so HDR and wide-gamut content survives until the client
+    // picks a format; everything else is an 8-bit desktop.
+    switch (SurfaceFormat)
+    {
+    case DXGI_FORMAT_R16G16B16A16_FLOAT:
+    case DXGI_FORMAT_R10G10B10A2_UNORM:
+        return SurfaceFormat;
+    default:
+        return DXGI_FORMAT_B8G8R8A8_UNORM;
+    }
+}
+
+static DXGI_FORMAT ToDxgiFormat(Protocol::PixelFormat Format)
+{
+    switch (Format)
+    {
+    case Protocol::PixelFormat::R10G10B10A2: return DXGI_FORMAT_R10G10B10A2_UNORM;
+    case Protocol::PixelFormat::RGBA16F: return DXGI_FORMAT_R16G16B16A16_FLOAT;
+    case Protocol::PixelFormat::B5G6R5: return DXGI_FORMAT_B5G6R5_UNORM;
+    default: return DXGI_FORMAT_B8G8R8A8_UNORM;
+    }
+}
+
+static Protocol::PixelFormat ToPixelFormat(DXGI_FORMAT StagingFormat)
+{
+    switch (StagingFormat)
+    {
+    case DXGI_FORMAT_R10G10B10A2_UNORM: return Protocol::PixelFormat::R10G10B10A2;
+    case DXGI_FORMAT_R16G16B16A16_FLOAT: return Protocol::PixelFormat::RGBA16F;
+    default: return Protocol::PixelFormat::BGRA8;
+    }
+}
+
+static Protocol::ColorSpace GetColorSpace(Protocol::PixelFormat Format)
+{
+    return Format == Protocol::PixelFormat::RGBA16F ? Protocol::ColorSpace::ScRgb :
+        Format == Protocol::PixelFormat::R10G10B10A2 ? Protocol::ColorSpace::Hdr10 :
+        Protocol::ColorSpace::Srgb;
+}
+
+static Protocol::PixelFormat SelectOutputFormat(DXGI_FORMAT StagingFormat, UINT32 Requested)
+{
+    // Every surface can be delivered as BGRA8; wider formats are only produced from surfaces that carry the range,
+    // and the narrow one only from surfaces that have nothing more to lose
+    switch (Protocol::PixelFormat(Requested))
+    {
+    case Protocol::PixelFormat::B5G6R5:
+        if (StagingFormat == DXGI_FORMAT_B8G8R8A8_UNORM) return Protocol::PixelFormat::B5G6R5;
+        return Protocol::PixelFormat::BGRA8;
+    case Protocol::PixelFormat::RGBA16F:
+        if (StagingFormat == DXGI_FORMAT_R16G16B16A16_FLOAT) return Protocol::PixelFormat::RGBA16F;
+        [[fallthrough]];
+    case Protocol::PixelFormat::R10G10B10A2:
+        if (StagingFormat != DXGI_FORMAT_B8G8R8A8_UNORM) return Protocol::PixelFormat::R10G10B10A2;
+        [[fallthrough]];
+    default:
+        return Protocol::PixelFormat::BGRA8;
+    }
+}
+
+static void ConvertRows(const void* Pixels, UINT SourcePitch, DXGI_FORMAT StagingFormat, Protocol::PixelFormat Format,
+    const Kernels::ChannelLut* GammaLut, void* Data, UINT Pitch, UINT Width, UINT Rows)
+{
+    // Rows of a frame at full size, a whole frame or a slice of one. The gamma ramp applies to 8-bit output only; it
+    // is fused with the copy when there is nothing to convert and with the packing of B5G6R5.
+    bool ApplyGamma = GammaLut != nullptr && Format == Protocol::PixelFormat::BGRA8;
+    if (ToDxgiFormat(Format) == StagingFormat)
+    {
+        if (ApplyGamma)
+        {
+            Kernels::ApplyChannelLut(Pixels, SourcePitch, Data, Pitch, Width, Rows, *GammaLut);
+        }
+        else if (SourcePitch == Pitch)
+        {
+            memcpy(Data, Pixels, size_t(Pitch) * Rows);
+        }
+        else
+        {
+            Kernels::CopyRows(Pixels, SourcePitch, Data, Pitch, size_t(Width) * Protocol::BytesPerPixel(Format), Rows);
+        }
+        return;
+    }
+
+    if (Format == Protocol::PixelFormat::B5G6R5)
+    {
+        Kernels::Bgra8ToB5G6R5(Pixels, SourcePitch, Data, Pitch, Width, Rows, GammaLut);
+        return;
+    }
+    if (StagingFormat == DXGI_FORMAT_R16G16B16A16_FLOAT && Format == Protocol::PixelFormat::R10G10B10A2)
+    {
+        Kernels::ScRgbToHdr10(Pixels, SourcePitch, Data, Pitch, Width, Rows);
+    }
+    else if (StagingFormat == DXGI_FORMAT_R16G16B16A16_FLOAT)
+    {
+        Kernels::ScRgbToBgra8(Pixels, SourcePitch, Data, Pitch, Width, Rows);
+    }
+    else
+    {
+        Kernels::Hdr10ToBgra8(Pixels, SourcePitch, Data, Pitch, Width, Rows);
+    }
+    if (ApplyGamma)
+    {
+        Kernels::ApplyChannelLut(Data, Pitch, Data, Pitch, Width, Rows, *GammaLut);
+    }
+}
+
 SwapChainProcessor::SwapChainProcessor(IDDCX_SWAPCHAIN hSwapChain, shared_ptr<Direct3DDevice> Device, HANDLE NewFrameEvent)
-    : m_hSwapChain(hSwapChain), m_Device(Device), m_hAvailableBufferEvent(NewFrameEvent), m_Width(0), m_Height(0)
+    : m_hSwapChain(hSwapChain), m_Device(Device), m_hAvailableBufferEvent(NewFrameEvent), m_Width(0), m_Height(0), m_Pitch(0),
+      m_Format(DXGI_FORMAT_UNKNOWN), m_Sequence(0), m_Timestamp(0)
 {
-    m_hTerminateEvent.Attach(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+    // Manual reset, so waiting for a staging surface doesn't take the signal from the acquire loop
+    m_hTerminateEvent.Attach(CreateEvent(nullptr, TRUE, FALSE, nullptr));
+    m_hDemandEvent.Attach(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+
+    // Every frame passes every stage, so each frame's damage stays relative to the frame published before it
+    m_Stages.AddStage("readback", [this](PendingFrame& Frame) { return ReadAhead(Frame); }, StagingSurfaceCount);
+    m_Stages.AddStage("diff", [this](PendingFrame& Frame) { return NarrowDamage(Frame); }, StagingSurfaceCount);
+    m_Stages.AddStage("publish", [this](PendingFrame& Frame) { return Publish(Frame); }, StagingSurfaceCount);
 
     // Immediately create and run the swap-chain processing thread, passing 'this' as the thread parameter
     m_hThread.Attach(CreateThread(nullptr, 0, RunThread, this, 0, nullptr));
@@ -16,8 +137,7 @@ SwapChainProcessor::SwapChainProcessor(IDDCX_SWAPCHAIN hSwapChain, shared_ptr<Di
 
 SwapChainProcessor::~SwapChainProcessor()
 {
-    // Alert the swap-chain processing thread to terminate
-    SetEvent(m_hTerminateEvent.Get());
+    Stop();
 
     if (m_hThread.Get())
     {
@@ -26,6 +146,15 @@ SwapChainProcessor::~SwapChainProcessor()
     }
 }
 
+void SwapChainProcessor::Stop()
+{
+    // Requests waiting for bands would otherwise sit out their timeout on a swap-chain that is gone
+    m_Slices.Shutdown();
+
+    // Alert the swap-chain processing thread to terminate
+    SetEvent(m_hTerminateEvent.Get());
+}
+
 DWORD CALLBACK SwapChainProcessor::RunThread(LPVOID Argument)
 {
     reinterpret_cast<SwapChainProcessor*>(Argument)->Run();
@@ -36,17 +165,18 @@ void SwapChainProcessor::Run()
 {
     // For improved performance, make use of the Multimedia Class Scheduler Service, which will intelligently
     // prioritize this thread for improved throughput in high CPU-load scenarios.
-    DWORD AvTask = 0;
-    HANDLE AvTaskHandle = AvSetMmThreadCharacteristicsW(L"Distribution", &AvTask);
+    Scheduling::ThreadPolicy Policy;
+    Policy.MmcssTask = L"Distribution";
+    Scheduling::ScopedThreadPolicy AppliedPolicy(Policy);
 
+    m_Stages.Start(Policy);
     RunCore();
+    m_Stages.Stop();
 
     // Always delete the swap-chain object when swap-chain processing loop terminates in order to kick the system to
     // provide a new swap-chain if necessary.
     WdfObjectDelete((WDFOBJECT)m_hSwapChain);
     m_hSwapChain = nullptr;
-
-    AvRevertMmThreadCharacteristics(AvTaskHandle);
 }
 
 void SwapChainProcessor::RunCore()
@@ -65,9 +195,18 @@ void SwapChainProcessor::RunCore()
     hr = IddCxSwapChainSetDevice(m_hSwapChain, &SetDevice);
     if (FAILED(hr))
     {
+        // The next swap-chain gets a new device rather than this one again
+        Direct3DDevice::Discard(*m_Device);
         return;
     }
 
+    // Without requests frames are left on the swap-chain, but the last one is held on to until the next arrives: the
+    // driver owns it until then, and a request ending the pause gets it captured at once. It is fully damaged, the
+    // frames skipped before it were never compared.
+    ComPtr<IDXGIResource> HeldBuffer;
+    FrameDamage HeldDamage;
+    UINT64 HeldTimestamp = 0;
+
     // Acquire and release buffers in a loop
     for (;;)
     {
@@ -75,7 +214,10 @@ void SwapChainProcessor::RunCore()
 
         // Ask for the next buffer from the producer
         IDARG_OUT_RELEASEANDACQUIREBUFFER Buffer = {};
-        hr = IddCxSwapChainReleaseAndAcquireBuffer(m_hSwapChain, &Buffer);
+        {
+            PD_TRACE_SPAN("AcquireBuffer");
+            hr = IddCxSwapChainReleaseAndAcquireBuffer(m_hSwapChain, &Buffer);
+        }
 
         // AcquireBuffer immediately returns STATUS_PENDING if no buffer is yet available
         if (hr == E_PENDING)
@@ -84,7 +226,8 @@ void SwapChainProcessor::RunCore()
             HANDLE WaitHandles[] =
             {
                 m_hAvailableBufferEvent,
-                m_hTerminateEvent.Get()
+                m_hTerminateEvent.Get(),
+                m_hDemandEvent.Get()
             };
             DWORD WaitResult = WaitForMultipleObjects(ARRAYSIZE(WaitHandles), WaitHandles, FALSE, 16);
             if (WaitResult == WAIT_OBJECT_0 || WaitResult == WAIT_TIMEOUT)
@@ -97,6 +240,20 @@ void SwapChainProcessor::RunCore()
                 // We need to terminate
                 break;
             }
+            else if (WaitResult == WAIT_OBJECT_0 + 2)
+            {
+                // A request after a pause, the frame on screen is the one held
+                if (HeldBuffer != nullptr)
+                {
+                    hr = ProcessResource(HeldBuffer.Get(), HeldDamage, HeldTimestamp);
+                    HeldBuffer.Reset();
+                    if (hr == E_ABORT)
+                    {
+                        break;
+                    }
+                }
+                continue;
+            }
             else
             {
                 // The wait was cancelled or something unexpected happened
@@ -108,6 +265,7 @@ void SwapChainProcessor::RunCore()
         {
             // We have new frame to process, the surface has a reference on it that the driver has to release
             AcquiredBuffer.Attach(Buffer.MetaData.pSurface);
+            HeldBuffer.Reset();
 
             // ==============================
             // TODO: Process the frame here
@@ -119,7 +277,21 @@ void SwapChainProcessor::RunCore()
             //  * a GPU VPBlt to another surface
             //  * a GPU custom compute shader encode operation
             // ==============================
-            ProcessResource(AcquiredBuffer.Get());
+            FrameDamage Damage;
+            GetFrameDamage(Buffer.MetaData, Damage);
+            if (m_Demand.IsActive(GetTickCount64()))
+            {
+                hr = ProcessResource(AcquiredBuffer.Get(), Damage, Buffer.MetaData.PresentDisplayQPCTime);
+            }
+            else
+            {
+                HeldBuffer = AcquiredBuffer;
+                HeldDamage.Full = true;
+                HeldDamage.Count = 0;
+                HeldTimestamp = Buffer.MetaData.PresentDisplayQPCTime;
+                m_Held.fetch_add(1, memory_order_relaxed);
+                hr = S_OK;
+            }
 
             // We have finished processing this frame hence we release the reference on it.
             // If the driver forgets to release the reference to the surface, it will be leaked which results in the
@@ -129,6 +301,11 @@ void SwapChainProcessor::RunCore()
             // S_OK and gives us a new frame, a driver may want to use the surface in future to re-encode the desktop 
             // for better quality if there is no new frame for a while
             AcquiredBuffer.Reset();
+            if (hr == E_ABORT)
+            {
+                // Asked to terminate while waiting for a staging surface
+                break;
+            }
 
             // Indicate to OS that we have finished inital processing of the frame, it is a hint that
             // OS could start preparing another frame
@@ -153,8 +330,41 @@ void SwapChainProcessor::RunCore()
     }
 }
 
-HRESULT SwapChainProcessor::ProcessResource(IDXGIResource* resource)
+void SwapChainProcessor::GetFrameDamage(const IDDCX_METADATA& MetaData, FrameDamage& Damage)
+{
+    Damage.Full = true;
+    Damage.Count = 0;
+
+    // Moved regions damage their destination; rather than tracking them, treat such frames as fully damaged
+    if (MetaData.MoveRegionCount != 0 || MetaData.DirtyRectCount > Protocol::MaxDamageRects)
+    {
+        return;
+    }
+
+    RECT DirtyRects[Protocol::MaxDamageRects];
+    IDARG_IN_GETDIRTYRECTS InArgs = {};
+    InArgs.DirtyRectInCount = MetaData.DirtyRectCount;
+    InArgs.pDirtyRects = DirtyRects;
+    IDARG_OUT_GETDIRTYRECTS OutArgs = {};
+    if (FAILED(IddCxSwapChainGetDirtyRects(m_hSwapChain, &InArgs, &OutArgs)))
+    {
+        return;
+    }
+
+    for (UINT i = 0; i < OutArgs.DirtyRectOutCount && i < Protocol::MaxDamageRects; i++)
+    {
+        Damage.Rects[i] = { DirtyRects[i].left, DirtyRects[i].top, DirtyRects[i].right, DirtyRects[i].bottom };
+    }
+    Damage.Count = min<UINT>(OutArgs.DirtyRectOutCount, Protocol::MaxDamageRects);
+    Damage.Full = false;
+}
+
+HRESULT SwapChainProcessor::ProcessResource(IDXGIResource* resource, const FrameDamage& Damage, UINT64 Timestamp)
 {
+    PD_TRACE_SPAN("ProcessResource");
+    PD_TRACE_COUNTER("DamageRects", Damage.Full ? -1 : INT64(Damage.Count));
+    auto Start = chrono::steady_clock::now();
+
     HRESULT hr;
 
     ComPtr<ID3D11Texture2D> texture;
@@ -167,22 +377,58 @@ HRESULT SwapChainProcessor::ProcessResource(IDXGIResource* resource)
     D3D11_TEXTURE2D_DESC desc;
     texture->GetDesc(&desc);
 
-    ComPtr<ID3D11Texture2D> CopyBuffer;
-    bool ShouldRecreate;
+    PendingFrame Frame;
+    bool Recreated;
+    hr = AcquireStagingSurface(desc, Frame.Surface, Recreated);
+    if (FAILED(hr))
     {
-        unique_lock<mutex> lock(m_MutexMeta);
-        CopyBuffer = m_CopyBuffer;
-        ShouldRecreate = desc.Width != m_Width || desc.Height != m_Height || CopyBuffer == nullptr;
+        return hr;
     }
 
-    if (ShouldRecreate)
+    m_Device->DeviceContext->CopyResource(Frame.Surface->Texture.Get(), texture.Get());
+
+    // Everything after the copy happens on the stages, while this thread goes back for the next frame
+    Frame.Damage = Damage;
+    Frame.Damage.Sequence = ++s_FrameSequence;
+    Frame.Damage.Full |= Recreated;
+    Frame.Timestamp = Timestamp;
+    if (IsProbing() && Probe::FitsMarker(desc.Width, desc.Height) && !Frame.Damage.Full)
     {
+        // The marker changes with every frame, whatever the OS says changed
+        if (Frame.Damage.Count < Protocol::MaxDamageRects)
+        {
+            Frame.Damage.Rects[Frame.Damage.Count++] = Probe::MarkerRect;
+        }
+        else
+        {
+            Frame.Damage.Full = true;
+        }
+    }
+    m_Stages.Submit(move(Frame));
+
+    m_Acquired.fetch_add(1, memory_order_relaxed);
+    m_AcquireNs.fetch_add(UINT64(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - Start)
+        .count()), memory_order_relaxed);
+    return S_OK;
+}
+
+HRESULT SwapChainProcessor::AcquireStagingSurface(const D3D11_TEXTURE2D_DESC& SurfaceDesc,
+    shared_ptr<StagingSurface>& Surface, bool& Recreated)
+{
+    // Surfaces of another size or format are let go; frames still passing the stages keep theirs until they are done
+    DXGI_FORMAT Format = GetStagingFormat(SurfaceDesc.Format);
+    Recreated = m_StagingSurfaces.empty() || m_StagingSurfaces[0]->Desc.Width != SurfaceDesc.Width
+        || m_StagingSurfaces[0]->Desc.Height != SurfaceDesc.Height || m_StagingSurfaces[0]->Desc.Format != Format;
+    if (Recreated)
+    {
+        m_StagingSurfaces.clear();
+
         D3D11_TEXTURE2D_DESC bufferDesc;
-        bufferDesc.Width = desc.Width;
-        bufferDesc.Height = desc.Height;
+        bufferDesc.Width = SurfaceDesc.Width;
+        bufferDesc.Height = SurfaceDesc.Height;
         bufferDesc.MipLevels = 1;
         bufferDesc.ArraySize = 1;
-        bufferDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+        bufferDesc.Format = Format;
         bufferDesc.SampleDesc.Count = 1;
         bufferDesc.SampleDesc.Quality = 0;
         bufferDesc.Usage = D3D11_USAGE_STAGING;
@@ -190,73 +436,555 @@ HRESULT SwapChainProcessor::ProcessResource(IDXGIResource* resource)
         bufferDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
         bufferDesc.MiscFlags = 0;
 
-        hr = m_Device->Device->CreateTexture2D(&bufferDesc, nullptr, &CopyBuffer);
-        if (FAILED(hr))
+        for (UINT i = 0; i < StagingSurfaceCount; i++)
         {
-            return hr;
+            auto Created = make_shared<StagingSurface>();
+            Created->Desc = bufferDesc;
+            HRESULT hr = m_Device->Device->CreateTexture2D(&bufferDesc, nullptr, &Created->Texture);
+            if (SUCCEEDED(hr))
+            {
+                hr = Created->Texture.As(&Created->Surface);
+            }
+            if (FAILED(hr))
+            {
+                m_StagingSurfaces.clear();
+                return hr;
+            }
+            m_StagingSurfaces.push_back(move(Created));
         }
+        m_Slices.Close();
+        m_FrameCache.Invalidate();
+    }
 
-        unique_lock<mutex> lock(m_MutexMeta);
-        m_Width = desc.Width;
-        m_Height = desc.Height;
-        m_CopyBuffer = CopyBuffer;
+    // Nobody else can take a surface the ring alone holds, the ring is where they all come from. With none free the
+    // stages are behind, and holding on to the swap-chain buffer meanwhile is what makes the OS slow down.
+    for (;;)
+    {
+        for (auto& Candidate : m_StagingSurfaces)
+        {
+            if (Candidate.use_count() == 1)
+            {
+                Surface = Candidate;
+                return S_OK;
+            }
+        }
+        if (WaitForSingleObject(m_hTerminateEvent.Get(), 1) != WAIT_TIMEOUT)
+        {
+            return E_ABORT;
+        }
     }
+}
 
-    m_Device->DeviceContext->CopyResource(CopyBuffer.Get(), texture.Get());
-    return S_OK;
+bool SwapChainProcessor::ReadAhead(PendingFrame& Frame)
+{
+    // Only while requests come in; otherwise the surface stays on the GPU until a request maps the latest frame
+    if (!m_Demand.IsActive(GetTickCount64()))
+    {
+        return true;
+    }
+
+    PD_TRACE_SPAN("ReadAhead");
+    const StagingSurface& Surface = *Frame.Surface;
+    Frame.Pixels = m_FrameCache.Get(Frame.Damage.Sequence,
+        [&](Readback::Frame& Target) { return ReadStaging(Surface, Frame.Damage.Sequence, Frame.Timestamp, Target); });
+    return true;
+}
+
+bool SwapChainProcessor::NarrowDamage(PendingFrame& Frame)
+{
+    // Dirty rects are often coarse and moves come in as full damage. Comparing with the frame before narrows the
+    // damage down to what changed, so requests send less. Only frames read ahead can be compared.
+    shared_ptr<const Readback::Frame> Base = move(m_DiffBase);
+    const Readback::Frame* Pixels = Frame.Pixels.get();
+    if (Pixels == nullptr || Pixels->Sequence != Frame.Damage.Sequence)
+    {
+        return true;
+    }
+    m_DiffBase = Frame.Pixels;
+    if (Base == nullptr || Base->Width != Pixels->Width || Base->Height != Pixels->Height
+        || Base->Pitch != Pixels->Pitch || Base->Format != Pixels->Format)
+    {
+        return true;
+    }
+
+    PD_TRACE_SPAN("NarrowDamage");
+    UINT BytesPerPixel = Pixels->Format == DXGI_FORMAT_R16G16B16A16_FLOAT ? 8 : 4;
+    Frame.Damage.Count = Kernels::DiffDamage(Base->Pixels.data(), Pixels->Pixels.data(), Pixels->Pitch,
+        Pixels->Width, Pixels->Height, BytesPerPixel, Frame.Damage.Full ? nullptr : Frame.Damage.Rects,
+        Frame.Damage.Count, Frame.Damage.Rects, Protocol::MaxDamageRects);
+    Frame.Damage.Full = false;
+    PD_TRACE_COUNTER("NarrowedRects", INT64(Frame.Damage.Count));
+    return true;
 }
 
-NTSTATUS SwapChainProcessor::FillRetrievalResponse(void* Buffer, size_t Size)
+bool SwapChainProcessor::Publish(PendingFrame& Frame)
 {
-    if (Size < sizeof(UINT[3]))
+    const D3D11_TEXTURE2D_DESC& Desc = Frame.Surface->Desc;
+    unique_lock<mutex> lock(m_MutexMeta);
+    if (Desc.Width != m_Width || Desc.Height != m_Height || Desc.Format != m_Format)
+    {
+        m_Pitch = 0;
+    }
+    if (Frame.Pixels != nullptr && Frame.Pixels->Sequence == Frame.Damage.Sequence)
+    {
+        m_Pitch = Frame.Pixels->Pitch;
+    }
+    m_Width = Desc.Width;
+    m_Height = Desc.Height;
+    m_Format = Desc.Format;
+    m_Published = move(Frame.Surface);
+    m_Sequence = Frame.Damage.Sequence;
+    m_Timestamp = Frame.Timestamp;
+    m_DamageHistory[m_Sequence % DamageHistoryLength] = Frame.Damage;
+    return true;
+}
+
+bool SwapChainProcessor::CollectDamage(UINT64 LastSequence, Protocol::DamageRect* Rects, UINT& Count)
+{
+    // Unites the damage of every frame after LastSequence, fails when the history can't answer that precisely.
+    // Must be called with m_MutexMeta held.
+    Count = 0;
+    if (LastSequence == 0 || LastSequence >= m_Sequence || m_Sequence - LastSequence > DamageHistoryLength)
+    {
+        return false;
+    }
+
+    for (UINT64 Sequence = LastSequence + 1; Sequence <= m_Sequence; Sequence++)
+    {
+        const FrameDamage& Entry = m_DamageHistory[Sequence % DamageHistoryLength];
+        if (Entry.Sequence != Sequence || Entry.Full || Count + Entry.Count > Protocol::MaxDamageRects)
+        {
+            return false;
+        }
+
+        copy(Entry.Rects, Entry.Rects + Entry.Count, Rects + Count);
+        Count += Entry.Count;
+    }
+    return true;
+}
+
+bool SwapChainProcessor::IsProbing() const
+{
+    return m_ProbeDemand.IsActive(GetTickCount64());
+}
+
+bool SwapChainProcessor::ReadStaging(const StagingSurface& Surface, UINT64 Sequence, UINT64 Timestamp,
+    Readback::Frame& Target)
+{
+    PD_TRACE_SPAN("ReadStaging");
+
+    const D3D11_TEXTURE2D_DESC& desc = Surface.Desc;
+
+    // Target may be the frame slice requests are copying from, which they are done with first
+    if (Sequence != 0)
+    {
+        m_Slices.Close();
+    }
+
+    // Copied as calibrated for the mode, or the plain way while the calibration runs in the background
+    Tuning::CopyStrategy Copy = GetCopyStrategy(desc.Width, desc.Height,
+        Protocol::BytesPerPixel(ToPixelFormat(desc.Format))).Strategy;
+
+    DXGI_MAPPED_RECT mapped;
+    HRESULT hr = Surface.Surface->Map(&mapped, DXGI_MAP_READ);
+    if (FAILED(hr))
+    {
+        return false;
+    }
+
+    // The recycled buffer keeps its allocation, so reading a frame of the same size allocates nothing
+    Target.Width = desc.Width;
+    Target.Height = desc.Height;
+    Target.Pitch = mapped.Pitch;
+    Target.Format = desc.Format;
+    Target.Pixels.resize(size_t(mapped.Pitch) * desc.Height);
+    if (Sequence != 0)
+    {
+        Slices::SliceFrame Frame;
+        Frame.Sequence = Sequence;
+        Frame.Timestamp = Timestamp;
+        Frame.Width = desc.Width;
+        Frame.Height = desc.Height;
+        Frame.Pitch = mapped.Pitch;
+        Frame.Format = desc.Format;
+        Frame.Pixels = Target.Pixels.data();
+        m_Slices.Begin(Frame);
+    }
+
+    // Read a band at a time, each handed to slice requests as soon as it lands. The marker is stamped into the copy
+    // rather than the surface, before the diff and every conversion, so it takes the same way to the client as the
+    // rest of the frame; it fits in the first band.
+    bool Probing = IsProbing();
+    for (UINT Band = 0; Band < Slices::SliceBoard::BandCount; Band++)
+    {
+        UINT Top, Rows;
+        Protocol::GetSliceRows(desc.Height, Slices::SliceBoard::BandCount, Band, Top, Rows);
+        size_t Offset = size_t(Top) * mapped.Pitch;
+        GetCopyTuner().Copy(Copy, mapped.pBits + Offset, mapped.Pitch, Target.Pixels.data() + Offset, mapped.Pitch,
+            mapped.Pitch, Rows);
+        if (Band == 0 && Probing)
+        {
+            Probe::StampMarker(Target.Pixels.data(), Target.Pitch, Target.Width, Target.Height,
+                ToPixelFormat(desc.Format), Timestamp);
+        }
+        if (Sequence != 0)
+        {
+            m_Slices.Publish(Band);
+        }
+    }
+    Surface.Surface->Unmap();
+
+    unique_lock<mutex> lockMeta(m_MutexMeta);
+    if (m_Published.get() == &Surface)
+    {
+        m_Pitch = mapped.Pitch;
+    }
+    return true;
+}
+
+NTSTATUS SwapChainProcessor::FillRetrievalResponse(const Protocol::FrameRequest& Request, void* Buffer, size_t Size)
+{
+    PD_TRACE_SPAN("FillRetrievalResponse");
+
+    if (Size < sizeof(Protocol::FrameDescriptor))
     {
         return STATUS_INVALID_BUFFER_SIZE;
     }
 
-    ComPtr<ID3D11Texture2D> CopyBuffer;
+    auto* Descriptor = static_cast<Protocol::FrameDescriptor*>(Buffer);
+    Protocol::DamageRect DamageRects[Protocol::MaxDamageRects];
+    UINT DamageCount = 0;
+    bool FullDamage = true;
+
+    OnRequest(Request.Features);
+
+    shared_ptr<StagingSurface> Surface;
     UINT Width, Height;
+    DXGI_FORMAT StagingFormat;
+    UINT64 Sequence, Timestamp;
+    shared_ptr<const Kernels::ChannelLut> GammaLut;
     {
         unique_lock<mutex> lockMeta(m_MutexMeta);
-        CopyBuffer = m_CopyBuffer;
+        Surface = m_Published;
         Width = m_Width;
         Height = m_Height;
+        StagingFormat = m_Format;
+        Sequence = m_Sequence;
+        Timestamp = m_Timestamp;
+        GammaLut = m_GammaLut;
+        if (Request.Features & Protocol::FeatureDamageRects)
+        {
+            FullDamage = !CollectDamage(Request.LastSequence, DamageRects, DamageCount);
+        }
     }
 
-    HRESULT hr;
-    if (CopyBuffer == nullptr)
+    if (Surface == nullptr)
     {
         return STATUS_INVALID_DEVICE_STATE;
     }
 
-    ComPtr<IDXGISurface> surface;
-    hr = CopyBuffer->QueryInterface(surface.GetAddressOf());
-    if (FAILED(hr))
+    Protocol::PixelFormat Format = SelectOutputFormat(StagingFormat, Request.Format);
+
+    // Like the narrow format, shrinking is reserved for 8-bit surfaces
+    UINT Downscale = (Request.Features & Protocol::FeatureDownscale) && StagingFormat == DXGI_FORMAT_B8G8R8A8_UNORM
+        ? min(Request.Downscale, Protocol::MaxDownscale) : 0;
+    if ((Width >> Downscale) == 0 || (Height >> Downscale) == 0)
     {
-        return STATUS_INTERNAL_ERROR;
+        Downscale = 0;
+    }
+    UINT OutputWidth = Width >> Downscale;
+    UINT OutputHeight = Height >> Downscale;
+
+    *Descriptor = {};
+    Descriptor->Magic = Protocol::FrameDescriptorMagic;
+    Descriptor->Version = Protocol::Version;
+    Descriptor->Format = UINT32(Format);
+    Descriptor->Width = OutputWidth;
+    Descriptor->Height = OutputHeight;
+    Descriptor->Sequence = Sequence;
+    Descriptor->Timestamp = Timestamp;
+    Descriptor->Flags = Downscale << Protocol::FrameDownscaleShift;
+
+    if ((Request.Features & Protocol::FeatureSkipUnchanged) && Request.LastSequence == Sequence)
+    {
+        Descriptor->HeaderSize = (UINT16)Protocol::GetHeaderSize(0);
+        Descriptor->Flags |= Protocol::FrameUnchanged;
+        return sizeof(Protocol::FrameDescriptor);
     }
 
-    DXGI_MAPPED_RECT mapped;
-    hr = surface->Map(&mapped, DXGI_MAP_READ);
-    if (FAILED(hr))
+    if (FullDamage)
+    {
+        DamageCount = 0;
+        Descriptor->Flags |= Protocol::FrameFullDamage;
+    }
+    for (UINT i = 0; i < DamageCount && Downscale != 0; i++)
+    {
+        DamageRects[i] = Kernels::DownscaleRect(DamageRects[i], Downscale);
+    }
+    Descriptor->DamageCount = DamageCount;
+    Descriptor->HeaderSize = (UINT16)Protocol::GetHeaderSize(DamageCount);
+
+    // Every request for this frame, from any reader, is served from one CPU copy of the staging surface, usually read
+    // ahead by the stages. The copy may be of a later frame; the descriptor keeps the older sequence so the client's
+    // next damage covers the difference.
+    shared_ptr<const Readback::Frame> Frame = m_FrameCache.Get(Sequence,
+        [&](Readback::Frame& Target) { return ReadStaging(*Surface, Sequence, Timestamp, Target); });
+    if (Frame != nullptr && (Frame->Width != Width || Frame->Height != Height || Frame->Format != UINT32(StagingFormat)))
+    {
+        // Read ahead past a mode change that isn't published yet, the published frame is read on its own
+        auto Published = make_shared<Readback::Frame>();
+        Frame = ReadStaging(*Surface, 0, Timestamp, *Published) ? move(Published) : nullptr;
+    }
+    if (Frame == nullptr)
     {
         return STATUS_INTERNAL_ERROR;
     }
+    const void* Pixels = Frame->Pixels.data();
+    UINT SourcePitch = Frame->Pitch;
+
+    // Frames delivered in the surface format keep the staging pitch so they are copied in one go, converted frames
+    // are tightly packed. Tiles are only cut from 8-bit frames at full size, and until they are encoded the stream
+    // is assumed to be as large as it can get.
+    bool Passthrough = ToDxgiFormat(Format) == StagingFormat && Downscale == 0;
+    bool Tiles = (Request.Compression & Protocol::CompressionTiles) && Passthrough
+        && Format == Protocol::PixelFormat::BGRA8;
+    Descriptor->Compression = Tiles ? Protocol::CompressionTiles : Protocol::CompressionNone;
+    Descriptor->Pitch = Tiles ? Width * 4 : Passthrough ? SourcePitch : OutputWidth * Protocol::BytesPerPixel(Format);
+    Descriptor->DataSize = Tiles ? Codec::GetMaxStreamSize(Width, Height) : UINT64(Descriptor->Pitch) * OutputHeight;
+    Descriptor->ColorSpace = UINT32(GetColorSpace(Format));
+
+    UINT64 required = Protocol::GetResponseSize(*Descriptor);
+    if (Size >= required)
+    {
+        Protocol::PackHeader(Buffer, DamageRects);
+        void* Data = (char*)Buffer + Descriptor->HeaderSize;
+
+        if (Tiles)
+        {
+            // Only the damaged tiles are sent, the client patches them into the frame it holds. A client starting
+            // over from a whole frame starts over with an empty cache as well.
+            unique_lock<mutex> lockTiles(m_MutexTiles);
+            Codec::TileCache* Cache = nullptr;
+            if (Request.Compression & Protocol::CompressionTileCache)
+            {
+                if (Request.LastSequence == 0)
+                {
+                    m_TileCache.Reset();
+                }
+                Cache = &m_TileCache;
+            }
+            if (!m_TileTasks)
+            {
+                m_TileTasks = make_unique<Scheduling::TaskScheduler>();
+            }
+            Descriptor->DataSize = Codec::EncodeTiles(Pixels, SourcePitch, Width, Height,
+                FullDamage ? nullptr : DamageRects, DamageCount, Request.Quality, GammaLut.get(), Cache,
+                m_TileTasks.get(), Data, Size - Descriptor->HeaderSize, &m_TileScratch);
+            lockTiles.unlock();
+            return (NTSTATUS)Protocol::GetResponseSize(*Descriptor);
+        }
+
+        if (Downscale == 0)
+        {
+            ConvertRows(Pixels, SourcePitch, StagingFormat, Format, GammaLut.get(), Data, Descriptor->Pitch, Width,
+                Height);
+        }
+        else if (Format == Protocol::PixelFormat::B5G6R5)
+        {
+            // Shrunk a piece of a row at a time into a buffer on the stack that stays in cache for packing. Pieces
+            // start on a multiple of 4 pixels, so the dither lines up as if the row was packed in one go.
+            UINT32 Row[256];
+            for (UINT y = 0; y < OutputHeight; y++)
+            {
+                const char* Source = (const char*)Pixels + (size_t(y) << Downscale) * SourcePitch;
+                char* Target = (char*)Data + size_t(y) * Descriptor->Pitch;
+                for (UINT x = 0; x < OutputWidth; x += ARRAYSIZE(Row))
+                {
+                    UINT Count = min(OutputWidth - x, UINT(ARRAYSIZE(Row)));
+                    Kernels::DownscaleBgra8(Source + (size_t(x) << Downscale) * 4, SourcePitch, Row, 0, Count, 1,
+                        Downscale);
+                    Kernels::Bgra8ToB5G6R5(Row, 0, Target + size_t(x) * 2, 0, Count, 1, GammaLut.get());
+                }
+            }
+        }
+        else
+        {
+            // Shrinking is reserved for 8-bit surfaces, so the gamma ramp always applies
+            Kernels::DownscaleBgra8(Pixels, SourcePitch, Data, Descriptor->Pitch, OutputWidth, OutputHeight, Downscale);
+            if (GammaLut != nullptr)
+            {
+                Kernels::ApplyChannelLut(Data, Descriptor->Pitch, Data, Descriptor->Pitch, OutputWidth, OutputHeight,
+                    *GammaLut);
+            }
+        }
+        return (NTSTATUS)required;
+    }
+    else
+    {
+        return sizeof(Protocol::FrameDescriptor);
+    }
+}
 
-    UINT* meta = (UINT*)Buffer;
-    meta[0] = Width;
-    meta[1] = Height;
-    meta[2] = mapped.Pitch;
+NTSTATUS SwapChainProcessor::FillSliceResponse(const Protocol::SliceRequest& Request, void* Buffer, size_t Size)
+{
+    PD_TRACE_SPAN("FillSliceResponse");
 
-    UINT required = mapped.Pitch * Height;
-    if (Size >= sizeof(UINT[3]) + required)
+    if (Size < sizeof(Protocol::SliceDescriptor))
     {
-        memcpy((char*)Buffer + sizeof(UINT[3]), mapped.pBits, required);
-        surface->Unmap();
-        return sizeof(UINT[3]) + required;
+        return STATUS_INVALID_BUFFER_SIZE;
     }
-    else
+
+    OnRequest(Request.Features);
+
+    shared_ptr<StagingSurface> Surface;
+    UINT64 Sequence, Timestamp;
+    shared_ptr<const Kernels::ChannelLut> GammaLut;
+    {
+        unique_lock<mutex> lockMeta(m_MutexMeta);
+        Surface = m_Published;
+        Sequence = m_Sequence;
+        Timestamp = m_Timestamp;
+        GammaLut = m_GammaLut;
+    }
+    if (Surface == nullptr)
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    // Frames are put on the slice board by whoever reads them back, usually the stages. A frame published without
+    // being read, for lack of requests until now, is read here like a whole frame request would.
+    if (Request.Slice == 0 && Sequence > Request.Sequence && m_Slices.GetSequence() < Sequence)
+    {
+        m_FrameCache.Get(Sequence,
+            [&](Readback::Frame& Target) { return ReadStaging(*Surface, Sequence, Timestamp, Target); });
+    }
+
+    auto* Descriptor = static_cast<Protocol::SliceDescriptor*>(Buffer);
+    *Descriptor = {};
+    Descriptor->Magic = Protocol::SliceDescriptorMagic;
+    Descriptor->Version = Protocol::Version;
+    Descriptor->Slice = Request.Slice;
+
+    Slices::SliceLease Lease;
+    UINT TimeoutMs = min(Request.TimeoutMs, MaxSliceWait);
+    switch (m_Slices.Acquire(Request.Sequence, Request.Slice, Request.SliceCount, TimeoutMs, Lease))
+    {
+    case Slices::WaitResult::Ready:
+        break;
+    case Slices::WaitResult::Unchanged:
+        Descriptor->Flags = Protocol::SliceUnchanged;
+        Descriptor->Sequence = Request.Sequence;
+        return sizeof(Protocol::SliceDescriptor);
+    case Slices::WaitResult::Superseded:
+        Descriptor->Flags = Protocol::SliceSuperseded;
+        return sizeof(Protocol::SliceDescriptor);
+    case Slices::WaitResult::Shutdown:
+        // As if the swap-chain were already gone, which it is about to be
+        return STATUS_INVALID_DEVICE_STATE;
+    default:
+        return STATUS_IO_TIMEOUT;
+    }
+
+    // The slice is copied straight out of the frame being read back, leased until the copy is done
+    const Slices::SliceFrame& Frame = Lease.GetFrame();
+    DXGI_FORMAT StagingFormat = DXGI_FORMAT(Frame.Format);
+    Protocol::PixelFormat Format = SelectOutputFormat(StagingFormat, Request.Format);
+    UINT Top, Rows;
+    Protocol::GetSliceRows(Frame.Height, Request.SliceCount, Request.Slice, Top, Rows);
+    Descriptor->Format = UINT32(Format);
+    Descriptor->ColorSpace = UINT32(GetColorSpace(Format));
+    Descriptor->Width = Frame.Width;
+    Descriptor->Height = Frame.Height;
+    Descriptor->Top = Top;
+    Descriptor->Rows = Rows;
+    Descriptor->Pitch = ToDxgiFormat(Format) == StagingFormat ? Frame.Pitch
+        : Frame.Width * Protocol::BytesPerPixel(Format);
+    Descriptor->Sequence = Frame.Sequence;
+    Descriptor->Timestamp = Frame.Timestamp;
+    Descriptor->DataSize = UINT64(Descriptor->Pitch) * Rows;
+
+    UINT64 Required = Protocol::SliceHeaderSize + Descriptor->DataSize;
+    if (Size < Required)
+    {
+        return sizeof(Protocol::SliceDescriptor);
+    }
+    ConvertRows(Frame.Pixels + size_t(Top) * Frame.Pitch, Frame.Pitch, StagingFormat, Format, GammaLut.get(),
+        (char*)Buffer + Protocol::SliceHeaderSize, Descriptor->Pitch, Frame.Width, Rows);
+    return (NTSTATUS)Required;
+}
+
+void SwapChainProcessor::OnRequest(UINT32 Features)
+{
+    if (m_Demand.OnRequest(GetTickCount64()))
+    {
+        SetEvent(m_hDemandEvent.Get());
+    }
+    if (Features & Protocol::FeatureLatencyProbe)
+    {
+        m_ProbeDemand.OnRequest(GetTickCount64());
+    }
+}
+
+void SwapChainProcessor::GetFrameLayout(UINT& Width, UINT& Height, UINT& Pitch)
+{
+    unique_lock<mutex> lockMeta(m_MutexMeta);
+    Width = m_Width;
+    Height = m_Height;
+    Pitch = m_Pitch;
+}
+
+void SwapChainProcessor::SetGammaLut(shared_ptr<const Kernels::ChannelLut> GammaLut)
+{
+    unique_lock<mutex> lockMeta(m_MutexMeta);
+    m_GammaLut = move(GammaLut);
+}
+
+void SwapChainProcessor::GetStatistics(Protocol::PipelineStatistics& Statistics)
+{
+    Statistics = {};
+    Statistics.Size = sizeof(Statistics);
+    Statistics.Version = Protocol::Version;
+    Statistics.Allocations = Allocation::GetCounts().Allocations;
+    auto Add = [&](const char* Name, UINT64 Processed, UINT64 Dropped, UINT64 BusyNs, UINT32 Depth, UINT32 MaxDepth)
+        {
+            if (Statistics.StageCount == Protocol::MaxStages)
+            {
+                return;
+            }
+            Protocol::StageStatistics& Stage = Statistics.Stages[Statistics.StageCount++];
+            strncpy_s(Stage.Name, Name, _TRUNCATE);
+            Stage.Processed = Processed;
+            Stage.Dropped = Dropped;
+            Stage.BusyNs = BusyNs;
+            Stage.Depth = Depth;
+            Stage.MaxDepth = MaxDepth;
+        };
+
+    // The copy on the swap-chain thread comes first; nothing queues in front of it but the OS, and what it drops are
+    // the frames nobody asked for
+    Add("acquire", m_Acquired.load(memory_order_relaxed), m_Held.load(memory_order_relaxed),
+        m_AcquireNs.load(memory_order_relaxed), 0, 0);
+    for (const Pipeline::StageStats& Stage : m_Stages.GetStats())
+    {
+        Add(Stage.Name, Stage.Processed, Stage.Dropped, Stage.BusyNs, Stage.Depth, Stage.MaxDepth);
+    }
+
+    unique_lock<mutex> lockMeta(m_MutexMeta);
+    Statistics.Sequence = m_Sequence;
+    UINT Width = m_Width, Height = m_Height;
+    DXGI_FORMAT Format = m_Format;
+    lockMeta.unlock();
+
+    // Looked up outside the lock, which the tuner's lookups take only briefly too
+    Tuning::TunedCopy Tuned;
+    if (Width != 0 && GetCopyTuner().Find(Width, Height, Protocol::BytesPerPixel(ToPixelFormat(Format)), Tuned))
     {
-        surface->Unmap();
-        return sizeof(UINT[3]);
+        Statistics.Copy.Width = Tuned.Width;
+        Statistics.Copy.Height = Tuned.Height;
+        Statistics.Copy.Method = UINT32(Tuned.Strategy.Method);
+        Statistics.Copy.Threads = Tuned.Strategy.Threads;
+        Statistics.Copy.ChunkRows = Tuned.Strategy.ChunkRows;
+        Statistics.Copy.Calibrated = Tuned.Calibrated;
+        Statistics.Copy.FrameNs = Tuned.FrameNs;
     }
 }
\ No newline at end of file